@@ -0,0 +1,123 @@
+#ifndef BOUNDING_VOLUME_H
+#define BOUNDING_VOLUME_H
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+
+namespace dzy {
+
+/// axis aligned bounding box
+///
+///     a default constructed box is empty(invalid), expanding an
+///     empty box by a point makes the box contain exactly that point.
+class AABB {
+public:
+    AABB();
+    AABB(const glm::vec3& min, const glm::vec3& max);
+
+    bool        isValid() const;
+    void        reset();
+    glm::vec3   getMin() const { return mMin; }
+    glm::vec3   getMax() const { return mMax; }
+    glm::vec3   getCenter() const;
+    /// half size of the box along each axis
+    glm::vec3   getExtent() const;
+    float       getSurfaceArea() const;
+
+    AABB&       expand(const glm::vec3& point);
+    AABB&       expand(const AABB& other);
+    /// grow the box by margin on all sides
+    AABB&       inflate(float margin);
+
+    bool        contains(const glm::vec3& point) const;
+    bool        contains(const AABB& other) const;
+    bool        intersects(const AABB& other) const;
+
+    /// bounding box of this box after transformation
+    ///
+    ///     the result is conservative, it contains all eight
+    ///     transformed corners of this box
+    AABB        transform(const glm::mat4& mat4) const;
+
+    static AABB merge(const AABB& a, const AABB& b);
+
+private:
+    glm::vec3   mMin;
+    glm::vec3   mMax;
+};
+
+class Sphere {
+public:
+    Sphere();
+    Sphere(const glm::vec3& center, float radius);
+
+    glm::vec3   getCenter() const { return mCenter; }
+    float       getRadius() const { return mRadius; }
+    bool        intersects(const AABB& box) const;
+    bool        contains(const AABB& box) const;
+
+private:
+    glm::vec3   mCenter;
+    float       mRadius;
+};
+
+class Ray {
+public:
+    Ray();
+    Ray(const glm::vec3& origin, const glm::vec3& direction);
+
+    glm::vec3   getOrigin() const { return mOrigin; }
+    glm::vec3   getDirection() const { return mDirection; }
+    glm::vec3   getPoint(float distance) const;
+
+    /// slab test against a box
+    ///
+    ///     @param box the box to test
+    ///     @param distance the distance along the ray to the entry point,
+    ///            0 if the origin is inside the box
+    ///     @return true if the ray hits the box
+    bool        intersects(const AABB& box, float& distance) const;
+
+private:
+    glm::vec3   mOrigin;
+    glm::vec3   mDirection;
+    glm::vec3   mInvDirection;
+};
+
+/// view frustum represented by six inward facing planes
+class Frustum {
+public:
+    enum Plane {
+        PLANE_LEFT = 0,
+        PLANE_RIGHT,
+        PLANE_BOTTOM,
+        PLANE_TOP,
+        PLANE_NEAR,
+        PLANE_FAR,
+        PLANE_NUM
+    };
+
+    enum Result {
+        OUTSIDE = 0,
+        INTERSECT,
+        INSIDE,
+    };
+
+    Frustum();
+    /// extract frustum planes from a view-projection matrix
+    Frustum(const glm::mat4& viewProj);
+
+    void        setMatrix(const glm::mat4& viewProj);
+    glm::vec4   getPlane(Plane plane) const { return mPlanes[plane]; }
+
+    Result      classify(const AABB& box) const;
+    bool        intersects(const AABB& box) const;
+    bool        intersects(const Sphere& sphere) const;
+
+private:
+    glm::vec4   mPlanes[PLANE_NUM];
+};
+
+} // namespace dzy
+
+#endif
@@ -0,0 +1,111 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <vector>
+#include <memory>
+#include "utils.h"
+#include "bounding_volume.h"
+
+namespace dzy {
+
+class Geometry;
+/// Dynamic bounding volume hierarchy over Geometry world bounds
+///
+///     Leaves store a "fat" box, the world bounds inflated by a margin,
+///     so small movements do not touch the tree at all. A leaf index is
+///     the proxy handle returned to the caller, it stays valid until the
+///     proxy is removed, even across rebuilds.
+class BVH : private noncopyable {
+public:
+    enum {
+        NULL_PROXY = -1,
+    };
+
+    /// @param margin the fat box margin in world unit
+    /// @param rebuildRatio rebuild the tree when its cost grows beyond
+    ///        this ratio of the cost right after the last rebuild
+    BVH(float margin = 0.1f, float rebuildRatio = 1.5f);
+    ~BVH();
+
+    /// insert a Geometry with its world bounds
+    ///
+    ///     @return the proxy handle of the Geometry
+    int     insert(const AABB& box, std::shared_ptr<Geometry> geometry);
+    void    remove(int proxy);
+
+    /// update the bounds of a proxy as its Geometry moves
+    ///
+    ///     @return true if the leaf is reinserted, false if the new box
+    ///             still fits into the fat box and the tree is untouched
+    bool    update(int proxy, const AABB& box);
+
+    /// recompute all internal boxes bottom up, keep the topology
+    void    refit();
+    /// rebuild the whole tree top down with median split
+    void    rebuild();
+    /// called once a frame, periodically checks the tree quality
+    /// and rebuilds when it degrades
+    void    optimize();
+
+    void    queryAABB(const AABB& box, std::vector<int>& proxies) const;
+    void    querySphere(const Sphere& sphere, std::vector<int>& proxies) const;
+    void    queryFrustum(const Frustum& frustum, std::vector<int>& proxies) const;
+
+    /// all proxies hit by the ray, sorted from near to far
+    void    queryRay(const Ray& ray, float maxDistance, std::vector<int>& proxies) const;
+
+    /// closest proxy hit by the ray
+    ///
+    ///     @param distance distance to the hit point on the proxy bounds
+    ///     @return the proxy handle, NULL_PROXY if nothing is hit
+    int     raycast(const Ray& ray, float maxDistance, float& distance) const;
+
+    std::shared_ptr<Geometry>   getGeometry(int proxy) const;
+    const AABB&                 getBounds(int proxy) const;
+    const AABB&                 getFatBounds(int proxy) const;
+    int                         getNumProxies() const { return mNumProxies; }
+    /// upper limit of proxy handles, for sizing per-proxy arrays
+    int                         getCapacity() const { return (int)mNodes.size(); }
+    int                         getHeight() const;
+    /// SAH cost of the tree, sum of internal node areas over root area
+    float                       getCost() const;
+
+    void                        dump(Log::Flag f = Log::F_GENERIC) const;
+
+private:
+    struct TreeNode {
+        // fat box for leaves, enclosing box for internal nodes
+        AABB                        mBox;
+        // exact world bounds, leaves only
+        AABB                        mTightBox;
+        // next free node while the node is in the free list
+        int                         mParent;
+        int                         mChild1;
+        int                         mChild2;
+        // leaf 0, free node -1
+        int                         mHeight;
+        std::weak_ptr<Geometry>     mGeometry;
+
+        bool isLeaf() const { return mChild1 == NULL_PROXY; }
+    };
+
+    int     allocateNode();
+    void    freeNode(int node);
+    void    insertLeaf(int leaf);
+    void    removeLeaf(int leaf);
+    void    refitAncestors(int node);
+    int     buildTopDown(std::vector<int>& leaves, int begin, int end);
+
+    std::vector<TreeNode>   mNodes;
+    int                     mRoot;
+    int                     mFreeList;
+    int                     mNumProxies;
+    float                   mMargin;
+    float                   mRebuildRatio;
+    float                   mBaselineCost;
+    int                     mFramesSinceCheck;
+};
+
+} // namespace dzy
+
+#endif
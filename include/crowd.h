@@ -0,0 +1,168 @@
+#ifndef CROWD_H
+#define CROWD_H
+
+#include <vector>
+#include <memory>
+#include <functional>
+#include <GLES3/gl3.h>
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+#include "utils.h"
+#include "bounding_volume.h"
+#include "frame_snapshot.h"
+
+namespace dzy {
+
+class Node;
+class Mesh;
+class Material;
+class Animation;
+class SkinBounds;
+/// Many instances of one skinned character, animated on the GPU
+///
+///     Each clip is sampled at a fixed rate into rows of a float texture,
+///     one row per pose holding the skinning matrix of every bone, see
+///     addClip. An instance is a world matrix, a clip and a time offset,
+///     the vertex shader fetches and blends the two poses around its
+///     time and skins the vertex with up to four bones, so the CPU only
+///     culls each instance against the bounds of its clip and packs its
+///     attributes. All visible instances of a Crowd are one instanced
+///     draw call, see CrowdRenderer.
+///
+///     Clips are added before the Crowd is added to a scene, see
+///     Scene::addCrowd, instances may change any time on the game thread.
+///     Instance matrices must be rigid or uniformly scaled.
+class Crowd : private noncopyable {
+public:
+    /// bones per vertex, the ones with the largest weights are kept
+    static const int MAX_BONE_INFLUENCES = 4;
+    /// bone indices are bytes
+    static const int MAX_BONES = 256;
+    /// poses of all clips, rows of a texture every ES 3.0 device supports
+    static const int MAX_POSES = 2048;
+
+    typedef std::function<bool(const AABB&)> VisibleFunc;
+
+    /// @param mesh a skinned Mesh with 3 float positions
+    /// @param material the material of all instances
+    /// @param sampleRate poses per unit of animation time
+    Crowd(std::shared_ptr<Mesh> mesh, std::shared_ptr<Material> material,
+        float sampleRate = 30.f);
+    ~Crowd();
+
+    /// the Mesh can be skinned by a Crowd
+    bool    isValid() const { return !mVertices.empty(); }
+
+    /// sample the poses of a clip, from the NodeAnim of the bone nodes
+    ///
+    ///     @param animation the clip
+    ///     @param root root of the scene graph holding the bone nodes
+    ///     @return the clip id, -1 if no bone of the Mesh has a node or
+    ///             MAX_POSES are exceeded
+    int     addClip(std::shared_ptr<Animation> animation, std::shared_ptr<Node> root);
+    int     getNumClips() const { return mClips.size(); }
+
+    /// add an instance
+    ///
+    ///     @param world the world matrix
+    ///     @param clip the clip it plays, see addClip
+    ///     @param timeOffset where it is in the clip at time 0, so
+    ///            instances playing the same clip are out of step
+    ///     @return the index of the instance
+    int     addInstance(const glm::mat4& world, int clip, float timeOffset = 0.f);
+    void    setInstance(int index, const glm::mat4& world, int clip, float timeOffset);
+    void    clearInstances() { mInstances.clear(); }
+    int     getNumInstances() const { return mInstances.size(); }
+
+    std::shared_ptr<Mesh> getMesh() { return mMesh; }
+    std::shared_ptr<Material> getMaterial() { return mMaterial; }
+    float   getSampleRate() const { return mSampleRate; }
+
+    /// pack the visible instances of a frame
+    ///
+    ///     @param time the animation time of the frame
+    ///     @param isVisible tells if world bounds are visible
+    ///     @param item receives the instance attributes, see CrowdRenderer
+    void    buildInstances(double time, VisibleFunc isVisible, FrameSnapshot::CrowdItem& item);
+
+    /// delete the GL objects, must be called with the context current
+    void    release();
+
+    friend class CrowdRenderer;
+private:
+    struct Vertex {
+        float           mPosition[3];
+        float           mNormal[3];
+        float           mWeights[MAX_BONE_INFLUENCES];
+        unsigned char   mBones[MAX_BONE_INFLUENCES];
+    };
+    struct Clip {
+        int             mFirstPose;
+        int             mNumPoses;
+        double          mDuration;
+    };
+    struct Instance {
+        glm::mat4       mWorld;
+        int             mClip;
+        float           mTimeOffset;
+    };
+
+    std::shared_ptr<Mesh>       mMesh;
+    std::shared_ptr<Material>   mMaterial;
+    float                       mSampleRate;
+    std::vector<Vertex>         mVertices;
+    std::vector<unsigned int>   mIndices;
+    int                         mNumBones;
+    // rows of 3 texels per bone, the rows of its 3x4 skinning matrix
+    std::vector<float>          mPoses;
+    std::vector<Clip>           mClips;
+    std::shared_ptr<SkinBounds> mBounds;
+    std::vector<Instance>       mInstances;
+
+    GLuint                      mPoseTexture;
+    int                         mPosesUploaded;
+    GLuint                      mVertexBO;
+    GLuint                      mIndexBO;
+    GLuint                      mVAO;
+};
+
+class MaterialTable;
+/// Draws the instances of the crowds of a frame
+///
+///     Vertices with their bone weights and the pose texture of a Crowd
+///     are uploaded when it is first drawn, the pose texture again when
+///     clips were added. Instance attributes of all crowds are streamed
+///     into one buffer per frame, each Crowd is one
+///     glDrawElementsInstanced with the internal crowd program.
+class CrowdRenderer : private noncopyable {
+public:
+    CrowdRenderer();
+    ~CrowdRenderer();
+
+    /// delete the instance buffer and the GL objects of the crowds drawn,
+    /// must be called with the context current
+    void    release();
+
+    /// draw the crowds of a frame into the bound scene target
+    ///
+    ///     the per-frame block of the frame camera must be current
+    void    draw(const FrameSnapshot& frame, MaterialTable& materials);
+
+    /// draw calls and instances in the last frame
+    int     getNumDrawCalls() const { return mNumDrawCalls; }
+    int     getNumInstances() const { return mNumInstances; }
+
+private:
+    bool    upload(Crowd& crowd);
+
+    GLuint                      mInstanceVBO;
+    std::vector<float>          mInstanceData;
+    // crowds with GL objects, released with the context
+    std::vector<std::weak_ptr<Crowd> > mUploaded;
+    int                         mNumDrawCalls;
+    int                         mNumInstances;
+};
+
+} // namespace dzy
+
+#endif
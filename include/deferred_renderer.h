@@ -0,0 +1,92 @@
+#ifndef DEFERRED_RENDERER_H
+#define DEFERRED_RENDERER_H
+
+#include <memory>
+#include <GLES3/gl3.h>
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+#include "utils.h"
+
+namespace dzy {
+
+struct LightGrid;
+/// Deferred shading through OpenGL ES 3 multiple render targets
+///
+///     Opaque lit Geometry write their surface into the G-buffer instead
+///     of a color: albedo (RGBA8), eye space normal (RGB10_A2), and the
+///     material table index with the view depth bits (RG32UI), see the
+///     gbuffer_ programs. The lights of the frame, taken from the
+///     LightGrid that clustered shading builds anyway, are then added
+///     one by one into the scene color, drawn with the depth and
+///     stencil of the G-buffer:
+///
+///         - emission of every surface, full screen
+///         - lights without a finite range, full screen
+///         - point and spot lights, as a sphere around their range
+///           marked in the stencil first, so only pixels whose surface
+///           lies inside the volume run the light shader
+///
+///     The lighting cost follows the pixels each light covers, not the
+///     Geometry drawn. Everything else, transparent or unlit, is drawn
+///     forward into the scene color afterwards. The targets are
+///     transient resources of the RenderGraph of the frame, see
+///     Render::submitFrame, in TARGET_FORMATS.
+class DeferredRenderer : private noncopyable {
+public:
+    enum Target {
+        TARGET_ALBEDO = 0,
+        TARGET_NORMAL,
+        TARGET_MATERIAL,
+        NUM_TARGETS,
+    };
+
+    static const GLenum TARGET_FORMATS[NUM_TARGETS];
+    /// the material target is cleared to it, pixels without a surface
+    static const glm::uvec4 BACKGROUND_MATERIAL;
+
+    DeferredRenderer();
+    ~DeferredRenderer();
+
+    /// delete all GL objects, must be called with the context current
+    void    release();
+
+    /// create the light volume once
+    ///
+    ///     @return false if deferred shading can not run, the frame is
+    ///             shaded forward then
+    bool    prepare();
+
+    /// add up the lights of the frame into the bound scene color, cleared
+    /// to the background
+    ///
+    ///     the depth and stencil of the G-buffer are bound with it. The
+    ///     per-frame block and the cluster light texture must be current,
+    ///     see FrameUniforms and LightClusters::upload.
+    ///
+    ///     @param grid the lights, in eye space
+    ///     @param proj the projection of the frame
+    ///     @param targets the G-buffer textures, in Target order
+    void    applyLights(const LightGrid& grid, const glm::mat4& proj,
+                const GLuint targets[NUM_TARGETS]);
+
+    /// lights drawn as volumes and full screen in the last frame
+    int     getNumLightVolumes() const { return mNumLightVolumes; }
+    int     getNumFullscreenLights() const { return mNumFullscreenLights; }
+
+private:
+    bool    createVolume();
+    void    drawFullscreen();
+
+    // unit sphere enclosing its tessellation, drawn scaled per light
+    GLuint      mVolumeVAO;
+    GLuint      mVolumeVBO;
+    GLuint      mVolumeIBO;
+    GLsizei     mNumVolumeIndices;
+
+    int         mNumLightVolumes;
+    int         mNumFullscreenLights;
+};
+
+} // namespace dzy
+
+#endif
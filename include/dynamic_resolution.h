@@ -0,0 +1,94 @@
+#ifndef DYNAMIC_RESOLUTION_H
+#define DYNAMIC_RESOLUTION_H
+
+#include <GLES3/gl3.h>
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+#include "utils.h"
+
+namespace dzy {
+
+/// Scene resolution following the frame time
+///
+///     The scene is drawn into an offscreen color and depth target at a
+///     fraction of the surface size and scaled up to the window with a
+///     linear blit, overlays are drawn on top at native resolution, see
+///     Render::submitFrame. The target is sized for the largest scale, a
+///     frame only uses its lower left part, so changing the scale costs
+///     nothing.
+///
+///     After each frame the controller compares the frame time with the
+///     target frame time. A fill rate bound frame costs in proportion to
+///     its area, so the scale of each axis moves towards
+///     scale * sqrt(target / time), at most MAX_STEP at once and only
+///     every ADJUST_INTERVAL frames, so the slow timer results catch up.
+///     Times just around the target leave the scale alone.
+///
+///     The frame time is the larger of the CPU time of the submission,
+///     swap included, and the GPU time of the frame when
+///     GL_EXT_disjoint_timer_query is there. The GPU time is read back a
+///     few frames late, the CPU never waits for it.
+class DynamicResolution : private noncopyable {
+public:
+    static const int TIMER_QUERIES = 4;
+    static const int ADJUST_INTERVAL = 8;
+    static const float MAX_STEP;
+
+    DynamicResolution();
+    ~DynamicResolution();
+
+    /// delete the timer queries, must be called with the context current
+    void    release();
+
+    /// frame time to hold, in milliseconds
+    void    setTargetFrameTime(float ms) { mTargetFrameTime = ms > 0.f ? ms : mTargetFrameTime; }
+    float   getTargetFrameTime() const { return mTargetFrameTime; }
+    /// bounds of the scale of each axis, within (0, 1]
+    void    setScaleRange(float minScale, float maxScale);
+    float   getMinScale() const { return mMinScale; }
+    float   getMaxScale() const { return mMaxScale; }
+    /// scale of each axis the next frame is drawn at
+    float   getScale() const { return mScale; }
+
+    /// size of the scene in pixels at the current scale
+    glm::ivec2 getSceneSize(int width, int height) const;
+    /// size of the target in pixels, the scene at the largest scale
+    glm::ivec2 getTargetSize(int width, int height) const;
+
+    /// start timing a frame, before its first draw
+    void    beginTiming();
+    /// stop timing a frame, before the swap
+    void    endTiming();
+    /// feed the frame time and adjust the scale
+    ///
+    ///     @param cpuTime microseconds spent submitting the frame
+    void    update(long long cpuTime);
+
+    /// smoothed frame time and last GPU time in milliseconds, the GPU
+    /// time is 0 without timer queries
+    float   getFrameTime() const { return mFrameTime; }
+    float   getGpuTime() const { return mGpuTime; }
+
+private:
+    void    readTimers();
+
+    float       mTargetFrameTime;
+    float       mMinScale;
+    float       mMaxScale;
+    float       mScale;
+    float       mFrameTime;
+    float       mGpuTime;
+    int         mFramesSinceAdjust;
+
+    // -1 before the extension is checked
+    int         mTimerSupported;
+    GLuint      mQueries[TIMER_QUERIES];
+    bool        mQueryPending[TIMER_QUERIES];
+    // the query of the frame being timed, -1 if none
+    int         mActiveQuery;
+    int         mNextQuery;
+};
+
+} // namespace dzy
+
+#endif
@@ -17,6 +17,7 @@ namespace dzy {
 class EngineCore;
 class Scene;
 class Render;
+class RenderThread;
 class EngineContext
     : public std::enable_shared_from_this<EngineContext>
     , private noncopyable {
@@ -46,6 +47,15 @@ public:
     void            releaseDisplay();
     bool            updateDisplay();
 
+    /// submit frames on a render thread owning the EGL context
+    ///
+    ///     on by default, takes effect the next time the display is
+    ///     initialized. EngineCore::update and the scene traversal run
+    ///     on the main thread, one frame ahead of GL submission.
+    void            setRenderThreadEnabled(bool enable) { mRenderThreadEnabled = enable; }
+    bool            isRenderThreadEnabled() const { return mRenderThreadEnabled; }
+    std::shared_ptr<RenderThread> getRenderThread() { return mRenderThread; }
+
     void            requestQuit();
     bool            needQuit();
     void            setRenderState(bool rendering);
@@ -57,12 +67,24 @@ public:
     EGLint          getSurfaceWidth();
     EGLint          getSurfaceHeight();
 
+    /// depth and stencil bits of the window
+    ///
+    ///     the window takes the depth of the scene drawn forward at full
+    ///     resolution and of the overlays, never stored since nothing
+    ///     reads it back. The stencil is only used by deferred shading,
+    ///     on targets of its own, so the window goes without one.
+    static const EGLint WINDOW_DEPTH_SIZE = 24;
+    static const EGLint WINDOW_STENCIL_SIZE = 0;
+
 private:
+    bool            chooseConfig(EGLDisplay display, EGLConfig* config);
     const char*     eglStatusStr() const;
 
     AAssetManager*              mAssetManager;
     std::weak_ptr<EngineCore>   mEngineCore;
     std::shared_ptr<Render>     mRender;
+    std::shared_ptr<RenderThread> mRenderThread;
+    bool                        mRenderThreadEnabled;
 
     bool                        mRequestQuit;
     bool                        mRendering;
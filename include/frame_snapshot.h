@@ -0,0 +1,193 @@
+#ifndef FRAME_SNAPSHOT_H
+#define FRAME_SNAPSHOT_H
+
+#include <memory>
+#include <vector>
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+#include "light_clusters.h"
+
+namespace dzy {
+
+class Scene;
+class Geometry;
+class Material;
+class Camera;
+class Light;
+class BVH;
+class Impostor;
+class Crowd;
+class ParticleEmitter;
+/// Everything needed to submit one frame, built on the game thread
+///
+///     Render::buildFrame walks the scene graph, runs animation, skinning
+///     and culling and records the visible Geometry here. Camera, lights
+///     and world matrices are copies, skinned vertices are copied out of
+///     the Mesh, so once published the snapshot does not change while the
+///     game thread simulates the next frame. Render::submitFrame turns it
+///     into GL calls, see RenderThread.
+struct FrameSnapshot {
+    struct DrawItem {
+        std::shared_ptr<Geometry>   mGeometry;
+        std::shared_ptr<Material>   mMaterial;
+        // copies of the Geometry own camera and light, null if it uses
+        // the ones of the scene
+        std::shared_ptr<Camera>     mCamera;
+        std::shared_ptr<Light>      mLight;
+        glm::mat4                   mWorld;
+        // inverse transpose of the world rotation and scale
+        glm::mat3                   mNormal;
+        // view depth normalized to [0, 1], for sorting
+        float                       mDepth;
+        // skinned vertices of this frame, empty if the Mesh is not skinned
+        std::vector<char>           mVertices;
+        // share of the pixels left to an impostor, see Impostor
+        float                       mFadeOut;
+
+        DrawItem() : mDepth(0.f), mFadeOut(0.f) {}
+    };
+
+    // a subtree drawn as its Impostor
+    struct ImpostorItem {
+        std::shared_ptr<Impostor>   mImpostor;
+        // world center and radius of the bounding sphere
+        glm::vec4                   mCenter;
+        // world rotation of the subtree root
+        glm::mat3                   mRotation;
+        // first and second view, weight of the second, share of the pixels
+        glm::vec4                   mViews;
+    };
+
+    // the atlas of an Impostor to draw before the frame
+    struct ImpostorBake {
+        std::shared_ptr<Impostor>   mImpostor;
+        // bounding sphere in the space of the subtree root
+        glm::vec3                   mCenter;
+        float                       mRadius;
+        // the Geometry of the subtree, world matrices relative to its root
+        std::vector<DrawItem>       mItems;
+    };
+
+    // the instances of a Crowd in view
+    struct CrowdItem {
+        std::shared_ptr<Crowd>      mCrowd;
+        // per instance the world matrix, first pose, number of poses and
+        // pose position of its clip, see Crowd::buildInstances
+        std::vector<float>          mInstances;
+        int                         mNumInstances;
+
+        CrowdItem() : mNumInstances(0) {}
+    };
+
+    // the uniforms of a ParticleEmitter, see ParticleEmitter::buildItem
+    struct EmitterItem {
+        std::shared_ptr<ParticleEmitter> mEmitter;
+        // time since the emitter was first drawn
+        double                      mTime;
+        glm::mat4                   mWorld;
+        // world planes particles bounce off, one per column
+        glm::mat4                   mPlanes;
+        // rate, number of particles, lifetime, lifetime jitter
+        glm::vec4                   mSpawn;
+        // initial velocity in emitter space, speed jitter
+        glm::vec4                   mVelocity;
+        // spawn radius, cosine of the spread, drag
+        glm::vec4                   mShape;
+        // world acceleration, bounce
+        glm::vec4                   mForces;
+        glm::vec4                   mColor;
+        glm::vec4                   mEndColor;
+        // size at birth and at death
+        glm::vec2                   mSize;
+        // simulated either way, only drawn when in view
+        bool                        mVisible;
+
+        EmitterItem() : mTime(0.0), mVisible(true) {}
+    };
+
+    // a shadow map of the shadow casting light, see ShadowMaps
+    struct ShadowItem {
+        // of the light, the map covers the view volume of proj
+        glm::mat4                   mView;
+        glm::mat4                   mProj;
+        // draw the static casters into the cache of the map first
+        bool                        mBake;
+        // draw the map, otherwise the last one is kept
+        bool                        mUpdate;
+        // static casters, only when baking
+        std::vector<DrawItem>       mStatic;
+        // dynamic casters, indices in mItems, only when updating
+        std::vector<int>            mDynamic;
+        // dynamic casters not in mItems, indices in mShadowCasters
+        std::vector<int>            mCasters;
+
+        ShadowItem() : mBake(false), mUpdate(false) {}
+    };
+
+    FrameSnapshot()
+        : mShadowLight(-1), mShadowSize(0)
+        , mDepthComplexity(0.f), mDepthPrepass(false), mFrame(0), mBuildTime(0) {}
+
+    /// drop all references, keeps the storage for the next frame
+    void clear() {
+        mScene.reset();
+        mCamera.reset();
+        mLights.clear();
+        mItems.clear();
+        mImpostors.clear();
+        mImpostorBakes.clear();
+        mCrowds.clear();
+        mEmitters.clear();
+        mShadows.clear();
+        mShadowCasters.clear();
+        mShadowLight = -1;
+        mOcclusionIndex.reset();
+        mLightGrid.clear();
+    }
+
+    std::shared_ptr<Scene>                  mScene;
+    // copy of the active camera, aspect ratio set to the surface
+    std::shared_ptr<Camera>                 mCamera;
+    // copies of the scene lights
+    std::vector<std::shared_ptr<Light> >    mLights;
+    // visible Geometry in scene graph order, see Render::buildDrawList
+    std::vector<DrawItem>                   mItems;
+    // subtrees replaced by their Impostor, fully or fading
+    std::vector<ImpostorItem>               mImpostors;
+    // atlas first needed by this frame, see ImpostorRenderer::bake
+    std::vector<ImpostorBake>               mImpostorBakes;
+    // crowds with instances in view, see CrowdRenderer
+    std::vector<CrowdItem>                  mCrowds;
+    // particle emitters met in the scene graph walk, see ParticleRenderer
+    std::vector<EmitterItem>                mEmitters;
+    // one map per cascade of the shadow casting light, see ShadowMaps
+    std::vector<ShadowItem>                 mShadows;
+    // dynamic casters of the maps culled from the view or occluded
+    std::vector<DrawItem>                   mShadowCasters;
+    // the shadow casting light in mLights, -1 for none
+    int                                     mShadowLight;
+    // size of the maps in texels
+    int                                     mShadowSize;
+    // far view depth of each map
+    glm::vec4                               mShadowSplits;
+    // lights assigned to view clusters, invalid if not shading clustered
+    LightGrid                               mLightGrid;
+    // screen area of the opaque scene Geometry over the screen area
+    float                                   mDepthComplexity;
+    // draw a depth pre-pass, see Render::setDepthPrepassMode
+    bool                                    mDepthPrepass;
+
+    // spatial index to issue hardware occlusion queries against after
+    // the frame, only set when the frame is submitted on the game thread
+    std::shared_ptr<BVH>                    mOcclusionIndex;
+    glm::mat4                               mViewProj;
+    glm::vec3                               mEye;
+
+    int                                     mFrame;
+    // microseconds spent in Render::buildFrame
+    long long                               mBuildTime;
+};
+
+} // namespace dzy
+
+#endif
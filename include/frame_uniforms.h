@@ -0,0 +1,141 @@
+#ifndef FRAME_UNIFORMS_H
+#define FRAME_UNIFORMS_H
+
+#include <vector>
+#include <memory>
+#include <GLES3/gl3.h>
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+#include "utils.h"
+
+namespace dzy {
+
+class Camera;
+class Light;
+/// Uniform buffer of the camera and lights shared by all draws of a frame
+///
+///     Backs the std140 block DzyFrame declared by the built-in programs
+///     (see FRAME_BLOCK in program.cpp), bound at UNIFORM_BINDING_FRAME.
+///     The block is filled once per frame, a draw only uploads its own
+///     world transform and material. Geometry with their own camera or
+///     light refill it, update() is a no-op while the camera and lights
+///     stay the same, so the scene ones are restored only once after an
+///     override.
+class FrameUniforms : private noncopyable {
+public:
+    static const int MAX_LIGHTS = 4;
+    static const int MAX_SHADOW_CASCADES = 4;
+
+    FrameUniforms();
+    ~FrameUniforms();
+
+    /// delete the buffer object, must be called with the context current
+    void    release();
+
+    /// start a frame, the next update() writes the buffer in any case
+    void    invalidate();
+
+    /// fill the block and bind it at UNIFORM_BINDING_FRAME
+    ///
+    ///     the camera aspect must already be set
+    ///
+    ///     @param camera the camera of the draws that follow
+    ///     @param lights the lights of the draws that follow, only the
+    ///            first MAX_LIGHTS are used
+    ///     @param clustered shade with the light clusters of the frame
+    ///            instead, see setLightGrid
+    ///     @return false without camera or buffer object
+    bool    update(std::shared_ptr<Camera> camera,
+                const std::vector<std::shared_ptr<Light> >& lights,
+                bool clustered = false);
+
+    /// fill the block with a view and projection and no lights
+    ///
+    ///     for draws not seen through a Camera, like the cells of an
+    ///     Impostor atlas. The next update() with a camera writes the
+    ///     block in any case.
+    ///
+    ///     @return false without buffer object
+    bool    update(const glm::mat4& view, const glm::mat4& proj);
+
+    /// cluster grid of the frame, see LightGrid, written by the next
+    /// update()
+    void    setLightGrid(const glm::vec4& scale, const glm::ivec4& count);
+
+    /// size of the target drawn to in pixels, written by the next
+    /// update()
+    void    setViewport(int width, int height);
+
+    /// shadow maps of the frame, see ShadowMaps, written by the next
+    /// update() with a camera
+    ///
+    ///     @param light the shadow casting light, null for no shadows
+    ///     @param sceneIndex its index in the scene lights, the light
+    ///            clusters are built from
+    ///     @param matrices world to map coordinates and depth per cascade
+    ///     @param splits far view depth of each cascade
+    ///     @param numCascades cascades in matrices and splits
+    void    setShadows(const Light* light, int sceneIndex, const glm::mat4* matrices,
+                const glm::vec4& splits, int numCascades);
+
+    /// matrices of the last update, for the few programs not reading
+    /// the block
+    glm::mat4& getViewMatrix() { return mBlock.mView; }
+    glm::mat4& getProjMatrix() { return mBlock.mProj; }
+
+    /// buffer writes in the last frame
+    int     getNumUpdates() const { return mNumUpdates; }
+
+private:
+    bool    upload();
+
+    // std140, every member is a multiple of 16 bytes and packs the same
+    struct LightBlock {
+        glm::vec4   mColor;
+        glm::vec4   mAmbient;
+        // in eye space
+        glm::vec4   mPosition;
+        // constant, linear, quadratic, strength
+        glm::vec4   mAttenuation;
+    };
+    struct Block {
+        glm::mat4   mView;
+        glm::mat4   mProj;
+        glm::mat4   mViewProj;
+        glm::vec4   mCameraPosition;
+        // x is the number of lights
+        glm::ivec4  mNumLights;
+        LightBlock  mLights[MAX_LIGHTS];
+        // see LightGrid, w is non-zero when shading with the clusters
+        glm::vec4   mClusterScale;
+        glm::ivec4  mClusterCount;
+        // size in xy, inverse size in zw
+        glm::vec4   mViewport;
+        // eye space to map coordinates and depth, per cascade
+        glm::mat4   mShadowMatrices[MAX_SHADOW_CASCADES];
+        // far view depth of each cascade
+        glm::vec4   mShadowSplits;
+        // the shadowed light in the clusters and in mLights, -1 if not
+        // there, and the number of cascades
+        glm::ivec4  mShadowLight;
+    };
+
+    Block                               mBlock;
+    GLuint                              mUBO;
+    bool                                mValid;
+    // what the buffer holds, only compared, never dereferenced
+    const Camera*                       mCamera;
+    std::vector<const Light*>           mLights;
+    bool                                mClustered;
+    // see setShadows, matrices from world space
+    const Light*                        mShadowCaster;
+    int                                 mShadowIndex;
+    glm::mat4                           mShadowMatrices[MAX_SHADOW_CASCADES];
+    int                                 mNumShadowCascades;
+    int                                 mFrameUpdates;
+    int                                 mNumUpdates;
+};
+
+} // namespace dzy
+
+#endif
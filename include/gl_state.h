@@ -0,0 +1,171 @@
+#ifndef GL_STATE_H
+#define GL_STATE_H
+
+#include <map>
+#include <memory>
+#include <vector>
+#include <mutex>
+#include <GLES3/gl3.h>
+#include "utils.h"
+
+namespace dzy {
+
+/// Immutable program and fixed function state of a draw
+///
+///     built once through GLState::getPipelineState and applied with
+///     GLState::apply, which only issues the calls for the fields that
+///     differ from the current state. The vertex layout is not part of
+///     it, that is the vertex array object of each Geometry.
+class PipelineState {
+public:
+    struct Desc {
+        GLuint      mProgram;
+        bool        mDepthTest;
+        bool        mDepthWrite;
+        GLenum      mDepthFunc;
+        bool        mCullFace;
+        GLenum      mCullMode;
+        bool        mBlend;
+        GLenum      mBlendSrc;
+        GLenum      mBlendDst;
+        bool        mColorWrite;
+
+        /// opaque defaults: depth test and write, back face culling,
+        /// no blending
+        Desc();
+        bool operator<(const Desc& rhs) const;
+    };
+
+    const Desc& getDesc() const { return mDesc; }
+
+    friend class GLState;
+private:
+    PipelineState(const Desc& desc) : mDesc(desc) {}
+
+    const Desc  mDesc;
+};
+
+/// Shadow of the GL state, drops redundant state changes
+///
+///     Everything drawing in the engine changes state through here, GL
+///     calls made behind its back leave the shadow stale, call reset()
+///     afterwards. Also counts the GL calls of each frame, issued and
+///     dropped ones.
+class GLState : public Singleton<GLState> {
+public:
+    /// forget the whole shadow state, e.g. for a new context
+    void    reset();
+
+    /// get the shared pipeline state object for a description
+    std::shared_ptr<const PipelineState> getPipelineState(const PipelineState::Desc& desc);
+    /// switch to a pipeline state, only differing fields are set
+    void    apply(const PipelineState& state);
+
+    void    useProgram(GLuint program);
+    void    bindVertexArray(GLuint vao);
+    void    bindBuffer(GLenum target, GLuint buffer);
+    /// bind a buffer to an indexed binding point, only uniform buffer
+    /// bindings below MAX_UNIFORM_BINDINGS are shadowed
+    void    bindBufferBase(GLenum target, GLuint index, GLuint buffer);
+    /// bind a texture to a texture unit, the active unit is left at it,
+    /// only units below MAX_TEXTURE_UNITS are shadowed
+    void    bindTexture(GLuint unit, GLenum target, GLuint texture);
+    /// GL_FRAMEBUFFER binds both the draw and the read framebuffer
+    void    bindFramebuffer(GLenum target, GLuint framebuffer);
+    void    enable(GLenum cap, bool enable);
+    void    depthMask(bool write);
+    void    depthFunc(GLenum func);
+    void    colorMask(bool write);
+    void    cullFace(GLenum mode);
+    void    blendFunc(GLenum src, GLenum dst);
+    void    viewport(GLint x, GLint y, GLsizei width, GLsizei height);
+
+    /// delete objects and forget their bindings, a new object may get
+    /// the same name
+    void    deleteProgram(GLuint program);
+    void    deleteVertexArray(GLuint vao);
+    void    deleteBuffer(GLuint buffer);
+    void    deleteTexture(GLuint texture);
+    void    deleteFramebuffer(GLuint framebuffer);
+
+    /// delete objects later from the thread owning the context, for
+    /// their owners dropped on a thread without it, safe from any thread
+    void    queueDeleteVertexArray(GLuint vao);
+    void    queueDeleteBuffer(GLuint buffer);
+    void    queueDeleteTexture(GLuint texture);
+    void    queueDeleteTransformFeedback(GLuint feedback);
+    /// delete the queued objects, must be called with the context current
+    void    deleteQueued();
+
+    /// count a call not going through the shadow state, like a draw
+    void    countCall(int n = 1) { mFrameCalls += n; }
+    /// count a uniform write, uniforms are shadowed by each Program
+    void    countUniform(bool skipped) { if (skipped) mFrameSkipped++; else mFrameCalls++; }
+
+    /// close the frame statistics, called once per frame
+    void    endFrame();
+    /// GL calls issued and dropped in the last frame
+    int     getNumCalls() const { return mNumCalls; }
+    int     getNumSkipped() const { return mNumSkipped; }
+
+    friend class Singleton<GLState>;
+
+private:
+    static const int MAX_UNIFORM_BINDINGS = 4;
+    static const int MAX_TEXTURE_UNITS = 16;
+
+    enum Cap {
+        CAP_DEPTH_TEST = 0,
+        CAP_CULL_FACE,
+        CAP_BLEND,
+        CAP_STENCIL_TEST,
+        CAP_SCISSOR_TEST,
+        CAP_POLYGON_OFFSET_FILL,
+        NUM_CAPS,
+    };
+
+    GLState();
+    virtual ~GLState();
+
+    static int getCapIndex(GLenum cap);
+
+    std::map<PipelineState::Desc, std::shared_ptr<const PipelineState> > mPipelineStates;
+
+    // -1 for unknown
+    int         mCaps[NUM_CAPS];
+    int         mDepthMask;
+    int         mColorMask;
+    GLuint      mProgram;
+    GLuint      mVertexArray;
+    GLuint      mArrayBuffer;
+    GLuint      mElementBuffer;
+    GLuint      mUniformBuffers[MAX_UNIFORM_BINDINGS];
+    // one target per unit is assumed
+    GLuint      mTextures[MAX_TEXTURE_UNITS];
+    GLuint      mActiveTexture;
+    GLuint      mDrawFramebuffer;
+    GLuint      mReadFramebuffer;
+    GLenum      mDepthFunc;
+    GLenum      mCullMode;
+    GLenum      mBlendSrc;
+    GLenum      mBlendDst;
+    // x, y, width and height, -1 for unknown
+    GLint       mViewport[4];
+
+    // see queueDeleteVertexArray, guarded by mQueueMutex
+    std::mutex              mQueueMutex;
+    std::vector<GLuint>     mQueuedVertexArrays;
+    std::vector<GLuint>     mQueuedBuffers;
+    std::vector<GLuint>     mQueuedTextures;
+    std::vector<GLuint>     mQueuedTransformFeedbacks;
+
+    int         mFrameCalls;
+    int         mFrameSkipped;
+    int         mNumCalls;
+    int         mNumSkipped;
+    int         mFrameCount;
+};
+
+} // namespace dzy
+
+#endif
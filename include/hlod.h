@@ -0,0 +1,121 @@
+#ifndef HLOD_H
+#define HLOD_H
+
+#include <vector>
+#include <string>
+#include <memory>
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+#include "utils.h"
+#include "bounding_volume.h"
+
+namespace dzy {
+
+class Scene;
+class Node;
+class Geometry;
+class Mesh;
+class Material;
+/// Hierarchical level of detail, clusters of distant static Geometry
+/// drawn as one proxy each
+///
+///     build() splits the static Geometry of a scene (see
+///     StaticBatcher::isStatic, transparent ones are left out) at the
+///     median of their centers along the longest axis until a cluster
+///     holds at most mLeafSize of them. Each cluster of the resulting
+///     binary tree gets a proxy Geometry: the meshes of its children,
+///     the Geometry for a leaf and the child proxies otherwise, merged
+///     in the space of the scene root and simplified by vertex
+///     clustering on a grid of mGridResolution cells along the longest
+///     side. The proxy material is the area weighted average of the
+///     merged materials. Proxies are attached to the root, the clustered
+///     Geometry stay in the scene graph.
+///
+///     Each frame select() walks the tree from the top, a cluster farther
+///     from the eye than mDistanceFactor times its radius is drawn as its
+///     proxy and nothing below it is, so thousands of far Geometry cost
+///     a few draw calls. Attach the hierarchy with Scene::setHLOD, the
+///     clustered Geometry must not move afterwards.
+class HLOD : private noncopyable {
+public:
+    /// @param leafSize most Geometry per leaf cluster
+    /// @param gridResolution simplification grid cells along the longest
+    ///        side of a cluster
+    HLOD(unsigned int leafSize = 16, int gridResolution = 16);
+    ~HLOD();
+
+    /// cluster all static Geometry of a scene, once per scene
+    ///
+    ///     must be called with the EGL context current
+    ///
+    ///     @param scene the scene
+    ///     @return the number of clusters, each with a proxy
+    int     build(std::shared_ptr<Scene> scene);
+
+    /// a cluster is drawn as its proxy beyond factor times its radius
+    void    setDistanceFactor(float factor) { mDistanceFactor = factor; }
+    float   getDistanceFactor() const { return mDistanceFactor; }
+
+    /// select the clusters drawn as proxies from an eye, before the
+    /// scene graph walk of a frame, see Render::buildFrame
+    ///
+    ///     @param eye the eye in world space
+    void    select(const glm::vec3& eye);
+
+    /// a Geometry of the hierarchy is drawn this frame
+    ///
+    ///     @param cluster the cluster the Geometry belongs to, or is the
+    ///            proxy of
+    ///     @param proxy the Geometry is the proxy of the cluster
+    bool    isDrawn(int cluster, bool proxy) const;
+
+    int     getNumClusters() const { return mClusters.size(); }
+    /// proxies and clustered Geometry drawn after the last select()
+    int     getNumProxiesDrawn() const { return mNumProxiesDrawn; }
+    int     getNumGeometryReplaced() const { return mNumReplaced; }
+
+private:
+    enum State {
+        // an ancestor draws its proxy
+        STATE_HIDDEN = 0,
+        STATE_PROXY,
+        // the children are drawn, the clustered Geometry for a leaf
+        STATE_REFINED,
+    };
+
+    struct Cluster {
+        // in the space of the scene root
+        AABB                        mBounds;
+        int                         mChildren[2];
+        // clustered Geometry, leaves only
+        std::vector<std::shared_ptr<Geometry> > mGeometry;
+        std::shared_ptr<Geometry>   mProxy;
+        // surface area of the merged meshes, weights the material
+        float                       mArea;
+    };
+
+    struct Entry {
+        std::shared_ptr<Geometry>   mGeometry;
+        AABB                        mBounds;
+    };
+
+    int     buildCluster(std::vector<Entry>& entries, size_t begin, size_t end);
+    bool    buildProxy(int cluster, const glm::mat4& rootInverse);
+    std::shared_ptr<Mesh> simplify(const std::vector<std::shared_ptr<Mesh> >& meshes,
+                const std::vector<glm::mat4>& transforms, const AABB& bounds,
+                const std::string& name);
+
+    unsigned int                mLeafSize;
+    int                         mGridResolution;
+    float                       mDistanceFactor;
+    std::weak_ptr<Node>         mRoot;
+    std::vector<Cluster>        mClusters;
+    // per cluster, empty until the first select()
+    std::vector<char>           mState;
+    int                         mNumProxiesDrawn;
+    int                         mNumReplaced;
+};
+
+} // namespace dzy
+
+#endif
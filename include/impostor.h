@@ -0,0 +1,178 @@
+#ifndef IMPOSTOR_H
+#define IMPOSTOR_H
+
+#include <map>
+#include <atomic>
+#include <vector>
+#include <memory>
+#include <GLES3/gl3.h>
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+#include "utils.h"
+#include "frame_snapshot.h"
+
+namespace dzy {
+
+/// Camera facing stand-in for a distant static subtree, see Node::setImpostor
+///
+///     The first time the subtree is seen it is drawn into an atlas of
+///     VIEWS_AROUND x VIEWS_UP cells, orthographic views around its up
+///     axis from the horizon to straight above, albedo with coverage in
+///     one texture and normal with depth in another, see getView. Once
+///     its bounding sphere covers less than the screen size, the subtree
+///     is replaced by a quad sampling the two cells nearest to the view
+///     direction, lit like the Geometry it stands for. Across the fade
+///     range above the screen size both are drawn, each discarding the
+///     pixels of a dither pattern the other keeps, so there is no
+///     blending and no pop.
+///
+///     The subtree must not move relative to its root, nor animate or
+///     skin, call invalidate() after changing it. An Impostor may be
+///     shared by Nodes holding the same content, the atlas is drawn from
+///     the first of them.
+class Impostor : private noncopyable {
+public:
+    static const int VIEWS_AROUND = 8;
+    static const int VIEWS_UP = 4;
+
+    enum State {
+        STATE_NONE = 0,
+        // queued with a frame, see FrameSnapshot::mImpostorBakes
+        STATE_QUEUED,
+        STATE_BAKED,
+        // nothing to draw in the subtree, or no render target
+        STATE_FAILED,
+    };
+
+    /// @param cellSize size of an atlas cell in pixels
+    Impostor(int cellSize = 64);
+    ~Impostor();
+
+    /// screen sizes the impostor is selected at
+    ///
+    ///     the screen size is the radius of the bounding sphere over
+    ///     half the screen height. Below size only the impostor is drawn,
+    ///     above size * (1 + fadeRange) only the subtree.
+    void    setScreenSize(float size, float fadeRange = 0.5f);
+    float   getScreenSize() const { return mScreenSize; }
+    float   getFadeRange() const { return mFadeRange; }
+
+    /// how much of the subtree the impostor replaces at a screen size,
+    /// 0 none, 1 all of it
+    float   getFadeOut(float screenSize) const;
+
+    int     getCellSize() const { return mCellSize; }
+    int     getWidth() const { return mCellSize * VIEWS_AROUND; }
+    int     getHeight() const { return mCellSize * VIEWS_UP; }
+
+    State   getState() const { return (State)mState.load(); }
+    bool    isBaked() const { return mState == STATE_BAKED; }
+    /// draw the atlas again when next seen
+    void    invalidate() { mState = STATE_NONE; }
+
+    /// mark the atlas as queued, false if it already is or is baked
+    bool    queueBake();
+    /// the frame queuing the atlas was dropped, queue it again
+    void    cancelBake();
+
+    /// bounding sphere of the subtree in the space of its root, set
+    /// when the atlas is queued
+    glm::vec3 getCenter() const { return mCenter; }
+    float   getRadius() const { return mRadius; }
+    void    setBounds(const glm::vec3& center, float radius);
+
+    /// textures of the atlas, 0 until baked
+    GLuint  getAlbedo() const { return mAlbedo; }
+    GLuint  getNormal() const { return mNormal; }
+
+    /// delete the atlas, must be called with the context current
+    void    release();
+
+    /// view of an atlas cell, in the space of the subtree root
+    ///
+    ///     view = row * VIEWS_AROUND + column, the yaw steps around the y
+    ///     axis by column, the pitch from 0 to 90 degrees by row. The
+    ///     VERTEX_impostor shader computes the same basis.
+    ///
+    ///     @param view the cell
+    ///     @param direction receives the direction from the center to the eye
+    ///     @param up receives the up vector of the view
+    static void getView(int view, glm::vec3& direction, glm::vec3& up);
+
+    /// the two views nearest to a direction
+    ///
+    ///     @param direction from the center to the eye, normalized, in
+    ///            the space of the subtree root
+    ///     @return the first and second view, and the weight of the second
+    static glm::vec3 selectViews(const glm::vec3& direction);
+
+    friend class ImpostorRenderer;
+private:
+    int                 mCellSize;
+    float               mScreenSize;
+    float               mFadeRange;
+    std::atomic<int>    mState;
+    glm::vec3           mCenter;
+    float               mRadius;
+    GLuint              mAlbedo;
+    GLuint              mNormal;
+};
+
+class MaterialTable;
+class FrameUniforms;
+/// Draws the atlas of impostors and the impostors of a frame
+///
+///     Atlas cells are drawn with the impostor_ variant of the program of
+///     each Geometry, Geometry without one are left out of the atlas.
+///     Impostors are drawn one instanced draw call per atlas, their
+///     centers, rotations and views streamed into one instance buffer
+///     per frame, with the internal impostor program.
+class ImpostorRenderer : private noncopyable {
+public:
+    ImpostorRenderer();
+    ~ImpostorRenderer();
+
+    /// delete all GL objects and the atlas drawn, must be called with
+    /// the context current
+    void    release();
+
+    /// draw the atlas of the impostors queued by a frame
+    ///
+    ///     changes the framebuffer, viewport and the per-frame block
+    ///
+    ///     @param frame the frame, its bake requests are consumed
+    ///     @param materials the material table of the scene
+    ///     @param uniforms the per-frame block, left invalid
+    void    bake(FrameSnapshot& frame, MaterialTable& materials, FrameUniforms& uniforms);
+
+    /// draw the impostors of a frame into the bound scene target
+    ///
+    ///     the per-frame block of the frame camera must be current
+    void    draw(const FrameSnapshot& frame);
+
+    /// impostors drawn and atlas baked in the last frame
+    int     getNumImpostors() const { return mNumImpostors; }
+    int     getNumBakes() const { return mNumBakes; }
+
+private:
+    bool    bakeAtlas(const FrameSnapshot::ImpostorBake& bake, bool hasLight,
+                MaterialTable& materials, FrameUniforms& uniforms);
+    bool    prepareTarget(Impostor& impostor);
+
+    GLuint                      mFramebuffer;
+    GLuint                      mDepthBuffer;
+    glm::ivec2                  mDepthSize;
+    GLuint                      mVAO;
+    GLuint                      mInstanceVBO;
+    std::vector<float>          mInstanceData;
+    // instances of the frame by atlas
+    std::map<const Impostor*, std::vector<size_t> > mGroups;
+    // atlas drawn, released with the context
+    std::vector<std::weak_ptr<Impostor> > mBaked;
+    int                         mNumImpostors;
+    int                         mNumBakes;
+};
+
+} // namespace dzy
+
+#endif
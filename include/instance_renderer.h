@@ -0,0 +1,117 @@
+#ifndef INSTANCE_RENDERER_H
+#define INSTANCE_RENDERER_H
+
+#include <map>
+#include <vector>
+#include <memory>
+#include <GLES3/gl3.h>
+#include "utils.h"
+#include "program.h"
+#include "gl_state.h"
+#include "frame_snapshot.h"
+
+namespace dzy {
+
+class Scene;
+class Geometry;
+class Mesh;
+class Material;
+class Program;
+class Camera;
+class Light;
+class MaterialTable;
+/// Hardware instancing of Geometry sharing a Mesh and a program
+///
+///     Draw items of a frame are queued by index before the frame is
+///     sorted and grouped by Mesh and program. At the end of the scene
+///     each group with at least mMinInstances members is drawn with a
+///     single glDrawElementsInstanced, world and normal matrices and
+///     material table indices are streamed into one instance buffer per
+///     frame.
+///     Smaller groups are handed back to be drawn one by one as usual.
+class InstanceRenderer : private noncopyable {
+public:
+    InstanceRenderer();
+    ~InstanceRenderer();
+
+    /// delete all GL objects, must be called with the context current
+    void    release();
+
+    /// queue a draw item for instanced drawing
+    ///
+    ///     the vertex buffer object of the Geometry must be up to date,
+    ///     the queue must be cleared before the frame is recycled
+    ///
+    ///     @param hasLight the frame has lights, selects the program
+    ///     @param frame the frame being drawn
+    ///     @param index of a visible Geometry without its own camera,
+    ///            light or program, and without bones in the frame items
+    ///     @return false if the program of the Geometry has no
+    ///             instanced variant, the caller draws it instead
+    bool    add(bool hasLight, const FrameSnapshot& frame, size_t index);
+
+    /// pack the instance buffer for this frame
+    ///
+    ///     groups with fewer than mMinInstances members are removed from
+    ///     the queue and handed back to be drawn one by one
+    ///
+    ///     @param frame the frame the items were queued from
+    ///     @param materials the table the instance material indices refer to
+    ///     @param singles receives the indices of the items not worth
+    ///            instancing
+    void    prepare(const FrameSnapshot& frame, MaterialTable& materials,
+                std::vector<size_t>& singles);
+
+    /// draw prepared groups
+    ///
+    ///     @param variant PROGRAM_VARIANT_COLOR draws all remaining
+    ///            groups and clears the queue. Other variants draw only
+    ///            the groups whose program has that variant, with the
+    ///            variant; G-buffer groups are removed from the queue,
+    ///            depth pre-pass groups are drawn again later
+    ///     @param depthPrepass the depth pre-pass ran, groups it drew
+    ///            are tested for equal depth without writing it
+    void    draw(const FrameSnapshot& frame, std::shared_ptr<Camera> camera,
+                std::shared_ptr<Light> light,
+                ProgramVariant variant = PROGRAM_VARIANT_COLOR,
+                bool depthPrepass = false);
+
+    /// drop whatever is still queued, called once the frame is submitted
+    /// whether its passes ran or not
+    void    clear();
+
+    void    setMinInstances(int n) { mMinInstances = n > 1 ? n : 2; }
+    int     getMinInstances() const { return mMinInstances; }
+
+    /// instanced draw calls and instances drawn in the last frame
+    int     getNumDrawCalls() const { return mNumDrawCalls; }
+    int     getNumInstances() const { return mNumInstances; }
+
+private:
+    typedef std::pair<const Mesh*, const Program*> GroupKey;
+    struct Group {
+        std::shared_ptr<Mesh>                   mMesh;
+        // material of the first member, for uploadData only
+        std::shared_ptr<Material>               mMaterial;
+        // indices into the frame items
+        std::vector<size_t>                     mItems;
+        // offset of the group in the instance buffer
+        size_t                                  mOffset;
+    };
+
+    void    drawGroup(const FrameSnapshot& frame, Group& group,
+                std::shared_ptr<Program> program,
+                const PipelineState::Desc& desc, glm::mat4& view, glm::mat4& proj,
+                std::shared_ptr<Camera> camera, std::shared_ptr<Light> light);
+
+    std::map<GroupKey, Group>   mGroups;
+    std::vector<float>          mInstanceData;
+    GLuint                      mInstanceVBO;
+    int                         mMinInstances;
+    int                         mNumDrawCalls;
+    int                         mNumInstances;
+};
+
+} // namespace dzy
+
+#endif
@@ -26,6 +26,7 @@ public:
         float           angleInnerCone,
         float           angleOuterCone);
 
+    LightSourceType getType();
     glm::vec3 getPosition();
     glm::vec3 getDirection();
     float getAttenuationConstant();
@@ -0,0 +1,136 @@
+#ifndef LIGHT_CLUSTERS_H
+#define LIGHT_CLUSTERS_H
+
+#include <vector>
+#include <memory>
+#include <stdint.h>
+#include <GLES3/gl3.h>
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+#include "utils.h"
+
+namespace dzy {
+
+class Camera;
+class Light;
+/// Lights of one frame sorted into the clusters of the view frustum
+///
+///     built by LightClusters::build, uploaded by LightClusters::upload.
+///     Texel layouts are those read by CLUSTER_LIGHTING in program.cpp.
+struct LightGrid {
+    LightGrid() : mNumLights(0), mValid(false) {}
+
+    bool isValid() const { return mValid; }
+    void clear() { mNumLights = 0; mValid = false; }
+
+    // tiles per pixel in xy, log depth scale and bias in zw
+    glm::vec4               mScale;
+    // clusters in x, y and z
+    glm::ivec4              mCount;
+    // LightClusters::LIGHT_TEXELS texels per light, in eye space
+    std::vector<glm::vec4>  mLights;
+    // first index and number of lights per cluster, x fastest
+    std::vector<uint32_t>   mClusters;
+    // light indices of all clusters, one run per cluster
+    std::vector<uint32_t>   mIndices;
+    int                     mNumLights;
+    bool                    mValid;
+};
+
+/// Clustered forward lighting
+///
+///     The view frustum is split into CLUSTERS_X by CLUSTERS_Y screen
+///     tiles and CLUSTERS_Z slices, exponentially spaced in depth. Every
+///     frame each point and spot light is tested against the clusters of
+///     the slices it reaches, four clusters at a time with Float4, and
+///     the light lists of all clusters are packed into one index array.
+///     Lights without a finite range, like directional ones, go into
+///     every cluster. A fragment finds its cluster from gl_FragCoord and
+///     its view depth and loops only over the lights listed there, so
+///     the per-pixel cost depends on the local light density, not on the
+///     number of lights in the scene.
+///
+///     build only touches CPU memory and runs on the game thread, upload
+///     runs with the context current.
+class LightClusters : private noncopyable {
+public:
+    static const int CLUSTERS_X = 16;
+    static const int CLUSTERS_Y = 9;
+    static const int CLUSTERS_Z = 24;
+    static const int NUM_CLUSTERS = CLUSTERS_X * CLUSTERS_Y * CLUSTERS_Z;
+    static const int MAX_LIGHTS = 1024;
+    /// position and range, color and type, direction and outer cone
+    /// cosine, attenuation and inner cone cosine, ambient and strength
+    static const int LIGHT_TEXELS = 5;
+    static const int INDEX_TEXTURE_WIDTH = 1024;
+    /// a light reaches as far as its attenuated intensity stays above
+    /// one over this
+    static const int LIGHT_CUTOFF = 256;
+
+    LightClusters();
+    ~LightClusters();
+
+    /// delete the textures, must be called with the context current
+    void    release();
+
+    /// assign lights to clusters
+    ///
+    ///     @param camera the camera of the frame, aspect already set
+    ///     @param lights the lights of the frame, up to MAX_LIGHTS used
+    ///     @param width surface width in pixels
+    ///     @param height surface height in pixels
+    ///     @param grid receives the result
+    void    build(std::shared_ptr<Camera> camera,
+                const std::vector<std::shared_ptr<Light> >& lights,
+                int width, int height, LightGrid& grid);
+
+    /// upload a grid and bind its textures at TEXTURE_UNIT_CLUSTER_*
+    ///
+    ///     @return false if the grid is not valid or a texture failed
+    bool    upload(const LightGrid& grid);
+
+    /// volume lit by a light, from its texels in LightGrid::mLights
+    ///
+    ///     a sphere around a point light, the bounding sphere of the cone
+    ///     of a spot light
+    ///     @return false if the light reaches everywhere or nowhere
+    static bool getBoundingSphere(const glm::vec4* texels,
+                glm::vec3& center, float& radius);
+
+    /// light to cluster assignments of the last build
+    int     getNumAssignments() const { return mNumAssignments; }
+
+private:
+    void    updateBounds(const glm::mat4& proj, float near, float far);
+    void    assignSphere(uint32_t light, const glm::vec3& center, float radius);
+    bool    createTextures();
+
+    // view space bounds of the clusters of each slice, structure of
+    // arrays so four clusters are tested at once
+    std::vector<float>      mMinX;
+    std::vector<float>      mMinY;
+    std::vector<float>      mMinZ;
+    std::vector<float>      mMaxX;
+    std::vector<float>      mMaxY;
+    std::vector<float>      mMaxZ;
+    // view depth of the slice boundaries
+    std::vector<float>      mSliceDepth;
+    // projection the bounds were computed for
+    glm::mat4               mProj;
+    float                   mNear;
+    float                   mFar;
+
+    // cluster << 16 | light, sorted into the grid by cluster
+    std::vector<uint32_t>   mPairs;
+    std::vector<uint32_t>   mGlobalLights;
+    int                     mNumAssignments;
+
+    GLuint                  mLightTexture;
+    GLuint                  mClusterTexture;
+    GLuint                  mIndexTexture;
+    int                     mIndexRows;
+};
+
+} // namespace dzy
+
+#endif
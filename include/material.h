@@ -40,6 +40,16 @@ public:
     float getShininess() const;
     void setShininess(float shininess);
 
+    /// 1 is opaque, transparent materials are drawn back to front
+    /// with blending after all opaque Geometry
+    float getOpacity() const;
+    void setOpacity(float opacity);
+    bool isTransparent() const;
+
+    /// changes on every setter call, tells copies of the material held
+    /// elsewhere, like MaterialTable, that they are stale
+    unsigned int getVersion() const { return mVersion; }
+
 private:
     enum Flags {
         F_AMBIENT     = 0x001,
@@ -53,7 +63,9 @@ private:
     glm::vec3   mAmbient;
     glm::vec3   mEmission;
     float       mShininess;
+    float       mOpacity;
     int         mFlags;
+    unsigned int mVersion;
 };
 
 } // namespace
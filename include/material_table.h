@@ -0,0 +1,81 @@
+#ifndef MATERIAL_TABLE_H
+#define MATERIAL_TABLE_H
+
+#include <map>
+#include <vector>
+#include <memory>
+#include <GLES3/gl3.h>
+#include "utils.h"
+
+namespace dzy {
+
+class Scene;
+class Material;
+/// All materials in one uniform buffer, draws select theirs by index
+///
+///     Backs the std140 block DzyMaterials of the built-in programs (see
+///     MATERIAL_BLOCK in program.cpp), bound at UNIFORM_BINDING_MATERIALS.
+///     The materials of a scene are packed when the scene is first drawn,
+///     an entry is written again only when the version of its Material
+///     changed, so a draw changes material with one integer uniform.
+///     Entry 0 holds the default material.
+class MaterialTable : private noncopyable {
+public:
+    /// 64 bytes each, fills the 16KB uniform block size every ES 3.0
+    /// device supports
+    static const int MAX_MATERIALS = 256;
+
+    MaterialTable();
+    ~MaterialTable();
+
+    /// delete the buffer object, must be called with the context current
+    void    release();
+
+    /// pack all materials of a scene, a no-op if it is already packed
+    void    setScene(std::shared_ptr<Scene> scene);
+
+    /// index of a material in the table
+    ///
+    ///     materials not in the scene are added on first use, entries
+    ///     are reclaimed from deleted materials when the table is full
+    ///
+    ///     @param material the material of a draw, may be null
+    ///     @return the entry index, 0 for null or if the table is full
+    int     getIndex(std::shared_ptr<Material> material);
+
+    /// entries in use and entries written since the table was created
+    int     getNumMaterials() const { return mEntries.size(); }
+    int     getNumWrites() const { return mNumWrites; }
+
+private:
+    // std140, same packing as glm
+    struct MaterialBlock {
+        // opacity in w
+        glm::vec4   mDiffuse;
+        // shininess in w
+        glm::vec4   mSpecular;
+        glm::vec4   mAmbient;
+        glm::vec4   mEmission;
+    };
+    struct Entry {
+        int                         mIndex;
+        unsigned int                mVersion;
+        std::weak_ptr<Material>     mMaterial;
+    };
+
+    bool    createBuffer();
+    int     allocate();
+    void    write(int index, const Material& material);
+
+    std::map<const Material*, Entry>    mEntries;
+    std::vector<int>                    mFreeIndices;
+    int                                 mNextIndex;
+    GLuint                              mUBO;
+    std::weak_ptr<Scene>                mScene;
+    bool                                mFullLogged;
+    int                                 mNumWrites;
+};
+
+} // namespace dzy
+
+#endif
@@ -6,6 +6,7 @@
 #include <memory>
 #include "nameobj.h"
 #include "transform.h"
+#include "bounding_volume.h"
 
 namespace dzy {
 
@@ -74,6 +75,7 @@ private:
 
 class AIAdapter;
 class Render;
+class StaticBatcher;
 /// The base class of all kind of Meshes
 ///
 ///     This class is used for building Mesh manuall when you already
@@ -129,8 +131,12 @@ public:
     unsigned int    getColorOffset(int channel) const;
     void*           getColorBuf(int channel);
 
+    unsigned int    getTextureCoordNumComponent(int channel) const;
+    unsigned int    getTextureCoordBufStride(int channel) const;
     unsigned int    getTextureCoordBufSize(int channel) const;
     unsigned int    getTextureCoordBufSize() const;
+    unsigned int    getTextureCoordOffset(int channel) const;
+    void*           getTextureCoordBuf(int channel);
 
     unsigned int    getNormalNumComponent() const;
     unsigned int    getNormalBufStride() const;
@@ -160,6 +166,11 @@ public:
     unsigned int    getIndexBufSize() const;
     void*           getIndexBuf();
 
+    /// bounding box of the original(bind pose) vertex positions
+    ///
+    ///     computed lazily on first call and cached, in model space
+    const AABB&     getBoundingBox();
+
     // these appendVertexXXX functions are used to build MeshData's raw
     // buffer into "structure of arrays", the order is not important, internal
     // variables are used to track the offset
@@ -199,6 +210,7 @@ public:
 
     friend class AIAdapter;
     friend class Render;
+    friend class StaticBatcher;
 protected:
     PrimitiveType                       mPrimitiveType;
 
@@ -244,6 +256,9 @@ protected:
 
     // A mesh use only ONE material, otherwise it is splitted to multiple meshes
     unsigned int                        mMaterialIndex;
+
+    AABB                                mBoundingBox;
+    bool                                mBoundingBoxValid;
 };
 
 class CubeMesh : public Mesh {
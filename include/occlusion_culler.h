@@ -0,0 +1,131 @@
+#ifndef OCCLUSION_CULLER_H
+#define OCCLUSION_CULLER_H
+
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "utils.h"
+#include "bounding_volume.h"
+
+namespace dzy {
+
+class Mesh;
+/// CPU software occlusion culling
+///
+///     Occluder triangles are rasterized into a low resolution depth
+///     buffer four pixels at a time, then reduced into a max depth per
+///     tile. Occludee bounds are tested against the tiles first and the
+///     pixels only when a tile can't reject them.
+///
+///     The work runs on a worker thread one frame ahead: the occluders
+///     and occludees submitted in frame N are resolved while frame N is
+///     drawn on the GPU, the result is consumed in frame N+1. A result
+///     is thrown away when the camera moved too far in between.
+class OcclusionCuller : private noncopyable {
+public:
+    struct Occluder {
+        // only original positions and indices are read by the worker
+        std::shared_ptr<Mesh>   mMesh;
+        glm::mat4               mWorld;
+    };
+
+    struct Occludee {
+        int                     mProxy;
+        AABB                    mBox;
+    };
+
+    /// @param width depth buffer width, rounded up to tile size
+    /// @param height depth buffer height, rounded up to tile size
+    OcclusionCuller(int width = 256, int height = 128);
+    ~OcclusionCuller();
+
+    void    start();
+    void    stop();
+
+    /// wait for the job submitted last frame and make its result current
+    ///
+    ///     @param viewProj the view-projection matrix of this frame
+    void    beginFrame(const glm::mat4& viewProj);
+
+    /// hand the occluders and occludees of this frame to the worker
+    void    submit(const glm::mat4& viewProj,
+                std::vector<Occluder>& occluders,
+                std::vector<Occludee>& occludees);
+
+    /// test a proxy against the current result
+    ///
+    ///     @param proxy the BVH proxy of the occludee
+    ///     @param box the current bounds, must be inside the box tested
+    ///            by the worker for the result to be trusted
+    ///     @return true if the proxy is known to be hidden
+    bool    isOccluded(int proxy, const AABB& box) const;
+
+    /// occluded over tested occludees of the last resolved frame
+    float   getOcclusionRate() const { return mOcclusionRate; }
+    int     getNumOccluded() const { return mNumOccluded; }
+    int     getNumTested() const { return mNumTested; }
+
+    /// max per-element difference of view-projection matrices under
+    /// which a result from the previous frame is still used
+    void    setCameraTolerance(float tolerance) { mCameraTolerance = tolerance; }
+
+private:
+    enum {
+        TILE_SIZE = 8,
+    };
+
+    struct Job {
+        glm::mat4               mViewProj;
+        std::vector<Occluder>   mOccluders;
+        std::vector<Occludee>   mOccludees;
+    };
+
+    struct Result {
+        glm::mat4               mViewProj;
+        // indexed by proxy, non-zero if occluded
+        std::vector<char>       mOccluded;
+        // indexed by proxy, the box the test was done with
+        std::vector<AABB>       mBoxes;
+        int                     mNumOccluded;
+        int                     mNumTested;
+        bool                    mValid;
+    };
+
+    void    workerLoop();
+    void    process(Job& job, Result& result);
+    void    clear();
+    void    rasterizeOccluder(const Occluder& occluder, const glm::mat4& viewProj);
+    void    rasterizeTriangle(const glm::vec4* clip);
+    void    buildHiZ();
+    bool    testOccludee(const AABB& box, const glm::mat4& viewProj) const;
+
+    int                         mWidth;
+    int                         mHeight;
+    int                         mTilesX;
+    int                         mTilesY;
+    // [0, 1] window depth, smaller is nearer
+    std::vector<float>          mDepth;
+    // farthest depth in each tile
+    std::vector<float>          mTileMaxDepth;
+
+    std::thread                 mWorker;
+    std::mutex                  mMutex;
+    std::condition_variable     mCondition;
+    bool                        mRunning;
+    bool                        mBusy;
+    Job                         mJob;
+    Result                      mPending;
+    Result                      mCurrent;
+
+    float                       mCameraTolerance;
+    float                       mOcclusionRate;
+    int                         mNumOccluded;
+    int                         mNumTested;
+    int                         mFrameCount;
+};
+
+} // namespace dzy
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef OCCLUSION_QUERY_H
+#define OCCLUSION_QUERY_H
+
+#include <vector>
+#include <memory>
+#include <GLES3/gl3.h>
+#include "utils.h"
+#include "bounding_volume.h"
+
+namespace dzy {
+
+class BVH;
+/// GPU occlusion culling with hardware occlusion queries
+///
+///     Each Geometry gets a GL_ANY_SAMPLES_PASSED_CONSERVATIVE query on
+///     its bounding box, drawn after the scene against the full depth
+///     buffer. Results are read back only once available, usually one
+///     or two frames later, so the CPU never waits on the GPU.
+///
+///     Temporal coherence: the last known result is used until a new
+///     one arrives. Hidden Geometry is skipped and its box re-tested
+///     every mHiddenInterval frames, visible Geometry is assumed to
+///     stay visible and re-tested every mVisibleInterval frames. A proxy
+///     not tested in the previous frame, e.g. back in the frustum, is
+///     visible until a new result arrives, its last one is stale.
+class OcclusionQueryManager : private noncopyable {
+public:
+    OcclusionQueryManager();
+    ~OcclusionQueryManager();
+
+    /// delete all GL objects, must be called with the context current
+    void    release();
+
+    /// collect available query results, called once at frame start
+    void    beginFrame();
+
+    /// the last known visibility of a proxy, schedules a new query
+    /// when the proxy is due for a re-test
+    ///
+    ///     @param proxy the BVH proxy of the Geometry
+    ///     @param owner identifies the Geometry, proxy handles are reused
+    ///            after removal, a new owner starts as visible
+    bool    isVisible(int proxy, const void* owner);
+
+    /// draw the bounding boxes of scheduled proxies inside queries
+    ///
+    ///     called after the scene is drawn, before swapping buffers
+    void    issueQueries(std::shared_ptr<BVH> bvh, const glm::mat4& viewProj,
+                const glm::vec3& eye);
+
+    void    setVisibleInterval(int frames) { mVisibleInterval = frames > 0 ? frames : 1; }
+    void    setHiddenInterval(int frames) { mHiddenInterval = frames > 0 ? frames : 1; }
+
+    /// hidden over tested proxies of the last frame
+    float   getOcclusionRate() const { return mOcclusionRate; }
+    int     getNumQueries() const { return mNumQueries; }
+
+private:
+    struct ProxyState {
+        const void*     mOwner;
+        // the owner when the query in flight was issued
+        const void*     mQueryOwner;
+        GLuint          mQuery;
+        int             mLastIssued;
+        // the frame isVisible was last called in
+        int             mLastTested;
+        bool            mPending;
+        bool            mVisible;
+    };
+
+    bool    createBoxMesh();
+
+    std::vector<ProxyState>     mStates;
+    std::vector<int>            mPending;
+    std::vector<int>            mScheduled;
+    GLuint                      mBoxVBO;
+    GLuint                      mBoxIBO;
+    int                         mFrame;
+    int                         mVisibleInterval;
+    int                         mHiddenInterval;
+
+    int                         mNumTested;
+    int                         mNumHidden;
+    int                         mNumQueries;
+    float                       mOcclusionRate;
+};
+
+} // namespace dzy
+
+#endif
@@ -0,0 +1,184 @@
+#ifndef PARTICLE_EMITTER_H
+#define PARTICLE_EMITTER_H
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <GLES3/gl3.h>
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+#include "utils.h"
+#include "bounding_volume.h"
+#include "frame_snapshot.h"
+#include "scene_graph.h"
+
+namespace dzy {
+
+/// A node emitting particles simulated and drawn on the GPU
+///
+///     The particles live in two buffers, each step reads one and writes
+///     the other with transform feedback, see ParticleRenderer. Particles
+///     are spawned at a fixed rate into slots in turn, move under a world
+///     acceleration and drag, bounce off up to MAX_PLANES world planes
+///     and die at the end of their lifetime, then are drawn as camera
+///     facing quads, blended additively. The CPU never touches them, the
+///     setters below only change the uniforms of the next frame, so the
+///     cost of an emitter does not depend on its number of particles.
+///
+///     At most getMaxParticles are alive, rate times lifetime when fewer.
+///     The particles are spawned at the world transform of the node and
+///     keep moving in world space when it moves.
+class ParticleEmitter : public NodeObj {
+public:
+    static const int MAX_PLANES = 4;
+
+    /// @param name the node name
+    /// @param maxParticles size of the particle buffers
+    ParticleEmitter(const std::string& name, int maxParticles);
+    ~ParticleEmitter();
+
+    virtual void update(double timeStamp);
+    virtual void draw(Render &render,
+        std::shared_ptr<Scene> scene, double timeStamp);
+
+    int     getMaxParticles() const { return mMaxParticles; }
+
+    /// particles spawned per unit of time, 0 stops spawning and lets the
+    /// live ones die out
+    void    setRate(float rate) { mRate = std::max(rate, 0.f); }
+    float   getRate() const { return mRate; }
+
+    /// @param lifetime time a particle lives
+    /// @param jitter fraction the lifetime of each particle varies by
+    void    setLifetime(float lifetime, float jitter = 0.f);
+
+    /// particles spawn within a sphere around the node
+    void    setRadius(float radius) { mRadius = radius; }
+
+    /// @param velocity initial velocity in the space of the node
+    /// @param spread half angle of the cone the velocity is spread over,
+    ///        in radians, pi spreads in all directions
+    /// @param jitter fraction the speed of each particle varies by
+    void    setVelocity(const glm::vec3& velocity, float spread = 0.f, float jitter = 0.f);
+
+    /// @param acceleration world acceleration, e.g. gravity
+    /// @param drag fraction of the velocity lost per unit of time
+    void    setForces(const glm::vec3& acceleration, float drag = 0.f);
+
+    /// add a plane particles bounce off
+    ///
+    ///     @param plane world plane, normal and distance, particles stay
+    ///            on the side the normal points to
+    ///     @param bounce fraction of the velocity kept off the plane,
+    ///            shared by all planes
+    ///     @return false if there are MAX_PLANES already
+    bool    addPlane(const glm::vec4& plane, float bounce = 0.5f);
+    void    clearPlanes() { mNumPlanes = 0; }
+    int     getNumPlanes() const { return mNumPlanes; }
+
+    /// @param color color at birth
+    /// @param endColor color at death, alpha fades the particle out
+    void    setColor(const glm::vec4& color, const glm::vec4& endColor);
+
+    /// @param size size at birth
+    /// @param endSize size at death
+    void    setSize(float size, float endSize);
+
+    /// bounds the particles stay in, in the space of the node
+    ///
+    ///     drawing is culled against them, particles are simulated
+    ///     either way. Never culled with invalid bounds, the default.
+    void    setBounds(const AABB& bounds) { mBounds = bounds; }
+    const AABB& getBounds() const { return mBounds; }
+
+    /// copy the uniforms of a frame
+    ///
+    ///     @param timeStamp the animation time of the frame
+    ///     @param item receives the uniforms, see ParticleRenderer
+    void    buildItem(double timeStamp, FrameSnapshot::EmitterItem& item);
+
+    /// delete the GL objects, must be called with the context current
+    void    release();
+
+    friend class ParticleRenderer;
+private:
+    int                         mMaxParticles;
+    float                       mRate;
+    float                       mLifetime;
+    float                       mLifetimeJitter;
+    float                       mRadius;
+    glm::vec3                   mVelocity;
+    float                       mSpread;
+    float                       mSpeedJitter;
+    glm::vec3                   mAcceleration;
+    float                       mDrag;
+    glm::vec4                   mPlanes[MAX_PLANES];
+    int                         mNumPlanes;
+    float                       mBounce;
+    glm::vec4                   mColor;
+    glm::vec4                   mEndColor;
+    glm::vec2                   mSize;
+    AABB                        mBounds;
+    // animation time the emitter was first drawn at, negative before
+    double                      mStartTime;
+
+    // render thread state, see ParticleRenderer
+    GLuint                      mBuffers[2];
+    // read from mBuffers[i] by the update and by the draw
+    GLuint                      mUpdateVAO[2];
+    GLuint                      mDrawVAO[2];
+    // capture into mBuffers[i]
+    GLuint                      mFeedback[2];
+    // the buffer holding the last step
+    int                         mCurrent;
+    double                      mSimulatedTime;
+    float                       mSeed;
+};
+
+/// Simulates and draws the particle emitters of a frame
+///
+///     The buffers of an emitter are created when it is first simulated,
+///     filled with dead particles. Each frame every emitter takes one
+///     step of the time since its last one, points drawn with
+///     GL_RASTERIZER_DISCARD through the internal particle_update
+///     program, then the live particles of the emitters in view are
+///     drawn with one glDrawArraysInstanced each through the internal
+///     particle program, after the rest of the scene.
+class ParticleRenderer : private noncopyable {
+public:
+    /// longest step taken, after a hitch particles slow down instead of
+    /// jumping
+    static const float MAX_STEP;
+
+    ParticleRenderer();
+    ~ParticleRenderer();
+
+    /// delete the GL objects of the emitters simulated, must be called
+    /// with the context current
+    void    release();
+
+    /// advance the particles of all emitters of a frame
+    void    simulate(const FrameSnapshot& frame);
+
+    /// draw the particles of the emitters in view into the bound scene
+    /// target, depth tested without writing it
+    ///
+    ///     the per-frame block of the frame camera must be current
+    void    draw(const FrameSnapshot& frame);
+
+    /// emitters drawn and particle slots simulated in the last frame
+    int     getNumDrawCalls() const { return mNumDrawCalls; }
+    int     getNumParticles() const { return mNumParticles; }
+
+private:
+    bool    upload(ParticleEmitter& emitter);
+
+    // emitters with GL objects, released with the context
+    std::vector<std::weak_ptr<ParticleEmitter> > mUploaded;
+    int                         mNumDrawCalls;
+    int                         mNumParticles;
+};
+
+} // namespace dzy
+
+#endif
@@ -6,6 +6,7 @@
 #include <memory>
 #include <GLES3/gl3.h>
 #include "utils.h"
+#include "shader_slot.h"
 
 class AAssetManager;
 
@@ -35,21 +36,26 @@ private:
     GLenum      mShaderType;
 };
 
-#define STORE_CHECK_ATTRIB_LOC(ATTRIB) do {                             \
-        GLint attribLoc = glGetAttribLocation(mProgramId, ATTRIB);      \
-        if (attribLoc == -1) {                                          \
-            break;                                                      \
-        }                                                               \
-        mLocations[ATTRIB] = attribLoc;                                 \
-    } while(0)
+/// uniform block binding points shared by all programs
+enum UniformBinding {
+    UNIFORM_BINDING_FRAME       = 0,    // DzyFrame, see FrameUniforms
+    UNIFORM_BINDING_MATERIALS   = 1,    // DzyMaterials, see MaterialTable
+};
 
-#define STORE_CHECK_UNIFORM_LOC(UNIFORM) do {                           \
-        GLint uniformLoc = glGetUniformLocation(mProgramId, UNIFORM);   \
-        if (uniformLoc == -1) {                                         \
-            break;                                                      \
-        }                                                               \
-        mLocations[UNIFORM] = uniformLoc;                               \
-    } while(0)
+/// texture units reserved for engine data, the highest of the 16 every
+/// GLES3 fragment stage has, so material textures can start at 0
+enum TextureUnit {
+    TEXTURE_UNIT_SHADOW_MAP         = 6,    // dzyShadowMap, see ShadowMaps
+    TEXTURE_UNIT_CROWD_POSES        = 7,    // dzyCrowdPoses, vertex stage, see Crowd
+    TEXTURE_UNIT_IMPOSTOR_ALBEDO    = 8,    // dzyImpostorAlbedo, see Impostor
+    TEXTURE_UNIT_IMPOSTOR_NORMAL    = 9,    // dzyImpostorNormal
+    TEXTURE_UNIT_GBUFFER_ALBEDO     = 10,   // dzyGBufferAlbedo, see DeferredRenderer
+    TEXTURE_UNIT_GBUFFER_NORMAL     = 11,   // dzyGBufferNormal
+    TEXTURE_UNIT_GBUFFER_MATERIAL   = 12,   // dzyGBufferMaterial
+    TEXTURE_UNIT_CLUSTER_LIGHTS     = 13,   // dzyClusterLights, see LightClusters
+    TEXTURE_UNIT_CLUSTER_GRID       = 14,   // dzyClusterGrid
+    TEXTURE_UNIT_CLUSTER_INDICES    = 15,   // dzyClusterIndices
+};
 
 class Scene;
 class Camera;
@@ -73,9 +79,8 @@ public:
     // bind program
     void use();
     bool link(std::shared_ptr<Shader> vtxShader, std::shared_ptr<Shader> fragShader);
-    /// store attribute and uniform location after binding
-    virtual bool storeLocation();
-    GLint getLocation(const char* name);
+    /// location of an attribute or uniform, -1 if the program lacks it
+    GLint getLocation(ShaderSlot slot) const { return mLocations[slot]; }
     void setRequirement(
         bool requireVertexColor,
         bool requireVertexNormal,
@@ -85,7 +90,9 @@ public:
 
     /// upload data to gpu
     ///
-    ///     data including material, light, transform and anything else except mesh
+    ///     data including material, light, transform and anything else except mesh,
+    ///     programs reading the per-frame block (see FrameUniforms) take
+    ///     camera and lights from there and only upload per draw data
     ///
     ///     @param camera current using camera
     ///     @param light
@@ -110,14 +117,47 @@ public:
     ///     @vbo vertex buffer object that hold the vertex data structures of arrays
     virtual bool updateMeshData(std::shared_ptr<Mesh> mesh, GLuint vbo);
 
+    /// select the material of the next draws
+    ///
+    ///     programs shading with a material read it from the material
+    ///     table, other programs ignore the index
+    ///
+    ///     @param index the entry of the material, see MaterialTable::getIndex
+    void setMaterialIndex(int index) { setUniform(SLOT_MATERIAL_INDEX, index); }
+
+    /// leave a dithered fraction of the pixels of the next draws to an
+    /// impostor, see Impostor, 0 draws them all. Programs without a
+    /// material ignore it
+    void setFadeOut(float fade) { setUniform(SLOT_FADE_OUT, fade); }
+
     friend class Shader;
 
+protected:
+    /// called by link with the shaders attached, right before linking,
+    /// e.g. to declare transform feedback varyings
+    virtual void prepareLink() {}
+
+    /// write a uniform, dropped if the program already holds the value
+    void setUniform(ShaderSlot slot, int value);
+    void setUniform(ShaderSlot slot, float value);
+    void setUniform(ShaderSlot slot, const glm::vec3& value);
+    void setUniform(ShaderSlot slot, const glm::vec4& value);
+    void setUniform(ShaderSlot slot, const glm::mat3& value);
+    void setUniform(ShaderSlot slot, const glm::mat4& value);
+
 protected:
     bool                                        mLinked;
     GLuint                                      mProgramId;
     std::vector<std::shared_ptr<Shader> >       mShaders;
-    std::map<std::string, GLint>                mLocations;
+    // resolved at link, -1 for names the program does not declare
+    GLint                                       mLocations[NUM_SHADER_SLOTS];
     int                                         mRequirement;
+
+private:
+    bool uniformChanged(ShaderSlot slot, const float* value, int size);
+
+    // last value written to each uniform
+    std::vector<float>                          mUniformValues[NUM_SHADER_SLOTS];
 };
 
 ///////////////////////////////////////////
@@ -126,7 +166,6 @@ protected:
 class Program000 : public Program {
 public:
     Program000();
-    virtual bool storeLocation();
     virtual bool uploadData(
         std::shared_ptr<Camera> camera,
         std::shared_ptr<Light> light,
@@ -140,7 +179,6 @@ public:
 class Program010 : public Program {
 public:
     Program010();
-    virtual bool storeLocation();
     virtual bool uploadData(
         std::shared_ptr<Camera> camera,
         std::shared_ptr<Light> light,
@@ -154,7 +192,6 @@ public:
 class Program020 : public Program {
 public:
     Program020();
-    virtual bool storeLocation();
     virtual bool uploadData(
         std::shared_ptr<Camera> camera,
         std::shared_ptr<Light> light,
@@ -168,7 +205,6 @@ public:
 class Program100 : public Program {
 public:
     Program100();
-    virtual bool storeLocation();
     virtual bool uploadData(
         std::shared_ptr<Camera> camera,
         std::shared_ptr<Light> light,
@@ -179,6 +215,241 @@ public:
     virtual bool updateMeshData(std::shared_ptr<Mesh> mesh, GLuint vbo);
 };
 
+///////////////////////////////////////////
+//     instanced variants of built-in programs
+///////////////////////////////////////////
+
+/// fixed attribute locations of per-instance data, world matrix, world
+/// normal matrix and material index, sourced with a divisor of 1
+enum InstanceAttribLocation {
+    INSTANCE_ATTRIB_WORLD       = 8,    // mat4, locations 8 to 11
+    INSTANCE_ATTRIB_NORMAL      = 12,   // mat3, locations 12 to 14
+    INSTANCE_ATTRIB_MATERIAL    = 15,   // float
+};
+
+/// Program020 taking world transforms and material indices from
+/// instance attributes, the world matrix passed to uploadData is ignored
+class ProgramInstanced020 : public Program020 {
+public:
+    virtual bool uploadData(
+        std::shared_ptr<Camera> camera,
+        std::shared_ptr<Light> light,
+        std::shared_ptr<Material> material,
+        glm::mat4& world,
+        glm::mat4& view,
+        glm::mat4& proj);
+};
+
+/// Program100 taking world transforms and material indices from
+/// instance attributes, the world matrix passed to uploadData is ignored
+class ProgramInstanced100 : public Program100 {
+public:
+    virtual bool uploadData(
+        std::shared_ptr<Camera> camera,
+        std::shared_ptr<Light> light,
+        std::shared_ptr<Material> material,
+        glm::mat4& world,
+        glm::mat4& view,
+        glm::mat4& proj);
+};
+
+/// writes depth only, for occlusion queries and depth passes
+class ProgramDepthOnly : public Program {
+public:
+    ProgramDepthOnly();
+    virtual bool uploadData(
+        std::shared_ptr<Camera> camera,
+        std::shared_ptr<Light> light,
+        std::shared_ptr<Material> material,
+        glm::mat4& world,
+        glm::mat4& view,
+        glm::mat4& proj);
+    virtual bool updateMeshData(std::shared_ptr<Mesh> mesh, GLuint vbo);
+};
+
+/// lighting passes of deferred shading, reads the G-buffer
+///
+///     the light is selected by its row in the cluster light texture,
+///     see LightClusters, and drawn as a volume or a full screen
+///     triangle, see DeferredRenderer
+class ProgramDeferredLight : public Program {
+public:
+    ProgramDeferredLight();
+    virtual bool uploadData(
+        std::shared_ptr<Camera> camera,
+        std::shared_ptr<Light> light,
+        std::shared_ptr<Material> material,
+        glm::mat4& world,
+        glm::mat4& view,
+        glm::mat4& proj);
+
+    /// @param index the light row in the cluster light texture
+    /// @param volume center in eye space and radius of the light volume
+    void setLight(int index, const glm::vec4& volume) {
+        setUniform(SLOT_LIGHT_INDEX, index);
+        setUniform(SLOT_LIGHT_VOLUME, volume);
+    }
+};
+
+/// camera facing quads textured from an impostor atlas, see
+/// ImpostorRenderer
+///
+///     the quads are made from gl_VertexID, everything else comes from
+///     instance attributes at ImpostorAttribLocation and from setGrid
+class ProgramImpostor : public Program {
+public:
+    ProgramImpostor();
+    virtual bool uploadData(
+        std::shared_ptr<Camera> camera,
+        std::shared_ptr<Light> light,
+        std::shared_ptr<Material> material,
+        glm::mat4& world,
+        glm::mat4& view,
+        glm::mat4& proj);
+
+    /// @param around views around the vertical axis, the atlas columns
+    /// @param up views from the horizon to the top, the atlas rows
+    void setGrid(int around, int up) {
+        setUniform(SLOT_IMPOSTOR_GRID, glm::vec4(around, up, 1.f / around, 1.f / up));
+    }
+};
+
+/// fixed attribute locations of impostor instances, sourced with a
+/// divisor of 1
+enum ImpostorAttribLocation {
+    IMPOSTOR_ATTRIB_CENTER      = 8,    // vec4, world center and radius
+    IMPOSTOR_ATTRIB_ROTATION    = 9,    // mat3, locations 9 to 11
+    IMPOSTOR_ATTRIB_VIEWS       = 12,   // vec4, two views, weight, fade
+};
+
+/// skinned instances of a Crowd, see CrowdRenderer
+///
+///     vertices and instances come from attributes at CrowdAttribLocation,
+///     the poses from dzyCrowdPoses and the material from setMaterialIndex
+class ProgramCrowd : public Program {
+public:
+    ProgramCrowd();
+    virtual bool uploadData(
+        std::shared_ptr<Camera> camera,
+        std::shared_ptr<Light> light,
+        std::shared_ptr<Material> material,
+        glm::mat4& world,
+        glm::mat4& view,
+        glm::mat4& proj);
+};
+
+/// fixed attribute locations of crowd vertices and, with a divisor of 1,
+/// crowd instances
+enum CrowdAttribLocation {
+    CROWD_ATTRIB_POSITION       = 0,    // vec3
+    CROWD_ATTRIB_NORMAL         = 1,    // vec3
+    CROWD_ATTRIB_WEIGHTS        = 2,    // vec4, bone weights
+    CROWD_ATTRIB_BONES          = 3,    // vec4, bone indices
+    CROWD_ATTRIB_WORLD          = 8,    // mat4, locations 8 to 11
+    CROWD_ATTRIB_POSE           = 12,   // vec3, first pose, poses, pose position
+};
+
+/// one simulation step of the particles of a ParticleEmitter, see
+/// ParticleRenderer
+///
+///     drawn as points with the rasterizer off, each vertex is a particle
+///     read from attributes at ParticleAttribLocation and captured by
+///     transform feedback into the other buffer. Dead particles are born
+///     again by the spawn schedule, everything the emitter sets comes
+///     from uniforms.
+class ProgramParticleUpdate : public Program {
+public:
+    ProgramParticleUpdate();
+    virtual bool uploadData(
+        std::shared_ptr<Camera> camera,
+        std::shared_ptr<Light> light,
+        std::shared_ptr<Material> material,
+        glm::mat4& world,
+        glm::mat4& view,
+        glm::mat4& proj);
+
+    /// @param world world matrix of the emitter, particles live in world space
+    /// @param planes world planes particles bounce off, one per column
+    /// @param spawn rate, number of particles, lifetime, lifetime jitter
+    /// @param velocity initial velocity in emitter space, speed jitter
+    /// @param shape spawn radius, cosine of the spread, drag
+    /// @param forces world acceleration, bounce
+    void setEmitter(const glm::mat4& world, const glm::mat4& planes,
+        const glm::vec4& spawn, const glm::vec4& velocity,
+        const glm::vec4& shape, const glm::vec4& forces) {
+        setUniform(SLOT_EMITTER_WORLD, world);
+        setUniform(SLOT_EMITTER_PLANES, planes);
+        setUniform(SLOT_EMITTER_SPAWN, spawn);
+        setUniform(SLOT_EMITTER_VELOCITY, velocity);
+        setUniform(SLOT_EMITTER_SHAPE, shape);
+        setUniform(SLOT_EMITTER_FORCES, forces);
+    }
+
+    /// @param time time in the spawn cycle
+    /// @param delta time since the last step
+    /// @param cycle spawn cycles elapsed, seeds the particles born
+    /// @param seed seed of the emitter
+    void setStep(float time, float delta, float cycle, float seed) {
+        setUniform(SLOT_EMITTER_STEP, glm::vec4(time, delta, cycle, seed));
+    }
+
+protected:
+    virtual void prepareLink();
+};
+
+/// particles of a ParticleEmitter as camera facing quads, see
+/// ParticleRenderer
+///
+///     the quads are made from gl_VertexID, particles are instance
+///     attributes at ParticleAttribLocation, color and size fade over
+///     the life of a particle, see setAppearance
+class ProgramParticle : public Program {
+public:
+    ProgramParticle();
+    virtual bool uploadData(
+        std::shared_ptr<Camera> camera,
+        std::shared_ptr<Light> light,
+        std::shared_ptr<Material> material,
+        glm::mat4& world,
+        glm::mat4& view,
+        glm::mat4& proj);
+
+    /// @param color color at birth
+    /// @param endColor color at death
+    /// @param size size at birth and at death
+    void setAppearance(const glm::vec4& color, const glm::vec4& endColor,
+        const glm::vec2& size) {
+        setUniform(SLOT_PARTICLE_COLOR, color);
+        setUniform(SLOT_PARTICLE_END_COLOR, endColor);
+        setUniform(SLOT_PARTICLE_SIZE, glm::vec4(size, 0.f, 0.f));
+    }
+};
+
+/// fixed attribute locations of particles, sourced per vertex by the
+/// update program and with a divisor of 1 when drawn
+enum ParticleAttribLocation {
+    PARTICLE_ATTRIB_POSITION    = 0,    // vec3, world position
+    PARTICLE_ATTRIB_VELOCITY    = 1,    // vec3, world velocity
+    PARTICLE_ATTRIB_AGE         = 2,    // vec2, age and lifetime
+};
+
+/// programs drawing the same vertices as a built-in or instanced
+/// program for another purpose, see ProgramManager::getVariant
+enum ProgramVariant {
+    // the program itself
+    PROGRAM_VARIANT_COLOR = 0,
+    // "gbuffer_" programs writing the surface attributes read by the
+    // deferred lighting passes, see DeferredRenderer
+    PROGRAM_VARIANT_GBUFFER,
+    // "depth_" programs with the same vertex shader and no fragment
+    // output, for the depth pre-pass
+    PROGRAM_VARIANT_DEPTH,
+    // "impostor_" programs writing albedo and normal with depth into
+    // an impostor atlas, see Impostor
+    PROGRAM_VARIANT_IMPOSTOR,
+    NUM_PROGRAM_VARIANTS,
+};
+
 class EngineContext;
 class Material;
 class Mesh;
@@ -202,17 +473,52 @@ public:
         bool hasLight,
         std::shared_ptr<Mesh> mesh);
 
+    /// get an internal program by technique name
+    ///
+    ///     internal programs are used by the render itself, they are
+    ///     never picked by getCompatibleProgram
+    ///
+    ///     @param technique the technique name in internalProgramTable
+    ///     @return the program, null if not found
+    std::shared_ptr<Program> getInternalProgram(const std::string& technique);
+
+    /// get the instanced variant of a built-in program
+    ///
+    ///     variants are the internal programs named "instanced_" followed
+    ///     by the built-in technique name
+    ///
+    ///     @param program a program returned by getCompatibleProgram
+    ///     @return the instanced variant, null if there is none
+    std::shared_ptr<Program> getInstancedProgram(std::shared_ptr<Program> program);
+
+    /// get a variant of a built-in program or of its instanced variant
+    ///
+    ///     variants are the internal programs named by the variant prefix
+    ///     followed by the technique name, "instanced_" included
+    ///
+    ///     @param program a built-in program or its instanced variant
+    ///     @param variant the variant, PROGRAM_VARIANT_COLOR returns program
+    ///     @return the variant, null if the program has none, e.g. no
+    ///             G-buffer variant for unlit programs
+    std::shared_ptr<Program> getVariant(std::shared_ptr<Program> program,
+        ProgramVariant variant);
+
     friend class Singleton<ProgramManager>;
 
 private:
     ProgramManager();
     virtual ~ProgramManager();
 
+    std::shared_ptr<Program> compileProgram(const ProgramTable& entry);
     std::shared_ptr<Program> createProgram(const std::string& name);
     bool isCompatible(bool b1, bool b2);
 
     std::vector<std::shared_ptr<Program> > mPrograms;
+    std::map<std::string, std::shared_ptr<Program> > mInternalPrograms;
+    std::map<Program*, std::shared_ptr<Program> > mInstancedPrograms;
+    std::map<Program*, std::shared_ptr<Program> > mVariants[NUM_PROGRAM_VARIANTS];
     static ProgramTable builtInProgramTable[];
+    static ProgramTable internalProgramTable[];
 };
 
 } // namespace dzy
@@ -2,7 +2,12 @@
 #define RENDER_H
 
 #include <memory>
+#include <vector>
 #include <GLES3/gl3.h>
+#include "bounding_volume.h"
+#include "frame_snapshot.h"
+#include "program.h"
+#include "render_queue.h"
 
 namespace dzy {
 
@@ -12,8 +17,42 @@ class Node;
 class Geometry;
 class Mesh;
 class Program;
+class BVH;
+class OcclusionCuller;
+class OcclusionQueryManager;
+class InstanceRenderer;
+class FrameUniforms;
+class MaterialTable;
+class Light;
+class Camera;
+class WorkerPool;
+class LightClusters;
+class DeferredRenderer;
+class DynamicResolution;
+class RenderGraph;
+class Impostor;
+class ImpostorRenderer;
+class CrowdRenderer;
+class ParticleEmitter;
+class ParticleRenderer;
+class ShadowMaps;
 class Render {
 public:
+    enum OcclusionMode {
+        OCCLUSION_NONE = 0,
+        // CPU rasterized occluders, see OcclusionCuller
+        OCCLUSION_SOFTWARE,
+        // GPU bounding box queries, see OcclusionQueryManager
+        OCCLUSION_HARDWARE,
+    };
+
+    enum DepthPrepassMode {
+        DEPTH_PREPASS_OFF = 0,
+        DEPTH_PREPASS_ON,
+        // on while the estimated depth complexity is high
+        DEPTH_PREPASS_AUTO,
+    };
+
     Render();
     ~Render();
     bool init();
@@ -21,19 +60,69 @@ public:
 
     /// draw the whole scene
     ///
-    ///     this is place where the camera and light model transform is built
+    ///     builds and submits a frame on the calling thread, the context
+    ///     must be current
     ///     @param scene the scene
     ///     @return true is success, false otherwise
     bool drawScene(std::shared_ptr<Scene> scene);
 
+    /// build the snapshot of a frame, no GL calls
+    ///
+    ///     this is place where the camera and light model transform is
+    ///     built, animation, skinning and culling are run and the visible
+    ///     Geometry recorded. Called on the game thread.
+    ///
+    ///     @param scene the scene
+    ///     @param frame receives the frame
+    ///     @return true is success, false otherwise
+    bool buildFrame(std::shared_ptr<Scene> scene, FrameSnapshot& frame);
+
+    /// draw a frame built by buildFrame and swap buffers
+    ///
+    ///     reads nothing but the snapshot, the Geometry buffer objects and
+    ///     the materials, so the game thread may build the next frame
+    ///     meanwhile, see RenderThread
+    bool submitFrame(FrameSnapshot& frame);
+
     /// draw a single node
     ///
-    ///     @param scene the scene that hosts the scene graph
+    ///     a node with an Impostor is selected by its screen size here,
+    ///     the Geometry below it fade out while the impostor fades in,
+    ///     until finishNode
+    ///
     ///     @param the node current being drawn
-    bool drawNode(std::shared_ptr<Scene> scene, std::shared_ptr<Node> node);
+    ///     @return false if the impostor replaces the whole subtree, the
+    ///             children are not drawn then
+    bool drawNode(std::shared_ptr<Node> node);
 
-    bool drawGeometry(std::shared_ptr<Scene> scene, std::shared_ptr<Geometry> geometry);
+    /// the children of a node drawn by drawNode are done
+    void finishNode(std::shared_ptr<Node> node);
+
+    /// record a Geometry for the frame being built
+    ///
+    ///     called during the scene graph walk, its world transform is
+    ///     brought up to date here. Once the walk is done the recorded
+    ///     Geometry are culled and turned into draw items in parallel,
+    ///     see buildDrawList. Draws are sorted by a key of pass,
+    ///     transparency, program, material, mesh and depth when the frame
+    ///     is submitted, see RenderQueue, Geometry sharing a Mesh may be
+    ///     drawn instanced, see InstanceRenderer.
+    ///
+    ///     @param geometry a Geometry of the scene graph
+    ///     @param boundsChanged the Geometry bounds changed this frame
+    ///     @param skinned the Mesh was skinned on the CPU this frame, its
+    ///            vertices are copied into the frame
+    void recordDraw(std::shared_ptr<Geometry> geometry, bool boundsChanged, bool skinned);
 
+    /// record a ParticleEmitter met in the scene graph walk
+    ///
+    ///     its uniforms are copied into the frame, it is simulated
+    ///     whether in view or not and drawn after the rest of the scene,
+    ///     see ParticleRenderer
+    ///
+    ///     @param emitter a ParticleEmitter of the scene graph
+    ///     @param timeStamp the animation time of the frame
+    void recordEmitter(std::shared_ptr<ParticleEmitter> emitter, double timeStamp);
 
     /// draw a mesh
     ///
@@ -42,12 +131,140 @@ public:
     ///     not contained in Mesh class, but in Node class. Buffer object handle
     ///     must be passed as parameters.
     ///
-    ///     @param scene the scene that hosts the scene graph
     ///     @param mesh the mesh holding geometry data is being drawn
     ///     @param vbo the vertex buffer object to hold mesh geometry data
     ///     @param ibo the index buffer object
-    void drawMesh(std::shared_ptr<Scene> scene, std::shared_ptr<Mesh> mesh,
-        std::shared_ptr<Program> program, GLuint vbo, GLuint ibo);
+    void drawMesh(std::shared_ptr<Mesh> mesh, std::shared_ptr<Program> program,
+        GLuint vbo, GLuint ibo);
+
+    /// draw a mesh through a vertex array object
+    ///
+    ///     the vertex array object holds all attribute and index buffer
+    ///     bindings, see Geometry::getVertexArray
+    ///
+    ///     @param mesh the mesh holding geometry data is being drawn
+    ///     @param vao the vertex array object of the mesh
+    void drawMesh(std::shared_ptr<Mesh> mesh, GLuint vao);
+
+    /// test a Geometry against the view frustum of this frame
+    ///
+    ///     the frustum is queried against the scene spatial index once
+    ///     at the beginning of drawScene, a Geometry whose bounds changed
+    ///     after the query is tested against its own bounds instead.
+    ///     Safe to call from several threads unless hardware occlusion
+    ///     queries are in use.
+    ///
+    ///     @param geometry the Geometry about to be drawn
+    ///     @param boundsChanged the Geometry bounds changed this frame
+    ///     @return false if the Geometry can be skipped
+    bool isVisible(std::shared_ptr<Geometry> geometry, bool boundsChanged);
+
+    /// test world bounds computed during the scene graph walk against
+    /// the view frustum of this frame, such as the pose of a skinned
+    /// Geometry before skinning it, see SkinBounds
+    ///
+    ///     @param box the bounds in world space
+    ///     @return false if what they bound can be skipped, it is
+    ///             counted as culled then
+    bool isVisible(const AABB& box);
+
+    /// cull and build draw items on all cores, see WorkerPool
+    void setParallelBuild(bool enable) { mParallelBuild = enable; }
+    bool getParallelBuild() const { return mParallelBuild; }
+
+    void setFrustumCulling(bool enable) { mFrustumCulling = enable; }
+    bool getFrustumCulling() const { return mFrustumCulling; }
+    /// number of Geometry culled in the last frame
+    int  getNumCulled() const { return mNumCulled; }
+
+    /// select the occlusion culling technique
+    ///
+    ///     OCCLUSION_SOFTWARE tests against Geometry flagged as occluders,
+    ///     OCCLUSION_HARDWARE tests against everything drawn, it falls
+    ///     back to OCCLUSION_SOFTWARE while frames are pipelined
+    void setOcclusionMode(OcclusionMode mode);
+    OcclusionMode getOcclusionMode() const { return mOcclusionMode; }
+    /// occluded over tested Geometry, resolved one or two frames behind
+    float getOcclusionRate() const;
+
+    /// Geometry sharing a Mesh and a program are drawn with one instanced
+    /// draw call, Geometry with bones, a program set by hand, or their
+    /// own camera or light never are
+    void setInstancing(bool enable) { mInstancing = enable; }
+    bool getInstancing() const { return mInstancing; }
+    std::shared_ptr<InstanceRenderer> getInstanceRenderer() { return mInstanceRenderer; }
+    /// camera and lights uniform block, see FrameUniforms
+    std::shared_ptr<FrameUniforms> getFrameUniforms() { return mFrameUniforms; }
+    /// all materials in one uniform buffer, see MaterialTable
+    std::shared_ptr<MaterialTable> getMaterialTable() { return mMaterialTable; }
+
+    /// shade the scene lights per view cluster, see LightClusters
+    ///
+    ///     otherwise only the first FrameUniforms::MAX_LIGHTS lights are
+    ///     used. Geometry with their own light are shaded by it alone
+    ///     either way.
+    void setClusteredLighting(bool enable) { mClusteredLighting = enable; }
+    bool getClusteredLighting() const { return mClusteredLighting; }
+    std::shared_ptr<LightClusters> getLightClusters() { return mLightClusters; }
+
+    /// shade opaque lit Geometry deferred, see DeferredRenderer
+    ///
+    ///     the lights come from the light clusters, which are built for
+    ///     deferred frames even with clustered lighting off. Falls back
+    ///     to forward shading if the G-buffer can not be created.
+    void setDeferredShading(bool enable) { mDeferredShading = enable; }
+    bool getDeferredShading() const { return mDeferredShading; }
+    std::shared_ptr<DeferredRenderer> getDeferredRenderer() { return mDeferredRenderer; }
+
+    /// lay down the depth of opaque scene Geometry before shading it
+    ///
+    ///     the pre-pass draws the opaque queue with the depth_ programs,
+    ///     color writes off, the main pass then tests GL_LEQUAL without
+    ///     writing depth, so every pixel is shaded once however much the
+    ///     Geometry overlaps. In DEPTH_PREPASS_AUTO the pre-pass runs while
+    ///     the depth complexity, estimated from the screen area of the
+    ///     projected opaque bounds, stays above the threshold. Deferred
+    ///     frames skip it, their shading already follows the pixels.
+    void setDepthPrepassMode(DepthPrepassMode mode) { mDepthPrepassMode = mode; }
+    DepthPrepassMode getDepthPrepassMode() const { return mDepthPrepassMode; }
+    /// depth complexity above which DEPTH_PREPASS_AUTO turns the pre-pass
+    /// on, it turns off again below DEPTH_PREPASS_HYSTERESIS of it
+    void setDepthPrepassThreshold(float threshold) { mDepthPrepassThreshold = threshold; }
+    float getDepthPrepassThreshold() const { return mDepthPrepassThreshold; }
+    /// smoothed screen coverage of opaque Geometry, 1 means the screen
+    /// is covered once
+    float getDepthComplexity() const { return mDepthComplexity; }
+    bool isDepthPrepassActive() const { return mDepthPrepassActive; }
+
+    /// draw the scene at a resolution following the frame time, see
+    /// DynamicResolution
+    ///
+    ///     overlays, Geometry with their own camera, are drawn at native
+    ///     resolution on top of the scaled up scene, against a depth
+    ///     buffer of their own
+    void setResolutionScaling(bool enable) { mResolutionScaling = enable; }
+    bool getResolutionScaling() const { return mResolutionScaling; }
+    std::shared_ptr<DynamicResolution> getDynamicResolution() { return mDynamicResolution; }
+    /// atlas and instances of the impostors, see Impostor
+    std::shared_ptr<ImpostorRenderer> getImpostorRenderer() { return mImpostorRenderer; }
+    /// skinned instances of the scene crowds, see Crowd
+    std::shared_ptr<CrowdRenderer> getCrowdRenderer() { return mCrowdRenderer; }
+    /// GPU particles of the scene emitters, see ParticleEmitter
+    std::shared_ptr<ParticleRenderer> getParticleRenderer() { return mParticleRenderer; }
+    /// cached shadow maps of the first directional or spot light, off by
+    /// default, see ShadowMaps
+    std::shared_ptr<ShadowMaps> getShadowMaps() { return mShadowMaps; }
+    /// passes and render targets of the last frame, see RenderGraph
+    std::shared_ptr<RenderGraph> getRenderGraph() { return mRenderGraph; }
+
+    /// frames are built and submitted on different threads
+    ///
+    ///     set by EngineContext while a RenderThread runs, hardware
+    ///     occlusion queries are replaced by software occlusion culling
+    ///     then, their results and the spatial index they are drawn from
+    ///     live on different threads
+    void setPipelined(bool pipelined);
+    bool isPipelined() const { return mPipelined; }
 
     std::shared_ptr<EngineContext> getEngineContext();
     static const char* glStatusStr();
@@ -55,8 +272,128 @@ public:
     friend class EngineContext;
 private:
     void setEngineContext(std::shared_ptr<EngineContext> engineContext);
+    void cullScene(std::shared_ptr<Scene> scene);
+    // the occlusion mode in use, hardware falls back to software while
+    // frames are pipelined
+    OcclusionMode getActiveOcclusionMode() const;
+    void buildDrawList(FrameSnapshot& frame);
+    bool queueInstance(bool hasLight, const FrameSnapshot& frame, size_t index);
+    void queueDraw(bool hasLight, const FrameSnapshot& frame, size_t index);
+    void drawInstances(const FrameSnapshot& frame,
+        ProgramVariant variant = PROGRAM_VARIANT_COLOR);
+    bool buildRenderGraph(const FrameSnapshot& frame, const glm::ivec2& targetSize);
+    void submitQueue(const FrameSnapshot& frame);
+    void drawQueue(const FrameSnapshot& frame, RenderQueue::Pass pass);
+    void drawDepthPrepass(const FrameSnapshot& frame);
+    void updateDepthPrepass(FrameSnapshot& frame);
+    std::shared_ptr<Program> getItemProgram(const FrameSnapshot::DrawItem& item,
+        bool hasLight, ProgramVariant variant);
+    bool drawItem(const FrameSnapshot& frame, const FrameSnapshot::DrawItem& item,
+        ProgramVariant variant);
+    float selectImpostor(std::shared_ptr<Node> node, std::shared_ptr<Impostor> impostor);
+    void queueImpostorBake(std::shared_ptr<Node> node, std::shared_ptr<Impostor> impostor);
+    bool updateFrameUniforms(const FrameSnapshot& frame,
+        std::shared_ptr<Camera> camera, std::shared_ptr<Light> light);
+    void submitOcclusion(std::shared_ptr<BVH> bvh,
+        const std::vector<int>& proxies, const glm::mat4& viewProj);
 
     std::weak_ptr<EngineContext>    mEngineContext;
+
+    bool                            mFrustumCulling;
+    // culling result of the current frame is valid
+    bool                            mCullingActive;
+    Frustum                         mFrustum;
+    // indexed by BVH proxy, non-zero if inside the frustum
+    std::vector<char>               mVisibility;
+    int                             mNumCulled;
+    // the index culled against in the current frame
+    std::shared_ptr<BVH>            mCullingIndex;
+
+    OcclusionMode                   mOcclusionMode;
+    std::shared_ptr<OcclusionCuller> mOcclusionCuller;
+    std::shared_ptr<OcclusionQueryManager> mOcclusionQueries;
+    glm::mat4                       mViewProj;
+    glm::vec3                       mEye;
+
+    bool                            mInstancing;
+    std::shared_ptr<InstanceRenderer> mInstanceRenderer;
+
+    std::shared_ptr<RenderQueue>    mRenderQueue;
+    // view of the active camera, for sort depth
+    glm::mat4                       mView;
+    float                           mDepthScale;
+    // projection and view of the active camera, for screen coverage
+    glm::mat4                       mBuildViewProj;
+    // eye and vertical focal length of the active camera, for screen size
+    glm::vec3                       mBuildEye;
+    float                           mBuildFocal;
+
+    std::shared_ptr<ImpostorRenderer> mImpostorRenderer;
+    // share of the pixels of the Geometry walked left to impostors, and
+    // the shares outside the impostor nodes walked into
+    float                           mFadeOut;
+    std::vector<float>              mFadeStack;
+
+    std::shared_ptr<CrowdRenderer>  mCrowdRenderer;
+    std::shared_ptr<ParticleRenderer> mParticleRenderer;
+    std::shared_ptr<ShadowMaps>     mShadowMaps;
+
+    std::shared_ptr<FrameUniforms>  mFrameUniforms;
+    // lights of the scene this frame, up to FrameUniforms::MAX_LIGHTS used
+    std::vector<std::shared_ptr<Light> > mSceneLights;
+    std::shared_ptr<MaterialTable>  mMaterialTable;
+    bool                            mClusteredLighting;
+    std::shared_ptr<LightClusters>  mLightClusters;
+    bool                            mDeferredShading;
+    // the frame being submitted writes the G-buffer
+    bool                            mDeferredFrame;
+    std::shared_ptr<DeferredRenderer> mDeferredRenderer;
+
+    DepthPrepassMode                mDepthPrepassMode;
+    float                           mDepthPrepassThreshold;
+    // smoothed over frames, so the pre-pass does not toggle every frame
+    float                           mDepthComplexity;
+    bool                            mDepthPrepassActive;
+    // the frame being submitted has had its depth laid down
+    bool                            mDepthPrepassFrame;
+
+    bool                            mResolutionScaling;
+    std::shared_ptr<DynamicResolution> mDynamicResolution;
+    // of the frame being submitted, the scene is smaller when scaled
+    glm::ivec2                      mSurfaceSize;
+    glm::ivec2                      mSceneSize;
+    std::shared_ptr<RenderGraph>    mRenderGraph;
+
+    bool                            mPipelined;
+    // the frame recordDraw appends to, only set inside buildFrame
+    FrameSnapshot*                  mBuildFrame;
+    // surface aspect ratio of the frame being built
+    float                           mAspect;
+
+    // Geometry recorded by the scene graph walk
+    struct Candidate {
+        std::shared_ptr<Geometry>   mGeometry;
+        glm::mat4                   mWorld;
+        bool                        mBoundsChanged;
+        bool                        mSkinned;
+        float                       mFadeOut;
+    };
+    // draw items of one chunk of candidates, kept across frames so the
+    // storage is reused, merged in chunk order into the frame
+    struct Fragment {
+        std::vector<FrameSnapshot::DrawItem>    mItems;
+        int                                     mNumCulled;
+        // screen area of the opaque items, in screens
+        float                                   mCoverage;
+    };
+    void buildFragment(size_t begin, size_t end, Fragment& fragment);
+
+    bool                            mParallelBuild;
+    std::shared_ptr<WorkerPool>     mWorkers;
+    std::vector<Candidate>          mCandidates;
+    std::vector<Fragment>           mFragments;
+    // frame of drawScene, built and submitted on the same thread
+    FrameSnapshot                   mLocalFrame;
 };
 
 } // namespace dzy 
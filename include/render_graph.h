@@ -0,0 +1,222 @@
+#ifndef RENDER_GRAPH_H
+#define RENDER_GRAPH_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <functional>
+#include <GLES3/gl3.h>
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+#include "utils.h"
+
+namespace dzy {
+
+/// Passes of one frame and the render targets they share
+///
+///     Every frame the passes are declared again, each with the targets
+///     it draws into (its attachments) and the resources it reads, then
+///     compiled and executed in declaration order:
+///
+///         - passes whose results reach neither the window nor a pass
+///           that is run are culled
+///         - transient resources live from the first to the last pass
+///           using them, resources with the same description and
+///           lifetimes that do not overlap share one GL object
+///         - each attachment of a pass has a load action, what it
+///           holds when the pass starts, and a store action, whether its
+///           contents are kept when the pass ends. A tiled GPU moves
+///           tiles between its on-chip memory and the GL object only for
+///           LOAD_ACTION_LOAD and STORE_ACTION_STORE, the others map to
+///           glClearBuffer and glInvalidateFramebuffer:
+///
+///             LOAD_ACTION_LOAD        keep what earlier passes left
+///             LOAD_ACTION_CLEAR       clear to the value of the pass
+///             LOAD_ACTION_DONT_CARE   invalidate, every pixel is drawn
+///             STORE_ACTION_AUTO       keep the contents if a later pass
+///                                     uses them, or for the window
+///             STORE_ACTION_STORE      keep the contents
+///             STORE_ACTION_DISCARD    invalidate
+///
+///           a transient resource holds nothing before its first pass, the
+///           GL object may still hold an aliased resource, so it is loaded
+///           as LOAD_ACTION_DONT_CARE then, and earlier passes never keep a
+///           pass that does not load the attachment from being culled
+///
+///     GL objects and framebuffers are kept across frames and deleted
+///     after PHYSICAL_LIFETIME frames without use. Everything here runs
+///     with the context current.
+class RenderGraph : private noncopyable {
+public:
+    typedef int Resource;
+    typedef std::function<void()> Execute;
+
+    static const Resource NULL_RESOURCE = -1;
+    static const int MAX_COLOR_ATTACHMENTS = 4;
+    static const int PHYSICAL_LIFETIME = 60;
+
+    enum LoadAction {
+        LOAD_ACTION_LOAD = 0,
+        LOAD_ACTION_CLEAR,
+        LOAD_ACTION_DONT_CARE,
+    };
+    enum StoreAction {
+        STORE_ACTION_AUTO = 0,
+        STORE_ACTION_STORE,
+        STORE_ACTION_DISCARD,
+    };
+
+    /// a 2D render target
+    struct TextureDesc {
+        TextureDesc() : mWidth(0), mHeight(0), mFormat(GL_RGBA8), mSampled(false) {}
+        TextureDesc(int width, int height, GLenum format, bool sampled = false)
+            : mWidth(width), mHeight(height), mFormat(format), mSampled(sampled) {}
+        bool operator==(const TextureDesc& rhs) const {
+            return mWidth == rhs.mWidth && mHeight == rhs.mHeight
+                && mFormat == rhs.mFormat && mSampled == rhs.mSampled;
+        }
+
+        int         mWidth;
+        int         mHeight;
+        // sized internal format
+        GLenum      mFormat;
+        // read through a sampler, a texture then, a renderbuffer otherwise
+        bool        mSampled;
+    };
+
+    RenderGraph();
+    ~RenderGraph();
+
+    /// delete all GL objects
+    void    release();
+
+    /// forget the passes and resources of the last frame
+    void    reset();
+
+    /// a transient render target, valid for this frame only
+    Resource createTexture(const char* name, const TextureDesc& desc);
+    /// the window, passes drawing into it are never culled. It is
+    /// attached as color 0 and as depth for its depth and stencil
+    Resource importWindow(int width, int height);
+
+    /// add a pass, run by execute() unless culled
+    ///
+    ///     @return the index of the pass, for the calls below
+    int     addPass(const char* name, Execute execute);
+    /// draw into a color attachment, the window only at index 0 and only
+    /// with no other attachment than its own depth
+    void    setColor(int pass, int index, Resource target,
+                LoadAction load = LOAD_ACTION_LOAD, StoreAction store = STORE_ACTION_AUTO);
+    /// draw into a depth or depth stencil attachment, cleared to depth 1
+    /// and stencil 0
+    void    setDepth(int pass, Resource target,
+                LoadAction load = LOAD_ACTION_LOAD, StoreAction store = STORE_ACTION_AUTO);
+    /// value a color attachment is cleared to, 0 by default, the unsigned
+    /// one for the integer formats
+    void    setClearColor(int pass, int index, const glm::vec4& color);
+    void    setClearColor(int pass, int index, const glm::uvec4& color);
+    /// read a resource, sampled or copied from
+    void    read(int pass, Resource resource);
+    /// viewport of the pass, the size of its attachments by default
+    void    setViewport(int pass, int width, int height);
+
+    /// cull passes, place the transient resources on GL objects
+    ///
+    ///     @return false if a GL object could not be created
+    bool    compile();
+
+    /// run the passes left after compile(), in order
+    ///
+    ///     each pass is entered with its attachments bound and its
+    ///     viewport set, the window is left bound
+    ///     @return false if a framebuffer is incomplete, the passes
+    ///             drawing into it are skipped
+    bool    execute();
+
+    /// name of the texture or renderbuffer of a resource, 0 for the
+    /// window, valid while executing
+    GLuint  getName(Resource resource) const;
+    /// bind a framebuffer holding one color resource for reading, e.g.
+    /// the source of glBlitFramebuffer
+    bool    bindReadFramebuffer(Resource color);
+
+    /// passes run and culled, GL objects alive, invalidated and cleared
+    /// attachments in the last frame
+    int     getNumPasses() const { return mNumPasses; }
+    int     getNumCulled() const { return mNumCulled; }
+    int     getNumPhysical() const { return mPhysicals.size(); }
+    int     getNumInvalidated() const { return mNumInvalidated; }
+    int     getNumCleared() const { return mNumCleared; }
+
+private:
+    struct ResourceNode {
+        std::string     mName;
+        TextureDesc     mDesc;
+        bool            mWindow;
+        // index in mPhysicals, -1 until compiled
+        int             mPhysical;
+        int             mFirstPass;
+        int             mLastPass;
+    };
+    struct Pass {
+        std::string     mName;
+        Execute         mExecute;
+        Resource        mColors[MAX_COLOR_ATTACHMENTS];
+        Resource        mDepth;
+        // actions per attachment, colors then depth
+        LoadAction      mLoad[MAX_COLOR_ATTACHMENTS + 1];
+        StoreAction     mStore[MAX_COLOR_ATTACHMENTS + 1];
+        glm::vec4       mClearColor[MAX_COLOR_ATTACHMENTS];
+        glm::uvec4      mClearColorUint[MAX_COLOR_ATTACHMENTS];
+        // whether a later pass needs the contents, for STORE_ACTION_AUTO
+        bool            mKeep[MAX_COLOR_ATTACHMENTS + 1];
+        std::vector<Resource> mReads;
+        glm::ivec2      mViewport;
+        bool            mCulled;
+    };
+    // a GL object backing transient resources
+    struct Physical {
+        TextureDesc     mDesc;
+        GLuint          mName;
+        // stable across frames, framebuffers are looked up by it
+        int             mId;
+        int             mLastFrame;
+        bool            mInUse;
+    };
+    // ids of the physicals per attachment, colors then depth
+    typedef std::vector<int> FramebufferKey;
+
+    bool    isValid(Resource resource) const;
+    void    cull();
+    bool    allocate();
+    int     acquire(const TextureDesc& desc);
+    void    collect();
+    GLuint  getFramebuffer(const Pass& pass, GLenum target);
+    GLuint  createFramebuffer(const Pass& pass, GLenum target);
+    LoadAction  getLoadAction(const Pass& pass, int index, int slot, Resource resource) const;
+    StoreAction getStoreAction(const Pass& pass, int slot) const;
+    void    load(const Pass& pass, int index);
+    void    store(const Pass& pass);
+    void    clear(const Pass& pass, int slot, Resource resource);
+    // attachments with their slot in Pass::mLoad and their attachment
+    // points, the window has GL_COLOR, GL_DEPTH and GL_STENCIL
+    void    getAttachments(const Pass& pass, std::vector<Resource>& resources,
+                std::vector<int>& slots, std::vector<GLenum>& points) const;
+
+    std::vector<ResourceNode>   mResources;
+    std::vector<Pass>           mPasses;
+    std::vector<Physical>       mPhysicals;
+    std::map<FramebufferKey, GLuint> mFramebuffers;
+    int                         mNextId;
+    int                         mFrame;
+    bool                        mCompiled;
+
+    int                         mNumPasses;
+    int                         mNumCulled;
+    int                         mNumInvalidated;
+    int                         mNumCleared;
+};
+
+} // namespace dzy
+
+#endif
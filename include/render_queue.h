@@ -0,0 +1,85 @@
+#ifndef RENDER_QUEUE_H
+#define RENDER_QUEUE_H
+
+#include <map>
+#include <vector>
+#include <memory>
+#include <stdint.h>
+#include "utils.h"
+
+namespace dzy {
+
+/// Flat list of draw items sorted by a packed 64-bit key
+///
+///     key layout, most significant bits first:
+///
+///         opaque:      pass:2 transparent:1 program:10 mesh:12 material:12 depth:24 unused:3
+///         transparent: pass:2 transparent:1 depth:24 program:10 mesh:12 material:12 unused:3
+///
+///     Opaque items are grouped by state to minimize program and buffer
+///     changes, front to back inside a state. Materials come last, they
+///     are selected by a material table index. Transparent items are
+///     drawn back to front, state only breaks ties. Keys are sorted with
+///     a LSD radix sort, 8 bits per pass, passes on a byte that is the
+///     same in every key are skipped.
+class RenderQueue : private noncopyable {
+public:
+    enum Pass {
+        // opaque lit Geometry written to the G-buffer, see DeferredRenderer
+        PASS_GBUFFER = 0,
+        PASS_SCENE,
+        // Geometry drawn with their own camera, after the scene
+        PASS_OVERLAY,
+    };
+
+    /// build a sort key
+    ///
+    ///     @param pass the pass of the item
+    ///     @param transparent the item is blended
+    ///     @param program program id, see getProgramId
+    ///     @param material material id, see getMaterialId
+    ///     @param mesh mesh id, see getMeshId
+    ///     @param depth view depth normalized to [0, 1]
+    static uint64_t makeKey(Pass pass, bool transparent,
+        unsigned int program, unsigned int material, unsigned int mesh, float depth);
+    static Pass getPass(uint64_t key) { return (Pass)(key >> 62); }
+    static bool isTransparent(uint64_t key) { return ((key >> 61) & 1) != 0; }
+
+    RenderQueue();
+
+    /// remove all items, ids are kept
+    void clear();
+    /// @param item index of the item in the frame, see FrameSnapshot
+    void push(uint64_t key, uint32_t item);
+    void sort();
+
+    size_t size() const { return mSorted.size(); }
+    bool empty() const { return mSorted.empty(); }
+    /// key and item index of the i-th item in sorted order
+    uint64_t getKey(size_t i) const { return mSorted[i].mKey; }
+    uint32_t getItem(size_t i) const { return mSorted[i].mIndex; }
+
+    /// small ids fitting in the key fields, assigned on first use
+    unsigned int getProgramId(const void* program) { return getId(mProgramIds, program, 10); }
+    unsigned int getMaterialId(const void* material) { return getId(mMaterialIds, material, 12); }
+    unsigned int getMeshId(const void* mesh) { return getId(mMeshIds, mesh, 12); }
+
+private:
+    struct SortItem {
+        uint64_t    mKey;
+        uint32_t    mIndex;
+    };
+    typedef std::map<const void*, unsigned int> IdMap;
+
+    unsigned int getId(IdMap& ids, const void* object, int bits);
+
+    std::vector<SortItem>   mSorted;
+    std::vector<SortItem>   mScratch;
+    IdMap                   mProgramIds;
+    IdMap                   mMaterialIds;
+    IdMap                   mMeshIds;
+};
+
+} // namespace dzy
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef RENDER_THREAD_H
+#define RENDER_THREAD_H
+
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "utils.h"
+#include "frame_snapshot.h"
+
+namespace dzy {
+
+class EngineContext;
+/// Submits frames on a thread of its own, the game thread runs ahead
+///
+///     The render thread owns the EGL context while it runs: it makes the
+///     context current, waits for published snapshots, draws and swaps
+///     them with Render::submitFrame. The game thread fills the next
+///     snapshot with Render::buildFrame meanwhile, so frame N+1 is
+///     simulated while frame N is submitted and the frame time is the
+///     longer of both instead of their sum.
+///
+///     NUM_SNAPSHOTS snapshots cycle between both threads: one being
+///     built, one waiting, one being drawn. acquire blocks once the game
+///     thread is that far ahead, which keeps input latency bounded.
+class RenderThread : private noncopyable {
+public:
+    static const int NUM_SNAPSHOTS = 3;
+
+    RenderThread();
+    ~RenderThread();
+
+    /// hand the EGL context over to the render thread
+    ///
+    ///     must be called on the thread the context is current on,
+    ///     the context is released there before the render thread starts
+    ///
+    ///     @return false if the context could not be released
+    bool    start(std::shared_ptr<EngineContext> engineContext);
+
+    /// finish the published frames and take the EGL context back
+    ///
+    ///     the context is current on the calling thread again afterwards
+    void    stop();
+
+    bool    isRunning() const { return mRunning; }
+
+    /// a free snapshot to build the next frame into, blocks while
+    /// all snapshots are in flight
+    ///
+    ///     @return null if the render thread is not running
+    FrameSnapshot*  acquire();
+
+    /// queue a snapshot returned by acquire for drawing
+    void    publish(FrameSnapshot* frame);
+
+    /// frames submitted since start
+    int         getNumFrames() const { return mNumFrames; }
+    /// microseconds the game thread waited in acquire for the last frame
+    long long   getWaitTime() const { return mWaitTime; }
+    /// microseconds spent in Render::submitFrame for the last frame
+    long long   getSubmitTime() const { return mSubmitTime; }
+
+private:
+    void    renderLoop();
+
+    std::weak_ptr<EngineContext>    mEngineContext;
+    FrameSnapshot                   mSnapshots[NUM_SNAPSHOTS];
+    // drawn, ready to be acquired again
+    std::deque<FrameSnapshot*>      mFree;
+    // published, not drawn yet
+    std::deque<FrameSnapshot*>      mQueued;
+
+    std::thread                     mThread;
+    std::mutex                      mMutex;
+    std::condition_variable         mCondition;
+    bool                            mRunning;
+    // the render thread made the context current
+    bool                            mContextReady;
+    int                             mFrameCount;
+
+    int                             mNumFrames;
+    long long                       mWaitTime;
+    long long                       mSubmitTime;
+};
+
+} // namespace dzy
+
+#endif
@@ -22,12 +22,16 @@ class Material;
 class Camera;
 class Light;
 class Animation;
+class BVH;
+class HLOD;
+class Crowd;
 typedef std::vector<std::shared_ptr<Camera> >      CameraContainer;
 typedef std::vector<std::shared_ptr<Light> >       LightContainer;
 typedef std::vector<std::shared_ptr<Animation> >   AnimationContainer;
 typedef std::vector<std::shared_ptr<Texture> >     TextureContainer;
 typedef std::vector<std::shared_ptr<Material> >    MaterialContainer;
 typedef std::vector<std::shared_ptr<Mesh> >        MeshContainer;
+typedef std::vector<std::shared_ptr<Crowd> >       CrowdContainer;
 class Scene {
 public:
     Scene();
@@ -43,6 +47,7 @@ public:
     std::shared_ptr<Camera>     getCamera(int idx);
     std::shared_ptr<Light>      getLight(int idx);
     std::shared_ptr<Animation>  getAnimation(int idx);
+    std::shared_ptr<Material>   getMaterial(int idx);
 
     bool atLeastOneMeshHasVertexPosition();
     bool atLeastOneMeshHasVertexColor();
@@ -50,6 +55,24 @@ public:
 
     std::shared_ptr<Node> getRootNode() { return mRootNode;}
 
+    /// the spatial index over all Geometry world bounds in the scene
+    std::shared_ptr<BVH>  getSpatialIndex() { return mSpatialIndex; }
+
+    /// insert all Geometry in the scene graph into the spatial index
+    /// and build the tree from scratch
+    void buildSpatialIndex();
+
+    /// hierarchical LOD drawing distant clusters of the scene as proxies,
+    /// see HLOD::build
+    void setHLOD(std::shared_ptr<HLOD> hlod) { mHLOD = hlod; }
+    std::shared_ptr<HLOD> getHLOD() { return mHLOD; }
+
+    /// draw a Crowd with the scene, see Crowd
+    void addCrowd(std::shared_ptr<Crowd> crowd);
+    void removeCrowd(std::shared_ptr<Crowd> crowd);
+    inline unsigned int getNumCrowds() { return mCrowds.size(); }
+    std::shared_ptr<Crowd> getCrowd(int idx);
+
     static std::shared_ptr<Scene> loadColladaFromFile(
         const std::string &file);
     static std::shared_ptr<Scene> loadColladaFromAsset(
@@ -71,6 +94,9 @@ private:
     MaterialContainer       mMaterials;
     MeshContainer           mMeshes;
     std::shared_ptr<Node>   mRootNode;
+    std::shared_ptr<BVH>    mSpatialIndex;
+    std::shared_ptr<HLOD>   mHLOD;
+    CrowdContainer          mCrowds;
 
     // transient status for easy traversal
     glm::mat4               mCameraModelTransform;
@@ -1,6 +1,7 @@
 #ifndef SCENE_GRAPH_H
 #define SCENE_GRAPH_H
 
+#include <map>
 #include <vector>
 #include <string>
 #include <memory>
@@ -15,6 +16,7 @@
 #include <glm/gtc/type_ptr.hpp>
 #include "nameobj.h"
 #include "transform.h"
+#include "bounding_volume.h"
 
 namespace dzy {
 
@@ -27,6 +29,9 @@ class Material;
 class Camera;
 class Light;
 class NodeAnim;
+class BVH;
+class Impostor;
+class SkinBounds;
 /// Base class for "element" in the scene graph
 class NodeObj : public NameObj, public std::enable_shared_from_this<NodeObj> {
 public:
@@ -104,7 +109,8 @@ public:
     void setMaterial(std::shared_ptr<Material> material);
     std::shared_ptr<Material> getMaterial();
 
-    // TODO: support multiple lights
+    // an own light replaces all the scene lights, the Geometry is lit
+    // by it alone
     void setLight(std::shared_ptr<Light> light);
     std::shared_ptr<Light> getLight();
 
@@ -192,8 +198,17 @@ public:
     /// dump the scene graph hierarchy starting from the current node.
     void dumpHierarchy(Log::Flag f = Log::F_GENERIC);
 
+    /// draw the subtree as a camera facing impostor when far away
+    ///
+    ///     the subtree must be static, see Impostor
+    ///
+    ///     @param impostor the impostor, null to always draw the subtree
+    void setImpostor(std::shared_ptr<Impostor> impostor) { mImpostor = impostor; }
+    std::shared_ptr<Impostor> getImpostor() { return mImpostor; }
+
 protected:
     std::vector<std::shared_ptr<NodeObj> >  mChildren;
+    std::shared_ptr<Impostor>               mImpostor;
 };
 
 class Geometry : public NodeObj {
@@ -208,8 +223,83 @@ public:
 
     std::shared_ptr<Mesh> getMesh();
 
+    GLuint getVertexBO() const { return mVertexBO; }
+    GLuint getIndexBO() const { return mIndexBO; }
+
+    /// bring the buffer objects up to date before drawing
+    ///
+    ///     called with the GL context current, on the render thread if
+    ///     there is one. The Mesh data is uploaded once, skinned vertices
+    ///     are uploaded every frame from the copy taken when the frame
+    ///     was built, the Mesh itself is skinned again meanwhile.
+    ///
+    ///     @param vertices skinned vertices of this frame, empty if none
+    bool prepareBufferObject(const std::vector<char>& vertices);
+
+    /// vertex array object binding the buffer objects of this Geometry
+    /// to the attributes of a program
+    ///
+    ///     created on first use and cached per program, the cache is
+    ///     dropped only when a buffer object is reallocated
+    ///
+    ///     @param program the program about to draw this Geometry
+    ///     @return the vertex array object, 0 on error
+    GLuint getVertexArray(std::shared_ptr<Program> program);
+
+    /// mesh bounds transformed by the world transform
+    AABB getWorldBoundingBox();
+
+    /// proxy handle in the spatial index, BVH::NULL_PROXY if not inserted
+    int getProxy() const { return mProxy; }
+
+    /// keep the proxy of this Geometry in sync with its world bounds
+    ///
+    ///     inserts the Geometry on first call, afterwards only touches
+    ///     the tree when the world transform has changed
+    ///
+    ///     @param bvh the spatial index of the scene hosting this Geometry
+    ///     @return true if the bounds in the index changed since last call
+    bool updateSpatialIndex(std::shared_ptr<BVH> bvh);
+
+    virtual void setUpdateFlag(UpdateFlag f, bool recursive);
+
+    /// mark this Geometry as an occluder for software occlusion culling
+    ///
+    ///     occluders are rasterized into the occlusion depth buffer
+    ///     instead of being tested against it, large static opaque
+    ///     Geometry like walls and terrain make good occluders.
+    void setOccluder(bool occluder) { mOccluder = occluder; }
+    bool isOccluder() const { return mOccluder; }
+
+    /// use a simplified mesh for occlusion, must not be larger than
+    /// the render mesh, the render mesh is used if not set
+    void setOccluderMesh(std::shared_ptr<Mesh> mesh) { mOccluderMesh = mesh; }
+    std::shared_ptr<Mesh> getOccluderMesh() { return mOccluderMesh ? mOccluderMesh : mMesh; }
+
+    /// this Geometry draws several static Geometry merged by StaticBatcher
+    bool isBatch() const { return mIsBatch; }
+    /// this Geometry is drawn by a batch, but stays pickable
+    bool isBatched() const { return !mBatch.expired(); }
+    std::shared_ptr<Geometry> getBatch() { return mBatch.lock(); }
+
+    /// this Geometry is clustered by an HLOD, or is one of its proxies
+    bool isInHLOD() const { return mHLODCluster >= 0; }
+    bool isHLODProxy() const { return mIsHLODProxy; }
+
+    /// animated bounds of a skinned Mesh, see SkinBounds::attach
+    ///
+    ///     the Geometry is culled by the bounds of its pose before it is
+    ///     skinned, and kept in the spatial index with the bounds of all
+    ///     clips instead of the bind pose
+    void setSkinBounds(std::shared_ptr<SkinBounds> bounds);
+    std::shared_ptr<SkinBounds> getSkinBounds() { return mSkinBounds; }
+
+    friend class StaticBatcher;
+    friend class HLOD;
+
 protected:
-    bool updateBufferObject();
+    bool updateBufferObject(const void* vertices);
+    void releaseVertexArrays();
 
 protected:
     // one on one mapping between Geometry and Mesh
@@ -220,6 +310,22 @@ protected:
     GLuint                      mVertexBO;
     GLuint                      mIndexBO;
     bool                        mBOUpdated;
+    // sizes of the buffer object storage, reallocated when changed
+    size_t                      mVertexBOSize;
+    size_t                      mIndexBOSize;
+    // program id to vertex array object
+    std::map<GLuint, GLuint>    mVertexArrays;
+    // handle into the scene spatial index
+    int                         mProxy;
+    std::weak_ptr<BVH>          mSpatialIndex;
+    bool                        mBoundsDirty;
+    bool                        mOccluder;
+    std::shared_ptr<Mesh>       mOccluderMesh;
+    bool                        mIsBatch;
+    std::weak_ptr<Geometry>     mBatch;
+    int                         mHLODCluster;
+    bool                        mIsHLODProxy;
+    std::shared_ptr<SkinBounds> mSkinBounds;
 };
 
 }
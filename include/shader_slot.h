@@ -0,0 +1,56 @@
+#ifndef SHADER_SLOT_H
+#define SHADER_SLOT_H
+
+namespace dzy {
+
+/// every vertex attribute and uniform the engine sets, X(SLOT, KIND, NAME)
+///
+///     built-in shaders and ShaderGenerator take their names from here,
+///     Program resolves all of them once at link into a table indexed
+///     by ShaderSlot. A name a program does not declare resolves to -1,
+///     setting it is a no-op.
+#define DZY_SHADER_SLOTS(X)                                                     \
+    X(SLOT_VERTEX_POSITION,     SLOT_KIND_ATTRIB,   "dzyVertexPosition")        \
+    X(SLOT_VERTEX_COLOR,        SLOT_KIND_ATTRIB,   "dzyVertexColor")           \
+    X(SLOT_VERTEX_NORMAL,       SLOT_KIND_ATTRIB,   "dzyVertexNormal")          \
+    X(SLOT_MVP_MATRIX,          SLOT_KIND_UNIFORM,  "dzyMVPMatrix")             \
+    X(SLOT_MV_MATRIX,           SLOT_KIND_UNIFORM,  "dzyMVMatrix")              \
+    X(SLOT_MODEL_MATRIX,        SLOT_KIND_UNIFORM,  "dzyModelMatrix")           \
+    X(SLOT_NORMAL_MATRIX,       SLOT_KIND_UNIFORM,  "dzyNormalMatrix")          \
+    X(SLOT_CONSTANT_COLOR,      SLOT_KIND_UNIFORM,  "dzyConstantColor")         \
+    X(SLOT_MATERIAL_INDEX,      SLOT_KIND_UNIFORM,  "dzyMaterialIndex")         \
+    X(SLOT_LIGHT_INDEX,         SLOT_KIND_UNIFORM,  "dzyLightIndex")            \
+    X(SLOT_LIGHT_VOLUME,        SLOT_KIND_UNIFORM,  "dzyLightVolume")           \
+    X(SLOT_FADE_OUT,            SLOT_KIND_UNIFORM,  "dzyFadeOut")               \
+    X(SLOT_IMPOSTOR_GRID,       SLOT_KIND_UNIFORM,  "dzyImpostorGrid")          \
+    X(SLOT_EMITTER_WORLD,       SLOT_KIND_UNIFORM,  "dzyEmitterWorld")          \
+    X(SLOT_EMITTER_PLANES,      SLOT_KIND_UNIFORM,  "dzyEmitterPlanes")         \
+    X(SLOT_EMITTER_SPAWN,       SLOT_KIND_UNIFORM,  "dzyEmitterSpawn")          \
+    X(SLOT_EMITTER_VELOCITY,    SLOT_KIND_UNIFORM,  "dzyEmitterVelocity")       \
+    X(SLOT_EMITTER_SHAPE,       SLOT_KIND_UNIFORM,  "dzyEmitterShape")          \
+    X(SLOT_EMITTER_FORCES,      SLOT_KIND_UNIFORM,  "dzyEmitterForces")         \
+    X(SLOT_EMITTER_STEP,        SLOT_KIND_UNIFORM,  "dzyEmitterStep")           \
+    X(SLOT_PARTICLE_COLOR,      SLOT_KIND_UNIFORM,  "dzyParticleColor")         \
+    X(SLOT_PARTICLE_END_COLOR,  SLOT_KIND_UNIFORM,  "dzyParticleEndColor")      \
+    X(SLOT_PARTICLE_SIZE,       SLOT_KIND_UNIFORM,  "dzyParticleSize")
+
+enum ShaderSlotKind {
+    SLOT_KIND_ATTRIB,
+    SLOT_KIND_UNIFORM,
+};
+
+enum ShaderSlot {
+#define DZY_SHADER_SLOT_ENUM(SLOT, KIND, NAME) SLOT,
+    DZY_SHADER_SLOTS(DZY_SHADER_SLOT_ENUM)
+#undef DZY_SHADER_SLOT_ENUM
+    NUM_SHADER_SLOTS
+};
+
+/// GLSL name of a slot
+const char* getShaderSlotName(ShaderSlot slot);
+/// attribute or uniform
+ShaderSlotKind getShaderSlotKind(ShaderSlot slot);
+
+} // namespace dzy
+
+#endif
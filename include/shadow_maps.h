@@ -0,0 +1,180 @@
+#ifndef SHADOW_MAPS_H
+#define SHADOW_MAPS_H
+
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <GLES3/gl3.h>
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+#include "utils.h"
+#include "bounding_volume.h"
+#include "frame_snapshot.h"
+#include "frame_uniforms.h"
+
+namespace dzy {
+
+class Geometry;
+class Light;
+class MaterialTable;
+/// Shadow maps of the first directional or spot light of the scene
+///
+///     Each map has a cache holding the depth of the static casters,
+///     Geometry without bones or animation along their parents. The
+///     cache is drawn again only when the light changes, when a static
+///     caster moves, is added or removed, or when the map moves. Every
+///     frame the map is updated the cache is copied into it and the
+///     dynamic casters inside its light frustum are drawn on top, in
+///     view or not, so the cost of a map follows the number of moving
+///     casters, not the size of the scene.
+///
+///     A directional light has up to MAX_CASCADES maps, each covering a
+///     slice of the view frustum, split between linear and logarithmic.
+///     A map covers its slice with a margin and follows the camera in
+///     steps of whole texels, so it moves, and its cache is drawn again,
+///     only once the slice leaves the margin. Cascade i is updated every
+///     2^i frames, at most every getMaxInterval frames, the distant ones
+///     on alternate frames. A spot light has one map of its cone, up to
+///     getDistance away.
+///
+///     The maps are placed and their casters picked on the game thread,
+///     see recordCaster and build, and drawn before the scene, see draw.
+class ShadowMaps : private noncopyable {
+public:
+    static const int MAX_CASCADES = FrameUniforms::MAX_SHADOW_CASCADES;
+
+    ShadowMaps();
+    ~ShadowMaps();
+
+    void    setEnabled(bool enable) { mEnabled = enable; }
+    bool    isEnabled() const { return mEnabled; }
+
+    /// size of each map in texels
+    void    setResolution(int size);
+    int     getResolution() const { return mResolution; }
+
+    /// maps of a directional light, from 1 to MAX_CASCADES
+    void    setNumCascades(int cascades);
+    int     getNumCascades() const { return mNumCascades; }
+
+    /// view depth shadows reach for a directional light, range of a spot
+    void    setDistance(float distance);
+    float   getDistance() const { return mDistance; }
+
+    /// frames between two updates of the most distant cascades
+    void    setMaxInterval(int frames);
+    int     getMaxInterval() const { return mMaxInterval; }
+
+    /// draw the caches again with the next frame, for changes to static
+    /// casters not seen while walking the scene graph, like a new Mesh
+    void    invalidate() { mInvalidated = true; }
+
+    /// a Geometry never moving on its own, its shadow is cached
+    static bool isStaticCaster(std::shared_ptr<Geometry> geometry);
+
+    /// record a Geometry met in the scene graph walk, see Render::recordDraw
+    ///
+    ///     @param geometry the Geometry
+    ///     @param world its world matrix
+    ///     @param moved its bounds changed this frame
+    ///     @param skinned its Mesh was skinned this frame
+    void    recordCaster(std::shared_ptr<Geometry> geometry, const glm::mat4& world,
+                bool moved, bool skinned);
+
+    /// place the maps of a frame and pick their casters
+    ///
+    ///     called once the draw items of the frame are built, the
+    ///     casters recorded since the last call are dropped
+    void    build(FrameSnapshot& frame);
+
+    /// delete the maps, must be called with the context current
+    void    release();
+
+    /// draw the maps a frame updates, then bind them for the scene
+    ///
+    ///     the buffer objects of the frame items must be up to date,
+    ///     the frame uniforms are left with a view of the light, the
+    ///     shadow lookups of the next update are set
+    void    draw(const FrameSnapshot& frame, MaterialTable& materials,
+                FrameUniforms& uniforms);
+
+    /// caches drawn and maps updated in the last frame
+    int     getNumBakes() const { return mNumBakes; }
+    int     getNumUpdates() const { return mNumUpdates; }
+
+private:
+    struct Caster {
+        std::shared_ptr<Geometry>   mGeometry;
+        glm::mat4                   mWorld;
+        AABB                        mBounds;
+        bool                        mSkinned;
+        // of a dynamic caster, its index in the frame items, else in the
+        // frame shadow casters once a map needs it, -1 for none
+        int                         mItem;
+        int                         mCaster;
+    };
+    // where a map is, game thread
+    struct Cascade {
+        glm::mat4                   mView;
+        glm::mat4                   mProj;
+        // light space center, snapped to texels in xy, half size
+        glm::vec3                   mCenter;
+        float                       mExtent;
+        bool                        mValid;
+
+        Cascade() : mExtent(0.f), mValid(false) {}
+    };
+
+    bool    placeCascade(Cascade& cascade, const glm::mat4& lightView,
+                const glm::vec3& center, float radius, bool bake);
+    void    placeSpot(Cascade& cascade, const glm::vec3& position,
+                const glm::vec3& direction, float cone);
+    void    pickCasters(const Cascade& cascade, FrameSnapshot& frame,
+                FrameSnapshot::ShadowItem& item);
+    bool    prepareMaps(int size, int layers, bool& created);
+    void    drawItem(const FrameSnapshot::DrawItem& item, bool hasLight,
+                MaterialTable& materials, glm::mat4& view, glm::mat4& proj);
+
+    bool                        mEnabled;
+    int                         mResolution;
+    int                         mNumCascades;
+    float                       mDistance;
+    int                         mMaxInterval;
+    bool                        mInvalidated;
+
+    // game thread, static casters recorded since the last build
+    std::vector<Caster>         mStatic;
+    // changes with the set of static casters, see recordCaster
+    size_t                      mStaticHash;
+    bool                        mStaticMoved;
+    size_t                      mLastStaticHash;
+    // game thread, dynamic casters recorded since the last build
+    std::vector<Caster>         mDynamic;
+    Cascade                     mCascades[MAX_CASCADES];
+    // the light the caches were drawn for
+    int                         mLightType;
+    glm::vec3                   mLightPosition;
+    glm::vec3                   mLightDirection;
+    float                       mLightCone;
+    int                         mBuiltResolution;
+    int                         mBuiltCascades;
+    float                       mBuiltDistance;
+    int                         mFrame;
+    // set by the render thread when the caches are lost
+    std::atomic<bool>           mCacheLost;
+
+    // render thread
+    GLuint                      mMaps;
+    GLuint                      mCaches;
+    GLuint                      mFramebuffers[2];
+    int                         mSize;
+    int                         mLayers;
+    // world to map coordinates of the maps as last drawn
+    glm::mat4                   mMatrices[MAX_CASCADES];
+    int                         mNumBakes;
+    int                         mNumUpdates;
+};
+
+} // namespace dzy
+
+#endif
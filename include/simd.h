@@ -0,0 +1,146 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define DZY_SIMD_NEON
+#elif defined(__SSE2__) || defined(__SSE__)
+#include <xmmintrin.h>
+#define DZY_SIMD_SSE
+#else
+#define DZY_SIMD_SCALAR
+#endif
+
+namespace dzy {
+
+/// four packed floats, maps to NEON on arm, SSE on x86
+///
+///     comparisons return lane masks, all bits set for true and
+///     zero for false, to be consumed by select() and anyTrue().
+class Float4 {
+public:
+    Float4() {}
+#if defined(DZY_SIMD_NEON)
+    typedef float32x4_t NativeType;
+    Float4(NativeType v) : mValue(v) {}
+    explicit Float4(float f) : mValue(vdupq_n_f32(f)) {}
+    Float4(float x, float y, float z, float w) {
+        float buf[4] = { x, y, z, w };
+        mValue = vld1q_f32(buf);
+    }
+    static Float4 load(const float* p) { return Float4(vld1q_f32(p)); }
+    void store(float* p) const { vst1q_f32(p, mValue); }
+
+    Float4 operator +(const Float4& o) const { return vaddq_f32(mValue, o.mValue); }
+    Float4 operator -(const Float4& o) const { return vsubq_f32(mValue, o.mValue); }
+    Float4 operator *(const Float4& o) const { return vmulq_f32(mValue, o.mValue); }
+    Float4 operator &(const Float4& o) const {
+        return vreinterpretq_f32_u32(vandq_u32(
+            vreinterpretq_u32_f32(mValue), vreinterpretq_u32_f32(o.mValue)));
+    }
+    Float4 operator |(const Float4& o) const {
+        return vreinterpretq_f32_u32(vorrq_u32(
+            vreinterpretq_u32_f32(mValue), vreinterpretq_u32_f32(o.mValue)));
+    }
+    Float4 operator >=(const Float4& o) const {
+        return vreinterpretq_f32_u32(vcgeq_f32(mValue, o.mValue));
+    }
+    Float4 operator >(const Float4& o) const {
+        return vreinterpretq_f32_u32(vcgtq_f32(mValue, o.mValue));
+    }
+    Float4 operator <(const Float4& o) const {
+        return vreinterpretq_f32_u32(vcltq_f32(mValue, o.mValue));
+    }
+
+    static Float4 min(const Float4& a, const Float4& b) { return vminq_f32(a.mValue, b.mValue); }
+    static Float4 max(const Float4& a, const Float4& b) { return vmaxq_f32(a.mValue, b.mValue); }
+    /// lanes of a where mask is set, lanes of b otherwise
+    static Float4 select(const Float4& mask, const Float4& a, const Float4& b) {
+        return vbslq_f32(vreinterpretq_u32_f32(mask.mValue), a.mValue, b.mValue);
+    }
+    static bool anyTrue(const Float4& mask) {
+        uint32x4_t m = vreinterpretq_u32_f32(mask.mValue);
+        uint32x2_t r = vorr_u32(vget_low_u32(m), vget_high_u32(m));
+        return (vget_lane_u32(r, 0) | vget_lane_u32(r, 1)) != 0;
+    }
+    float maxElement() const {
+        float32x2_t r = vpmax_f32(vget_low_f32(mValue), vget_high_f32(mValue));
+        r = vpmax_f32(r, r);
+        return vget_lane_f32(r, 0);
+    }
+#elif defined(DZY_SIMD_SSE)
+    typedef __m128 NativeType;
+    Float4(NativeType v) : mValue(v) {}
+    explicit Float4(float f) : mValue(_mm_set1_ps(f)) {}
+    Float4(float x, float y, float z, float w) : mValue(_mm_setr_ps(x, y, z, w)) {}
+    static Float4 load(const float* p) { return Float4(_mm_loadu_ps(p)); }
+    void store(float* p) const { _mm_storeu_ps(p, mValue); }
+
+    Float4 operator +(const Float4& o) const { return _mm_add_ps(mValue, o.mValue); }
+    Float4 operator -(const Float4& o) const { return _mm_sub_ps(mValue, o.mValue); }
+    Float4 operator *(const Float4& o) const { return _mm_mul_ps(mValue, o.mValue); }
+    Float4 operator &(const Float4& o) const { return _mm_and_ps(mValue, o.mValue); }
+    Float4 operator |(const Float4& o) const { return _mm_or_ps(mValue, o.mValue); }
+    Float4 operator >=(const Float4& o) const { return _mm_cmpge_ps(mValue, o.mValue); }
+    Float4 operator >(const Float4& o) const { return _mm_cmpgt_ps(mValue, o.mValue); }
+    Float4 operator <(const Float4& o) const { return _mm_cmplt_ps(mValue, o.mValue); }
+
+    static Float4 min(const Float4& a, const Float4& b) { return _mm_min_ps(a.mValue, b.mValue); }
+    static Float4 max(const Float4& a, const Float4& b) { return _mm_max_ps(a.mValue, b.mValue); }
+    /// lanes of a where mask is set, lanes of b otherwise
+    static Float4 select(const Float4& mask, const Float4& a, const Float4& b) {
+        return _mm_or_ps(_mm_and_ps(mask.mValue, a.mValue), _mm_andnot_ps(mask.mValue, b.mValue));
+    }
+    static bool anyTrue(const Float4& mask) { return _mm_movemask_ps(mask.mValue) != 0; }
+    float maxElement() const {
+        __m128 r = _mm_max_ps(mValue, _mm_movehl_ps(mValue, mValue));
+        r = _mm_max_ss(r, _mm_shuffle_ps(r, r, 1));
+        return _mm_cvtss_f32(r);
+    }
+#else
+    explicit Float4(float f) { for (int i=0; i<4; i++) mValue[i] = f; }
+    Float4(float x, float y, float z, float w) {
+        mValue[0] = x; mValue[1] = y; mValue[2] = z; mValue[3] = w;
+    }
+    static Float4 load(const float* p) { return Float4(p[0], p[1], p[2], p[3]); }
+    void store(float* p) const { for (int i=0; i<4; i++) p[i] = mValue[i]; }
+
+    Float4 operator +(const Float4& o) const { Float4 r; for (int i=0; i<4; i++) r.mValue[i] = mValue[i] + o.mValue[i]; return r; }
+    Float4 operator -(const Float4& o) const { Float4 r; for (int i=0; i<4; i++) r.mValue[i] = mValue[i] - o.mValue[i]; return r; }
+    Float4 operator *(const Float4& o) const { Float4 r; for (int i=0; i<4; i++) r.mValue[i] = mValue[i] * o.mValue[i]; return r; }
+    Float4 operator &(const Float4& o) const { Float4 r; for (int i=0; i<4; i++) r.mMask[i] = mMask[i] & o.mMask[i]; return r; }
+    Float4 operator |(const Float4& o) const { Float4 r; for (int i=0; i<4; i++) r.mMask[i] = mMask[i] | o.mMask[i]; return r; }
+    Float4 operator >=(const Float4& o) const { Float4 r; for (int i=0; i<4; i++) r.mMask[i] = mValue[i] >= o.mValue[i] ? ~0u : 0u; return r; }
+    Float4 operator >(const Float4& o) const { Float4 r; for (int i=0; i<4; i++) r.mMask[i] = mValue[i] > o.mValue[i] ? ~0u : 0u; return r; }
+    Float4 operator <(const Float4& o) const { Float4 r; for (int i=0; i<4; i++) r.mMask[i] = mValue[i] < o.mValue[i] ? ~0u : 0u; return r; }
+
+    static Float4 min(const Float4& a, const Float4& b) { Float4 r; for (int i=0; i<4; i++) r.mValue[i] = a.mValue[i] < b.mValue[i] ? a.mValue[i] : b.mValue[i]; return r; }
+    static Float4 max(const Float4& a, const Float4& b) { Float4 r; for (int i=0; i<4; i++) r.mValue[i] = a.mValue[i] > b.mValue[i] ? a.mValue[i] : b.mValue[i]; return r; }
+    /// lanes of a where mask is set, lanes of b otherwise
+    static Float4 select(const Float4& mask, const Float4& a, const Float4& b) {
+        Float4 r; for (int i=0; i<4; i++) r.mValue[i] = mask.mMask[i] ? a.mValue[i] : b.mValue[i]; return r;
+    }
+    static bool anyTrue(const Float4& mask) {
+        return (mask.mMask[0] | mask.mMask[1] | mask.mMask[2] | mask.mMask[3]) != 0;
+    }
+    float maxElement() const {
+        float r = mValue[0];
+        for (int i=1; i<4; i++) if (mValue[i] > r) r = mValue[i];
+        return r;
+    }
+#endif
+
+private:
+#if defined(DZY_SIMD_SCALAR)
+    union {
+        float           mValue[4];
+        unsigned int    mMask[4];
+    };
+#else
+    NativeType  mValue;
+#endif
+};
+
+} // namespace dzy
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef SKIN_BOUNDS_H
+#define SKIN_BOUNDS_H
+
+#include <vector>
+#include <memory>
+#include "utils.h"
+#include "transform.h"
+#include "bounding_volume.h"
+
+namespace dzy {
+
+class Scene;
+class Node;
+class Mesh;
+class NodeObj;
+class Animation;
+/// Conservative bounds of a skinned Mesh in any pose, without skinning it
+///
+///     Per joint the bind pose box of the vertices it weights is kept,
+///     a skinned vertex is a weighted mean of its joint transforms, so
+///     it lies within the union of those boxes moved by the transforms
+///     of the pose, see getPoseBounds. Geometry::draw culls a skinned
+///     Geometry this way before skinning it, off screen characters are
+///     never skinned.
+///
+///     Per clip, poses are sampled over the duration of an Animation
+///     and their bounds merged, see addClip. The union of all clips is
+///     the box a skinned Geometry is kept with in the spatial index.
+class SkinBounds : private noncopyable {
+public:
+    SkinBounds(std::shared_ptr<Mesh> mesh);
+    ~SkinBounds();
+
+    /// bind pose box of the vertices weighted by a joint, invalid if none
+    ///
+    ///     @param bone index of the bone in the Mesh
+    const AABB& getJointBounds(int bone) const { return mJoints[bone]; }
+
+    /// bounds of a pose in the space of the Mesh
+    ///
+    ///     @param bones bones of the Mesh posed
+    ///     @param nodeTransforms bone transforms of their nodes, see
+    ///            NodeObj::getBoneTransform
+    AABB    getPoseBounds(const std::vector<int>& bones,
+                const std::vector<Transform>& nodeTransforms) const;
+
+    /// sample the poses of a clip
+    ///
+    ///     nodes of the scene graph not animated by the clip keep their
+    ///     local transforms. Poses are sampled at numSamples + 1 times
+    ///     over the duration, the merged box is grown by the largest move
+    ///     between two samples.
+    ///
+    ///     @param animation the clip
+    ///     @param root root of the scene graph holding the bone nodes
+    ///     @param numSamples intervals the duration is sampled at
+    ///     @return false if no bone of the Mesh has a node
+    bool    addClip(std::shared_ptr<Animation> animation,
+                std::shared_ptr<Node> root, int numSamples = 32);
+
+    int     getNumClips() const { return mClips.size(); }
+    /// bounds of a clip in the space of the Mesh
+    const AABB& getClipBounds(int clip) const { return mClips[clip].mBounds; }
+    std::shared_ptr<Animation> getClip(int clip) const { return mClips[clip].mAnimation.lock(); }
+
+    /// the bind pose and all clips, in the space of the Mesh
+    const AABB& getBounds() const { return mBounds; }
+
+    /// give all skinned Geometry of a scene the bounds of their Mesh,
+    /// with every Animation of the scene as a clip
+    ///
+    ///     @param scene the scene
+    ///     @param numSamples intervals each clip is sampled at
+    ///     @return the number of Geometry given bounds
+    static int attach(std::shared_ptr<Scene> scene, int numSamples = 32);
+
+    /// bone transforms of nodes at a time of a clip, the nodes are left
+    /// untouched, see NodeObj::getBoneTransform
+    ///
+    ///     @param animation the clip
+    ///     @param nodes bone nodes, nodes the clip does not animate keep
+    ///            their local transforms
+    ///     @param time the time in the clip
+    ///     @param nodeTransforms receives a transform per node
+    static void getClipPose(std::shared_ptr<Animation> animation,
+                const std::vector<std::shared_ptr<NodeObj> >& nodes, double time,
+                std::vector<Transform>& nodeTransforms);
+
+private:
+    struct Clip {
+        std::weak_ptr<Animation>    mAnimation;
+        AABB                        mBounds;
+    };
+
+    std::weak_ptr<Mesh>         mMesh;
+    // per bone of the Mesh
+    std::vector<AABB>           mJoints;
+    // vertices no bone weights are never moved
+    AABB                        mUnweighted;
+    std::vector<Clip>           mClips;
+    AABB                        mBounds;
+};
+
+} // namespace dzy
+
+#endif
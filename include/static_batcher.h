@@ -0,0 +1,60 @@
+#ifndef STATIC_BATCHER_H
+#define STATIC_BATCHER_H
+
+#include <vector>
+#include <string>
+#include <memory>
+#include "utils.h"
+
+namespace dzy {
+
+class Scene;
+class Node;
+class Geometry;
+class Mesh;
+/// Merge static Geometry sharing a material and vertex format
+///
+///     Vertices are pre-transformed into the space of the scene root
+///     node, so transforming the root still moves the batches. One
+///     batch Geometry is attached to the root per group, the merged
+///     Geometry stay in the scene graph and the spatial index for
+///     picking, they are just not drawn any more.
+///
+///     A Geometry is static when neither it nor any ancestor below the
+///     root is animated and its mesh is not skinned. Moving a batched
+///     Geometry afterwards is not reflected in its batch.
+class StaticBatcher : private noncopyable {
+public:
+    /// @param maxVertices vertex limit per batch, bigger groups are
+    ///        split along their longest axis to keep culling effective
+    StaticBatcher(unsigned int maxVertices = 65536);
+
+    /// batch all static Geometry in the scene
+    ///
+    ///     must be called with the EGL context current
+    ///
+    ///     @param scene the scene to batch
+    ///     @return the number of batches created
+    int batch(std::shared_ptr<Scene> scene);
+
+    /// number of Geometry merged into batches by the last batch()
+    int getNumMerged() const { return mNumMerged; }
+
+    /// a Geometry never moves relative to the root and can be merged with
+    /// others, not already in a batch nor in an HLOD
+    static bool isStatic(std::shared_ptr<Geometry> geometry, std::shared_ptr<Node> root);
+
+private:
+    typedef std::vector<std::shared_ptr<Geometry> > GeometryList;
+
+    std::string getFormatSignature(std::shared_ptr<Mesh> mesh);
+    std::shared_ptr<Geometry> merge(const GeometryList& group,
+        const glm::mat4& rootInverse, const std::string& name);
+
+    unsigned int    mMaxVertices;
+    int             mNumMerged;
+};
+
+} // namespace dzy
+
+#endif
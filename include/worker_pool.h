@@ -0,0 +1,58 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <vector>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "utils.h"
+
+namespace dzy {
+
+/// A few worker threads running batches of independent jobs
+///
+///     run hands out job indices to the workers and to the calling
+///     thread, which works too, and returns once all jobs are done.
+///     Jobs are meant to be coarse, a chunk of some tens of items each,
+///     they are taken one at a time under a lock.
+class WorkerPool : private noncopyable {
+public:
+    typedef std::function<void (int job)> Job;
+
+    static const int MAX_THREADS = 7;
+
+    /// @param numThreads worker threads besides the caller of run, 0
+    ///        picks one less than the number of cores
+    WorkerPool(int numThreads = 0);
+    ~WorkerPool();
+
+    /// workers are started by the first run
+    void    stop();
+
+    /// run job(0) ... job(numJobs - 1), blocks until all have returned
+    void    run(int numJobs, const Job& job);
+
+    /// threads working in run, the caller included
+    int     getNumThreads() const { return mNumThreads + 1; }
+
+private:
+    void    start();
+    void    workerLoop();
+
+    int                         mNumThreads;
+    std::vector<std::thread>    mWorkers;
+    std::mutex                  mMutex;
+    std::condition_variable     mCondition;
+    std::condition_variable     mDoneCondition;
+    bool                        mRunning;
+    // the batch being run, null between runs
+    const Job*                  mJob;
+    int                         mNumJobs;
+    int                         mNextJob;
+    int                         mNumDone;
+};
+
+} // namespace dzy
+
+#endif
@@ -7,6 +7,7 @@
 #include "mesh.h"
 #include "scene.h"
 #include "camera.h"
+#include "static_batcher.h"
 
 using namespace dzy;
 using namespace std;
@@ -53,6 +54,10 @@ bool SViewer::start() {
         mScene = Scene::loadColladaFromFile(mSceneFileName);
     if (!mScene) return false;
 
+    // blender collada exports are split into many small meshes
+    StaticBatcher batcher;
+    batcher.batch(mScene);
+
     shared_ptr<Node> rootNode(mScene->getRootNode());
     rootNode->dumpHierarchy();
     return true;
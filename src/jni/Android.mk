@@ -18,9 +18,34 @@ LOCAL_SRC_FILES :=          \
     program.cpp             \
     transform.cpp           \
     animation.cpp           \
-    shader_generator.cpp
+    shader_generator.cpp    \
+    bounding_volume.cpp     \
+    bvh.cpp                 \
+    occlusion_culler.cpp    \
+    occlusion_query.cpp     \
+    static_batcher.cpp      \
+    instance_renderer.cpp   \
+    render_queue.cpp        \
+    gl_state.cpp            \
+    frame_uniforms.cpp      \
+    material_table.cpp      \
+    render_thread.cpp       \
+    worker_pool.cpp         \
+    light_clusters.cpp      \
+    deferred_renderer.cpp   \
+    dynamic_resolution.cpp  \
+    render_graph.cpp        \
+    impostor.cpp            \
+    hlod.cpp                \
+    skin_bounds.cpp         \
+    crowd.cpp               \
+    particle_emitter.cpp    \
+    shadow_maps.cpp
 LOCAL_C_INCLUDES:= $(LOCAL_PATH)/../../include
 LOCAL_CPPFLAGS  := -std=c++11
+ifeq ($(TARGET_ARCH_ABI),armeabi-v7a)
+LOCAL_ARM_NEON  := true
+endif
 LOCAL_STATIC_LIBRARIES := android_native_app_glue ndk_helper
 include $(BUILD_STATIC_LIBRARY)
 
@@ -186,16 +186,19 @@ shared_ptr<Material> AIAdapter::typeCast(aiMaterial *material) {
     shared_ptr<Material> ma(new Material);
     aiColor3D diffuse, specular, ambient, emission;
     float shininess;
+    float opacity = 1.f;
     material->Get(AI_MATKEY_COLOR_DIFFUSE, diffuse);
     material->Get(AI_MATKEY_COLOR_SPECULAR, specular);
     material->Get(AI_MATKEY_COLOR_AMBIENT, ambient);
     material->Get(AI_MATKEY_COLOR_EMISSIVE, emission);
     material->Get(AI_MATKEY_SHININESS, shininess);
+    material->Get(AI_MATKEY_OPACITY, opacity);
     ma->setDiffuse(typeCast(diffuse));
     ma->setSpecular(typeCast(specular));
     ma->setAmbient(typeCast(ambient));
     ma->setEmission(typeCast(emission));
     ma->setShininess(shininess);
+    ma->setOpacity(opacity);
     return ma;
 }
 
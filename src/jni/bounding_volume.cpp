@@ -0,0 +1,210 @@
+#include <float.h>
+#include <algorithm>
+#include "bounding_volume.h"
+
+using namespace std;
+
+namespace dzy {
+
+AABB::AABB()
+    : mMin( FLT_MAX,  FLT_MAX,  FLT_MAX)
+    , mMax(-FLT_MAX, -FLT_MAX, -FLT_MAX) {
+}
+
+AABB::AABB(const glm::vec3& min, const glm::vec3& max)
+    : mMin(min)
+    , mMax(max) {
+}
+
+bool AABB::isValid() const {
+    return mMin.x <= mMax.x && mMin.y <= mMax.y && mMin.z <= mMax.z;
+}
+
+void AABB::reset() {
+    mMin = glm::vec3( FLT_MAX,  FLT_MAX,  FLT_MAX);
+    mMax = glm::vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+}
+
+glm::vec3 AABB::getCenter() const {
+    return (mMin + mMax) * 0.5f;
+}
+
+glm::vec3 AABB::getExtent() const {
+    return (mMax - mMin) * 0.5f;
+}
+
+float AABB::getSurfaceArea() const {
+    if (!isValid()) return 0.f;
+    glm::vec3 d = mMax - mMin;
+    return 2.f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+AABB& AABB::expand(const glm::vec3& point) {
+    mMin = glm::min(mMin, point);
+    mMax = glm::max(mMax, point);
+    return *this;
+}
+
+AABB& AABB::expand(const AABB& other) {
+    if (!other.isValid()) return *this;
+    mMin = glm::min(mMin, other.mMin);
+    mMax = glm::max(mMax, other.mMax);
+    return *this;
+}
+
+AABB& AABB::inflate(float margin) {
+    if (!isValid()) return *this;
+    mMin -= glm::vec3(margin, margin, margin);
+    mMax += glm::vec3(margin, margin, margin);
+    return *this;
+}
+
+bool AABB::contains(const glm::vec3& point) const {
+    return point.x >= mMin.x && point.x <= mMax.x
+        && point.y >= mMin.y && point.y <= mMax.y
+        && point.z >= mMin.z && point.z <= mMax.z;
+}
+
+bool AABB::contains(const AABB& other) const {
+    return other.mMin.x >= mMin.x && other.mMax.x <= mMax.x
+        && other.mMin.y >= mMin.y && other.mMax.y <= mMax.y
+        && other.mMin.z >= mMin.z && other.mMax.z <= mMax.z;
+}
+
+bool AABB::intersects(const AABB& other) const {
+    return mMin.x <= other.mMax.x && mMax.x >= other.mMin.x
+        && mMin.y <= other.mMax.y && mMax.y >= other.mMin.y
+        && mMin.z <= other.mMax.z && mMax.z >= other.mMin.z;
+}
+
+AABB AABB::transform(const glm::mat4& mat4) const {
+    if (!isValid()) return AABB();
+    // Arvo's method, transform center and extent instead of 8 corners
+    glm::vec3 center = glm::vec3(mat4 * glm::vec4(getCenter(), 1.f));
+    glm::vec3 extent = getExtent();
+    glm::vec3 newExtent(0.f, 0.f, 0.f);
+    for (int i=0; i<3; i++) {
+        for (int j=0; j<3; j++) {
+            newExtent[i] += fabsf(mat4[j][i]) * extent[j];
+        }
+    }
+    return AABB(center - newExtent, center + newExtent);
+}
+
+AABB AABB::merge(const AABB& a, const AABB& b) {
+    AABB ret(a);
+    ret.expand(b);
+    return ret;
+}
+
+Sphere::Sphere()
+    : mCenter(0.f, 0.f, 0.f)
+    , mRadius(0.f) {
+}
+
+Sphere::Sphere(const glm::vec3& center, float radius)
+    : mCenter(center)
+    , mRadius(radius) {
+}
+
+bool Sphere::intersects(const AABB& box) const {
+    glm::vec3 closest = glm::clamp(mCenter, box.getMin(), box.getMax());
+    glm::vec3 d = closest - mCenter;
+    return glm::dot(d, d) <= mRadius * mRadius;
+}
+
+bool Sphere::contains(const AABB& box) const {
+    // farthest corner of the box must be inside the sphere
+    glm::vec3 d = glm::max(glm::abs(box.getMin() - mCenter),
+        glm::abs(box.getMax() - mCenter));
+    return glm::dot(d, d) <= mRadius * mRadius;
+}
+
+Ray::Ray()
+    : mOrigin(0.f, 0.f, 0.f)
+    , mDirection(0.f, 0.f, -1.f)
+    , mInvDirection(FLT_MAX, FLT_MAX, -1.f) {
+}
+
+Ray::Ray(const glm::vec3& origin, const glm::vec3& direction)
+    : mOrigin(origin)
+    , mDirection(glm::normalize(direction)) {
+    for (int i=0; i<3; i++) {
+        mInvDirection[i] = mDirection[i] != 0.f ? 1.f / mDirection[i] : FLT_MAX;
+    }
+}
+
+glm::vec3 Ray::getPoint(float distance) const {
+    return mOrigin + mDirection * distance;
+}
+
+bool Ray::intersects(const AABB& box, float& distance) const {
+    if (!box.isValid()) return false;
+    glm::vec3 t1 = (box.getMin() - mOrigin) * mInvDirection;
+    glm::vec3 t2 = (box.getMax() - mOrigin) * mInvDirection;
+    glm::vec3 tmin = glm::min(t1, t2);
+    glm::vec3 tmax = glm::max(t1, t2);
+    float tnear = max(max(tmin.x, tmin.y), tmin.z);
+    float tfar  = min(min(tmax.x, tmax.y), tmax.z);
+    if (tfar < 0.f || tnear > tfar) return false;
+    distance = tnear > 0.f ? tnear : 0.f;
+    return true;
+}
+
+Frustum::Frustum() {
+    for (int i=0; i<PLANE_NUM; i++)
+        mPlanes[i] = glm::vec4(0.f, 0.f, 0.f, 1.f);
+}
+
+Frustum::Frustum(const glm::mat4& viewProj) {
+    setMatrix(viewProj);
+}
+
+void Frustum::setMatrix(const glm::mat4& viewProj) {
+    // Gribb-Hartmann plane extraction, glm matrices are column major
+    glm::vec4 row0(viewProj[0][0], viewProj[1][0], viewProj[2][0], viewProj[3][0]);
+    glm::vec4 row1(viewProj[0][1], viewProj[1][1], viewProj[2][1], viewProj[3][1]);
+    glm::vec4 row2(viewProj[0][2], viewProj[1][2], viewProj[2][2], viewProj[3][2]);
+    glm::vec4 row3(viewProj[0][3], viewProj[1][3], viewProj[2][3], viewProj[3][3]);
+
+    mPlanes[PLANE_LEFT]   = row3 + row0;
+    mPlanes[PLANE_RIGHT]  = row3 - row0;
+    mPlanes[PLANE_BOTTOM] = row3 + row1;
+    mPlanes[PLANE_TOP]    = row3 - row1;
+    mPlanes[PLANE_NEAR]   = row3 + row2;
+    mPlanes[PLANE_FAR]    = row3 - row2;
+
+    for (int i=0; i<PLANE_NUM; i++) {
+        float len = glm::length(glm::vec3(mPlanes[i]));
+        if (len > 0.f) mPlanes[i] /= len;
+    }
+}
+
+Frustum::Result Frustum::classify(const AABB& box) const {
+    if (!box.isValid()) return OUTSIDE;
+    glm::vec3 center = box.getCenter();
+    glm::vec3 extent = box.getExtent();
+    Result result = INSIDE;
+    for (int i=0; i<PLANE_NUM; i++) {
+        glm::vec3 normal(mPlanes[i]);
+        float d = glm::dot(normal, center) + mPlanes[i].w;
+        float r = glm::dot(glm::abs(normal), extent);
+        if (d + r < 0.f) return OUTSIDE;
+        if (d - r < 0.f) result = INTERSECT;
+    }
+    return result;
+}
+
+bool Frustum::intersects(const AABB& box) const {
+    return classify(box) != OUTSIDE;
+}
+
+bool Frustum::intersects(const Sphere& sphere) const {
+    for (int i=0; i<PLANE_NUM; i++) {
+        float d = glm::dot(glm::vec3(mPlanes[i]), sphere.getCenter()) + mPlanes[i].w;
+        if (d < -sphere.getRadius()) return false;
+    }
+    return true;
+}
+
+} // namespace dzy
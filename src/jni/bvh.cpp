@@ -0,0 +1,431 @@
+#include <float.h>
+#include <assert.h>
+#include <algorithm>
+#include "log.h"
+#include "scene_graph.h"
+#include "bvh.h"
+
+using namespace std;
+
+namespace dzy {
+
+// number of frames between two tree quality checks
+static const int QUALITY_CHECK_INTERVAL = 60;
+
+BVH::BVH(float margin, float rebuildRatio)
+    : mRoot(NULL_PROXY)
+    , mFreeList(NULL_PROXY)
+    , mNumProxies(0)
+    , mMargin(margin)
+    , mRebuildRatio(rebuildRatio)
+    , mBaselineCost(0.f)
+    , mFramesSinceCheck(0) {
+}
+
+BVH::~BVH() {
+    TRACE("");
+}
+
+int BVH::allocateNode() {
+    int node;
+    if (mFreeList == NULL_PROXY) {
+        node = (int)mNodes.size();
+        mNodes.push_back(TreeNode());
+    } else {
+        node = mFreeList;
+        mFreeList = mNodes[node].mParent;
+    }
+    TreeNode& n = mNodes[node];
+    n.mBox.reset();
+    n.mTightBox.reset();
+    n.mParent = NULL_PROXY;
+    n.mChild1 = NULL_PROXY;
+    n.mChild2 = NULL_PROXY;
+    n.mHeight = 0;
+    n.mGeometry.reset();
+    return node;
+}
+
+void BVH::freeNode(int node) {
+    assert(node >= 0 && node < (int)mNodes.size());
+    mNodes[node].mParent = mFreeList;
+    mNodes[node].mHeight = -1;
+    mNodes[node].mGeometry.reset();
+    mFreeList = node;
+}
+
+int BVH::insert(const AABB& box, shared_ptr<Geometry> geometry) {
+    int proxy = allocateNode();
+    AABB fat(box);
+    fat.inflate(mMargin);
+    mNodes[proxy].mBox = fat;
+    mNodes[proxy].mTightBox = box;
+    mNodes[proxy].mGeometry = geometry;
+    insertLeaf(proxy);
+    mNumProxies++;
+    return proxy;
+}
+
+void BVH::remove(int proxy) {
+    if (proxy < 0 || proxy >= (int)mNodes.size() || !mNodes[proxy].isLeaf()
+        || mNodes[proxy].mHeight < 0) {
+        ALOGE("invalid BVH proxy %d", proxy);
+        return;
+    }
+    removeLeaf(proxy);
+    freeNode(proxy);
+    mNumProxies--;
+}
+
+bool BVH::update(int proxy, const AABB& box) {
+    if (proxy < 0 || proxy >= (int)mNodes.size() || mNodes[proxy].mHeight != 0) {
+        ALOGE("invalid BVH proxy %d", proxy);
+        return false;
+    }
+    mNodes[proxy].mTightBox = box;
+    if (mNodes[proxy].mBox.contains(box)) return false;
+
+    removeLeaf(proxy);
+    AABB fat(box);
+    fat.inflate(mMargin);
+    mNodes[proxy].mBox = fat;
+    insertLeaf(proxy);
+    return true;
+}
+
+void BVH::insertLeaf(int leaf) {
+    if (mRoot == NULL_PROXY) {
+        mRoot = leaf;
+        mNodes[leaf].mParent = NULL_PROXY;
+        return;
+    }
+
+    // find the best sibling, descend by the surface area heuristic
+    AABB leafBox = mNodes[leaf].mBox;
+    int index = mRoot;
+    while (!mNodes[index].isLeaf()) {
+        int child1 = mNodes[index].mChild1;
+        int child2 = mNodes[index].mChild2;
+
+        float area = mNodes[index].mBox.getSurfaceArea();
+        float combinedArea = AABB::merge(mNodes[index].mBox, leafBox).getSurfaceArea();
+        // cost of creating a new parent for this node and the new leaf
+        float cost = 2.f * combinedArea;
+        // minimum cost of pushing the leaf further down the tree
+        float inheritanceCost = 2.f * (combinedArea - area);
+
+        float cost1 = AABB::merge(mNodes[child1].mBox, leafBox).getSurfaceArea() + inheritanceCost;
+        if (!mNodes[child1].isLeaf())
+            cost1 -= mNodes[child1].mBox.getSurfaceArea();
+        float cost2 = AABB::merge(mNodes[child2].mBox, leafBox).getSurfaceArea() + inheritanceCost;
+        if (!mNodes[child2].isLeaf())
+            cost2 -= mNodes[child2].mBox.getSurfaceArea();
+
+        if (cost < cost1 && cost < cost2) break;
+        index = cost1 < cost2 ? child1 : child2;
+    }
+
+    int sibling = index;
+    int oldParent = mNodes[sibling].mParent;
+    // allocateNode may grow mNodes, don't hold references across it
+    int newParent = allocateNode();
+    mNodes[newParent].mParent = oldParent;
+    mNodes[newParent].mBox = AABB::merge(leafBox, mNodes[sibling].mBox);
+    mNodes[newParent].mHeight = mNodes[sibling].mHeight + 1;
+    mNodes[newParent].mChild1 = sibling;
+    mNodes[newParent].mChild2 = leaf;
+
+    if (oldParent != NULL_PROXY) {
+        if (mNodes[oldParent].mChild1 == sibling)
+            mNodes[oldParent].mChild1 = newParent;
+        else
+            mNodes[oldParent].mChild2 = newParent;
+    } else {
+        mRoot = newParent;
+    }
+    mNodes[sibling].mParent = newParent;
+    mNodes[leaf].mParent = newParent;
+
+    refitAncestors(newParent);
+}
+
+void BVH::removeLeaf(int leaf) {
+    if (leaf == mRoot) {
+        mRoot = NULL_PROXY;
+        return;
+    }
+
+    int parent = mNodes[leaf].mParent;
+    int grandParent = mNodes[parent].mParent;
+    int sibling = mNodes[parent].mChild1 == leaf ?
+        mNodes[parent].mChild2 : mNodes[parent].mChild1;
+
+    if (grandParent != NULL_PROXY) {
+        if (mNodes[grandParent].mChild1 == parent)
+            mNodes[grandParent].mChild1 = sibling;
+        else
+            mNodes[grandParent].mChild2 = sibling;
+        mNodes[sibling].mParent = grandParent;
+        freeNode(parent);
+        refitAncestors(grandParent);
+    } else {
+        mRoot = sibling;
+        mNodes[sibling].mParent = NULL_PROXY;
+        freeNode(parent);
+    }
+    mNodes[leaf].mParent = NULL_PROXY;
+}
+
+void BVH::refitAncestors(int node) {
+    while (node != NULL_PROXY) {
+        int child1 = mNodes[node].mChild1;
+        int child2 = mNodes[node].mChild2;
+        mNodes[node].mHeight = 1 + max(mNodes[child1].mHeight, mNodes[child2].mHeight);
+        mNodes[node].mBox = AABB::merge(mNodes[child1].mBox, mNodes[child2].mBox);
+        node = mNodes[node].mParent;
+    }
+}
+
+void BVH::refit() {
+    // children are not guaranteed to have lower indices than parents,
+    // walk from every leaf up instead, stop once the box is unchanged
+    for (int i=0; i<(int)mNodes.size(); i++) {
+        if (mNodes[i].mHeight != 0) continue;
+        int node = mNodes[i].mParent;
+        while (node != NULL_PROXY) {
+            int child1 = mNodes[node].mChild1;
+            int child2 = mNodes[node].mChild2;
+            AABB box = AABB::merge(mNodes[child1].mBox, mNodes[child2].mBox);
+            if (mNodes[node].mBox.contains(box) && box.contains(mNodes[node].mBox))
+                break;
+            mNodes[node].mBox = box;
+            node = mNodes[node].mParent;
+        }
+    }
+}
+
+void BVH::rebuild() {
+    MeasureDuration duration;
+    vector<int> leaves;
+    leaves.reserve(mNumProxies);
+    for (int i=0; i<(int)mNodes.size(); i++) {
+        if (mNodes[i].mHeight < 0) continue;
+        if (mNodes[i].isLeaf()) {
+            mNodes[i].mParent = NULL_PROXY;
+            leaves.push_back(i);
+        } else {
+            freeNode(i);
+        }
+    }
+
+    if (leaves.empty()) {
+        mRoot = NULL_PROXY;
+        return;
+    }
+
+    mRoot = buildTopDown(leaves, 0, (int)leaves.size());
+    mNodes[mRoot].mParent = NULL_PROXY;
+    mBaselineCost = getCost();
+    DEBUG(Log::F_GENERIC, "BVH rebuilt, %d proxies, height %d, cost %f, %lld us",
+        mNumProxies, getHeight(), mBaselineCost, duration.getMicroSeconds());
+}
+
+int BVH::buildTopDown(vector<int>& leaves, int begin, int end) {
+    if (end - begin == 1) return leaves[begin];
+
+    AABB centroidBox;
+    for (int i=begin; i<end; i++) {
+        centroidBox.expand(mNodes[leaves[i]].mBox.getCenter());
+    }
+    glm::vec3 extent = centroidBox.getExtent();
+    int axis = 0;
+    if (extent.y > extent[axis]) axis = 1;
+    if (extent.z > extent[axis]) axis = 2;
+
+    int mid = (begin + end) / 2;
+    nth_element(leaves.begin() + begin, leaves.begin() + mid, leaves.begin() + end,
+        [&](int a, int b) {
+            return mNodes[a].mBox.getCenter()[axis] < mNodes[b].mBox.getCenter()[axis];
+        });
+
+    int child1 = buildTopDown(leaves, begin, mid);
+    int child2 = buildTopDown(leaves, mid, end);
+    int node = allocateNode();
+    mNodes[node].mChild1 = child1;
+    mNodes[node].mChild2 = child2;
+    mNodes[node].mBox = AABB::merge(mNodes[child1].mBox, mNodes[child2].mBox);
+    mNodes[node].mHeight = 1 + max(mNodes[child1].mHeight, mNodes[child2].mHeight);
+    mNodes[child1].mParent = node;
+    mNodes[child2].mParent = node;
+    return node;
+}
+
+void BVH::optimize() {
+    if (++mFramesSinceCheck < QUALITY_CHECK_INTERVAL) return;
+    mFramesSinceCheck = 0;
+    if (mNumProxies < 2) return;
+
+    float cost = getCost();
+    if (mBaselineCost <= 0.f) {
+        mBaselineCost = cost;
+    } else if (cost > mBaselineCost * mRebuildRatio) {
+        DEBUG(Log::F_GENERIC, "BVH degraded, cost %f => %f", mBaselineCost, cost);
+        rebuild();
+    }
+}
+
+void BVH::queryAABB(const AABB& box, vector<int>& proxies) const {
+    if (mRoot == NULL_PROXY) return;
+    vector<int> stk;
+    stk.reserve(64);
+    stk.push_back(mRoot);
+    while (!stk.empty()) {
+        int node = stk.back();
+        stk.pop_back();
+        const TreeNode& n = mNodes[node];
+        if (!n.mBox.intersects(box)) continue;
+        if (n.isLeaf()) {
+            if (n.mTightBox.intersects(box)) proxies.push_back(node);
+        } else {
+            stk.push_back(n.mChild1);
+            stk.push_back(n.mChild2);
+        }
+    }
+}
+
+void BVH::querySphere(const Sphere& sphere, vector<int>& proxies) const {
+    if (mRoot == NULL_PROXY) return;
+    vector<int> stk;
+    stk.reserve(64);
+    stk.push_back(mRoot);
+    while (!stk.empty()) {
+        int node = stk.back();
+        stk.pop_back();
+        const TreeNode& n = mNodes[node];
+        if (!sphere.intersects(n.mBox)) continue;
+        if (n.isLeaf()) {
+            if (sphere.intersects(n.mTightBox)) proxies.push_back(node);
+        } else {
+            stk.push_back(n.mChild1);
+            stk.push_back(n.mChild2);
+        }
+    }
+}
+
+void BVH::queryFrustum(const Frustum& frustum, vector<int>& proxies) const {
+    if (mRoot == NULL_PROXY) return;
+    // node index and whether the node is known to be fully inside
+    vector<pair<int, bool> > stk;
+    stk.reserve(64);
+    stk.push_back(make_pair(mRoot, false));
+    while (!stk.empty()) {
+        int node = stk.back().first;
+        bool inside = stk.back().second;
+        stk.pop_back();
+        const TreeNode& n = mNodes[node];
+        if (!inside) {
+            Frustum::Result result = frustum.classify(n.isLeaf() ? n.mTightBox : n.mBox);
+            if (result == Frustum::OUTSIDE) continue;
+            inside = (result == Frustum::INSIDE);
+        }
+        if (n.isLeaf()) {
+            proxies.push_back(node);
+        } else {
+            stk.push_back(make_pair(n.mChild1, inside));
+            stk.push_back(make_pair(n.mChild2, inside));
+        }
+    }
+}
+
+void BVH::queryRay(const Ray& ray, float maxDistance, vector<int>& proxies) const {
+    if (mRoot == NULL_PROXY) return;
+    vector<pair<float, int> > hits;
+    vector<int> stk;
+    stk.reserve(64);
+    stk.push_back(mRoot);
+    while (!stk.empty()) {
+        int node = stk.back();
+        stk.pop_back();
+        const TreeNode& n = mNodes[node];
+        float distance;
+        if (!ray.intersects(n.mBox, distance) || distance > maxDistance) continue;
+        if (n.isLeaf()) {
+            if (ray.intersects(n.mTightBox, distance) && distance <= maxDistance)
+                hits.push_back(make_pair(distance, node));
+        } else {
+            stk.push_back(n.mChild1);
+            stk.push_back(n.mChild2);
+        }
+    }
+    sort(hits.begin(), hits.end());
+    for (size_t i=0; i<hits.size(); i++) {
+        proxies.push_back(hits[i].second);
+    }
+}
+
+int BVH::raycast(const Ray& ray, float maxDistance, float& distance) const {
+    int closest = NULL_PROXY;
+    if (mRoot == NULL_PROXY) return closest;
+    float best = maxDistance;
+    vector<int> stk;
+    stk.reserve(64);
+    stk.push_back(mRoot);
+    while (!stk.empty()) {
+        int node = stk.back();
+        stk.pop_back();
+        const TreeNode& n = mNodes[node];
+        float d;
+        if (!ray.intersects(n.mBox, d) || d > best) continue;
+        if (n.isLeaf()) {
+            if (ray.intersects(n.mTightBox, d) && d <= best) {
+                best = d;
+                closest = node;
+            }
+        } else {
+            stk.push_back(n.mChild1);
+            stk.push_back(n.mChild2);
+        }
+    }
+    if (closest != NULL_PROXY) distance = best;
+    return closest;
+}
+
+shared_ptr<Geometry> BVH::getGeometry(int proxy) const {
+    if (proxy < 0 || proxy >= (int)mNodes.size() || mNodes[proxy].mHeight != 0)
+        return nullptr;
+    return mNodes[proxy].mGeometry.lock();
+}
+
+const AABB& BVH::getBounds(int proxy) const {
+    assert(proxy >= 0 && proxy < (int)mNodes.size());
+    return mNodes[proxy].mTightBox;
+}
+
+const AABB& BVH::getFatBounds(int proxy) const {
+    assert(proxy >= 0 && proxy < (int)mNodes.size());
+    return mNodes[proxy].mBox;
+}
+
+int BVH::getHeight() const {
+    if (mRoot == NULL_PROXY) return 0;
+    return mNodes[mRoot].mHeight;
+}
+
+float BVH::getCost() const {
+    if (mRoot == NULL_PROXY) return 0.f;
+    float rootArea = mNodes[mRoot].mBox.getSurfaceArea();
+    if (rootArea <= 0.f) return 0.f;
+    float totalArea = 0.f;
+    for (size_t i=0; i<mNodes.size(); i++) {
+        if (mNodes[i].mHeight > 0)
+            totalArea += mNodes[i].mBox.getSurfaceArea();
+    }
+    return totalArea / rootArea;
+}
+
+void BVH::dump(Log::Flag f) const {
+    DUMP(f, "BVH: %d proxies, %d nodes, height %d, cost %f",
+        mNumProxies, (int)mNodes.size(), getHeight(), getCost());
+}
+
+} // namespace dzy
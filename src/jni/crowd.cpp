@@ -0,0 +1,373 @@
+#include <math.h>
+#include <stddef.h>
+#include <algorithm>
+#define GLM_FORCE_RADIANS
+#include <EGL/egl.h>
+#include <glm/gtc/type_ptr.hpp>
+#include "log.h"
+#include "scene_graph.h"
+#include "mesh.h"
+#include "animation.h"
+#include "program.h"
+#include "gl_state.h"
+#include "material_table.h"
+#include "skin_bounds.h"
+#include "crowd.h"
+
+using namespace std;
+
+namespace dzy {
+
+// world matrix, then first pose, number of poses and pose position
+static const int INSTANCE_NUM_FLOATS = 16 + 3;
+
+Crowd::Crowd(shared_ptr<Mesh> mesh, shared_ptr<Material> material, float sampleRate)
+    : mMesh(mesh)
+    , mMaterial(material)
+    , mSampleRate(sampleRate > 0.f ? sampleRate : 30.f)
+    , mNumBones(0)
+    , mPoseTexture(0)
+    , mPosesUploaded(0)
+    , mVertexBO(0)
+    , mIndexBO(0)
+    , mVAO(0) {
+    if (!mesh || !mesh->hasBones() || !mesh->hasFaces()) {
+        ALOGE("Crowd needs a skinned Mesh with faces");
+        return;
+    }
+    if (mesh->getPositionNumComponent() != 3 ||
+        mesh->getPositionBufStride() != 3 * sizeof(float) ||
+        (mesh->hasVertexNormals() && mesh->getNormalBufStride() != 3 * sizeof(float))) {
+        ALOGE("%s: Crowd supports 3 float positions and normals only", mesh->getName().c_str());
+        return;
+    }
+    if (mesh->getNumBones() > MAX_BONES) {
+        ALOGE("%s: %d bones, a Crowd skins with %d at most", mesh->getName().c_str(),
+            mesh->getNumBones(), MAX_BONES);
+        return;
+    }
+    mNumBones = mesh->getNumBones();
+
+    // bone influences by vertex
+    unsigned int numVertices = mesh->getNumVertices();
+    vector<vector<pair<float, int> > > influences(numVertices);
+    for (int b=0; b<mNumBones; b++) {
+        shared_ptr<Bone> bone(mesh->getBone(b));
+        for (size_t i=0; i<bone->mWeights.size(); i++) {
+            const VertexWeight& vw = bone->mWeights[i];
+            if (vw.mWeight <= 0.f || vw.mVertexIndex >= numVertices) continue;
+            influences[vw.mVertexIndex].push_back(make_pair(vw.mWeight, b));
+        }
+    }
+
+    const float* pos = (const float*)mesh->getOriginalPositionBuf();
+    const float* normals = mesh->hasVertexNormals() ?
+        (const float*)mesh->getOriginalNormalBuf() : NULL;
+    mVertices.resize(numVertices);
+    for (unsigned int v=0; v<numVertices; v++) {
+        Vertex& vertex = mVertices[v];
+        for (int k=0; k<3; k++) {
+            vertex.mPosition[k] = pos[v*3+k];
+            vertex.mNormal[k] = normals ? normals[v*3+k] : 0.f;
+        }
+        // the largest weights, normalized to sum up to 1, a vertex
+        // without any is not moved, see VERTEX_crowd
+        vector<pair<float, int> >& weights = influences[v];
+        sort(weights.begin(), weights.end(), greater<pair<float, int> >());
+        if (weights.size() > MAX_BONE_INFLUENCES) weights.resize(MAX_BONE_INFLUENCES);
+        float sum = 0.f;
+        for (size_t i=0; i<weights.size(); i++) sum += weights[i].first;
+        for (int i=0; i<MAX_BONE_INFLUENCES; i++) {
+            bool used = i < (int)weights.size();
+            vertex.mWeights[i] = used ? weights[i].first / sum : 0.f;
+            vertex.mBones[i] = used ? weights[i].second : 0;
+        }
+    }
+    const unsigned int* indices = (const unsigned int*)mesh->getIndexBuf();
+    mIndices.assign(indices, indices + mesh->getNumIndices());
+    mBounds.reset(new SkinBounds(mesh));
+}
+
+Crowd::~Crowd() {
+    TRACE("");
+    // CrowdRenderer forgets an expired Crowd, its objects are deleted
+    // here, by the render thread with its next frame if dropped elsewhere
+    if (eglGetCurrentContext() != EGL_NO_CONTEXT) {
+        release();
+    } else {
+        GLState* state = GLState::get();
+        state->queueDeleteVertexArray(mVAO);
+        state->queueDeleteBuffer(mVertexBO);
+        state->queueDeleteBuffer(mIndexBO);
+        state->queueDeleteTexture(mPoseTexture);
+    }
+}
+
+int Crowd::addClip(shared_ptr<Animation> animation, shared_ptr<Node> root) {
+    if (!isValid() || !animation || !root) return -1;
+
+    // a bone without a node keeps the bind pose
+    vector<int> bones;
+    vector<shared_ptr<NodeObj> > nodes;
+    for (int b=0; b<mNumBones; b++) {
+        shared_ptr<NodeObj> node(root->getChild(mMesh->getBone(b)->getName()));
+        if (!node) continue;
+        bones.push_back(b);
+        nodes.push_back(node);
+    }
+    if (bones.empty()) {
+        ALOGW("%s: no bone animated by clip %s", mMesh->getName().c_str(),
+            animation->getName().c_str());
+        return -1;
+    }
+
+    Clip clip;
+    clip.mFirstPose = mPoses.size() / (mNumBones * 12);
+    clip.mDuration = animation->getDuration();
+    clip.mNumPoses = max(1, (int)ceil(clip.mDuration * mSampleRate));
+    if (clip.mFirstPose + clip.mNumPoses > MAX_POSES) {
+        ALOGE("%s: clip %s needs %d poses, %d left", mMesh->getName().c_str(),
+            animation->getName().c_str(), clip.mNumPoses, MAX_POSES - clip.mFirstPose);
+        return -1;
+    }
+    if (!mBounds->addClip(animation, root, clip.mNumPoses)) return -1;
+
+    vector<Transform> nodeTransforms;
+    size_t row = mPoses.size();
+    mPoses.resize(row + clip.mNumPoses * mNumBones * 12);
+    for (int p=0; p<clip.mNumPoses; p++) {
+        vector<glm::mat4> matrices(mNumBones, glm::mat4(1.f));
+        SkinBounds::getClipPose(animation, nodes, p / mSampleRate, nodeTransforms);
+        for (size_t i=0; i<bones.size(); i++) {
+            // the same transform Bone::transform skins the vertices with
+            Transform finalTransform(mMesh->getBone(bones[i])->mTransform);
+            finalTransform.combine(nodeTransforms[i]);
+            matrices[bones[i]] = finalTransform.toMat4();
+        }
+        float* data = &mPoses[row + p * mNumBones * 12];
+        for (int b=0; b<mNumBones; b++) {
+            for (int r=0; r<3; r++) {
+                for (int c=0; c<4; c++) *data++ = matrices[b][c][r];
+            }
+        }
+    }
+    mClips.push_back(clip);
+    DUMP(Log::F_ANIMATION, "%-10s crowd clip %-10s %d poses from %d",
+        mMesh->getName().c_str(), animation->getName().c_str(),
+        clip.mNumPoses, clip.mFirstPose);
+    return mClips.size() - 1;
+}
+
+int Crowd::addInstance(const glm::mat4& world, int clip, float timeOffset) {
+    Instance instance;
+    instance.mWorld = world;
+    instance.mClip = clip;
+    instance.mTimeOffset = timeOffset;
+    mInstances.push_back(instance);
+    return mInstances.size() - 1;
+}
+
+void Crowd::setInstance(int index, const glm::mat4& world, int clip, float timeOffset) {
+    if (index < 0 || index >= (int)mInstances.size()) {
+        ALOGE("Crowd has no instance %d", index);
+        return;
+    }
+    Instance& instance = mInstances[index];
+    instance.mWorld = world;
+    instance.mClip = clip;
+    instance.mTimeOffset = timeOffset;
+}
+
+void Crowd::buildInstances(double time, VisibleFunc isVisible, FrameSnapshot::CrowdItem& item) {
+    item.mInstances.clear();
+    item.mNumInstances = 0;
+    if (!isValid()) return;
+    for (size_t i=0; i<mInstances.size(); i++) {
+        const Instance& instance = mInstances[i];
+        if (instance.mClip < 0 || instance.mClip >= (int)mClips.size()) continue;
+        if (!isVisible(mBounds->getClipBounds(instance.mClip).transform(instance.mWorld)))
+            continue;
+
+        // the time wraps like NodeAnim does, in double precision
+        const Clip& clip = mClips[instance.mClip];
+        double phase = clip.mDuration > 0.0 ?
+            fmod(time + instance.mTimeOffset, clip.mDuration) : 0.0;
+        if (phase < 0.0) phase += clip.mDuration;
+        float pose = min((float)(phase * mSampleRate), clip.mNumPoses - 1e-3f);
+        const float* world = glm::value_ptr(instance.mWorld);
+        item.mInstances.insert(item.mInstances.end(), world, world + 16);
+        item.mInstances.push_back(clip.mFirstPose);
+        item.mInstances.push_back(clip.mNumPoses);
+        item.mInstances.push_back(pose);
+        item.mNumInstances++;
+    }
+}
+
+void Crowd::release() {
+    GLState* state = GLState::get();
+    if (mPoseTexture) state->deleteTexture(mPoseTexture);
+    if (mVertexBO) state->deleteBuffer(mVertexBO);
+    if (mIndexBO) state->deleteBuffer(mIndexBO);
+    if (mVAO) state->deleteVertexArray(mVAO);
+    mPoseTexture = 0;
+    mPosesUploaded = 0;
+    mVertexBO = 0;
+    mIndexBO = 0;
+    mVAO = 0;
+}
+
+CrowdRenderer::CrowdRenderer()
+    : mInstanceVBO(0)
+    , mNumDrawCalls(0)
+    , mNumInstances(0) {
+}
+
+CrowdRenderer::~CrowdRenderer() {
+    TRACE("");
+}
+
+void CrowdRenderer::release() {
+    if (mInstanceVBO) GLState::get()->deleteBuffer(mInstanceVBO);
+    mInstanceVBO = 0;
+    // uploaded again on a new context when next drawn
+    for (size_t i=0; i<mUploaded.size(); i++) {
+        shared_ptr<Crowd> crowd(mUploaded[i].lock());
+        if (crowd) crowd->release();
+    }
+    mUploaded.clear();
+}
+
+bool CrowdRenderer::upload(Crowd& crowd) {
+    GLState* state = GLState::get();
+    if (!crowd.mVAO) {
+        GLuint buffers[2] = { 0, 0 };
+        glGenBuffers(2, buffers);
+        glGenVertexArrays(1, &crowd.mVAO);
+        crowd.mVertexBO = buffers[0];
+        crowd.mIndexBO = buffers[1];
+        if (!crowd.mVertexBO || !crowd.mIndexBO || !crowd.mVAO) {
+            ALOGE("crowd buffers not created");
+            return false;
+        }
+        // vertex attributes and the index buffer are recorded in the vao,
+        // instance attributes are set per draw
+        state->bindVertexArray(crowd.mVAO);
+        state->bindBuffer(GL_ARRAY_BUFFER, crowd.mVertexBO);
+        glBufferData(GL_ARRAY_BUFFER, crowd.mVertices.size() * sizeof(Crowd::Vertex),
+            &crowd.mVertices[0], GL_STATIC_DRAW);
+        const GLsizei stride = sizeof(Crowd::Vertex);
+        glEnableVertexAttribArray(CROWD_ATTRIB_POSITION);
+        glVertexAttribPointer(CROWD_ATTRIB_POSITION, 3, GL_FLOAT, GL_FALSE, stride,
+            (void*)offsetof(Crowd::Vertex, mPosition));
+        glEnableVertexAttribArray(CROWD_ATTRIB_NORMAL);
+        glVertexAttribPointer(CROWD_ATTRIB_NORMAL, 3, GL_FLOAT, GL_FALSE, stride,
+            (void*)offsetof(Crowd::Vertex, mNormal));
+        glEnableVertexAttribArray(CROWD_ATTRIB_WEIGHTS);
+        glVertexAttribPointer(CROWD_ATTRIB_WEIGHTS, 4, GL_FLOAT, GL_FALSE, stride,
+            (void*)offsetof(Crowd::Vertex, mWeights));
+        glEnableVertexAttribArray(CROWD_ATTRIB_BONES);
+        glVertexAttribPointer(CROWD_ATTRIB_BONES, 4, GL_UNSIGNED_BYTE, GL_FALSE, stride,
+            (void*)offsetof(Crowd::Vertex, mBones));
+        state->bindBuffer(GL_ELEMENT_ARRAY_BUFFER, crowd.mIndexBO);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, crowd.mIndices.size() * sizeof(unsigned int),
+            &crowd.mIndices[0], GL_STATIC_DRAW);
+        state->bindVertexArray(0);
+        state->bindBuffer(GL_ARRAY_BUFFER, 0);
+        state->countCall(10);
+    }
+
+    int numPoses = crowd.mPoses.size() / (crowd.mNumBones * 12);
+    if (crowd.mPosesUploaded != numPoses) {
+        // immutable storage, clips added later get a new texture
+        if (crowd.mPoseTexture) state->deleteTexture(crowd.mPoseTexture);
+        crowd.mPoseTexture = 0;
+        glGenTextures(1, &crowd.mPoseTexture);
+        if (!crowd.mPoseTexture) {
+            ALOGE("glGenTextures error");
+            return false;
+        }
+        state->bindTexture(TEXTURE_UNIT_CROWD_POSES, GL_TEXTURE_2D, crowd.mPoseTexture);
+        glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA32F, crowd.mNumBones * 3, numPoses);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, crowd.mNumBones * 3, numPoses,
+            GL_RGBA, GL_FLOAT, &crowd.mPoses[0]);
+        // fetched texel by texel, float textures are not filterable
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        state->countCall(4);
+        crowd.mPosesUploaded = numPoses;
+        DEBUG(Log::F_GLES, "crowd poses %dx%d uploaded", crowd.mNumBones * 3, numPoses);
+    }
+    return true;
+}
+
+void CrowdRenderer::draw(const FrameSnapshot& frame, MaterialTable& materials) {
+    mNumDrawCalls = 0;
+    mNumInstances = 0;
+    if (frame.mCrowds.empty()) return;
+    shared_ptr<Program> program(ProgramManager::get()->getInternalProgram("crowd"));
+    if (!program) return;
+
+    // one upload per frame for all crowds
+    mInstanceData.clear();
+    for (size_t i=0; i<frame.mCrowds.size(); i++) {
+        const vector<float>& data = frame.mCrowds[i].mInstances;
+        mInstanceData.insert(mInstanceData.end(), data.begin(), data.end());
+    }
+    if (mInstanceData.empty()) return;
+
+    GLState* state = GLState::get();
+    if (!mInstanceVBO) glGenBuffers(1, &mInstanceVBO);
+    if (!mInstanceVBO) {
+        ALOGE("crowd instance buffer not created");
+        return;
+    }
+    state->bindBuffer(GL_ARRAY_BUFFER, mInstanceVBO);
+    // orphan last frame's storage instead of waiting for the GPU
+    glBufferData(GL_ARRAY_BUFFER, mInstanceData.size() * sizeof(float),
+        &mInstanceData[0], GL_STREAM_DRAW);
+
+    PipelineState::Desc desc;
+    desc.mProgram = program->getId();
+    state->apply(*state->getPipelineState(desc));
+
+    const GLsizei stride = INSTANCE_NUM_FLOATS * sizeof(float);
+    size_t offset = 0;
+    for (size_t i=0; i<frame.mCrowds.size(); i++) {
+        const FrameSnapshot::CrowdItem& item = frame.mCrowds[i];
+        size_t crowdOffset = offset;
+        offset += item.mNumInstances * stride;
+        if (!item.mNumInstances) continue;
+        Crowd& crowd = *item.mCrowd;
+        bool known = crowd.mVAO != 0;
+        if (!upload(crowd)) continue;
+        if (!known) mUploaded.push_back(item.mCrowd);
+
+        program->setMaterialIndex(materials.getIndex(crowd.getMaterial()));
+        state->bindTexture(TEXTURE_UNIT_CROWD_POSES, GL_TEXTURE_2D, crowd.mPoseTexture);
+        state->bindVertexArray(crowd.mVAO);
+        state->bindBuffer(GL_ARRAY_BUFFER, mInstanceVBO);
+        for (int c=0; c<4; c++) {
+            GLuint loc = CROWD_ATTRIB_WORLD + c;
+            glEnableVertexAttribArray(loc);
+            glVertexAttribPointer(loc, 4, GL_FLOAT, GL_FALSE, stride,
+                (void*)(crowdOffset + c * 4 * sizeof(float)));
+            glVertexAttribDivisor(loc, 1);
+        }
+        glEnableVertexAttribArray(CROWD_ATTRIB_POSE);
+        glVertexAttribPointer(CROWD_ATTRIB_POSE, 3, GL_FLOAT, GL_FALSE, stride,
+            (void*)(crowdOffset + 16 * sizeof(float)));
+        glVertexAttribDivisor(CROWD_ATTRIB_POSE, 1);
+
+        glDrawElementsInstanced(GL_TRIANGLES, crowd.mIndices.size(), GL_UNSIGNED_INT,
+            (void*)0, item.mNumInstances);
+        state->countCall();
+        mNumDrawCalls++;
+        mNumInstances += item.mNumInstances;
+    }
+    state->bindVertexArray(0);
+    state->bindBuffer(GL_ARRAY_BUFFER, 0);
+    mUploaded.erase(remove_if(mUploaded.begin(), mUploaded.end(),
+        [] (const weak_ptr<Crowd>& crowd) { return crowd.expired(); }), mUploaded.end());
+}
+
+} // namespace dzy
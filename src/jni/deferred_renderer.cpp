@@ -0,0 +1,218 @@
+#include <math.h>
+#include <vector>
+#include "log.h"
+#include "program.h"
+#include "gl_state.h"
+#include "light_clusters.h"
+#include "deferred_renderer.h"
+
+using namespace std;
+
+namespace dzy {
+
+// tessellation of the light volume
+static const int VOLUME_SLICES = 16;
+static const int VOLUME_STACKS = 8;
+
+const GLenum DeferredRenderer::TARGET_FORMATS[NUM_TARGETS] = {
+    GL_RGBA8, GL_RGB10_A2, GL_RG32UI
+};
+const glm::uvec4 DeferredRenderer::BACKGROUND_MATERIAL(0xFFFFFFFF, 0, 0, 0);
+
+DeferredRenderer::DeferredRenderer()
+    : mVolumeVAO(0)
+    , mVolumeVBO(0)
+    , mVolumeIBO(0)
+    , mNumVolumeIndices(0)
+    , mNumLightVolumes(0)
+    , mNumFullscreenLights(0) {
+}
+
+DeferredRenderer::~DeferredRenderer() {
+    TRACE("");
+}
+
+void DeferredRenderer::release() {
+    if (mVolumeVAO) GLState::get()->deleteVertexArray(mVolumeVAO);
+    if (mVolumeVBO) GLState::get()->deleteBuffer(mVolumeVBO);
+    if (mVolumeIBO) GLState::get()->deleteBuffer(mVolumeIBO);
+    mVolumeVAO = 0;
+    mVolumeVBO = 0;
+    mVolumeIBO = 0;
+    mNumVolumeIndices = 0;
+}
+
+bool DeferredRenderer::createVolume() {
+    shared_ptr<Program> program(ProgramManager::get()->getInternalProgram("deferred_light_volume"));
+    if (!program) return false;
+    GLint posLoc = program->getLocation(SLOT_VERTEX_POSITION);
+    if (posLoc < 0) return false;
+
+    // a UV sphere, scaled so that its faces, not only its vertices,
+    // enclose the unit sphere
+    float scale = 1.f / (cosf((float)M_PI / VOLUME_SLICES) * cosf((float)M_PI / VOLUME_STACKS));
+    vector<float> vertices;
+    for (int i=0; i<=VOLUME_STACKS; i++) {
+        float theta = (float)M_PI * i / VOLUME_STACKS;
+        for (int j=0; j<VOLUME_SLICES; j++) {
+            float phi = 2.f * (float)M_PI * j / VOLUME_SLICES;
+            vertices.push_back(sinf(theta) * cosf(phi) * scale);
+            vertices.push_back(cosf(theta) * scale);
+            vertices.push_back(sinf(theta) * sinf(phi) * scale);
+        }
+    }
+    // counter clockwise seen from outside
+    vector<GLushort> indices;
+    for (int i=0; i<VOLUME_STACKS; i++) {
+        for (int j=0; j<VOLUME_SLICES; j++) {
+            GLushort a = i * VOLUME_SLICES + j;
+            GLushort b = i * VOLUME_SLICES + (j + 1) % VOLUME_SLICES;
+            GLushort c = a + VOLUME_SLICES;
+            GLushort d = b + VOLUME_SLICES;
+            indices.push_back(a); indices.push_back(b); indices.push_back(c);
+            indices.push_back(b); indices.push_back(d); indices.push_back(c);
+        }
+    }
+
+    glGenVertexArrays(1, &mVolumeVAO);
+    glGenBuffers(1, &mVolumeVBO);
+    glGenBuffers(1, &mVolumeIBO);
+    if (!mVolumeVAO || !mVolumeVBO || !mVolumeIBO) {
+        ALOGE("light volume creation error");
+        return false;
+    }
+    GLState* state = GLState::get();
+    state->bindVertexArray(mVolumeVAO);
+    state->bindBuffer(GL_ARRAY_BUFFER, mVolumeVBO);
+    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float), &vertices[0], GL_STATIC_DRAW);
+    glEnableVertexAttribArray(posLoc);
+    glVertexAttribPointer(posLoc, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+    state->bindBuffer(GL_ELEMENT_ARRAY_BUFFER, mVolumeIBO);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLushort), &indices[0], GL_STATIC_DRAW);
+    state->bindVertexArray(0);
+    state->bindBuffer(GL_ARRAY_BUFFER, 0);
+    mNumVolumeIndices = indices.size();
+    return true;
+}
+
+bool DeferredRenderer::prepare() {
+    if (!mVolumeVAO && !createVolume()) {
+        ALOGE("no light volume, deferred shading disabled");
+        return false;
+    }
+    return true;
+}
+
+void DeferredRenderer::drawFullscreen() {
+    GLState::get()->bindVertexArray(0);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    GLState::get()->countCall();
+}
+
+void DeferredRenderer::applyLights(const LightGrid& grid, const glm::mat4& proj,
+    const GLuint targets[NUM_TARGETS]) {
+    mNumLightVolumes = 0;
+    mNumFullscreenLights = 0;
+    ProgramManager* programs = ProgramManager::get();
+    shared_ptr<ProgramDeferredLight> emission(static_pointer_cast<ProgramDeferredLight>(
+        programs->getInternalProgram("deferred_emission")));
+    shared_ptr<ProgramDeferredLight> fullscreen(static_pointer_cast<ProgramDeferredLight>(
+        programs->getInternalProgram("deferred_light_fullscreen")));
+    shared_ptr<ProgramDeferredLight> volume(static_pointer_cast<ProgramDeferredLight>(
+        programs->getInternalProgram("deferred_light_volume")));
+
+    GLState* state = GLState::get();
+    for (int i=0; i<NUM_TARGETS; i++)
+        state->bindTexture(TEXTURE_UNIT_GBUFFER_ALBEDO + i, GL_TEXTURE_2D, targets[i]);
+    if (!emission || !fullscreen || !volume) return;
+
+    PipelineState::Desc desc;
+    desc.mDepthTest = false;
+    desc.mDepthWrite = false;
+    desc.mCullFace = false;
+    desc.mProgram = emission->getId();
+    state->apply(*state->getPipelineState(desc));
+    drawFullscreen();
+
+    // lights reaching everywhere cover the screen anyway
+    desc.mProgram = fullscreen->getId();
+    desc.mBlend = true;
+    desc.mBlendSrc = GL_ONE;
+    desc.mBlendDst = GL_ONE;
+    shared_ptr<const PipelineState> fullscreenState(state->getPipelineState(desc));
+    // a volume reaching past the far plane loses the back faces the
+    // stencil test relies on, far = p32 / (p22 + 1)
+    float far = proj[3][2] / (proj[2][2] + 1.f);
+    vector<int> volumes;
+    for (int i=0; i<grid.mNumLights; i++) {
+        const glm::vec4* texels = &grid.mLights[i * LightClusters::LIGHT_TEXELS];
+        glm::vec3 center;
+        float radius;
+        if (LightClusters::getBoundingSphere(texels, center, radius)) {
+            float depth = -center.z;
+            // outside the depth range of the view
+            if (depth + radius < 0.f || depth - radius > far) continue;
+            if (depth + radius <= far) {
+                volumes.push_back(i);
+                continue;
+            }
+        } else if (texels[0].w == 0.f) {
+            continue;
+        }
+        state->apply(*fullscreenState);
+        fullscreen->setLight(i, glm::vec4(0.f));
+        drawFullscreen();
+        mNumFullscreenLights++;
+    }
+    if (volumes.empty()) return;
+
+    // stencil marks the pixels whose surface is inside the volume: back
+    // faces behind the surface increment, front faces behind it
+    // decrement, no color written
+    PipelineState::Desc stencilDesc;
+    stencilDesc.mProgram = volume->getId();
+    stencilDesc.mDepthWrite = false;
+    stencilDesc.mCullFace = false;
+    stencilDesc.mColorWrite = false;
+    shared_ptr<const PipelineState> stencilState(state->getPipelineState(stencilDesc));
+    // then light those pixels from the back faces, so a camera inside
+    // the volume still sees it, and reset the stencil on the way
+    PipelineState::Desc lightDesc;
+    lightDesc.mProgram = volume->getId();
+    lightDesc.mDepthTest = false;
+    lightDesc.mDepthWrite = false;
+    lightDesc.mCullMode = GL_FRONT;
+    lightDesc.mBlend = true;
+    lightDesc.mBlendSrc = GL_ONE;
+    lightDesc.mBlendDst = GL_ONE;
+    shared_ptr<const PipelineState> lightState(state->getPipelineState(lightDesc));
+
+    state->enable(GL_STENCIL_TEST, true);
+    state->bindVertexArray(mVolumeVAO);
+    for (size_t v=0; v<volumes.size(); v++) {
+        int i = volumes[v];
+        glm::vec3 center;
+        float radius;
+        LightClusters::getBoundingSphere(&grid.mLights[i * LightClusters::LIGHT_TEXELS],
+            center, radius);
+        volume->use();
+        volume->setLight(i, glm::vec4(center, radius));
+
+        state->apply(*stencilState);
+        glStencilFunc(GL_ALWAYS, 0, 0xFF);
+        glStencilOpSeparate(GL_BACK, GL_KEEP, GL_INCR_WRAP, GL_KEEP);
+        glStencilOpSeparate(GL_FRONT, GL_KEEP, GL_DECR_WRAP, GL_KEEP);
+        glDrawElements(GL_TRIANGLES, mNumVolumeIndices, GL_UNSIGNED_SHORT, (void*)0);
+
+        state->apply(*lightState);
+        glStencilFunc(GL_NOTEQUAL, 0, 0xFF);
+        glStencilOp(GL_KEEP, GL_KEEP, GL_ZERO);
+        glDrawElements(GL_TRIANGLES, mNumVolumeIndices, GL_UNSIGNED_SHORT, (void*)0);
+        state->countCall(7);
+        mNumLightVolumes++;
+    }
+    state->bindVertexArray(0);
+    state->enable(GL_STENCIL_TEST, false);
+}
+
+} // namespace dzy
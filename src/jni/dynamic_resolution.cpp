@@ -0,0 +1,138 @@
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include "log.h"
+#include "gl_state.h"
+#include "dynamic_resolution.h"
+
+using namespace std;
+
+// GL_EXT_disjoint_timer_query, used through the ES 3 query entry points
+#ifndef GL_TIME_ELAPSED_EXT
+#define GL_TIME_ELAPSED_EXT 0x88BF
+#endif
+#ifndef GL_GPU_DISJOINT_EXT
+#define GL_GPU_DISJOINT_EXT 0x8FBB
+#endif
+
+namespace dzy {
+
+const float DynamicResolution::MAX_STEP = 0.1f;
+
+// weight of the newest frame in the smoothed frame time
+static const float FRAME_TIME_SMOOTHING = 0.2f;
+// the scale is kept while the frame time is within these fractions of
+// the target, a frame waiting for vsync takes about the target itself
+static const float UPPER_BAND = 1.05f;
+static const float LOWER_BAND = 0.85f;
+
+DynamicResolution::DynamicResolution()
+    : mTargetFrameTime(1000.f / 60.f)
+    , mMinScale(0.5f)
+    , mMaxScale(1.f)
+    , mScale(1.f)
+    , mFrameTime(0.f)
+    , mGpuTime(0.f)
+    , mFramesSinceAdjust(0)
+    , mTimerSupported(-1)
+    , mActiveQuery(-1)
+    , mNextQuery(0) {
+    for (int i=0; i<TIMER_QUERIES; i++) {
+        mQueries[i] = 0;
+        mQueryPending[i] = false;
+    }
+}
+
+DynamicResolution::~DynamicResolution() {
+    TRACE("");
+}
+
+void DynamicResolution::release() {
+    if (mQueries[0]) glDeleteQueries(TIMER_QUERIES, mQueries);
+    for (int i=0; i<TIMER_QUERIES; i++) {
+        mQueries[i] = 0;
+        mQueryPending[i] = false;
+    }
+    mTimerSupported = -1;
+    mActiveQuery = -1;
+}
+
+void DynamicResolution::setScaleRange(float minScale, float maxScale) {
+    mMaxScale = glm::clamp(maxScale, 0.1f, 1.f);
+    mMinScale = glm::clamp(minScale, 0.1f, mMaxScale);
+    mScale = glm::clamp(mScale, mMinScale, mMaxScale);
+}
+
+glm::ivec2 DynamicResolution::getSceneSize(int width, int height) const {
+    return glm::max(glm::ivec2(glm::vec2(width, height) * mScale + 0.5f), glm::ivec2(1));
+}
+
+glm::ivec2 DynamicResolution::getTargetSize(int width, int height) const {
+    return glm::max(glm::ivec2(glm::vec2(width, height) * mMaxScale + 0.5f), glm::ivec2(1));
+}
+
+void DynamicResolution::beginTiming() {
+    if (mTimerSupported < 0) {
+        const char* extensions = (const char*)glGetString(GL_EXTENSIONS);
+        mTimerSupported = extensions && strstr(extensions, "GL_EXT_disjoint_timer_query");
+        if (mTimerSupported) glGenQueries(TIMER_QUERIES, mQueries);
+        if (mTimerSupported && !mQueries[0]) {
+            ALOGW("glGenQueries error, frames timed on the CPU only");
+            mTimerSupported = 0;
+        }
+    }
+    if (!mTimerSupported) return;
+
+    readTimers();
+    // all queries still in flight, this frame goes untimed
+    if (mQueryPending[mNextQuery]) return;
+    mActiveQuery = mNextQuery;
+    mNextQuery = (mNextQuery + 1) % TIMER_QUERIES;
+    glBeginQuery(GL_TIME_ELAPSED_EXT, mQueries[mActiveQuery]);
+    GLState::get()->countCall();
+}
+
+void DynamicResolution::endTiming() {
+    if (mActiveQuery < 0) return;
+    glEndQuery(GL_TIME_ELAPSED_EXT);
+    GLState::get()->countCall();
+    mQueryPending[mActiveQuery] = true;
+    mActiveQuery = -1;
+}
+
+void DynamicResolution::readTimers() {
+    // results of a disjoint period, like a frequency change, are garbage
+    GLint disjoint = 0;
+    glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+    // oldest first, mNextQuery was issued longest ago
+    for (int n=0; n<TIMER_QUERIES; n++) {
+        int i = (mNextQuery + n) % TIMER_QUERIES;
+        if (!mQueryPending[i]) continue;
+        GLuint available = GL_FALSE;
+        glGetQueryObjectuiv(mQueries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) break;
+        GLuint elapsed = 0;
+        glGetQueryObjectuiv(mQueries[i], GL_QUERY_RESULT, &elapsed);
+        mQueryPending[i] = false;
+        if (!disjoint) mGpuTime = elapsed * 1e-6f;
+    }
+}
+
+void DynamicResolution::update(long long cpuTime) {
+    float frameTime = max(cpuTime * 1e-3f, mGpuTime);
+    mFrameTime = mFrameTime > 0.f ?
+        mFrameTime + (frameTime - mFrameTime) * FRAME_TIME_SMOOTHING : frameTime;
+    if (++mFramesSinceAdjust < ADJUST_INTERVAL) return;
+    mFramesSinceAdjust = 0;
+
+    if (mFrameTime <= mTargetFrameTime * UPPER_BAND && mFrameTime >= mTargetFrameTime * LOWER_BAND)
+        return;
+    float scale = mScale * sqrtf(mTargetFrameTime / mFrameTime);
+    scale = glm::clamp(scale, mScale * (1.f - MAX_STEP), mScale * (1.f + MAX_STEP));
+    scale = glm::clamp(scale, mMinScale, mMaxScale);
+    if (scale != mScale)
+        DEBUG(Log::F_GLES, "resolution scale %.2f, frame time %.2f ms", scale, mFrameTime);
+    mScale = scale;
+}
+
+} // namespace dzy
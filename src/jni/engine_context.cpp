@@ -1,6 +1,7 @@
 #include <android/asset_manager.h>
 #include <sstream>
 #include <fstream>
+#include <vector>
 #include <sys/types.h>
 #include <unistd.h>
 #include <EGL/egl.h>
@@ -11,6 +12,7 @@
 #include "scene.h"
 #include "render.h"
 #include "program.h"
+#include "render_thread.h"
 #include "engine_context.h"
 
 using namespace std;
@@ -22,6 +24,8 @@ EngineContext::EngineContext()
     : mRequestQuit  (false)
     , mRendering    (false)
     , mRender       (new Render)
+    , mRenderThread (new RenderThread)
+    , mRenderThreadEnabled(true)
     , mDisplay      (EGL_NO_DISPLAY)
     , mEglContext   (EGL_NO_CONTEXT)
     , mSurface      (EGL_NO_SURFACE)
@@ -56,23 +60,8 @@ bool EngineContext::initDisplay() {
         return false;
     }
 
-    const EGLint configAttribs[] = {
-        EGL_SURFACE_TYPE,       EGL_WINDOW_BIT,
-        EGL_BLUE_SIZE,          8,
-        EGL_GREEN_SIZE,         8,
-        EGL_RED_SIZE,           8,
-        EGL_ALPHA_SIZE,         8,
-        EGL_DEPTH_SIZE,         8,
-        EGL_STENCIL_SIZE,       8,
-        EGL_SAMPLE_BUFFERS,     1,
-        EGL_RENDERABLE_TYPE,    EGL_OPENGL_ES2_BIT,
-        EGL_NONE
-    };
-
     EGLConfig config;
-    EGLint numConfigs;
-    if (!eglChooseConfig(display, configAttribs, &config, 1, &numConfigs)
-        && numConfigs < 1){
+    if (!chooseConfig(display, &config)) {
         ALOGE("Unable to choose egl config: %s", eglStatusStr());
         return false;
     }
@@ -122,7 +111,71 @@ bool EngineContext::initDisplay() {
     if (!ProgramManager::get()->preCompile(shared_from_this()))
         return false;
 
-    return engineCore->start();
+    if (!engineCore->start()) return false;
+
+    // from here on GL is only called from the render thread
+    if (mRenderThreadEnabled) {
+        if (mRenderThread->start(shared_from_this()))
+            mRender->setPipelined(true);
+        else
+            ALOGW("render thread failed to start, rendering on the main thread");
+    }
+    return true;
+}
+
+bool EngineContext::chooseConfig(EGLDisplay display, EGLConfig* config) {
+    const EGLint configAttribs[] = {
+        EGL_SURFACE_TYPE,       EGL_WINDOW_BIT,
+        EGL_BLUE_SIZE,          8,
+        EGL_GREEN_SIZE,         8,
+        EGL_RED_SIZE,           8,
+        EGL_ALPHA_SIZE,         8,
+        EGL_DEPTH_SIZE,         WINDOW_DEPTH_SIZE,
+        EGL_RENDERABLE_TYPE,    EGL_OPENGL_ES2_BIT,
+        EGL_NONE
+    };
+    EGLint numConfigs = 0;
+    if (!eglChooseConfig(display, configAttribs, NULL, 0, &numConfigs) || numConfigs < 1)
+        return false;
+    vector<EGLConfig> configs(numConfigs);
+    if (!eglChooseConfig(display, configAttribs, &configs[0], numConfigs, &numConfigs)
+        || numConfigs < 1)
+        return false;
+
+    // the sizes are minimums, eglChooseConfig sorts the smallest depth and
+    // stencil first but puts deeper colors ahead of them. Everything not
+    // asked for costs tile memory, and a multisampled window can not take
+    // the blit of an offscreen scene
+    int best = -1;
+    int bestScore = 0;
+    for (EGLint i=0; i<numConfigs; i++) {
+        EGLint r, g, b, a, depth, stencil, samples;
+        eglGetConfigAttrib(display, configs[i], EGL_RED_SIZE, &r);
+        eglGetConfigAttrib(display, configs[i], EGL_GREEN_SIZE, &g);
+        eglGetConfigAttrib(display, configs[i], EGL_BLUE_SIZE, &b);
+        eglGetConfigAttrib(display, configs[i], EGL_ALPHA_SIZE, &a);
+        eglGetConfigAttrib(display, configs[i], EGL_DEPTH_SIZE, &depth);
+        eglGetConfigAttrib(display, configs[i], EGL_STENCIL_SIZE, &stencil);
+        eglGetConfigAttrib(display, configs[i], EGL_SAMPLE_BUFFERS, &samples);
+        int score = 0;
+        if (r == 8 && g == 8 && b == 8 && a == 8) score += 8;
+        if (samples == 0) score += 4;
+        if (stencil == WINDOW_STENCIL_SIZE) score += 2;
+        if (depth == WINDOW_DEPTH_SIZE) score += 1;
+        if (best < 0 || score > bestScore) {
+            best = i;
+            bestScore = score;
+        }
+    }
+    *config = configs[best];
+
+    EGLint depth, stencil, samples;
+    eglGetConfigAttrib(display, *config, EGL_DEPTH_SIZE, &depth);
+    eglGetConfigAttrib(display, *config, EGL_STENCIL_SIZE, &stencil);
+    eglGetConfigAttrib(display, *config, EGL_SAMPLES, &samples);
+    DEBUG(Log::F_GLES, "egl config of %d: depth %d, stencil %d, samples %d",
+        numConfigs, depth, stencil, samples);
+    return true;
 }
 
 const char* EngineContext::eglStatusStr() const {
@@ -153,6 +206,9 @@ void EngineContext::releaseDisplay() {
         ALOGE("EngineCore released before EngineContext");
         return;
     }
+    // the context is current on this thread again once stopped
+    mRenderThread->stop();
+    mRender->setPipelined(false);
     engineCore->stop();
     ProgramManager::release();
     mRender->release();
@@ -179,8 +235,17 @@ bool EngineContext::updateDisplay() {
     }
     engineCore->updateFrame();
     shared_ptr<Scene> currentScene(engineCore->getScene());
-    mRender->drawScene(currentScene);
-    return true;
+    if (!mRenderThread->isRunning())
+        return mRender->drawScene(currentScene);
+
+    // waits while the render thread is a full pipeline behind
+    FrameSnapshot* frame = mRenderThread->acquire();
+    if (!frame) return false;
+    // a frame that failed to build holds no scene, it is handed back
+    // without drawing
+    bool ret = mRender->buildFrame(currentScene, *frame);
+    mRenderThread->publish(frame);
+    return ret;
 }
 
 AAssetManager* EngineContext::getAssetManager() {
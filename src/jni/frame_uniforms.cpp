@@ -0,0 +1,161 @@
+#include "log.h"
+#include "camera.h"
+#include "light.h"
+#include "program.h"
+#include "gl_state.h"
+#include "frame_uniforms.h"
+
+using namespace std;
+
+namespace dzy {
+
+static_assert(sizeof(glm::mat4) == 64 && sizeof(glm::vec4) == 16 && sizeof(glm::ivec4) == 16,
+    "glm types must pack like std140");
+
+FrameUniforms::FrameUniforms()
+    : mUBO(0)
+    , mValid(false)
+    , mCamera(NULL)
+    , mClustered(false)
+    , mShadowCaster(NULL)
+    , mShadowIndex(-1)
+    , mNumShadowCascades(0)
+    , mFrameUpdates(0)
+    , mNumUpdates(0) {
+    // glm vectors start zeroed, matrices as identity, nothing is read
+    // before update() writes it
+    mBlock.mShadowLight = glm::ivec4(-1, -1, 0, 0);
+}
+
+FrameUniforms::~FrameUniforms() {
+    TRACE("");
+}
+
+void FrameUniforms::release() {
+    if (mUBO) GLState::get()->deleteBuffer(mUBO);
+    mUBO = 0;
+    mValid = false;
+}
+
+void FrameUniforms::invalidate() {
+    mValid = false;
+    mNumUpdates = mFrameUpdates;
+    mFrameUpdates = 0;
+}
+
+void FrameUniforms::setLightGrid(const glm::vec4& scale, const glm::ivec4& count) {
+    glm::ivec4 clusterCount(count.x, count.y, count.z, mBlock.mClusterCount.w);
+    if (mBlock.mClusterScale == scale && mBlock.mClusterCount == clusterCount) return;
+    mBlock.mClusterScale = scale;
+    mBlock.mClusterCount = clusterCount;
+    mValid = false;
+}
+
+void FrameUniforms::setViewport(int width, int height) {
+    glm::vec4 viewport(width, height, 1.f / width, 1.f / height);
+    if (mBlock.mViewport == viewport) return;
+    mBlock.mViewport = viewport;
+    mValid = false;
+}
+
+void FrameUniforms::setShadows(const Light* light, int sceneIndex, const glm::mat4* matrices,
+    const glm::vec4& splits, int numCascades) {
+    if (!light) numCascades = 0;
+    numCascades = numCascades < MAX_SHADOW_CASCADES ? numCascades : MAX_SHADOW_CASCADES;
+    bool same = mShadowCaster == light && mShadowIndex == sceneIndex
+        && mNumShadowCascades == numCascades && mBlock.mShadowSplits == splits;
+    for (int i=0; i<numCascades && same; i++)
+        same = mShadowMatrices[i] == matrices[i];
+    if (same) return;
+    mShadowCaster = light;
+    mShadowIndex = sceneIndex;
+    mNumShadowCascades = numCascades;
+    for (int i=0; i<numCascades; i++) mShadowMatrices[i] = matrices[i];
+    mBlock.mShadowSplits = splits;
+    mValid = false;
+}
+
+bool FrameUniforms::update(shared_ptr<Camera> camera,
+    const vector<shared_ptr<Light> >& lights, bool clustered) {
+    if (!camera) {
+        ALOGE("No camera available in scene");
+        return false;
+    }
+
+    size_t numLights = lights.size() < MAX_LIGHTS ? lights.size() : MAX_LIGHTS;
+    if (mValid && mCamera == camera.get() && mClustered == clustered
+        && mLights.size() == numLights) {
+        bool same = true;
+        for (size_t i=0; i<numLights && same; i++)
+            same = mLights[i] == lights[i].get();
+        if (same) return true;
+    }
+
+    Block& block = mBlock;
+    block.mView = camera->getViewMatrix();
+    block.mProj = camera->getProjMatrix();
+    block.mViewProj = block.mProj * block.mView;
+    block.mCameraPosition = glm::vec4(glm::vec3(glm::inverse(block.mView)[3]), 1.f);
+    block.mNumLights = glm::ivec4(numLights, 0, 0, 0);
+    mLights.resize(numLights);
+    for (size_t i=0; i<numLights; i++) {
+        shared_ptr<Light> light(lights[i]);
+        LightBlock& lb = block.mLights[i];
+        lb.mColor = glm::vec4(light->getColorDiffuse(), 1.f);
+        lb.mAmbient = glm::vec4(light->getColorAmbient(), 1.f);
+        lb.mPosition = block.mView * light->getTransform() * glm::vec4(light->getPosition(), 1.f);
+        lb.mAttenuation = glm::vec4(light->getAttenuationConstant(),
+            light->getAttenuationLinear(), light->getAttenuationQuadratic(), 1.f);
+        mLights[i] = light.get();
+    }
+    // shadow lookups start from eye space
+    glm::mat4 toWorld = glm::inverse(block.mView);
+    block.mShadowLight = glm::ivec4(-1, -1, mNumShadowCascades, 0);
+    if (mNumShadowCascades) {
+        block.mShadowLight.x = mShadowIndex;
+        for (size_t i=0; i<numLights; i++)
+            if (mLights[i] == mShadowCaster) block.mShadowLight.y = i;
+    }
+    for (int i=0; i<mNumShadowCascades; i++)
+        block.mShadowMatrices[i] = mShadowMatrices[i] * toWorld;
+    mCamera = camera.get();
+    block.mClusterCount.w = clustered ? 1 : 0;
+    mClustered = clustered;
+    mValid = upload();
+    return mValid;
+}
+
+bool FrameUniforms::update(const glm::mat4& view, const glm::mat4& proj) {
+    mBlock.mView = view;
+    mBlock.mProj = proj;
+    mBlock.mViewProj = proj * view;
+    mBlock.mCameraPosition = glm::vec4(glm::vec3(glm::inverse(view)[3]), 1.f);
+    mBlock.mNumLights = glm::ivec4(0);
+    mBlock.mClusterCount.w = 0;
+    mBlock.mShadowLight = glm::ivec4(-1, -1, 0, 0);
+    mLights.clear();
+    mCamera = NULL;
+    mValid = false;
+    return upload();
+}
+
+bool FrameUniforms::upload() {
+    if (!mUBO) {
+        glGenBuffers(1, &mUBO);
+        if (!mUBO) {
+            ALOGE("glGenBuffers error");
+            return false;
+        }
+        GLState::get()->bindBuffer(GL_UNIFORM_BUFFER, mUBO);
+        glBufferData(GL_UNIFORM_BUFFER, sizeof(Block), NULL, GL_DYNAMIC_DRAW);
+    }
+
+    GLState::get()->bindBuffer(GL_UNIFORM_BUFFER, mUBO);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(Block), &mBlock);
+    GLState::get()->countCall();
+    GLState::get()->bindBufferBase(GL_UNIFORM_BUFFER, UNIFORM_BINDING_FRAME, mUBO);
+    mFrameUpdates++;
+    return true;
+}
+
+} // namespace dzy
@@ -0,0 +1,358 @@
+#include "log.h"
+#include "gl_state.h"
+
+using namespace std;
+
+namespace dzy {
+
+static const GLuint UNKNOWN_NAME = 0xFFFFFFFF;
+static const GLenum UNKNOWN_ENUM = 0xFFFFFFFF;
+static const int STATS_INTERVAL = 60;
+
+PipelineState::Desc::Desc()
+    : mProgram(0)
+    , mDepthTest(true)
+    , mDepthWrite(true)
+    , mDepthFunc(GL_LESS)
+    , mCullFace(true)
+    , mCullMode(GL_BACK)
+    , mBlend(false)
+    , mBlendSrc(GL_SRC_ALPHA)
+    , mBlendDst(GL_ONE_MINUS_SRC_ALPHA)
+    , mColorWrite(true) {
+}
+
+bool PipelineState::Desc::operator<(const Desc& rhs) const {
+    if (mProgram != rhs.mProgram) return mProgram < rhs.mProgram;
+    if (mDepthTest != rhs.mDepthTest) return mDepthTest < rhs.mDepthTest;
+    if (mDepthWrite != rhs.mDepthWrite) return mDepthWrite < rhs.mDepthWrite;
+    if (mDepthFunc != rhs.mDepthFunc) return mDepthFunc < rhs.mDepthFunc;
+    if (mCullFace != rhs.mCullFace) return mCullFace < rhs.mCullFace;
+    if (mCullMode != rhs.mCullMode) return mCullMode < rhs.mCullMode;
+    if (mBlend != rhs.mBlend) return mBlend < rhs.mBlend;
+    if (mBlendSrc != rhs.mBlendSrc) return mBlendSrc < rhs.mBlendSrc;
+    if (mBlendDst != rhs.mBlendDst) return mBlendDst < rhs.mBlendDst;
+    return mColorWrite < rhs.mColorWrite;
+}
+
+GLState::GLState()
+    : mFrameCalls(0)
+    , mFrameSkipped(0)
+    , mNumCalls(0)
+    , mNumSkipped(0)
+    , mFrameCount(0) {
+    reset();
+}
+
+GLState::~GLState() {
+    TRACE("");
+}
+
+void GLState::reset() {
+    for (int i=0; i<NUM_CAPS; i++) mCaps[i] = -1;
+    mDepthMask      = -1;
+    mColorMask      = -1;
+    mProgram        = UNKNOWN_NAME;
+    mVertexArray    = UNKNOWN_NAME;
+    mArrayBuffer    = UNKNOWN_NAME;
+    mElementBuffer  = UNKNOWN_NAME;
+    for (int i=0; i<MAX_UNIFORM_BINDINGS; i++) mUniformBuffers[i] = UNKNOWN_NAME;
+    for (int i=0; i<MAX_TEXTURE_UNITS; i++) mTextures[i] = UNKNOWN_NAME;
+    mActiveTexture  = UNKNOWN_NAME;
+    mDrawFramebuffer = UNKNOWN_NAME;
+    mReadFramebuffer = UNKNOWN_NAME;
+    mDepthFunc      = UNKNOWN_ENUM;
+    mCullMode       = UNKNOWN_ENUM;
+    mBlendSrc       = UNKNOWN_ENUM;
+    mBlendDst       = UNKNOWN_ENUM;
+    for (int i=0; i<4; i++) mViewport[i] = -1;
+    // program names are only valid in their context
+    mPipelineStates.clear();
+}
+
+shared_ptr<const PipelineState> GLState::getPipelineState(const PipelineState::Desc& desc) {
+    auto it = mPipelineStates.find(desc);
+    if (it != mPipelineStates.end()) return it->second;
+    shared_ptr<const PipelineState> state(new PipelineState(desc));
+    mPipelineStates[desc] = state;
+    return state;
+}
+
+void GLState::apply(const PipelineState& state) {
+    const PipelineState::Desc& desc = state.mDesc;
+    useProgram(desc.mProgram);
+    enable(GL_DEPTH_TEST, desc.mDepthTest);
+    if (desc.mDepthTest) {
+        depthMask(desc.mDepthWrite);
+        depthFunc(desc.mDepthFunc);
+    }
+    enable(GL_CULL_FACE, desc.mCullFace);
+    if (desc.mCullFace) cullFace(desc.mCullMode);
+    enable(GL_BLEND, desc.mBlend);
+    if (desc.mBlend) blendFunc(desc.mBlendSrc, desc.mBlendDst);
+    colorMask(desc.mColorWrite);
+}
+
+void GLState::useProgram(GLuint program) {
+    if (mProgram == program) {
+        mFrameSkipped++;
+        return;
+    }
+    glUseProgram(program);
+    mProgram = program;
+    mFrameCalls++;
+}
+
+void GLState::bindVertexArray(GLuint vao) {
+    if (mVertexArray == vao) {
+        mFrameSkipped++;
+        return;
+    }
+    glBindVertexArray(vao);
+    mVertexArray = vao;
+    // the element array buffer binding is part of the vertex array
+    mElementBuffer = UNKNOWN_NAME;
+    mFrameCalls++;
+}
+
+void GLState::bindBuffer(GLenum target, GLuint buffer) {
+    GLuint* current = NULL;
+    if (target == GL_ARRAY_BUFFER) current = &mArrayBuffer;
+    else if (target == GL_ELEMENT_ARRAY_BUFFER) current = &mElementBuffer;
+    if (current && *current == buffer) {
+        mFrameSkipped++;
+        return;
+    }
+    glBindBuffer(target, buffer);
+    if (current) *current = buffer;
+    mFrameCalls++;
+}
+
+void GLState::bindBufferBase(GLenum target, GLuint index, GLuint buffer) {
+    GLuint* current = NULL;
+    if (target == GL_UNIFORM_BUFFER && index < (GLuint)MAX_UNIFORM_BINDINGS)
+        current = &mUniformBuffers[index];
+    if (current && *current == buffer) {
+        mFrameSkipped++;
+        return;
+    }
+    glBindBufferBase(target, index, buffer);
+    if (current) *current = buffer;
+    mFrameCalls++;
+}
+
+void GLState::bindTexture(GLuint unit, GLenum target, GLuint texture) {
+    GLuint* current = unit < (GLuint)MAX_TEXTURE_UNITS ? &mTextures[unit] : NULL;
+    if (current && *current == texture) {
+        mFrameSkipped++;
+        return;
+    }
+    if (mActiveTexture != unit) {
+        glActiveTexture(GL_TEXTURE0 + unit);
+        mActiveTexture = unit;
+        mFrameCalls++;
+    }
+    glBindTexture(target, texture);
+    if (current) *current = texture;
+    mFrameCalls++;
+}
+
+void GLState::bindFramebuffer(GLenum target, GLuint framebuffer) {
+    bool draw = target != GL_READ_FRAMEBUFFER;
+    bool read = target != GL_DRAW_FRAMEBUFFER;
+    if ((!draw || mDrawFramebuffer == framebuffer) && (!read || mReadFramebuffer == framebuffer)) {
+        mFrameSkipped++;
+        return;
+    }
+    glBindFramebuffer(target, framebuffer);
+    if (draw) mDrawFramebuffer = framebuffer;
+    if (read) mReadFramebuffer = framebuffer;
+    mFrameCalls++;
+}
+
+int GLState::getCapIndex(GLenum cap) {
+    switch (cap) {
+        case GL_DEPTH_TEST:             return CAP_DEPTH_TEST;
+        case GL_CULL_FACE:              return CAP_CULL_FACE;
+        case GL_BLEND:                  return CAP_BLEND;
+        case GL_STENCIL_TEST:           return CAP_STENCIL_TEST;
+        case GL_SCISSOR_TEST:           return CAP_SCISSOR_TEST;
+        case GL_POLYGON_OFFSET_FILL:    return CAP_POLYGON_OFFSET_FILL;
+        default:                        return -1;
+    }
+}
+
+void GLState::enable(GLenum cap, bool enable) {
+    int index = getCapIndex(cap);
+    if (index >= 0 && mCaps[index] == (int)enable) {
+        mFrameSkipped++;
+        return;
+    }
+    if (enable) glEnable(cap);
+    else        glDisable(cap);
+    if (index >= 0) mCaps[index] = enable;
+    mFrameCalls++;
+}
+
+void GLState::depthMask(bool write) {
+    if (mDepthMask == (int)write) {
+        mFrameSkipped++;
+        return;
+    }
+    glDepthMask(write ? GL_TRUE : GL_FALSE);
+    mDepthMask = write;
+    mFrameCalls++;
+}
+
+void GLState::depthFunc(GLenum func) {
+    if (mDepthFunc == func) {
+        mFrameSkipped++;
+        return;
+    }
+    glDepthFunc(func);
+    mDepthFunc = func;
+    mFrameCalls++;
+}
+
+void GLState::colorMask(bool write) {
+    if (mColorMask == (int)write) {
+        mFrameSkipped++;
+        return;
+    }
+    GLboolean b = write ? GL_TRUE : GL_FALSE;
+    glColorMask(b, b, b, b);
+    mColorMask = write;
+    mFrameCalls++;
+}
+
+void GLState::cullFace(GLenum mode) {
+    if (mCullMode == mode) {
+        mFrameSkipped++;
+        return;
+    }
+    glCullFace(mode);
+    mCullMode = mode;
+    mFrameCalls++;
+}
+
+void GLState::blendFunc(GLenum src, GLenum dst) {
+    if (mBlendSrc == src && mBlendDst == dst) {
+        mFrameSkipped++;
+        return;
+    }
+    glBlendFunc(src, dst);
+    mBlendSrc = src;
+    mBlendDst = dst;
+    mFrameCalls++;
+}
+
+void GLState::viewport(GLint x, GLint y, GLsizei width, GLsizei height) {
+    if (mViewport[0] == x && mViewport[1] == y && mViewport[2] == width
+        && mViewport[3] == height) {
+        mFrameSkipped++;
+        return;
+    }
+    glViewport(x, y, width, height);
+    mViewport[0] = x;
+    mViewport[1] = y;
+    mViewport[2] = width;
+    mViewport[3] = height;
+    mFrameCalls++;
+}
+
+void GLState::deleteProgram(GLuint program) {
+    glDeleteProgram(program);
+    if (mProgram == program) mProgram = UNKNOWN_NAME;
+    for (auto it = mPipelineStates.begin(); it != mPipelineStates.end(); ) {
+        if (it->first.mProgram == program) it = mPipelineStates.erase(it);
+        else it++;
+    }
+}
+
+void GLState::deleteVertexArray(GLuint vao) {
+    glDeleteVertexArrays(1, &vao);
+    // deleting the bound vertex array binds 0
+    if (mVertexArray == vao) {
+        mVertexArray = 0;
+        mElementBuffer = UNKNOWN_NAME;
+    }
+}
+
+void GLState::deleteBuffer(GLuint buffer) {
+    glDeleteBuffers(1, &buffer);
+    // deleting a bound buffer binds 0
+    if (mArrayBuffer == buffer) mArrayBuffer = 0;
+    if (mElementBuffer == buffer) mElementBuffer = 0;
+    for (int i=0; i<MAX_UNIFORM_BINDINGS; i++)
+        if (mUniformBuffers[i] == buffer) mUniformBuffers[i] = 0;
+}
+
+void GLState::queueDeleteVertexArray(GLuint vao) {
+    if (!vao) return;
+    lock_guard<mutex> lock(mQueueMutex);
+    mQueuedVertexArrays.push_back(vao);
+}
+
+void GLState::queueDeleteBuffer(GLuint buffer) {
+    if (!buffer) return;
+    lock_guard<mutex> lock(mQueueMutex);
+    mQueuedBuffers.push_back(buffer);
+}
+
+void GLState::queueDeleteTexture(GLuint texture) {
+    if (!texture) return;
+    lock_guard<mutex> lock(mQueueMutex);
+    mQueuedTextures.push_back(texture);
+}
+
+void GLState::queueDeleteTransformFeedback(GLuint feedback) {
+    if (!feedback) return;
+    lock_guard<mutex> lock(mQueueMutex);
+    mQueuedTransformFeedbacks.push_back(feedback);
+}
+
+void GLState::deleteQueued() {
+    vector<GLuint> vertexArrays, buffers, textures, feedbacks;
+    {
+        lock_guard<mutex> lock(mQueueMutex);
+        vertexArrays.swap(mQueuedVertexArrays);
+        buffers.swap(mQueuedBuffers);
+        textures.swap(mQueuedTextures);
+        feedbacks.swap(mQueuedTransformFeedbacks);
+    }
+    // vertex arrays and transform feedbacks first, they reference the
+    // buffers
+    for (size_t i=0; i<vertexArrays.size(); i++) deleteVertexArray(vertexArrays[i]);
+    // transform feedbacks are not shadowed
+    if (!feedbacks.empty()) glDeleteTransformFeedbacks(feedbacks.size(), &feedbacks[0]);
+    for (size_t i=0; i<buffers.size(); i++) deleteBuffer(buffers[i]);
+    for (size_t i=0; i<textures.size(); i++) deleteTexture(textures[i]);
+}
+
+void GLState::deleteTexture(GLuint texture) {
+    glDeleteTextures(1, &texture);
+    // deleting a bound texture binds 0 on every unit
+    for (int i=0; i<MAX_TEXTURE_UNITS; i++)
+        if (mTextures[i] == texture) mTextures[i] = 0;
+}
+
+void GLState::deleteFramebuffer(GLuint framebuffer) {
+    glDeleteFramebuffers(1, &framebuffer);
+    // deleting a bound framebuffer binds the window
+    if (mDrawFramebuffer == framebuffer) mDrawFramebuffer = 0;
+    if (mReadFramebuffer == framebuffer) mReadFramebuffer = 0;
+}
+
+void GLState::endFrame() {
+    mNumCalls = mFrameCalls;
+    mNumSkipped = mFrameSkipped;
+    mFrameCalls = 0;
+    mFrameSkipped = 0;
+    if (++mFrameCount >= STATS_INTERVAL) {
+        mFrameCount = 0;
+        DEBUG(Log::F_GLES, "gl calls per frame: %d issued, %d redundant dropped",
+            mNumCalls, mNumSkipped);
+    }
+}
+
+} // namespace dzy
@@ -0,0 +1,326 @@
+#include <map>
+#include <sstream>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include "log.h"
+#include "scene.h"
+#include "scene_graph.h"
+#include "mesh.h"
+#include "material.h"
+#include "static_batcher.h"
+#include "hlod.h"
+
+using namespace std;
+
+namespace dzy {
+
+// surface area of a mesh after a transform
+static float getSurfaceArea(shared_ptr<Mesh> mesh, const glm::mat4& transform) {
+    const float* pos = (const float*)mesh->getOriginalPositionBuf();
+    const unsigned int* indices = (const unsigned int*)mesh->getIndexBuf();
+    float area = 0.f;
+    for (unsigned int i=0; i+2<mesh->getNumIndices(); i+=3) {
+        glm::vec3 p[3];
+        for (int k=0; k<3; k++) {
+            const float* v = pos + indices[i+k] * 3;
+            p[k] = glm::vec3(transform * glm::vec4(v[0], v[1], v[2], 1.f));
+        }
+        area += 0.5f * glm::length(glm::cross(p[1] - p[0], p[2] - p[0]));
+    }
+    return area;
+}
+
+HLOD::HLOD(unsigned int leafSize, int gridResolution)
+    : mLeafSize(leafSize > 1 ? leafSize : 2)
+    // vertex keys of a cell are packed into 21 bits per axis
+    , mGridResolution(glm::clamp(gridResolution, 1, 128))
+    , mDistanceFactor(10.f)
+    , mNumProxiesDrawn(0)
+    , mNumReplaced(0) {
+}
+
+HLOD::~HLOD() {
+    TRACE("");
+}
+
+int HLOD::build(shared_ptr<Scene> scene) {
+    shared_ptr<Node> root(scene ? scene->getRootNode() : nullptr);
+    if (!root) {
+        ALOGE("Invalid scene to build HLOD for");
+        return 0;
+    }
+    if (!mClusters.empty()) {
+        ALOGW("HLOD already built");
+        return mClusters.size();
+    }
+
+    MeasureDuration duration;
+    glm::mat4 rootInverse = glm::inverse(root->getWorldTransform().toMat4());
+    vector<Entry> entries;
+    root->depthFirstTraversal([&] (shared_ptr<NodeObj> nodeObj) {
+        shared_ptr<Geometry> geometry = dynamic_pointer_cast<Geometry>(nodeObj);
+        if (!geometry || !StaticBatcher::isStatic(geometry, root)) return;
+        // proxies are opaque
+        shared_ptr<Material> material(geometry->getMaterial());
+        if (material && material->isTransparent()) return;
+        Entry entry;
+        entry.mGeometry = geometry;
+        entry.mBounds = geometry->getWorldBoundingBox().transform(rootInverse);
+        entries.push_back(entry);
+    });
+    if (entries.size() < 2) return 0;
+
+    mRoot = root;
+    buildCluster(entries, 0, entries.size());
+    // children come after their parent, their proxies are merged into it
+    for (int c=mClusters.size()-1; c>=0; c--) {
+        if (!buildProxy(c, rootInverse)) {
+            ALOGE("HLOD proxy %d not built", c);
+            mClusters.clear();
+            return 0;
+        }
+    }
+
+    int numGeometry = 0;
+    for (size_t c=0; c<mClusters.size(); c++) {
+        Cluster& cluster = mClusters[c];
+        for (size_t i=0; i<cluster.mGeometry.size(); i++) {
+            cluster.mGeometry[i]->mHLODCluster = c;
+            numGeometry++;
+        }
+        cluster.mProxy->mHLODCluster = c;
+        cluster.mProxy->mIsHLODProxy = true;
+        root->attachChild(cluster.mProxy);
+        cluster.mProxy->setUpdateFlag(NodeObj::F_UPDATE_WORLD_TRANSFORM, false);
+    }
+    mState.clear();
+
+    DUMP(Log::F_MODEL, "HLOD: %d Geometry in %d clusters, %lld us",
+        numGeometry, (int)mClusters.size(), duration.getMicroSeconds());
+    return mClusters.size();
+}
+
+int HLOD::buildCluster(vector<Entry>& entries, size_t begin, size_t end) {
+    int index = mClusters.size();
+    mClusters.push_back(Cluster());
+    AABB bounds;
+    AABB centers;
+    for (size_t i=begin; i<end; i++) {
+        bounds.expand(entries[i].mBounds);
+        centers.expand(entries[i].mBounds.getCenter());
+    }
+    mClusters[index].mBounds = bounds;
+    mClusters[index].mChildren[0] = -1;
+    mClusters[index].mChildren[1] = -1;
+    mClusters[index].mArea = 0.f;
+
+    if (end - begin <= mLeafSize) {
+        for (size_t i=begin; i<end; i++)
+            mClusters[index].mGeometry.push_back(entries[i].mGeometry);
+        return index;
+    }
+
+    // median split along the longest axis of the centers, so both
+    // halves hold the same number of Geometry
+    glm::vec3 extent = centers.getExtent();
+    int axis = 0;
+    if (extent.y > extent[axis]) axis = 1;
+    if (extent.z > extent[axis]) axis = 2;
+    size_t middle = begin + (end - begin) / 2;
+    nth_element(entries.begin() + begin, entries.begin() + middle, entries.begin() + end,
+        [axis] (const Entry& a, const Entry& b) {
+            return a.mBounds.getCenter()[axis] < b.mBounds.getCenter()[axis];
+        });
+    int left = buildCluster(entries, begin, middle);
+    int right = buildCluster(entries, middle, end);
+    mClusters[index].mChildren[0] = left;
+    mClusters[index].mChildren[1] = right;
+    return index;
+}
+
+bool HLOD::buildProxy(int index, const glm::mat4& rootInverse) {
+    Cluster& cluster = mClusters[index];
+    vector<shared_ptr<Mesh> > meshes;
+    vector<glm::mat4> transforms;
+    // materials with their surface area
+    vector<pair<shared_ptr<Material>, float> > materials;
+    cluster.mArea = 0.f;
+    if (cluster.mChildren[0] < 0) {
+        for (size_t i=0; i<cluster.mGeometry.size(); i++) {
+            shared_ptr<Geometry> geometry(cluster.mGeometry[i]);
+            glm::mat4 transform = rootInverse * geometry->getWorldTransform().toMat4();
+            float area = getSurfaceArea(geometry->getMesh(), transform);
+            meshes.push_back(geometry->getMesh());
+            transforms.push_back(transform);
+            materials.push_back(make_pair(geometry->getMaterial(), area));
+            cluster.mArea += area;
+        }
+    } else {
+        // proxies are in the space of the root already
+        for (int k=0; k<2; k++) {
+            const Cluster& child = mClusters[cluster.mChildren[k]];
+            meshes.push_back(child.mProxy->getMesh());
+            transforms.push_back(glm::mat4(1.f));
+            materials.push_back(make_pair(child.mProxy->getMaterial(), child.mArea));
+            cluster.mArea += child.mArea;
+        }
+    }
+
+    ostringstream name;
+    name << "hlod-" << index;
+    shared_ptr<Mesh> mesh(simplify(meshes, transforms, cluster.mBounds, name.str()));
+    if (!mesh) return false;
+
+    glm::vec3 diffuse(0.f), specular(0.f), ambient(0.f), emission(0.f);
+    float shininess = 0.f;
+    float total = 0.f;
+    Material fallback;
+    for (size_t i=0; i<materials.size(); i++) {
+        const Material& material = materials[i].first ? *materials[i].first : fallback;
+        float weight = materials[i].second;
+        diffuse += material.getDiffuse() * weight;
+        specular += material.getSpecular() * weight;
+        ambient += material.getAmbient() * weight;
+        emission += material.getEmission() * weight;
+        shininess += material.getShininess() * weight;
+        total += weight;
+    }
+    shared_ptr<Material> merged(new Material(name.str()));
+    if (total > 0.f) {
+        merged->setDiffuse(diffuse / total);
+        merged->setSpecular(specular / total);
+        merged->setAmbient(ambient / total);
+        merged->setEmission(emission / total);
+        merged->setShininess(shininess / total);
+    }
+
+    cluster.mProxy.reset(new Geometry(name.str(), mesh));
+    cluster.mProxy->setMaterial(merged);
+    return true;
+}
+
+shared_ptr<Mesh> HLOD::simplify(const vector<shared_ptr<Mesh> >& meshes,
+    const vector<glm::mat4>& transforms, const AABB& bounds, const string& name) {
+    glm::vec3 origin = bounds.getMin();
+    glm::vec3 extent = bounds.getMax() - origin;
+    float longest = max(extent.x, max(extent.y, extent.z));
+    float cellSize = longest > 0.f ? longest / mGridResolution : 1.f;
+    glm::ivec3 maxCell(mGridResolution - 1);
+
+    // one vertex per occupied cell at the mean of its vertices, with the
+    // area weighted normal of the faces around them
+    unordered_map<unsigned int, unsigned int> cells;
+    vector<glm::vec3> sums;
+    vector<glm::vec3> normals;
+    vector<unsigned int> counts;
+    vector<unsigned int> indices;
+    unordered_set<unsigned long long> faces;
+    for (size_t m=0; m<meshes.size(); m++) {
+        shared_ptr<Mesh> mesh(meshes[m]);
+        const float* pos = (const float*)mesh->getOriginalPositionBuf();
+        unsigned int n = mesh->getNumVertices();
+        vector<unsigned int> remap(n);
+        vector<glm::vec3> positions(n);
+        for (unsigned int v=0; v<n; v++) {
+            glm::vec3 p(transforms[m] * glm::vec4(pos[v*3], pos[v*3+1], pos[v*3+2], 1.f));
+            glm::ivec3 cell = glm::clamp(glm::ivec3(glm::floor((p - origin) / cellSize)),
+                glm::ivec3(0), maxCell);
+            unsigned int key = (cell.z * mGridResolution + cell.y) * mGridResolution + cell.x;
+            auto it = cells.find(key);
+            if (it == cells.end()) {
+                it = cells.insert(make_pair(key, (unsigned int)sums.size())).first;
+                sums.push_back(glm::vec3(0.f));
+                normals.push_back(glm::vec3(0.f));
+                counts.push_back(0);
+            }
+            remap[v] = it->second;
+            sums[it->second] += p;
+            counts[it->second]++;
+            positions[v] = p;
+        }
+
+        const unsigned int* src = (const unsigned int*)mesh->getIndexBuf();
+        for (unsigned int i=0; i+2<mesh->getNumIndices(); i+=3) {
+            unsigned int a = remap[src[i]], b = remap[src[i+1]], c = remap[src[i+2]];
+            glm::vec3 normal = glm::cross(positions[src[i+1]] - positions[src[i]],
+                positions[src[i+2]] - positions[src[i]]);
+            normals[a] += normal;
+            normals[b] += normal;
+            normals[c] += normal;
+            // collapsed into a cell
+            if (a == b || b == c || a == c) continue;
+            // the same face from several sources, keep its winding
+            unsigned int first = min(a, min(b, c));
+            while (a != first) {
+                unsigned int t = a; a = b; b = c; c = t;
+            }
+            unsigned long long face = ((unsigned long long)a << 42)
+                | ((unsigned long long)b << 21) | c;
+            if (!faces.insert(face).second) continue;
+            indices.push_back(a);
+            indices.push_back(b);
+            indices.push_back(c);
+        }
+    }
+    if (indices.empty()) return nullptr;
+
+    unsigned int numVertices = sums.size();
+    vector<float> positionBuf(numVertices * 3);
+    vector<float> normalBuf(numVertices * 3);
+    for (unsigned int v=0; v<numVertices; v++) {
+        glm::vec3 p = sums[v] / (float)counts[v];
+        float length = glm::length(normals[v]);
+        glm::vec3 d = length > 0.f ? normals[v] / length : glm::vec3(0.f, 1.f, 0.f);
+        for (int k=0; k<3; k++) {
+            positionBuf[v*3+k] = p[k];
+            normalBuf[v*3+k] = d[k];
+        }
+    }
+
+    shared_ptr<Mesh> mesh(new Mesh(Mesh::PRIMITIVE_TYPE_TRIANGLE, numVertices, name));
+    mesh->reserveDataStorage(positionBuf.size() * sizeof(float) * 2);
+    mesh->appendVertexPositions(&positionBuf[0], 3, sizeof(float));
+    mesh->appendVertexNormals(&normalBuf[0], 3, sizeof(float));
+    mesh->buildIndexBuffer(&indices[0], indices.size() / 3);
+    return mesh;
+}
+
+void HLOD::select(const glm::vec3& eye) {
+    mNumProxiesDrawn = 0;
+    mNumReplaced = 0;
+    shared_ptr<Node> root(mRoot.lock());
+    if (!root || mClusters.empty()) return;
+
+    glm::vec3 local(glm::inverse(root->getWorldTransform().toMat4()) * glm::vec4(eye, 1.f));
+    mState.assign(mClusters.size(), STATE_HIDDEN);
+    vector<int> stack(1, 0);
+    while (!stack.empty()) {
+        int c = stack.back();
+        stack.pop_back();
+        const Cluster& cluster = mClusters[c];
+        glm::vec3 closest = glm::clamp(local, cluster.mBounds.getMin(), cluster.mBounds.getMax());
+        float radius = glm::length(cluster.mBounds.getExtent());
+        if (glm::length(local - closest) > radius * mDistanceFactor) {
+            mState[c] = STATE_PROXY;
+            mNumProxiesDrawn++;
+            continue;
+        }
+        mState[c] = STATE_REFINED;
+        if (cluster.mChildren[0] >= 0) {
+            stack.push_back(cluster.mChildren[0]);
+            stack.push_back(cluster.mChildren[1]);
+        }
+    }
+    for (size_t c=0; c<mClusters.size(); c++) {
+        if (mState[c] != STATE_REFINED) mNumReplaced += mClusters[c].mGeometry.size();
+    }
+}
+
+bool HLOD::isDrawn(int cluster, bool proxy) const {
+    // nothing selected yet, draw the scene as it is
+    if (cluster < 0 || cluster >= (int)mState.size()) return !proxy;
+    return mState[cluster] == (proxy ? STATE_PROXY : STATE_REFINED);
+}
+
+} // namespace dzy
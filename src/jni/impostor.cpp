@@ -0,0 +1,380 @@
+#include <math.h>
+#include <algorithm>
+#include <EGL/egl.h>
+#include <glm/gtc/matrix_transform.hpp>
+#include "log.h"
+#include "scene_graph.h"
+#include "mesh.h"
+#include "material.h"
+#include "program.h"
+#include "gl_state.h"
+#include "frame_uniforms.h"
+#include "material_table.h"
+#include "impostor.h"
+
+using namespace std;
+
+namespace dzy {
+
+// center and radius, rotation, views and fade, see ImpostorItem
+static const int INSTANCE_NUM_FLOATS = 4 + 9 + 4;
+
+Impostor::Impostor(int cellSize)
+    : mCellSize(cellSize > 0 ? cellSize : 64)
+    , mScreenSize(0.1f)
+    , mFadeRange(0.5f)
+    , mState(STATE_NONE)
+    , mCenter(0.f)
+    , mRadius(0.f)
+    , mAlbedo(0)
+    , mNormal(0) {
+}
+
+Impostor::~Impostor() {
+    TRACE("");
+    // dropped on the game thread the atlases go with the next frame of
+    // the render thread, ImpostorRenderer forgets them meanwhile
+    if (eglGetCurrentContext() != EGL_NO_CONTEXT) {
+        release();
+    } else {
+        GLState::get()->queueDeleteTexture(mAlbedo);
+        GLState::get()->queueDeleteTexture(mNormal);
+    }
+}
+
+void Impostor::setScreenSize(float size, float fadeRange) {
+    mScreenSize = size > 0.f ? size : 0.f;
+    mFadeRange = fadeRange > 0.f ? fadeRange : 0.f;
+}
+
+float Impostor::getFadeOut(float screenSize) const {
+    float full = mScreenSize * (1.f + mFadeRange);
+    if (screenSize >= full) return 0.f;
+    if (screenSize <= mScreenSize) return 1.f;
+    return (full - screenSize) / (full - mScreenSize);
+}
+
+bool Impostor::queueBake() {
+    int state = STATE_NONE;
+    return mState.compare_exchange_strong(state, STATE_QUEUED);
+}
+
+void Impostor::cancelBake() {
+    int state = STATE_QUEUED;
+    mState.compare_exchange_strong(state, STATE_NONE);
+}
+
+void Impostor::setBounds(const glm::vec3& center, float radius) {
+    mCenter = center;
+    mRadius = radius;
+}
+
+void Impostor::release() {
+    if (mAlbedo) GLState::get()->deleteTexture(mAlbedo);
+    if (mNormal) GLState::get()->deleteTexture(mNormal);
+    mAlbedo = 0;
+    mNormal = 0;
+    int state = STATE_BAKED;
+    mState.compare_exchange_strong(state, STATE_NONE);
+}
+
+void Impostor::getView(int view, glm::vec3& direction, glm::vec3& up) {
+    int column = view % VIEWS_AROUND;
+    int row = view / VIEWS_AROUND;
+    float yaw = 2.f * (float)M_PI * column / VIEWS_AROUND;
+    float pitch = 0.5f * (float)M_PI * row / max(VIEWS_UP - 1, 1);
+    direction = glm::vec3(sinf(yaw) * cosf(pitch), sinf(pitch), cosf(yaw) * cosf(pitch));
+    up = glm::vec3(-sinf(yaw) * sinf(pitch), cosf(pitch), -cosf(yaw) * sinf(pitch));
+}
+
+glm::vec3 Impostor::selectViews(const glm::vec3& direction) {
+    // seen from below, the horizon views are the nearest there are
+    float pitch = asinf(glm::clamp(direction.y, 0.f, 1.f));
+    float yaw = atan2f(direction.x, direction.z);
+    if (yaw < 0.f) yaw += 2.f * (float)M_PI;
+    int row = (int)floorf(pitch / (0.5f * (float)M_PI) * (VIEWS_UP - 1) + 0.5f);
+    float column = yaw / (2.f * (float)M_PI) * VIEWS_AROUND;
+    int first = (int)floorf(column);
+    float weight = column - first;
+    first %= VIEWS_AROUND;
+    int second = (first + 1) % VIEWS_AROUND;
+    return glm::vec3(row * VIEWS_AROUND + first, row * VIEWS_AROUND + second, weight);
+}
+
+ImpostorRenderer::ImpostorRenderer()
+    : mFramebuffer(0)
+    , mDepthBuffer(0)
+    , mDepthSize(0)
+    , mVAO(0)
+    , mInstanceVBO(0)
+    , mNumImpostors(0)
+    , mNumBakes(0) {
+}
+
+ImpostorRenderer::~ImpostorRenderer() {
+    TRACE("");
+}
+
+void ImpostorRenderer::release() {
+    GLState* state = GLState::get();
+    if (mFramebuffer) state->deleteFramebuffer(mFramebuffer);
+    if (mDepthBuffer) glDeleteRenderbuffers(1, &mDepthBuffer);
+    if (mVAO) state->deleteVertexArray(mVAO);
+    if (mInstanceVBO) state->deleteBuffer(mInstanceVBO);
+    mFramebuffer = 0;
+    mDepthBuffer = 0;
+    mDepthSize = glm::ivec2(0);
+    mVAO = 0;
+    mInstanceVBO = 0;
+    mGroups.clear();
+    // drawn again on a new context when next seen
+    for (size_t i=0; i<mBaked.size(); i++) {
+        shared_ptr<Impostor> impostor(mBaked[i].lock());
+        if (impostor) impostor->release();
+    }
+    mBaked.clear();
+}
+
+void ImpostorRenderer::bake(FrameSnapshot& frame, MaterialTable& materials,
+    FrameUniforms& uniforms) {
+    mNumBakes = 0;
+    if (frame.mImpostorBakes.empty()) return;
+
+    bool hasLight = !frame.mLights.empty();
+    for (size_t i=0; i<frame.mImpostorBakes.size(); i++) {
+        const FrameSnapshot::ImpostorBake& bake = frame.mImpostorBakes[i];
+        shared_ptr<Impostor> impostor(bake.mImpostor);
+        if (!bakeAtlas(bake, hasLight, materials, uniforms)) {
+            ALOGW("impostor atlas not drawn, the subtree is drawn instead");
+            impostor->mState = Impostor::STATE_FAILED;
+            continue;
+        }
+        impostor->mState = Impostor::STATE_BAKED;
+        mNumBakes++;
+        bool known = false;
+        for (size_t j=0; j<mBaked.size() && !known; j++)
+            known = mBaked[j].lock() == impostor;
+        if (!known) mBaked.push_back(impostor);
+    }
+    frame.mImpostorBakes.clear();
+
+    // depth is only needed while drawing the cells
+    GLState::get()->bindFramebuffer(GL_FRAMEBUFFER, 0);
+    if (mDepthBuffer) glDeleteRenderbuffers(1, &mDepthBuffer);
+    mDepthBuffer = 0;
+    mDepthSize = glm::ivec2(0);
+    mBaked.erase(remove_if(mBaked.begin(), mBaked.end(),
+        [] (const weak_ptr<Impostor>& impostor) { return impostor.expired(); }), mBaked.end());
+}
+
+bool ImpostorRenderer::prepareTarget(Impostor& impostor) {
+    GLState* state = GLState::get();
+    int width = impostor.getWidth();
+    int height = impostor.getHeight();
+    if (!impostor.mAlbedo) {
+        GLuint textures[2] = { 0, 0 };
+        glGenTextures(2, textures);
+        if (!textures[0] || !textures[1]) {
+            ALOGE("glGenTextures error");
+            return false;
+        }
+        // minified far away, the cells get mipmaps
+        int levels = 1;
+        for (int size = max(width, height); size > 1; size >>= 1) levels++;
+        for (int i=0; i<2; i++) {
+            state->bindTexture(0, GL_TEXTURE_2D, textures[i]);
+            glTexStorage2D(GL_TEXTURE_2D, levels, GL_RGBA8, width, height);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        }
+        impostor.mAlbedo = textures[0];
+        impostor.mNormal = textures[1];
+    }
+
+    if (!mFramebuffer) {
+        glGenFramebuffers(1, &mFramebuffer);
+        if (!mFramebuffer) {
+            ALOGE("glGenFramebuffers error");
+            return false;
+        }
+    }
+    if (mDepthSize != glm::ivec2(width, height)) {
+        if (!mDepthBuffer) glGenRenderbuffers(1, &mDepthBuffer);
+        if (!mDepthBuffer) {
+            ALOGE("glGenRenderbuffers error");
+            return false;
+        }
+        glBindRenderbuffer(GL_RENDERBUFFER, mDepthBuffer);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT16, width, height);
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+        mDepthSize = glm::ivec2(width, height);
+    }
+
+    state->bindFramebuffer(GL_FRAMEBUFFER, mFramebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, impostor.mAlbedo, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, impostor.mNormal, 0);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, mDepthBuffer);
+    static const GLenum drawBuffers[2] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+    glDrawBuffers(2, drawBuffers);
+    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    if (status != GL_FRAMEBUFFER_COMPLETE) {
+        ALOGE("impostor framebuffer incomplete: 0x%x", status);
+        return false;
+    }
+    state->viewport(0, 0, width, height);
+    return true;
+}
+
+bool ImpostorRenderer::bakeAtlas(const FrameSnapshot::ImpostorBake& bake, bool hasLight,
+    MaterialTable& materials, FrameUniforms& uniforms) {
+    Impostor& impostor = *bake.mImpostor;
+    if (bake.mItems.empty() || bake.mRadius <= 0.f) return false;
+    if (!prepareTarget(impostor)) return false;
+
+    // coverage and depth of the background are 0 and the far plane
+    GLState* state = GLState::get();
+    static const GLfloat transparent[4] = { 0.f, 0.f, 0.f, 0.f };
+    static const GLfloat farDepth = 1.f;
+    glClearBufferfv(GL_COLOR, 0, transparent);
+    glClearBufferfv(GL_COLOR, 1, transparent);
+    glClearBufferfv(GL_DEPTH, 0, &farDepth);
+    state->countCall(3);
+
+    vector<shared_ptr<Program> > programs(bake.mItems.size());
+    for (size_t i=0; i<bake.mItems.size(); i++) {
+        const FrameSnapshot::DrawItem& item = bake.mItems[i];
+        if (!item.mGeometry->prepareBufferObject(item.mVertices)) continue;
+        shared_ptr<Mesh> mesh(item.mGeometry->getMesh());
+        programs[i] = ProgramManager::get()->getVariant(
+            item.mGeometry->getProgram(item.mMaterial, hasLight, mesh),
+            PROGRAM_VARIANT_IMPOSTOR);
+    }
+
+    // the sphere fills each cell, the depth spans it
+    float radius = bake.mRadius;
+    glm::mat4 proj = glm::ortho(-radius, radius, -radius, radius, radius, 3.f * radius);
+    int cell = impostor.getCellSize();
+    for (int v=0; v<Impostor::VIEWS_AROUND * Impostor::VIEWS_UP; v++) {
+        glm::vec3 direction, up;
+        Impostor::getView(v, direction, up);
+        glm::mat4 view = glm::lookAt(bake.mCenter + direction * 2.f * radius, bake.mCenter, up);
+        state->viewport((v % Impostor::VIEWS_AROUND) * cell, (v / Impostor::VIEWS_AROUND) * cell,
+            cell, cell);
+        if (!uniforms.update(view, proj)) return false;
+
+        for (size_t i=0; i<bake.mItems.size(); i++) {
+            const FrameSnapshot::DrawItem& item = bake.mItems[i];
+            shared_ptr<Program> program(programs[i]);
+            if (!program) continue;
+            PipelineState::Desc desc;
+            desc.mProgram = program->getId();
+            state->apply(*state->getPipelineState(desc));
+            glm::mat4 world = item.mWorld;
+            program->uploadData(nullptr, nullptr, item.mMaterial, world, view, proj);
+            program->setMaterialIndex(materials.getIndex(item.mMaterial));
+            GLuint vao = item.mGeometry->getVertexArray(program);
+            if (!vao) continue;
+            state->bindVertexArray(vao);
+            glDrawElements(GL_TRIANGLES, item.mGeometry->getMesh()->getNumIndices(),
+                GL_UNSIGNED_INT, (void*)0);
+            state->countCall();
+        }
+    }
+    state->bindVertexArray(0);
+
+    static const GLenum depth = GL_DEPTH_ATTACHMENT;
+    glInvalidateFramebuffer(GL_FRAMEBUFFER, 1, &depth);
+    state->bindTexture(0, GL_TEXTURE_2D, impostor.mAlbedo);
+    glGenerateMipmap(GL_TEXTURE_2D);
+    state->bindTexture(0, GL_TEXTURE_2D, impostor.mNormal);
+    glGenerateMipmap(GL_TEXTURE_2D);
+    state->countCall(3);
+    DEBUG(Log::F_GLES, "impostor atlas %dx%d drawn from %d Geometry",
+        impostor.getWidth(), impostor.getHeight(), (int)bake.mItems.size());
+    return true;
+}
+
+void ImpostorRenderer::draw(const FrameSnapshot& frame) {
+    mNumImpostors = 0;
+    if (frame.mImpostors.empty()) return;
+    shared_ptr<Program> base(ProgramManager::get()->getInternalProgram("impostor"));
+    if (!base) return;
+    ProgramImpostor* program = static_cast<ProgramImpostor*>(base.get());
+
+    // one draw call per atlas, one upload per frame
+    mGroups.clear();
+    for (size_t i=0; i<frame.mImpostors.size(); i++) {
+        mGroups[frame.mImpostors[i].mImpostor.get()].push_back(i);
+    }
+    mInstanceData.clear();
+    for (auto it = mGroups.begin(); it != mGroups.end(); it++) {
+        for (size_t i=0; i<it->second.size(); i++) {
+            const FrameSnapshot::ImpostorItem& item = frame.mImpostors[it->second[i]];
+            const float* c = glm::value_ptr(item.mCenter);
+            const float* r = glm::value_ptr(item.mRotation);
+            const float* v = glm::value_ptr(item.mViews);
+            mInstanceData.insert(mInstanceData.end(), c, c + 4);
+            mInstanceData.insert(mInstanceData.end(), r, r + 9);
+            mInstanceData.insert(mInstanceData.end(), v, v + 4);
+        }
+    }
+
+    GLState* state = GLState::get();
+    if (!mInstanceVBO) glGenBuffers(1, &mInstanceVBO);
+    if (!mVAO) glGenVertexArrays(1, &mVAO);
+    if (!mInstanceVBO || !mVAO) {
+        ALOGE("impostor buffers not created");
+        return;
+    }
+    state->bindBuffer(GL_ARRAY_BUFFER, mInstanceVBO);
+    // orphan last frame's storage instead of waiting for the GPU
+    glBufferData(GL_ARRAY_BUFFER, mInstanceData.size() * sizeof(float),
+        &mInstanceData[0], GL_STREAM_DRAW);
+
+    // the quad corners come from gl_VertexID, the quads face the camera
+    // both ways round
+    PipelineState::Desc desc;
+    desc.mProgram = program->getId();
+    desc.mCullFace = false;
+    state->apply(*state->getPipelineState(desc));
+    program->setGrid(Impostor::VIEWS_AROUND, Impostor::VIEWS_UP);
+    state->bindVertexArray(mVAO);
+
+    const GLsizei stride = INSTANCE_NUM_FLOATS * sizeof(float);
+    size_t offset = 0;
+    for (auto it = mGroups.begin(); it != mGroups.end(); it++) {
+        const Impostor* impostor = it->first;
+        GLsizei numInstances = it->second.size();
+        size_t groupOffset = offset;
+        offset += numInstances * stride;
+        if (!impostor->getAlbedo()) continue;
+        state->bindTexture(TEXTURE_UNIT_IMPOSTOR_ALBEDO, GL_TEXTURE_2D, impostor->getAlbedo());
+        state->bindTexture(TEXTURE_UNIT_IMPOSTOR_NORMAL, GL_TEXTURE_2D, impostor->getNormal());
+
+        glEnableVertexAttribArray(IMPOSTOR_ATTRIB_CENTER);
+        glVertexAttribPointer(IMPOSTOR_ATTRIB_CENTER, 4, GL_FLOAT, GL_FALSE, stride,
+            (void*)groupOffset);
+        glVertexAttribDivisor(IMPOSTOR_ATTRIB_CENTER, 1);
+        for (int c=0; c<3; c++) {
+            GLuint loc = IMPOSTOR_ATTRIB_ROTATION + c;
+            glEnableVertexAttribArray(loc);
+            glVertexAttribPointer(loc, 3, GL_FLOAT, GL_FALSE, stride,
+                (void*)(groupOffset + (4 + c * 3) * sizeof(float)));
+            glVertexAttribDivisor(loc, 1);
+        }
+        glEnableVertexAttribArray(IMPOSTOR_ATTRIB_VIEWS);
+        glVertexAttribPointer(IMPOSTOR_ATTRIB_VIEWS, 4, GL_FLOAT, GL_FALSE, stride,
+            (void*)(groupOffset + (4 + 9) * sizeof(float)));
+        glVertexAttribDivisor(IMPOSTOR_ATTRIB_VIEWS, 1);
+
+        glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, numInstances);
+        state->countCall();
+        mNumImpostors += numInstances;
+    }
+    state->bindVertexArray(0);
+    state->bindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+} // namespace dzy
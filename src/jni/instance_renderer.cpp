@@ -0,0 +1,186 @@
+#include "log.h"
+#include "scene.h"
+#include "scene_graph.h"
+#include "mesh.h"
+#include "material.h"
+#include "camera.h"
+#include "light.h"
+#include "program.h"
+#include "gl_state.h"
+#include "material_table.h"
+#include "instance_renderer.h"
+
+using namespace std;
+
+namespace dzy {
+
+// world matrix followed by world normal matrix, column major, and the
+// material index
+static const int INSTANCE_NUM_FLOATS = 16 + 9 + 1;
+
+InstanceRenderer::InstanceRenderer()
+    : mInstanceVBO(0)
+    , mMinInstances(2)
+    , mNumDrawCalls(0)
+    , mNumInstances(0) {
+}
+
+InstanceRenderer::~InstanceRenderer() {
+    TRACE("");
+}
+
+void InstanceRenderer::release() {
+    mGroups.clear();
+    if (mInstanceVBO) GLState::get()->deleteBuffer(mInstanceVBO);
+    mInstanceVBO = 0;
+}
+
+bool InstanceRenderer::add(bool hasLight, const FrameSnapshot& frame, size_t index) {
+    const FrameSnapshot::DrawItem& item = frame.mItems[index];
+    shared_ptr<Mesh> mesh(item.mGeometry->getMesh());
+    shared_ptr<Material> material(item.mMaterial);
+    shared_ptr<Program> program(item.mGeometry->getProgram(material, hasLight, mesh));
+    if (!program || !ProgramManager::get()->getInstancedProgram(program))
+        return false;
+
+    // materials are per instance, only the program has to match
+    Group& group = mGroups[GroupKey(mesh.get(), program.get())];
+    if (group.mItems.empty()) {
+        group.mMesh = mesh;
+        group.mMaterial = material;
+    }
+    group.mItems.push_back(index);
+    return true;
+}
+
+void InstanceRenderer::prepare(const FrameSnapshot& frame, MaterialTable& materials,
+    vector<size_t>& singles) {
+    mNumDrawCalls = 0;
+    mNumInstances = 0;
+
+    // pack the instances of all groups, one upload per frame
+    mInstanceData.clear();
+    for (auto it = mGroups.begin(); it != mGroups.end(); ) {
+        Group& group = it->second;
+        if (group.mItems.empty()) {
+            // nothing of this group drawn last frame, drop the Mesh reference
+            it = mGroups.erase(it);
+            continue;
+        }
+        if ((int)group.mItems.size() < mMinInstances) {
+            singles.insert(singles.end(), group.mItems.begin(), group.mItems.end());
+            group.mItems.clear();
+            it++;
+            continue;
+        }
+        group.mOffset = mInstanceData.size() * sizeof(float);
+        for (size_t i=0; i<group.mItems.size(); i++) {
+            // normal matrices are computed when the frame is built
+            const FrameSnapshot::DrawItem& item = frame.mItems[group.mItems[i]];
+            const float* w = glm::value_ptr(item.mWorld);
+            const float* n = glm::value_ptr(item.mNormal);
+            mInstanceData.insert(mInstanceData.end(), w, w + 16);
+            mInstanceData.insert(mInstanceData.end(), n, n + 9);
+            mInstanceData.push_back((float)materials.getIndex(item.mMaterial));
+        }
+        it++;
+    }
+    if (mInstanceData.empty()) return;
+
+    if (!mInstanceVBO) glGenBuffers(1, &mInstanceVBO);
+    GLState::get()->bindBuffer(GL_ARRAY_BUFFER, mInstanceVBO);
+    // orphan last frame's storage instead of waiting for the GPU
+    glBufferData(GL_ARRAY_BUFFER, mInstanceData.size() * sizeof(float),
+        &mInstanceData[0], GL_STREAM_DRAW);
+    GLState::get()->bindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void InstanceRenderer::draw(const FrameSnapshot& frame, shared_ptr<Camera> camera,
+    shared_ptr<Light> light, ProgramVariant variant, bool depthPrepass) {
+    if (mInstanceData.empty()) return;
+    if (!camera) {
+        ALOGE("No camera available in scene");
+        return;
+    }
+
+    glm::mat4 view = camera->getViewMatrix();
+    glm::mat4 proj = camera->getProjMatrix();
+    for (auto it = mGroups.begin(); it != mGroups.end(); it++) {
+        Group& group = it->second;
+        if (group.mItems.empty()) continue;
+        ProgramManager* programs = ProgramManager::get();
+        shared_ptr<Program> program(programs->getInstancedProgram(
+            frame.mItems[group.mItems[0]].mGeometry->getProgram()));
+        PipelineState::Desc desc;
+        if (variant == PROGRAM_VARIANT_DEPTH) {
+            desc.mColorWrite = false;
+        } else if (depthPrepass && programs->getVariant(program, PROGRAM_VARIANT_DEPTH)) {
+            desc.mDepthFunc = GL_LEQUAL;
+            desc.mDepthWrite = false;
+        }
+        program = programs->getVariant(program, variant);
+        // groups without the variant stay queued for the color pass
+        if (!program && variant != PROGRAM_VARIANT_COLOR) continue;
+        if (program) drawGroup(frame, group, program, desc, view, proj, camera, light);
+        if (variant != PROGRAM_VARIANT_DEPTH) group.mItems.clear();
+    }
+    if (variant == PROGRAM_VARIANT_COLOR) mInstanceData.clear();
+    GLState::get()->bindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void InstanceRenderer::clear() {
+    for (auto it = mGroups.begin(); it != mGroups.end(); it++)
+        it->second.mItems.clear();
+    mInstanceData.clear();
+}
+
+void InstanceRenderer::drawGroup(const FrameSnapshot& frame, Group& group,
+    shared_ptr<Program> program, const PipelineState::Desc& state,
+    glm::mat4& view, glm::mat4& proj, shared_ptr<Camera> camera,
+    shared_ptr<Light> light) {
+    shared_ptr<Geometry> first(frame.mItems[group.mItems[0]].mGeometry);
+
+    PipelineState::Desc desc(state);
+    desc.mProgram = program->getId();
+    GLState::get()->apply(*GLState::get()->getPipelineState(desc));
+    glm::mat4 world(1.f);
+    program->uploadData(camera, light, group.mMaterial, world, view, proj);
+    // every Geometry of the group holds the same data, use the first
+    // one, its vao for the instanced program also keeps the instance
+    // attributes and their divisors away from other programs
+    GLuint vao = first->getVertexArray(program);
+    if (!vao) return;
+    GLState::get()->bindVertexArray(vao);
+
+    const GLsizei stride = INSTANCE_NUM_FLOATS * sizeof(float);
+    GLState::get()->bindBuffer(GL_ARRAY_BUFFER, mInstanceVBO);
+    // the group offset moves every frame, pointers are set again
+    for (int c=0; c<4; c++) {
+        GLuint loc = INSTANCE_ATTRIB_WORLD + c;
+        glEnableVertexAttribArray(loc);
+        glVertexAttribPointer(loc, 4, GL_FLOAT, GL_FALSE, stride,
+            (void*)(group.mOffset + c * 4 * sizeof(float)));
+        glVertexAttribDivisor(loc, 1);
+    }
+    for (int c=0; c<3; c++) {
+        GLuint loc = INSTANCE_ATTRIB_NORMAL + c;
+        glEnableVertexAttribArray(loc);
+        glVertexAttribPointer(loc, 3, GL_FLOAT, GL_FALSE, stride,
+            (void*)(group.mOffset + (16 + c * 3) * sizeof(float)));
+        glVertexAttribDivisor(loc, 1);
+    }
+    glEnableVertexAttribArray(INSTANCE_ATTRIB_MATERIAL);
+    glVertexAttribPointer(INSTANCE_ATTRIB_MATERIAL, 1, GL_FLOAT, GL_FALSE, stride,
+        (void*)(group.mOffset + (16 + 9) * sizeof(float)));
+    glVertexAttribDivisor(INSTANCE_ATTRIB_MATERIAL, 1);
+
+    GLsizei numInstances = group.mItems.size();
+    glDrawElementsInstanced(GL_TRIANGLES, group.mMesh->getNumIndices(),
+        GL_UNSIGNED_INT, (void*)0, numInstances);
+    GLState::get()->countCall();
+    GLState::get()->bindVertexArray(0);
+    mNumDrawCalls++;
+    mNumInstances += numInstances;
+}
+
+} // namespace dzy
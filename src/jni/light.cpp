@@ -29,6 +29,10 @@ Light::Light(
     , mAngleOuterCone       (angleOuterCone) {
 } 
 
+Light::LightSourceType Light::getType() {
+    return mType;
+}
+
 glm::vec3 Light::getPosition() {
     return mPosition;
 }
@@ -0,0 +1,333 @@
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include "log.h"
+#include "camera.h"
+#include "light.h"
+#include "program.h"
+#include "gl_state.h"
+#include "simd.h"
+#include "light_clusters.h"
+
+using namespace std;
+
+namespace dzy {
+
+static const int CLUSTERS_XY = LightClusters::CLUSTERS_X * LightClusters::CLUSTERS_Y;
+static_assert(CLUSTERS_XY % 4 == 0, "clusters of a slice are tested four at a time");
+static_assert(LightClusters::NUM_CLUSTERS < (1 << 16) && LightClusters::MAX_LIGHTS < (1 << 16),
+    "cluster and light index are packed in 32 bits");
+// largest index texture, 2M light to cluster assignments
+static const int MAX_INDEX_ROWS = 2048;
+
+// light types as read by the shader
+static const float LIGHT_TYPE_POINT = 0.f;
+static const float LIGHT_TYPE_DIRECTIONAL = 1.f;
+static const float LIGHT_TYPE_SPOT = 2.f;
+
+LightClusters::LightClusters()
+    : mNear(0.f)
+    , mFar(0.f)
+    , mNumAssignments(0)
+    , mLightTexture(0)
+    , mClusterTexture(0)
+    , mIndexTexture(0)
+    , mIndexRows(0) {
+}
+
+LightClusters::~LightClusters() {
+    TRACE("");
+}
+
+void LightClusters::release() {
+    if (mLightTexture) GLState::get()->deleteTexture(mLightTexture);
+    if (mClusterTexture) GLState::get()->deleteTexture(mClusterTexture);
+    if (mIndexTexture) GLState::get()->deleteTexture(mIndexTexture);
+    mLightTexture = 0;
+    mClusterTexture = 0;
+    mIndexTexture = 0;
+    mIndexRows = 0;
+}
+
+void LightClusters::build(shared_ptr<Camera> camera,
+    const vector<shared_ptr<Light> >& lights,
+    int width, int height, LightGrid& grid) {
+    grid.clear();
+    if (!camera || width <= 0 || height <= 0) return;
+    float near = camera->getNearPlane();
+    float far = camera->getFarPlane();
+    if (near <= 0.f || far <= near) return;
+
+    glm::mat4 proj = camera->getProjMatrix();
+    if (proj != mProj || near != mNear || far != mFar)
+        updateBounds(proj, near, far);
+    glm::mat4 view = camera->getViewMatrix();
+
+    int numLights = min((int)lights.size(), (int)MAX_LIGHTS);
+    grid.mLights.resize(numLights * LIGHT_TEXELS);
+    mPairs.clear();
+    mGlobalLights.clear();
+    for (int i=0; i<numLights; i++) {
+        Light& light = *lights[i];
+        glm::mat4 toEye = view * light.getTransform();
+        glm::vec3 position = glm::vec3(toEye * glm::vec4(light.getPosition(), 1.f));
+        glm::vec3 direction = glm::mat3(toEye) * light.getDirection();
+        if (glm::dot(direction, direction) > 0.f) direction = glm::normalize(direction);
+        glm::vec3 color = light.getColorDiffuse();
+        float c = light.getAttenuationConstant();
+        float l = light.getAttenuationLinear();
+        float q = light.getAttenuationQuadratic();
+        // assimp cone angles are full angles
+        float outer = light.getAngleOuterCone() * 0.5f;
+        float inner = light.getAngleInnerCone() * 0.5f;
+
+        float type = LIGHT_TYPE_POINT;
+        if (light.getType() == Light::LIGHT_SOURCE_DIRECTIONAL)
+            type = LIGHT_TYPE_DIRECTIONAL;
+        else if (light.getType() == Light::LIGHT_SOURCE_SPOT && outer < (float)M_PI * 0.5f)
+            type = LIGHT_TYPE_SPOT;
+
+        // distance where the intensity drops below 1 / LIGHT_CUTOFF,
+        // negative for unlimited
+        float range = -1.f;
+        if (type != LIGHT_TYPE_DIRECTIONAL) {
+            float k = max(color.r, max(color.g, color.b)) * LIGHT_CUTOFF;
+            if (q > 0.f) {
+                float disc = l * l - 4.f * q * (c - k);
+                range = disc > 0.f ? (-l + sqrtf(disc)) / (2.f * q) : 0.f;
+            } else if (l > 0.f) {
+                range = max((k - c) / l, 0.f);
+            }
+        }
+
+        glm::vec4* texels = &grid.mLights[i * LIGHT_TEXELS];
+        texels[0] = glm::vec4(position, range);
+        texels[1] = glm::vec4(color, type);
+        texels[2] = glm::vec4(direction, cosf(outer));
+        texels[3] = glm::vec4(c, l, q, cosf(inner));
+        texels[4] = glm::vec4(light.getColorAmbient(), 1.f);
+
+        glm::vec3 center;
+        float radius;
+        if (range < 0.f)
+            mGlobalLights.push_back(i);
+        else if (getBoundingSphere(texels, center, radius))
+            assignSphere(i, center, radius);
+    }
+
+    // counting sort of the assignments by cluster, lights keep their
+    // order inside a cluster
+    uint32_t numGlobal = mGlobalLights.size();
+    grid.mClusters.assign(NUM_CLUSTERS * 2, 0);
+    for (size_t i=0; i<mPairs.size(); i++) {
+        grid.mClusters[(mPairs[i] >> 16) * 2 + 1]++;
+    }
+    uint32_t offset = 0;
+    for (int i=0; i<NUM_CLUSTERS; i++) {
+        uint32_t count = grid.mClusters[i * 2 + 1] + numGlobal;
+        grid.mClusters[i * 2] = offset;
+        grid.mClusters[i * 2 + 1] = numGlobal;
+        offset += count;
+    }
+    grid.mIndices.resize(offset);
+    for (int i=0; i<NUM_CLUSTERS; i++) {
+        uint32_t* dst = offset ? &grid.mIndices[grid.mClusters[i * 2]] : NULL;
+        for (uint32_t g=0; g<numGlobal; g++) dst[g] = mGlobalLights[g];
+    }
+    for (size_t i=0; i<mPairs.size(); i++) {
+        uint32_t cluster = mPairs[i] >> 16;
+        uint32_t& count = grid.mClusters[cluster * 2 + 1];
+        grid.mIndices[grid.mClusters[cluster * 2] + count++] = mPairs[i] & 0xFFFF;
+    }
+    mNumAssignments = offset;
+
+    float depthScale = CLUSTERS_Z / logf(far / near);
+    grid.mScale = glm::vec4((float)CLUSTERS_X / width, (float)CLUSTERS_Y / height,
+        depthScale, -logf(near) * depthScale);
+    grid.mCount = glm::ivec4(CLUSTERS_X, CLUSTERS_Y, CLUSTERS_Z, 0);
+    grid.mNumLights = numLights;
+    grid.mValid = true;
+}
+
+bool LightClusters::getBoundingSphere(const glm::vec4* texels,
+    glm::vec3& center, float& radius) {
+    glm::vec3 position(texels[0]);
+    float range = texels[0].w;
+    if (range <= 0.f) return false;
+    if (texels[1].w != LIGHT_TYPE_SPOT) {
+        center = position;
+        radius = range;
+        return true;
+    }
+    // bounding sphere of the cone, the one through the tip and the rim
+    // for narrow cones, the one around the rim for wide ones
+    glm::vec3 direction(texels[2]);
+    float cosOuter = texels[2].w;
+    if (cosOuter >= (float)M_SQRT1_2) {
+        radius = range / (2.f * cosOuter);
+        center = position + direction * radius;
+    } else {
+        radius = range * sqrtf(1.f - cosOuter * cosOuter);
+        center = position + direction * range * cosOuter;
+    }
+    return true;
+}
+
+void LightClusters::updateBounds(const glm::mat4& proj, float near, float far) {
+    mProj = proj;
+    mNear = near;
+    mFar = far;
+
+    mSliceDepth.resize(CLUSTERS_Z + 1);
+    for (int k=0; k<=CLUSTERS_Z; k++) {
+        mSliceDepth[k] = near * powf(far / near, (float)k / CLUSTERS_Z);
+    }
+
+    mMinX.resize(NUM_CLUSTERS);
+    mMinY.resize(NUM_CLUSTERS);
+    mMinZ.resize(NUM_CLUSTERS);
+    mMaxX.resize(NUM_CLUSTERS);
+    mMaxY.resize(NUM_CLUSTERS);
+    mMaxZ.resize(NUM_CLUSTERS);
+    // ndc = (p00 * x + p20 * z) / -z, so x = (ndc + p20) * depth / p00
+    float p00 = proj[0][0], p11 = proj[1][1];
+    float p20 = proj[2][0], p21 = proj[2][1];
+    for (int k=0; k<CLUSTERS_Z; k++) {
+        float dn = mSliceDepth[k];
+        float df = mSliceDepth[k + 1];
+        for (int j=0; j<CLUSTERS_Y; j++) {
+            float y0 = (-1.f + 2.f * j / CLUSTERS_Y + p21) / p11;
+            float y1 = (-1.f + 2.f * (j + 1) / CLUSTERS_Y + p21) / p11;
+            for (int i=0; i<CLUSTERS_X; i++) {
+                float x0 = (-1.f + 2.f * i / CLUSTERS_X + p20) / p00;
+                float x1 = (-1.f + 2.f * (i + 1) / CLUSTERS_X + p20) / p00;
+                int c = k * CLUSTERS_XY + j * CLUSTERS_X + i;
+                mMinX[c] = min(x0 * dn, x0 * df);
+                mMaxX[c] = max(x1 * dn, x1 * df);
+                mMinY[c] = min(y0 * dn, y0 * df);
+                mMaxY[c] = max(y1 * dn, y1 * df);
+                mMinZ[c] = -df;
+                mMaxZ[c] = -dn;
+            }
+        }
+    }
+}
+
+void LightClusters::assignSphere(uint32_t light, const glm::vec3& center, float radius) {
+    float depth = -center.z;
+    if (depth + radius < mNear || depth - radius > mFar) return;
+
+    // only the slices the sphere reaches in depth are tested
+    float logRatio = logf(mFar / mNear);
+    float nearest = max(depth - radius, mNear);
+    float farthest = min(depth + radius, mFar);
+    int k0 = (int)(logf(nearest / mNear) / logRatio * CLUSTERS_Z);
+    int k1 = (int)(logf(farthest / mNear) / logRatio * CLUSTERS_Z);
+    k0 = max(0, min(k0, CLUSTERS_Z - 1));
+    k1 = max(0, min(k1, CLUSTERS_Z - 1));
+
+    const Float4 zero(0.f);
+    const Float4 cx(center.x), cy(center.y), cz(center.z);
+    const Float4 r2(radius * radius);
+    for (int k=k0; k<=k1; k++) {
+        int base = k * CLUSTERS_XY;
+        for (int t=0; t<CLUSTERS_XY; t+=4) {
+            int c = base + t;
+            // distance from the sphere center to the cluster box
+            Float4 dx = Float4::max(Float4::load(&mMinX[c]) - cx, zero)
+                + Float4::max(cx - Float4::load(&mMaxX[c]), zero);
+            Float4 dy = Float4::max(Float4::load(&mMinY[c]) - cy, zero)
+                + Float4::max(cy - Float4::load(&mMaxY[c]), zero);
+            Float4 dz = Float4::max(Float4::load(&mMinZ[c]) - cz, zero)
+                + Float4::max(cz - Float4::load(&mMaxZ[c]), zero);
+            Float4 inside = (dx * dx + dy * dy + dz * dz) < r2;
+            if (!Float4::anyTrue(inside)) continue;
+
+            float mask[4];
+            inside.store(mask);
+            for (int lane=0; lane<4; lane++) {
+                uint32_t bits;
+                memcpy(&bits, &mask[lane], sizeof(bits));
+                if (bits) mPairs.push_back((uint32_t)(c + lane) << 16 | light);
+            }
+        }
+    }
+}
+
+bool LightClusters::createTextures() {
+    GLuint textures[2] = { 0, 0 };
+    glGenTextures(2, textures);
+    if (!textures[0] || !textures[1]) {
+        ALOGE("glGenTextures error");
+        return false;
+    }
+    mLightTexture = textures[0];
+    mClusterTexture = textures[1];
+
+    // read with texelFetch only, integer textures must not be filtered
+    GLState::get()->bindTexture(TEXTURE_UNIT_CLUSTER_LIGHTS, GL_TEXTURE_2D, mLightTexture);
+    glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA32F, LIGHT_TEXELS, MAX_LIGHTS);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    GLState::get()->bindTexture(TEXTURE_UNIT_CLUSTER_GRID, GL_TEXTURE_2D, mClusterTexture);
+    glTexStorage2D(GL_TEXTURE_2D, 1, GL_RG32UI, CLUSTERS_XY, CLUSTERS_Z);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    return true;
+}
+
+bool LightClusters::upload(const LightGrid& grid) {
+    if (!grid.isValid()) return false;
+    if (!mLightTexture && !createTextures()) return false;
+
+    int numIndices = grid.mIndices.size();
+    int rows = max(1, (numIndices + INDEX_TEXTURE_WIDTH - 1) / INDEX_TEXTURE_WIDTH);
+    if (rows > MAX_INDEX_ROWS) {
+        ALOGW("light clusters: %d assignments exceed the index texture", numIndices);
+        return false;
+    }
+    if (rows > mIndexRows) {
+        // immutable storage, grown to the next power of two
+        if (mIndexTexture) GLState::get()->deleteTexture(mIndexTexture);
+        mIndexRows = 1;
+        while (mIndexRows < rows) mIndexRows <<= 1;
+        glGenTextures(1, &mIndexTexture);
+        if (!mIndexTexture) {
+            ALOGE("glGenTextures error");
+            mIndexRows = 0;
+            return false;
+        }
+        GLState::get()->bindTexture(TEXTURE_UNIT_CLUSTER_INDICES, GL_TEXTURE_2D, mIndexTexture);
+        glTexStorage2D(GL_TEXTURE_2D, 1, GL_R32UI, INDEX_TEXTURE_WIDTH, mIndexRows);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    }
+
+    GLState* state = GLState::get();
+    state->bindTexture(TEXTURE_UNIT_CLUSTER_LIGHTS, GL_TEXTURE_2D, mLightTexture);
+    if (grid.mNumLights > 0) {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, LIGHT_TEXELS, grid.mNumLights,
+            GL_RGBA, GL_FLOAT, &grid.mLights[0]);
+        state->countCall();
+    }
+    state->bindTexture(TEXTURE_UNIT_CLUSTER_GRID, GL_TEXTURE_2D, mClusterTexture);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, CLUSTERS_XY, CLUSTERS_Z,
+        GL_RG_INTEGER, GL_UNSIGNED_INT, &grid.mClusters[0]);
+    state->countCall();
+    state->bindTexture(TEXTURE_UNIT_CLUSTER_INDICES, GL_TEXTURE_2D, mIndexTexture);
+    int fullRows = numIndices / INDEX_TEXTURE_WIDTH;
+    int rest = numIndices % INDEX_TEXTURE_WIDTH;
+    if (fullRows > 0) {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, INDEX_TEXTURE_WIDTH, fullRows,
+            GL_RED_INTEGER, GL_UNSIGNED_INT, &grid.mIndices[0]);
+        state->countCall();
+    }
+    if (rest > 0) {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, fullRows, rest, 1,
+            GL_RED_INTEGER, GL_UNSIGNED_INT, &grid.mIndices[fullRows * INDEX_TEXTURE_WIDTH]);
+        state->countCall();
+    }
+    return true;
+}
+
+} // namespace dzy
@@ -10,10 +10,13 @@ Material::Material(const string& name)
     , mAmbient(1.f, 1.f, 1.f)
     , mEmission(0.f, 0.f, 0.f)
     , mShininess(0.f)
-    , mFlags(0) {
+    , mOpacity(1.f)
+    , mFlags(0)
+    , mVersion(0) {
 }
 
-Material::Material(const Material& rhs) {
+Material::Material(const Material& rhs)
+    : mVersion(0) {
     operator=(rhs);
 }
 
@@ -25,7 +28,9 @@ Material& Material::operator =(const Material& rhs) {
         mAmbient    = rhs.mAmbient;
         mEmission   = rhs.mEmission;
         mShininess  = rhs.mShininess;
+        mOpacity    = rhs.mOpacity;
         mFlags      = rhs.mFlags;
+        mVersion++;
     }
     return *this;
 }
@@ -48,11 +53,13 @@ glm::vec3 Material::getAmbient() const {
 void Material::setAmbient(const glm::vec3& color) {
     mFlags |= F_AMBIENT;
     mAmbient = color;
+    mVersion++;
 }
 
 void Material::clearAmbient() {
     mFlags &= ~F_AMBIENT;
     mAmbient = glm::vec3(1.f, 1.f, 1.f);
+    mVersion++;
 }
 
 bool Material::hasDiffuse() const {
@@ -66,11 +73,13 @@ glm::vec3 Material::getDiffuse() const {
 void Material::setDiffuse(const glm::vec3& color) {
     mFlags |= F_DIFFUSE;
     mDiffuse = color;
+    mVersion++;
 }
 
 void Material::clearDiffuse() {
     mFlags &= ~F_DIFFUSE;
     mDiffuse = glm::vec3(0.f, 0.f, 0.f);
+    mVersion++;
 }
 
 bool Material::hasSpecular() const {
@@ -84,11 +93,13 @@ glm::vec3 Material::getSpecular() const {
 void Material::setSpecular(const glm::vec3& color) {
     mFlags |= F_SPECULAR;
     mSpecular = color;
+    mVersion++;
 }
 
 void Material::clearSpecular() {
     mFlags &= ~F_SPECULAR;
     mSpecular= glm::vec3(0.f, 0.f, 0.f);
+    mVersion++;
 }
 
 bool Material::hasEmission() const {
@@ -102,11 +113,13 @@ glm::vec3 Material::getEmission() const {
 void Material::setEmission(const glm::vec3& color) {
     mFlags |= F_EMISSION;
     mEmission = color;
+    mVersion++;
 }
 
 void Material::clearEmission() {
     mFlags &= ~F_EMISSION;
     mEmission = glm::vec3(0.f, 0.f, 0.f);
+    mVersion++;
 }
 
 float Material::getShininess() const {
@@ -115,6 +128,20 @@ float Material::getShininess() const {
 
 void Material::setShininess(float shininess) {
     mShininess = shininess;
+    mVersion++;
+}
+
+float Material::getOpacity() const {
+    return mOpacity;
+}
+
+void Material::setOpacity(float opacity) {
+    mOpacity = opacity;
+    mVersion++;
+}
+
+bool Material::isTransparent() const {
+    return mOpacity < 1.f;
 }
 
 } //namespace
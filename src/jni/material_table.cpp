@@ -0,0 +1,126 @@
+#include "log.h"
+#include "scene.h"
+#include "material.h"
+#include "program.h"
+#include "gl_state.h"
+#include "material_table.h"
+
+using namespace std;
+
+namespace dzy {
+
+MaterialTable::MaterialTable()
+    : mNextIndex(1)
+    , mUBO(0)
+    , mFullLogged(false)
+    , mNumWrites(0) {
+}
+
+MaterialTable::~MaterialTable() {
+    TRACE("");
+}
+
+void MaterialTable::release() {
+    if (mUBO) GLState::get()->deleteBuffer(mUBO);
+    mUBO = 0;
+    mEntries.clear();
+    mFreeIndices.clear();
+    mNextIndex = 1;
+    mScene.reset();
+}
+
+void MaterialTable::setScene(shared_ptr<Scene> scene) {
+    if (mScene.lock() == scene) return;
+    mScene = scene;
+    if (!mUBO && !createBuffer()) return;
+
+    MeasureDuration duration;
+    for (unsigned int i=0; i<scene->getNumMaterials(); i++) {
+        getIndex(scene->getMaterial(i));
+    }
+    DEBUG(Log::F_GLES, "material table: %d entries, %lld us",
+        (int)mEntries.size(), duration.getMicroSeconds());
+}
+
+int MaterialTable::getIndex(shared_ptr<Material> material) {
+    if (!material) return 0;
+    if (!mUBO && !createBuffer()) return 0;
+
+    auto it = mEntries.find(material.get());
+    if (it != mEntries.end()) {
+        Entry& entry = it->second;
+        // a new Material at the address of a deleted one takes over
+        // its entry
+        if (entry.mVersion != material->getVersion() || entry.mMaterial.expired()) {
+            entry.mVersion = material->getVersion();
+            entry.mMaterial = material;
+            write(entry.mIndex, *material);
+        }
+        return entry.mIndex;
+    }
+
+    int index = allocate();
+    if (index == 0) return 0;
+    Entry entry = { index, material->getVersion(), material };
+    mEntries[material.get()] = entry;
+    write(index, *material);
+    return index;
+}
+
+bool MaterialTable::createBuffer() {
+    glGenBuffers(1, &mUBO);
+    if (!mUBO) {
+        ALOGE("glGenBuffers error");
+        return false;
+    }
+    vector<MaterialBlock> blocks(MAX_MATERIALS);
+    Material defaultMaterial;
+    GLState::get()->bindBuffer(GL_UNIFORM_BUFFER, mUBO);
+    glBufferData(GL_UNIFORM_BUFFER, MAX_MATERIALS * sizeof(MaterialBlock),
+        &blocks[0], GL_DYNAMIC_DRAW);
+    write(0, defaultMaterial);
+    GLState::get()->bindBufferBase(GL_UNIFORM_BUFFER, UNIFORM_BINDING_MATERIALS, mUBO);
+    return true;
+}
+
+int MaterialTable::allocate() {
+    if (mFreeIndices.empty() && mNextIndex >= MAX_MATERIALS) {
+        // reclaim the entries of deleted materials
+        for (auto it = mEntries.begin(); it != mEntries.end(); ) {
+            if (it->second.mMaterial.expired()) {
+                mFreeIndices.push_back(it->second.mIndex);
+                it = mEntries.erase(it);
+            } else {
+                it++;
+            }
+        }
+    }
+    if (!mFreeIndices.empty()) {
+        int index = mFreeIndices.back();
+        mFreeIndices.pop_back();
+        return index;
+    }
+    if (mNextIndex < MAX_MATERIALS) return mNextIndex++;
+
+    if (!mFullLogged) {
+        ALOGW("material table full, %d entries, drawing with the default material",
+            MAX_MATERIALS);
+        mFullLogged = true;
+    }
+    return 0;
+}
+
+void MaterialTable::write(int index, const Material& material) {
+    MaterialBlock block;
+    block.mDiffuse = glm::vec4(material.getDiffuse(), material.getOpacity());
+    block.mSpecular = glm::vec4(material.getSpecular(), material.getShininess());
+    block.mAmbient = glm::vec4(material.getAmbient(), 1.f);
+    block.mEmission = glm::vec4(material.getEmission(), 1.f);
+    GLState::get()->bindBuffer(GL_UNIFORM_BUFFER, mUBO);
+    glBufferSubData(GL_UNIFORM_BUFFER, index * sizeof(MaterialBlock),
+        sizeof(MaterialBlock), &block);
+    GLState::get()->countCall();
+    mNumWrites++;
+}
+
+} // namespace dzy
@@ -102,7 +102,8 @@ Mesh::Mesh(PrimitiveType type, unsigned int numVertices, const string &name)
     , mBitangentBytesComponent  (0)
     , mHasBitangent             (false)
     , mTransformedPosOffset     (-1)
-    , mTransformedNormalOffset  (-1) {
+    , mTransformedNormalOffset  (-1)
+    , mBoundingBoxValid         (false) {
     memset(&mColorOffset[0], 0, MAX_COLOR_SETS * sizeof(unsigned int));
     memset(&mColorNumComponents[0], 0, MAX_COLOR_SETS * sizeof(unsigned int));
     memset(&mColorBytesComponent[0], 0, MAX_COLOR_SETS * sizeof(unsigned int));
@@ -262,6 +263,14 @@ void * Mesh::getColorBuf(int channel) {
     return mMeshData.getBuf(mColorOffset[channel]);
 }
 
+unsigned int Mesh::getTextureCoordNumComponent(int channel) const {
+    return mTextureCoordNumComponents[channel];
+}
+
+unsigned int Mesh::getTextureCoordBufStride(int channel) const {
+    return mTextureCoordNumComponents[channel] * mTextureCoordBytesComponent[channel];
+}
+
 unsigned int Mesh::getTextureCoordBufSize(int channel) const {
     return mTextureCoordBytesComponent[channel] *
         mTextureCoordNumComponents[channel] * mNumVertices;
@@ -274,6 +283,14 @@ unsigned int Mesh::getTextureCoordBufSize() const {
     return totalSize;
 }
 
+unsigned int Mesh::getTextureCoordOffset(int channel) const {
+    return mTextureCoordOffset[channel];
+}
+
+void* Mesh::getTextureCoordBuf(int channel) {
+    return mMeshData.getBuf(mTextureCoordOffset[channel]);
+}
+
 unsigned int Mesh::getNormalNumComponent() const {
     return mNormalNumComponents;
 }
@@ -395,6 +412,25 @@ void Mesh::appendVertexPositions(
     mPosNumComponents = numComponents;
     mPosBytesComponent = bytesEachComponent;
     mHasPos = true;
+    mBoundingBoxValid = false;
+}
+
+const AABB& Mesh::getBoundingBox() {
+    if (mBoundingBoxValid) return mBoundingBox;
+
+    mBoundingBox.reset();
+    unsigned int component = getPositionNumComponent();
+    if (hasVertexPositions() && component >= 2 && mPosBytesComponent == sizeof(float)) {
+        float* pos = (float*)getOriginalPositionBuf();
+        for (unsigned int i=0; i<mNumVertices; i++) {
+            float* p = pos + component * i;
+            mBoundingBox.expand(glm::vec3(p[0], p[1], component > 2 ? p[2] : 0.f));
+        }
+    } else {
+        ALOGW("%s: unsupported position format for bounding box", getName().c_str());
+    }
+    mBoundingBoxValid = true;
+    return mBoundingBox;
 }
 
 void Mesh::appendVertexColors(
@@ -0,0 +1,379 @@
+#include <float.h>
+#include <math.h>
+#include <algorithm>
+#include "log.h"
+#include "mesh.h"
+#include "simd.h"
+#include "occlusion_culler.h"
+
+using namespace std;
+
+namespace dzy {
+
+// log the occlusion rate every this many frames
+static const int STATS_INTERVAL = 60;
+// vertices closer than this in clip w are treated as behind the camera
+static const float W_EPSILON = 1e-5f;
+
+OcclusionCuller::OcclusionCuller(int width, int height)
+    : mWidth((width + TILE_SIZE - 1) / TILE_SIZE * TILE_SIZE)
+    , mHeight((height + TILE_SIZE - 1) / TILE_SIZE * TILE_SIZE)
+    , mRunning(false)
+    , mBusy(false)
+    , mCameraTolerance(0.05f)
+    , mOcclusionRate(0.f)
+    , mNumOccluded(0)
+    , mNumTested(0)
+    , mFrameCount(0) {
+    mTilesX = mWidth / TILE_SIZE;
+    mTilesY = mHeight / TILE_SIZE;
+    mDepth.resize(mWidth * mHeight);
+    mTileMaxDepth.resize(mTilesX * mTilesY);
+    mPending.mValid = false;
+    mCurrent.mValid = false;
+}
+
+OcclusionCuller::~OcclusionCuller() {
+    TRACE("");
+    stop();
+}
+
+void OcclusionCuller::start() {
+    if (mRunning) return;
+    mRunning = true;
+    mBusy = false;
+    mWorker = thread(&OcclusionCuller::workerLoop, this);
+}
+
+void OcclusionCuller::stop() {
+    {
+        lock_guard<mutex> lock(mMutex);
+        if (!mRunning) return;
+        mRunning = false;
+    }
+    mCondition.notify_all();
+    if (mWorker.joinable()) mWorker.join();
+    mBusy = false;
+    mJob.mOccluders.clear();
+    mJob.mOccludees.clear();
+    mPending.mValid = false;
+    mCurrent.mValid = false;
+}
+
+void OcclusionCuller::workerLoop() {
+    unique_lock<mutex> lock(mMutex);
+    while (true) {
+        mCondition.wait(lock, [this] { return !mRunning || mBusy; });
+        if (!mRunning) break;
+        // main thread leaves mJob and mPending alone while busy
+        lock.unlock();
+        process(mJob, mPending);
+        lock.lock();
+        mBusy = false;
+        mCondition.notify_all();
+    }
+}
+
+void OcclusionCuller::beginFrame(const glm::mat4& viewProj) {
+    if (!mRunning) {
+        mCurrent.mValid = false;
+        return;
+    }
+
+    {
+        unique_lock<mutex> lock(mMutex);
+        mCondition.wait(lock, [this] { return !mBusy; });
+        swap(mCurrent, mPending);
+        mPending.mValid = false;
+    }
+
+    if (!mCurrent.mValid) return;
+
+    float diff = 0.f;
+    for (int i=0; i<4; i++) {
+        for (int j=0; j<4; j++) {
+            diff = max(diff, fabsf(viewProj[i][j] - mCurrent.mViewProj[i][j]));
+        }
+    }
+    if (diff > mCameraTolerance) {
+        // camera moved too far, last frame result may hide new objects
+        mCurrent.mValid = false;
+        return;
+    }
+
+    mNumOccluded = mCurrent.mNumOccluded;
+    mNumTested = mCurrent.mNumTested;
+    mOcclusionRate = mNumTested > 0 ? (float)mNumOccluded / mNumTested : 0.f;
+    if (++mFrameCount >= STATS_INTERVAL) {
+        mFrameCount = 0;
+        DEBUG(Log::F_GENERIC, "occlusion culling: %d/%d occluded, rate %.1f%%",
+            mNumOccluded, mNumTested, mOcclusionRate * 100.f);
+    }
+}
+
+void OcclusionCuller::submit(const glm::mat4& viewProj,
+    vector<Occluder>& occluders, vector<Occludee>& occludees) {
+    {
+        lock_guard<mutex> lock(mMutex);
+        if (!mRunning || mBusy) {
+            occluders.clear();
+            occludees.clear();
+            return;
+        }
+        mJob.mViewProj = viewProj;
+        mJob.mOccluders.swap(occluders);
+        mJob.mOccludees.swap(occludees);
+        mBusy = true;
+    }
+    occluders.clear();
+    occludees.clear();
+    mCondition.notify_all();
+}
+
+bool OcclusionCuller::isOccluded(int proxy, const AABB& box) const {
+    if (!mCurrent.mValid) return false;
+    if (proxy < 0 || proxy >= (int)mCurrent.mOccluded.size()) return false;
+    return mCurrent.mOccluded[proxy] && mCurrent.mBoxes[proxy].contains(box);
+}
+
+void OcclusionCuller::process(Job& job, Result& result) {
+    clear();
+    for (size_t i=0; i<job.mOccluders.size(); i++) {
+        rasterizeOccluder(job.mOccluders[i], job.mViewProj);
+    }
+    buildHiZ();
+
+    int maxProxy = -1;
+    for (size_t i=0; i<job.mOccludees.size(); i++) {
+        maxProxy = max(maxProxy, job.mOccludees[i].mProxy);
+    }
+    result.mViewProj = job.mViewProj;
+    result.mOccluded.assign(maxProxy + 1, 0);
+    result.mBoxes.resize(maxProxy + 1);
+    result.mNumOccluded = 0;
+    result.mNumTested = job.mOccludees.size();
+    for (size_t i=0; i<job.mOccludees.size(); i++) {
+        const Occludee& occludee = job.mOccludees[i];
+        result.mBoxes[occludee.mProxy] = occludee.mBox;
+        if (!job.mOccluders.empty() && testOccludee(occludee.mBox, job.mViewProj)) {
+            result.mOccluded[occludee.mProxy] = 1;
+            result.mNumOccluded++;
+        }
+    }
+    result.mValid = true;
+
+    // drop mesh references as soon as possible
+    job.mOccluders.clear();
+    job.mOccludees.clear();
+}
+
+void OcclusionCuller::clear() {
+    fill(mDepth.begin(), mDepth.end(), 1.f);
+}
+
+void OcclusionCuller::rasterizeOccluder(const Occluder& occluder, const glm::mat4& viewProj) {
+    shared_ptr<Mesh> mesh(occluder.mMesh);
+    if (!mesh || !mesh->hasVertexPositions() || !mesh->hasFaces()) return;
+    if (mesh->getPositionNumComponent() != 3 || mesh->getPositionBufStride() != 3 * sizeof(float)) {
+        ALOGW("%s: unsupported occluder position format", mesh->getName().c_str());
+        return;
+    }
+
+    glm::mat4 mvp = viewProj * occluder.mWorld;
+    const float* pos = (const float*)mesh->getOriginalPositionBuf();
+    const unsigned int* indices = (const unsigned int*)mesh->getIndexBuf();
+    unsigned int numVertices = mesh->getNumVertices();
+    unsigned int numIndices = mesh->getNumIndices();
+
+    vector<glm::vec4> clipVertices(numVertices);
+    for (unsigned int i=0; i<numVertices; i++) {
+        clipVertices[i] = mvp * glm::vec4(pos[i*3], pos[i*3+1], pos[i*3+2], 1.f);
+    }
+
+    for (unsigned int i=0; i+2<numIndices; i+=3) {
+        glm::vec4 tri[3] = {
+            clipVertices[indices[i]],
+            clipVertices[indices[i+1]],
+            clipVertices[indices[i+2]]
+        };
+
+        // trivially reject triangles outside one of the side planes
+        if ((tri[0].x >  tri[0].w && tri[1].x >  tri[1].w && tri[2].x >  tri[2].w) ||
+            (tri[0].x < -tri[0].w && tri[1].x < -tri[1].w && tri[2].x < -tri[2].w) ||
+            (tri[0].y >  tri[0].w && tri[1].y >  tri[1].w && tri[2].y >  tri[2].w) ||
+            (tri[0].y < -tri[0].w && tri[1].y < -tri[1].w && tri[2].y < -tri[2].w))
+            continue;
+
+        // distance to the near plane z = -w
+        float d[3];
+        int numInside = 0;
+        for (int j=0; j<3; j++) {
+            d[j] = tri[j].z + tri[j].w;
+            if (d[j] > W_EPSILON) numInside++;
+        }
+        if (numInside == 0) continue;
+        if (numInside == 3) {
+            rasterizeTriangle(tri);
+            continue;
+        }
+
+        // clip against the near plane, results in a triangle or a quad
+        glm::vec4 poly[4];
+        int n = 0;
+        for (int j=0; j<3; j++) {
+            int k = (j + 1) % 3;
+            bool inJ = d[j] > W_EPSILON;
+            bool inK = d[k] > W_EPSILON;
+            if (inJ) poly[n++] = tri[j];
+            if (inJ != inK) {
+                float t = (d[j] - W_EPSILON) / (d[j] - d[k]);
+                poly[n++] = tri[j] + (tri[k] - tri[j]) * t;
+            }
+        }
+        for (int j=1; j+1<n; j++) {
+            glm::vec4 fan[3] = { poly[0], poly[j], poly[j+1] };
+            rasterizeTriangle(fan);
+        }
+    }
+}
+
+void OcclusionCuller::rasterizeTriangle(const glm::vec4* clip) {
+    float x[3], y[3], z[3];
+    for (int i=0; i<3; i++) {
+        float invW = 1.f / clip[i].w;
+        x[i] = (clip[i].x * invW * 0.5f + 0.5f) * mWidth;
+        y[i] = (clip[i].y * invW * 0.5f + 0.5f) * mHeight;
+        z[i] = clip[i].z * invW * 0.5f + 0.5f;
+    }
+
+    // counter clockwise front faces have positive area, cull the rest
+    float area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+    if (area <= 0.f) return;
+
+    int minX = max(0, (int)floorf(min(min(x[0], x[1]), x[2])));
+    int maxX = min(mWidth - 1, (int)ceilf(max(max(x[0], x[1]), x[2])));
+    int minY = max(0, (int)floorf(min(min(y[0], y[1]), y[2])));
+    int maxY = min(mHeight - 1, (int)ceilf(max(max(y[0], y[1]), y[2])));
+    if (minX > maxX || minY > maxY) return;
+    // step four pixels at a time, width is a multiple of four
+    minX &= ~3;
+
+    // edge i is opposite to vertex i, E(x, y) = A * x + B * y + C
+    float A[3], B[3], C[3];
+    for (int i=0; i<3; i++) {
+        int a = (i + 1) % 3;
+        int b = (i + 2) % 3;
+        A[i] = y[a] - y[b];
+        B[i] = x[b] - x[a];
+        C[i] = -(A[i] * x[a] + B[i] * y[a]);
+    }
+
+    // depth is affine in screen space
+    float invArea = 1.f / area;
+    float zA = (z[0] * A[0] + z[1] * A[1] + z[2] * A[2]) * invArea;
+    float zB = (z[0] * B[0] + z[1] * B[1] + z[2] * B[2]) * invArea;
+    float zC = (z[0] * C[0] + z[1] * C[1] + z[2] * C[2]) * invArea;
+
+    const Float4 zero(0.f);
+    const Float4 laneOffset(0.5f, 1.5f, 2.5f, 3.5f);
+    Float4 A4[3], step4[3];
+    for (int i=0; i<3; i++) {
+        A4[i] = Float4(A[i]);
+        step4[i] = Float4(A[i] * 4.f);
+    }
+    Float4 zA4(zA);
+    Float4 zStep4(zA * 4.f);
+
+    for (int py=minY; py<=maxY; py++) {
+        float cy = py + 0.5f;
+        Float4 xs = Float4((float)minX) + laneOffset;
+        Float4 e0 = A4[0] * xs + Float4(B[0] * cy + C[0]);
+        Float4 e1 = A4[1] * xs + Float4(B[1] * cy + C[1]);
+        Float4 e2 = A4[2] * xs + Float4(B[2] * cy + C[2]);
+        Float4 depth = zA4 * xs + Float4(zB * cy + zC);
+
+        float* row = &mDepth[py * mWidth];
+        for (int px=minX; px<=maxX; px+=4) {
+            Float4 mask = (e0 >= zero) & (e1 >= zero) & (e2 >= zero);
+            if (Float4::anyTrue(mask)) {
+                Float4 old = Float4::load(row + px);
+                Float4::select(mask, Float4::min(old, depth), old).store(row + px);
+            }
+            e0 = e0 + step4[0];
+            e1 = e1 + step4[1];
+            e2 = e2 + step4[2];
+            depth = depth + zStep4;
+        }
+    }
+}
+
+void OcclusionCuller::buildHiZ() {
+    for (int ty=0; ty<mTilesY; ty++) {
+        for (int tx=0; tx<mTilesX; tx++) {
+            Float4 tileMax(0.f);
+            for (int j=0; j<TILE_SIZE; j++) {
+                const float* row = &mDepth[(ty * TILE_SIZE + j) * mWidth + tx * TILE_SIZE];
+                for (int i=0; i<TILE_SIZE; i+=4) {
+                    tileMax = Float4::max(tileMax, Float4::load(row + i));
+                }
+            }
+            mTileMaxDepth[ty * mTilesX + tx] = tileMax.maxElement();
+        }
+    }
+}
+
+bool OcclusionCuller::testOccludee(const AABB& box, const glm::mat4& viewProj) const {
+    glm::vec3 bmin = box.getMin();
+    glm::vec3 bmax = box.getMax();
+    float minX = FLT_MAX, minY = FLT_MAX, minZ = FLT_MAX;
+    float maxX = -FLT_MAX, maxY = -FLT_MAX;
+    for (int i=0; i<8; i++) {
+        glm::vec4 corner(
+            (i & 1) ? bmax.x : bmin.x,
+            (i & 2) ? bmax.y : bmin.y,
+            (i & 4) ? bmax.z : bmin.z,
+            1.f);
+        glm::vec4 clip = viewProj * corner;
+        // crossing the near plane, can't be occluded
+        if (clip.w <= W_EPSILON || clip.z < -clip.w) return false;
+        float invW = 1.f / clip.w;
+        float sx = (clip.x * invW * 0.5f + 0.5f) * mWidth;
+        float sy = (clip.y * invW * 0.5f + 0.5f) * mHeight;
+        float sz = clip.z * invW * 0.5f + 0.5f;
+        minX = min(minX, sx); maxX = max(maxX, sx);
+        minY = min(minY, sy); maxY = max(maxY, sy);
+        minZ = min(minZ, sz);
+    }
+
+    int x0 = max(0, (int)floorf(minX));
+    int x1 = min(mWidth - 1, (int)floorf(maxX));
+    int y0 = max(0, (int)floorf(minY));
+    int y1 = min(mHeight - 1, (int)floorf(maxY));
+    if (x0 > x1 || y0 > y1) return false;
+
+    const Float4 nearest(minZ);
+    const Float4 laneIndex(0.f, 1.f, 2.f, 3.f);
+    const Float4 first((float)x0);
+    const Float4 last((float)x1);
+    for (int ty=y0/TILE_SIZE; ty<=y1/TILE_SIZE; ty++) {
+        for (int tx=x0/TILE_SIZE; tx<=x1/TILE_SIZE; tx++) {
+            // the whole tile is nearer than the occludee
+            if (minZ > mTileMaxDepth[ty * mTilesX + tx]) continue;
+
+            int rowBegin = max(y0, ty * TILE_SIZE);
+            int rowEnd = min(y1, ty * TILE_SIZE + TILE_SIZE - 1);
+            for (int py=rowBegin; py<=rowEnd; py++) {
+                const float* row = &mDepth[py * mWidth];
+                for (int px=tx*TILE_SIZE; px<(tx+1)*TILE_SIZE; px+=4) {
+                    Float4 xs = Float4((float)px) + laneIndex;
+                    Float4 mask = (xs >= first) & (last >= xs);
+                    Float4 farther = Float4::load(row + px) >= nearest;
+                    if (Float4::anyTrue(mask & farther)) return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+} // namespace dzy
@@ -0,0 +1,215 @@
+#include <algorithm>
+#define GLM_FORCE_RADIANS
+#include <glm/gtc/matrix_transform.hpp>
+#include "log.h"
+#include "program.h"
+#include "bvh.h"
+#include "gl_state.h"
+#include "occlusion_query.h"
+
+using namespace std;
+
+namespace dzy {
+
+// boxes are inflated so they never z-fight with the Geometry inside
+static const float BOX_INFLATE_RATIO = 0.01f;
+static const float BOX_INFLATE_MIN = 0.01f;
+
+OcclusionQueryManager::OcclusionQueryManager()
+    : mBoxVBO(0)
+    , mBoxIBO(0)
+    , mFrame(0)
+    , mVisibleInterval(8)
+    , mHiddenInterval(1)
+    , mNumTested(0)
+    , mNumHidden(0)
+    , mNumQueries(0)
+    , mOcclusionRate(0.f) {
+}
+
+OcclusionQueryManager::~OcclusionQueryManager() {
+    TRACE("");
+}
+
+void OcclusionQueryManager::release() {
+    for (size_t i=0; i<mStates.size(); i++) {
+        if (mStates[i].mQuery) glDeleteQueries(1, &mStates[i].mQuery);
+    }
+    mStates.clear();
+    mPending.clear();
+    mScheduled.clear();
+    if (mBoxVBO) GLState::get()->deleteBuffer(mBoxVBO);
+    if (mBoxIBO) GLState::get()->deleteBuffer(mBoxIBO);
+    mBoxVBO = 0;
+    mBoxIBO = 0;
+}
+
+bool OcclusionQueryManager::createBoxMesh() {
+    static const GLfloat vertices[] = {
+        -1.f, -1.f, -1.f,
+         1.f, -1.f, -1.f,
+         1.f,  1.f, -1.f,
+        -1.f,  1.f, -1.f,
+        -1.f, -1.f,  1.f,
+         1.f, -1.f,  1.f,
+         1.f,  1.f,  1.f,
+        -1.f,  1.f,  1.f,
+    };
+    static const GLubyte indices[] = {
+        0, 2, 1,  0, 3, 2,      // back
+        4, 5, 6,  4, 6, 7,      // front
+        0, 1, 5,  0, 5, 4,      // bottom
+        3, 7, 6,  3, 6, 2,      // top
+        0, 4, 7,  0, 7, 3,      // left
+        1, 2, 6,  1, 6, 5,      // right
+    };
+
+    glGenBuffers(1, &mBoxVBO);
+    glGenBuffers(1, &mBoxIBO);
+    if (!mBoxVBO || !mBoxIBO) {
+        ALOGE("failed to create occlusion query box buffers");
+        return false;
+    }
+    GLState* glState = GLState::get();
+    glState->bindVertexArray(0);
+    glState->bindBuffer(GL_ARRAY_BUFFER, mBoxVBO);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
+    glState->bindBuffer(GL_ELEMENT_ARRAY_BUFFER, mBoxIBO);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
+    glState->bindBuffer(GL_ARRAY_BUFFER, 0);
+    glState->bindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    return true;
+}
+
+void OcclusionQueryManager::beginFrame() {
+    mFrame++;
+    mOcclusionRate = mNumTested > 0 ? (float)mNumHidden / mNumTested : 0.f;
+    mNumTested = 0;
+    mNumHidden = 0;
+
+    // never wait, results not available yet are picked up next frame
+    size_t n = 0;
+    for (size_t i=0; i<mPending.size(); i++) {
+        ProxyState& state = mStates[mPending[i]];
+        GLuint available = GL_FALSE;
+        glGetQueryObjectuiv(state.mQuery, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (available) {
+            GLuint samplesPassed = GL_FALSE;
+            glGetQueryObjectuiv(state.mQuery, GL_QUERY_RESULT, &samplesPassed);
+            // the result of a Geometry gone from a reused proxy is dropped
+            if (state.mQueryOwner == state.mOwner)
+                state.mVisible = samplesPassed != GL_FALSE;
+            state.mPending = false;
+        } else {
+            mPending[n++] = mPending[i];
+        }
+    }
+    mPending.resize(n);
+}
+
+bool OcclusionQueryManager::isVisible(int proxy, const void* owner) {
+    if (proxy < 0) return true;
+    if (proxy >= (int)mStates.size()) {
+        ProxyState state = { NULL, NULL, 0, 0, 0, false, true };
+        mStates.resize(proxy + 1, state);
+    }
+
+    ProxyState& state = mStates[proxy];
+    bool tested = state.mLastTested == mFrame - 1;
+    state.mLastTested = mFrame;
+    if (state.mOwner != owner) {
+        // new Geometry on a reused proxy, a result in flight belongs to
+        // the old one and is dropped when it arrives
+        state.mOwner = owner;
+        state.mVisible = true;
+        // spread the first re-test of visible proxies over the interval
+        state.mLastIssued = mFrame - proxy % mVisibleInterval;
+        if (!state.mPending) mScheduled.push_back(proxy);
+    } else if (!tested) {
+        // out of the frustum or not drawn since, the last result is from
+        // another viewpoint, show it rather than let it pop in late
+        state.mVisible = true;
+        if (!state.mPending) mScheduled.push_back(proxy);
+    } else if (!state.mPending) {
+        int interval = state.mVisible ? mVisibleInterval : mHiddenInterval;
+        if (mFrame - state.mLastIssued >= interval)
+            mScheduled.push_back(proxy);
+    }
+
+    mNumTested++;
+    if (!state.mVisible) mNumHidden++;
+    return state.mVisible;
+}
+
+void OcclusionQueryManager::issueQueries(shared_ptr<BVH> bvh,
+    const glm::mat4& viewProj, const glm::vec3& eye) {
+    mNumQueries = 0;
+    if (mScheduled.empty() || !bvh) {
+        mScheduled.clear();
+        return;
+    }
+
+    shared_ptr<Program> program(ProgramManager::get()->getInternalProgram("depth_only"));
+    if (!program) {
+        mScheduled.clear();
+        return;
+    }
+    if (!mBoxVBO && !createBoxMesh()) {
+        mScheduled.clear();
+        return;
+    }
+
+    // test against depth, touch nothing
+    PipelineState::Desc desc;
+    desc.mProgram = program->getId();
+    desc.mDepthWrite = false;
+    desc.mCullFace = false;
+    desc.mColorWrite = false;
+    GLState* glState = GLState::get();
+    glState->apply(*glState->getPipelineState(desc));
+
+    // one box for all queries, not worth a vertex array object
+    GLint posLoc = program->getLocation(SLOT_VERTEX_POSITION);
+    glState->bindVertexArray(0);
+    glState->bindBuffer(GL_ARRAY_BUFFER, mBoxVBO);
+    glEnableVertexAttribArray(posLoc);
+    glVertexAttribPointer(posLoc, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+    glState->bindBuffer(GL_ELEMENT_ARRAY_BUFFER, mBoxIBO);
+
+    glm::mat4 identity(1.f);
+    glm::mat4 proj(viewProj);
+    for (size_t i=0; i<mScheduled.size(); i++) {
+        int proxy = mScheduled[i];
+        ProxyState& state = mStates[proxy];
+        if (state.mPending) continue;
+        state.mLastIssued = mFrame;
+        state.mQueryOwner = state.mOwner;
+
+        AABB box(bvh->getBounds(proxy));
+        glm::vec3 extent = box.getExtent();
+        box.inflate(max(BOX_INFLATE_MIN,
+            BOX_INFLATE_RATIO * max(max(extent.x, extent.y), extent.z)));
+        if (box.contains(eye)) {
+            // the camera is inside the box, no face to rasterize
+            state.mVisible = true;
+            continue;
+        }
+
+        if (!state.mQuery) glGenQueries(1, &state.mQuery);
+        glm::mat4 world = glm::scale(glm::translate(identity, box.getCenter()), box.getExtent());
+        program->uploadData(nullptr, nullptr, nullptr, world, identity, proj);
+        glBeginQuery(GL_ANY_SAMPLES_PASSED_CONSERVATIVE, state.mQuery);
+        glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_BYTE, (void*)0);
+        glEndQuery(GL_ANY_SAMPLES_PASSED_CONSERVATIVE);
+        glState->countCall(3);
+        state.mPending = true;
+        mPending.push_back(proxy);
+        mNumQueries++;
+    }
+    mScheduled.clear();
+
+    glState->bindBuffer(GL_ARRAY_BUFFER, 0);
+    glState->bindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+} // namespace dzy
@@ -0,0 +1,312 @@
+#include <math.h>
+#include <algorithm>
+#include <EGL/egl.h>
+#include "log.h"
+#include "render.h"
+#include "program.h"
+#include "gl_state.h"
+#include "particle_emitter.h"
+
+using namespace std;
+
+namespace dzy {
+
+// position, velocity, age and lifetime
+static const int PARTICLE_NUM_FLOATS = 3 + 3 + 2;
+
+const float ParticleRenderer::MAX_STEP = 0.1f;
+
+ParticleEmitter::ParticleEmitter(const string& name, int maxParticles)
+    : NodeObj(name)
+    , mMaxParticles(max(maxParticles, 1))
+    , mRate(0.f)
+    , mLifetime(1.f)
+    , mLifetimeJitter(0.f)
+    , mRadius(0.f)
+    , mVelocity(0.f, 1.f, 0.f)
+    , mSpread(0.f)
+    , mSpeedJitter(0.f)
+    , mAcceleration(0.f)
+    , mDrag(0.f)
+    , mNumPlanes(0)
+    , mBounce(0.5f)
+    , mColor(1.f)
+    , mEndColor(1.f, 1.f, 1.f, 0.f)
+    , mSize(0.1f, 0.1f)
+    , mStartTime(-1.0)
+    , mCurrent(0)
+    , mSimulatedTime(0.0) {
+    // particles of emitters with the same settings still differ
+    static int numEmitters = 0;
+    mSeed = (float)(numEmitters++ % 65536);
+    for (int i=0; i<2; i++) {
+        mBuffers[i] = 0;
+        mUpdateVAO[i] = 0;
+        mDrawVAO[i] = 0;
+        mFeedback[i] = 0;
+    }
+}
+
+ParticleEmitter::~ParticleEmitter() {
+    TRACE("");
+    // effects come and go, ParticleRenderer forgets an expired emitter,
+    // its objects are deleted here, by the render thread with its next
+    // frame if dropped elsewhere
+    if (eglGetCurrentContext() != EGL_NO_CONTEXT) {
+        release();
+    } else {
+        GLState* state = GLState::get();
+        for (int i=0; i<2; i++) {
+            state->queueDeleteVertexArray(mUpdateVAO[i]);
+            state->queueDeleteVertexArray(mDrawVAO[i]);
+            state->queueDeleteTransformFeedback(mFeedback[i]);
+            state->queueDeleteBuffer(mBuffers[i]);
+        }
+    }
+}
+
+void ParticleEmitter::update(double /*timeStamp*/) {
+    // the particles are updated on the GPU, see ParticleRenderer
+}
+
+void ParticleEmitter::draw(Render &render, shared_ptr<Scene> /*scene*/, double timeStamp) {
+    NodeObj::updateAnimation(timeStamp);
+    render.recordEmitter(dynamic_pointer_cast<ParticleEmitter>(shared_from_this()), timeStamp);
+}
+
+void ParticleEmitter::setLifetime(float lifetime, float jitter) {
+    mLifetime = max(lifetime, 0.f);
+    mLifetimeJitter = glm::clamp(jitter, 0.f, 1.f);
+}
+
+void ParticleEmitter::setVelocity(const glm::vec3& velocity, float spread, float jitter) {
+    mVelocity = velocity;
+    mSpread = glm::clamp(spread, 0.f, (float)M_PI);
+    mSpeedJitter = glm::clamp(jitter, 0.f, 1.f);
+}
+
+void ParticleEmitter::setForces(const glm::vec3& acceleration, float drag) {
+    mAcceleration = acceleration;
+    mDrag = max(drag, 0.f);
+}
+
+bool ParticleEmitter::addPlane(const glm::vec4& plane, float bounce) {
+    if (mNumPlanes == MAX_PLANES) {
+        ALOGW("%s: %d planes at most", getName().c_str(), MAX_PLANES);
+        return false;
+    }
+    float length = glm::length(glm::vec3(plane));
+    if (length <= 0.f) {
+        ALOGE("%s: plane without a normal", getName().c_str());
+        return false;
+    }
+    mPlanes[mNumPlanes++] = plane / length;
+    mBounce = glm::clamp(bounce, 0.f, 1.f);
+    return true;
+}
+
+void ParticleEmitter::setColor(const glm::vec4& color, const glm::vec4& endColor) {
+    mColor = color;
+    mEndColor = endColor;
+}
+
+void ParticleEmitter::setSize(float size, float endSize) {
+    mSize = glm::vec2(max(size, 0.f), max(endSize, 0.f));
+}
+
+void ParticleEmitter::buildItem(double timeStamp, FrameSnapshot::EmitterItem& item) {
+    if (mStartTime < 0.0) mStartTime = timeStamp;
+    item.mEmitter = dynamic_pointer_cast<ParticleEmitter>(shared_from_this());
+    item.mTime = max(timeStamp - mStartTime, 0.0);
+    item.mWorld = getWorldTransform().toMat4();
+    // unused planes are never crossed
+    for (int i=0; i<MAX_PLANES; i++)
+        item.mPlanes[i] = i < mNumPlanes ? mPlanes[i] : glm::vec4(0.f, 0.f, 0.f, 1.f);
+    item.mSpawn = glm::vec4(mRate, mMaxParticles, mLifetime, mLifetimeJitter);
+    item.mVelocity = glm::vec4(mVelocity, mSpeedJitter);
+    item.mShape = glm::vec4(mRadius, cos(mSpread), mDrag, 0.f);
+    item.mForces = glm::vec4(mAcceleration, mBounce);
+    item.mColor = mColor;
+    item.mEndColor = mEndColor;
+    item.mSize = mSize;
+    item.mVisible = true;
+}
+
+void ParticleEmitter::release() {
+    GLState* state = GLState::get();
+    for (int i=0; i<2; i++) {
+        if (mBuffers[i]) state->deleteBuffer(mBuffers[i]);
+        if (mUpdateVAO[i]) state->deleteVertexArray(mUpdateVAO[i]);
+        if (mDrawVAO[i]) state->deleteVertexArray(mDrawVAO[i]);
+        mBuffers[i] = 0;
+        mUpdateVAO[i] = 0;
+        mDrawVAO[i] = 0;
+    }
+    if (mFeedback[0] || mFeedback[1]) glDeleteTransformFeedbacks(2, mFeedback);
+    mFeedback[0] = mFeedback[1] = 0;
+    mCurrent = 0;
+}
+
+ParticleRenderer::ParticleRenderer()
+    : mNumDrawCalls(0)
+    , mNumParticles(0) {
+}
+
+ParticleRenderer::~ParticleRenderer() {
+    TRACE("");
+}
+
+void ParticleRenderer::release() {
+    // created again on a new context when next simulated, with the
+    // particles dead
+    for (size_t i=0; i<mUploaded.size(); i++) {
+        shared_ptr<ParticleEmitter> emitter(mUploaded[i].lock());
+        if (emitter) emitter->release();
+    }
+    mUploaded.clear();
+}
+
+bool ParticleRenderer::upload(ParticleEmitter& emitter) {
+    if (emitter.mBuffers[0]) return true;
+    glGenBuffers(2, emitter.mBuffers);
+    glGenVertexArrays(2, emitter.mUpdateVAO);
+    glGenVertexArrays(2, emitter.mDrawVAO);
+    glGenTransformFeedbacks(2, emitter.mFeedback);
+    for (int i=0; i<2; i++) {
+        if (!emitter.mBuffers[i] || !emitter.mUpdateVAO[i] || !emitter.mDrawVAO[i] ||
+            !emitter.mFeedback[i]) {
+            ALOGE("%s: particle buffers not created", emitter.getName().c_str());
+            emitter.release();
+            return false;
+        }
+    }
+
+    // all dead, age past lifetime
+    vector<float> particles(emitter.mMaxParticles * PARTICLE_NUM_FLOATS, 0.f);
+    for (int p=0; p<emitter.mMaxParticles; p++) particles[p * PARTICLE_NUM_FLOATS + 6] = 1.f;
+
+    GLState* state = GLState::get();
+    const GLsizei stride = PARTICLE_NUM_FLOATS * sizeof(float);
+    for (int i=0; i<2; i++) {
+        state->bindBuffer(GL_ARRAY_BUFFER, emitter.mBuffers[i]);
+        glBufferData(GL_ARRAY_BUFFER, particles.size() * sizeof(float),
+            &particles[0], GL_DYNAMIC_COPY);
+        // the update reads every attribute per vertex
+        state->bindVertexArray(emitter.mUpdateVAO[i]);
+        glEnableVertexAttribArray(PARTICLE_ATTRIB_POSITION);
+        glVertexAttribPointer(PARTICLE_ATTRIB_POSITION, 3, GL_FLOAT, GL_FALSE, stride,
+            (void*)0);
+        glEnableVertexAttribArray(PARTICLE_ATTRIB_VELOCITY);
+        glVertexAttribPointer(PARTICLE_ATTRIB_VELOCITY, 3, GL_FLOAT, GL_FALSE, stride,
+            (void*)(3 * sizeof(float)));
+        glEnableVertexAttribArray(PARTICLE_ATTRIB_AGE);
+        glVertexAttribPointer(PARTICLE_ATTRIB_AGE, 2, GL_FLOAT, GL_FALSE, stride,
+            (void*)(6 * sizeof(float)));
+        // the draw reads position and age per quad
+        state->bindVertexArray(emitter.mDrawVAO[i]);
+        glEnableVertexAttribArray(PARTICLE_ATTRIB_POSITION);
+        glVertexAttribPointer(PARTICLE_ATTRIB_POSITION, 3, GL_FLOAT, GL_FALSE, stride,
+            (void*)0);
+        glVertexAttribDivisor(PARTICLE_ATTRIB_POSITION, 1);
+        glEnableVertexAttribArray(PARTICLE_ATTRIB_AGE);
+        glVertexAttribPointer(PARTICLE_ATTRIB_AGE, 2, GL_FLOAT, GL_FALSE, stride,
+            (void*)(6 * sizeof(float)));
+        glVertexAttribDivisor(PARTICLE_ATTRIB_AGE, 1);
+        // steps reading the other buffer write this one
+        glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, emitter.mFeedback[i]);
+        glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, emitter.mBuffers[i]);
+    }
+    glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, 0);
+    state->bindVertexArray(0);
+    state->bindBuffer(GL_ARRAY_BUFFER, 0);
+    state->countCall(32);
+    emitter.mCurrent = 0;
+    emitter.mSimulatedTime = 0.0;
+    DEBUG(Log::F_GLES, "%s: particle buffers of %d particles created",
+        emitter.getName().c_str(), emitter.mMaxParticles);
+    return true;
+}
+
+void ParticleRenderer::simulate(const FrameSnapshot& frame) {
+    mNumParticles = 0;
+    // dropped emitters deleted their objects themselves
+    mUploaded.erase(remove_if(mUploaded.begin(), mUploaded.end(),
+        [] (const weak_ptr<ParticleEmitter>& emitter) { return emitter.expired(); }),
+        mUploaded.end());
+    if (frame.mEmitters.empty()) return;
+    shared_ptr<ProgramParticleUpdate> program(dynamic_pointer_cast<ProgramParticleUpdate>(
+        ProgramManager::get()->getInternalProgram("particle_update")));
+    if (!program) return;
+
+    GLState* state = GLState::get();
+    PipelineState::Desc desc;
+    desc.mProgram = program->getId();
+    state->apply(*state->getPipelineState(desc));
+    // only the captured vertices matter
+    glEnable(GL_RASTERIZER_DISCARD);
+    for (size_t i=0; i<frame.mEmitters.size(); i++) {
+        const FrameSnapshot::EmitterItem& item = frame.mEmitters[i];
+        ParticleEmitter& emitter = *item.mEmitter;
+        bool known = emitter.mBuffers[0] != 0;
+        if (!upload(emitter)) continue;
+        if (!known) mUploaded.push_back(item.mEmitter);
+
+        // nothing to do for a frame submitted again
+        double delta = item.mTime - emitter.mSimulatedTime;
+        if (delta <= 0.0) continue;
+        emitter.mSimulatedTime = item.mTime;
+        // the spawn schedule repeats every cycle, the time in the cycle
+        // keeps the float precision of the shader however long it runs
+        double cycle = item.mSpawn.x > 0.f ? item.mSpawn.y / item.mSpawn.x : 1.0;
+        double cycles = floor(item.mTime / cycle);
+        program->setEmitter(item.mWorld, item.mPlanes, item.mSpawn, item.mVelocity,
+            item.mShape, item.mForces);
+        program->setStep((float)(item.mTime - cycles * cycle),
+            (float)min(delta, (double)MAX_STEP), (float)cycles, emitter.mSeed);
+
+        int next = 1 - emitter.mCurrent;
+        state->bindVertexArray(emitter.mUpdateVAO[emitter.mCurrent]);
+        glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, emitter.mFeedback[next]);
+        glBeginTransformFeedback(GL_POINTS);
+        glDrawArrays(GL_POINTS, 0, emitter.mMaxParticles);
+        glEndTransformFeedback();
+        glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, 0);
+        state->countCall(5);
+        emitter.mCurrent = next;
+        mNumParticles += emitter.mMaxParticles;
+    }
+    glDisable(GL_RASTERIZER_DISCARD);
+    state->bindVertexArray(0);
+}
+
+void ParticleRenderer::draw(const FrameSnapshot& frame) {
+    mNumDrawCalls = 0;
+    if (frame.mEmitters.empty()) return;
+    shared_ptr<ProgramParticle> program(dynamic_pointer_cast<ProgramParticle>(
+        ProgramManager::get()->getInternalProgram("particle")));
+    if (!program) return;
+
+    GLState* state = GLState::get();
+    // additive, so the particles need no sorting, and they hide nothing
+    PipelineState::Desc desc;
+    desc.mProgram = program->getId();
+    desc.mDepthWrite = false;
+    desc.mCullFace = false;
+    desc.mBlend = true;
+    desc.mBlendSrc = GL_SRC_ALPHA;
+    desc.mBlendDst = GL_ONE;
+    state->apply(*state->getPipelineState(desc));
+    for (size_t i=0; i<frame.mEmitters.size(); i++) {
+        const FrameSnapshot::EmitterItem& item = frame.mEmitters[i];
+        ParticleEmitter& emitter = *item.mEmitter;
+        if (!item.mVisible || !emitter.mBuffers[0]) continue;
+        program->setAppearance(item.mColor, item.mEndColor, item.mSize);
+        state->bindVertexArray(emitter.mDrawVAO[emitter.mCurrent]);
+        glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, emitter.mMaxParticles);
+        state->countCall();
+        mNumDrawCalls++;
+    }
+    state->bindVertexArray(0);
+}
+
+} // namespace dzy
@@ -6,6 +6,7 @@
 #include "mesh.h"
 #include "material.h"
 #include "light.h"
+#include "gl_state.h"
 #include "program.h"
 
 using namespace std;
@@ -85,11 +86,32 @@ bool Shader::compileFromAsset(
     return compileFromMemory(buffer.get(), sz);
 }
 
+static const char* SHADER_SLOT_NAMES[] = {
+#define DZY_SHADER_SLOT_NAME(SLOT, KIND, NAME) NAME,
+    DZY_SHADER_SLOTS(DZY_SHADER_SLOT_NAME)
+#undef DZY_SHADER_SLOT_NAME
+};
+
+static const ShaderSlotKind SHADER_SLOT_KINDS[] = {
+#define DZY_SHADER_SLOT_KIND(SLOT, KIND, NAME) KIND,
+    DZY_SHADER_SLOTS(DZY_SHADER_SLOT_KIND)
+#undef DZY_SHADER_SLOT_KIND
+};
+
+const char* getShaderSlotName(ShaderSlot slot) {
+    return SHADER_SLOT_NAMES[slot];
+}
+
+ShaderSlotKind getShaderSlotKind(ShaderSlot slot) {
+    return SHADER_SLOT_KINDS[slot];
+}
+
 Program::Program()
     : mLinked(false)
     , mProgramId(0)
     , mRequirement(0) {
     TRACE("");
+    for (int i=0; i<NUM_SHADER_SLOTS; i++) mLocations[i] = -1;
     mProgramId = glCreateProgram();
     if (!mProgramId) {
         ALOGE("glCreateProgram error");
@@ -99,11 +121,11 @@ Program::Program()
 
 Program::~Program() {
     TRACE("");
-    if (mProgramId) glDeleteProgram(mProgramId);
+    if (mProgramId) GLState::get()->deleteProgram(mProgramId);
 }
 
 void Program::use() {
-    glUseProgram(mProgramId);
+    GLState::get()->useProgram(mProgramId);
 }
 
 bool Program::link(std::shared_ptr<Shader> vtxShader, std::shared_ptr<Shader> fragShader) {
@@ -120,12 +142,50 @@ bool Program::link(std::shared_ptr<Shader> vtxShader, std::shared_ptr<Shader> fr
     for (auto iter = mShaders.begin(); iter != mShaders.end(); iter++) {
         if (*iter) glAttachShader(mProgramId, (*iter)->getShaderID());
     }
+    prepareLink();
 
     if (!ndk_helper::shader::LinkProgram(mProgramId)) {
         ALOGE("error link program");
         return false;
     }
 
+    // GLSL ES 3.00 has no binding layout qualifier, every program
+    // declaring the per-frame block reads it from the same binding
+    GLuint frameBlock = glGetUniformBlockIndex(mProgramId, "DzyFrame");
+    if (frameBlock != GL_INVALID_INDEX)
+        glUniformBlockBinding(mProgramId, frameBlock, UNIFORM_BINDING_FRAME);
+    GLuint materialBlock = glGetUniformBlockIndex(mProgramId, "DzyMaterials");
+    if (materialBlock != GL_INVALID_INDEX)
+        glUniformBlockBinding(mProgramId, materialBlock, UNIFORM_BINDING_MATERIALS);
+    // samplers of engine data are set once, their units never change
+    static const struct { const char* mName; TextureUnit mUnit; } SAMPLER_UNITS[] = {
+        { "dzyClusterLights",   TEXTURE_UNIT_CLUSTER_LIGHTS },
+        { "dzyClusterGrid",     TEXTURE_UNIT_CLUSTER_GRID },
+        { "dzyClusterIndices",  TEXTURE_UNIT_CLUSTER_INDICES },
+        { "dzyGBufferAlbedo",   TEXTURE_UNIT_GBUFFER_ALBEDO },
+        { "dzyGBufferNormal",   TEXTURE_UNIT_GBUFFER_NORMAL },
+        { "dzyGBufferMaterial", TEXTURE_UNIT_GBUFFER_MATERIAL },
+        { "dzyImpostorAlbedo",  TEXTURE_UNIT_IMPOSTOR_ALBEDO },
+        { "dzyImpostorNormal",  TEXTURE_UNIT_IMPOSTOR_NORMAL },
+        { "dzyCrowdPoses",      TEXTURE_UNIT_CROWD_POSES },
+        { "dzyShadowMap",       TEXTURE_UNIT_SHADOW_MAP },
+    };
+    for (size_t i=0; i<sizeof(SAMPLER_UNITS)/sizeof(SAMPLER_UNITS[0]); i++) {
+        GLint location = glGetUniformLocation(mProgramId, SAMPLER_UNITS[i].mName);
+        if (location < 0) continue;
+        GLState::get()->useProgram(mProgramId);
+        glUniform1i(location, SAMPLER_UNITS[i].mUnit);
+    }
+
+    // draws index this table, names are never looked up again
+    for (int i=0; i<NUM_SHADER_SLOTS; i++) {
+        ShaderSlot slot = (ShaderSlot)i;
+        if (getShaderSlotKind(slot) == SLOT_KIND_ATTRIB)
+            mLocations[i] = glGetAttribLocation(mProgramId, getShaderSlotName(slot));
+        else
+            mLocations[i] = glGetUniformLocation(mProgramId, getShaderSlotName(slot));
+    }
+
     if (!ndk_helper::shader::ValidateProgram(mProgramId)) {
         ALOGE("program validation fail");
         return false;
@@ -136,23 +196,6 @@ bool Program::link(std::shared_ptr<Shader> vtxShader, std::shared_ptr<Shader> fr
     return true;
 }
 
-bool Program::storeLocation() {
-    ALOGE("subclass should implement storeLocation()");
-    return false;
-}
-
-GLint Program::getLocation(const char* name) {
-    if (!isValid()) {
-        ALOGE("Program not valid");
-        return -1;
-    }
-    if (mLocations.find(name) == mLocations.end()) {
-        ALOGE("%s not found in shader", name);
-        return -1;
-    }
-    return mLocations[name];
-}
-
 void Program::setRequirement(
             bool requireVertexColor,
             bool requireVertexNormal,
@@ -172,6 +215,54 @@ bool Program::hasRequirement(Requirement requirement) {
     return (mRequirement & (1 << requirement)) != 0;
 }
 
+bool Program::uniformChanged(ShaderSlot slot, const float* value, int size) {
+    if (mLocations[slot] < 0) return false;
+    vector<float>& cached = mUniformValues[slot];
+    bool changed = cached.size() != (size_t)size ||
+        memcmp(&cached[0], value, size * sizeof(float)) != 0;
+    if (changed) cached.assign(value, value + size);
+    GLState::get()->countUniform(!changed);
+    return changed;
+}
+
+void Program::setUniform(ShaderSlot slot, int value) {
+    GLint location = mLocations[slot];
+    // exact for any index or flag a shader takes
+    float cached = (float)value;
+    if (uniformChanged(slot, &cached, 1))
+        glUniform1i(location, value);
+}
+
+void Program::setUniform(ShaderSlot slot, float value) {
+    GLint location = mLocations[slot];
+    if (uniformChanged(slot, &value, 1))
+        glUniform1f(location, value);
+}
+
+void Program::setUniform(ShaderSlot slot, const glm::vec3& value) {
+    GLint location = mLocations[slot];
+    if (uniformChanged(slot, glm::value_ptr(value), 3))
+        glUniform3fv(location, 1, glm::value_ptr(value));
+}
+
+void Program::setUniform(ShaderSlot slot, const glm::vec4& value) {
+    GLint location = mLocations[slot];
+    if (uniformChanged(slot, glm::value_ptr(value), 4))
+        glUniform4fv(location, 1, glm::value_ptr(value));
+}
+
+void Program::setUniform(ShaderSlot slot, const glm::mat3& value) {
+    GLint location = mLocations[slot];
+    if (uniformChanged(slot, glm::value_ptr(value), 9))
+        glUniformMatrix3fv(location, 1, GL_FALSE, glm::value_ptr(value));
+}
+
+void Program::setUniform(ShaderSlot slot, const glm::mat4& value) {
+    GLint location = mLocations[slot];
+    if (uniformChanged(slot, glm::value_ptr(value), 16))
+        glUniformMatrix4fv(location, 1, GL_FALSE, glm::value_ptr(value));
+}
+
 bool Program::uploadData(
     shared_ptr<Camera> camera,
     shared_ptr<Light> light,
@@ -188,12 +279,64 @@ bool Program::updateMeshData(shared_ptr<Mesh> mesh, GLuint vbo) {
     return false;
 }
 
+/// per-frame block, the layout must match FrameUniforms::Block
+///
+///     declared highp so that both stages agree on its precision
+#define FRAME_BLOCK                                                     \
+"struct DzyLight {\n"                                                   \
+"    highp vec4 color;\n"                                               \
+"    highp vec4 ambient;\n"                                             \
+"    highp vec4 position; // in eye space\n"                            \
+"    highp vec4 attenuation; // constant, linear, quadratic, strength\n"\
+"};\n"                                                                  \
+"layout(std140) uniform DzyFrame {\n"                                   \
+"    highp mat4 dzyViewMatrix;\n"                                       \
+"    highp mat4 dzyProjMatrix;\n"                                       \
+"    highp mat4 dzyViewProjMatrix;\n"                                   \
+"    highp vec4 dzyCameraPosition;\n"                                   \
+"    highp ivec4 dzyNumLights; // x only\n"                             \
+"    DzyLight dzyLights[4]; // FrameUniforms::MAX_LIGHTS\n"             \
+"    highp vec4 dzyClusterScale; // see LightGrid\n"                    \
+"    highp ivec4 dzyClusterCount; // w non-zero if clustered\n"         \
+"    highp vec4 dzyViewport; // size in xy, inverse size in zw\n"       \
+"    highp mat4 dzyShadowMatrices[4]; // eye space to shadow maps\n"    \
+"    highp vec4 dzyShadowSplits; // far view depth of each cascade\n"   \
+"    highp ivec4 dzyShadowLight; // cluster light, light, cascades\n"   \
+"};\n"
+
+/// material table block, the layout must match MaterialTable::MaterialBlock
+#define MATERIAL_BLOCK                                                  \
+"struct DzyMaterial {\n"                                                \
+"    highp vec4 diffuse; // opacity in a\n"                             \
+"    highp vec4 specular; // shininess in a\n"                          \
+"    highp vec4 ambient;\n"                                             \
+"    highp vec4 emission;\n"                                            \
+"};\n"                                                                  \
+"layout(std140) uniform DzyMaterials {\n"                               \
+"    DzyMaterial dzyMaterials[256]; // MaterialTable::MAX_MATERIALS\n"  \
+"};\n"
+
+/// screen door crossfade between a Geometry and its impostor, see
+/// Impostor, the Geometry keeps the pixels whose threshold is at least
+/// its dzyFadeOut, the impostor the others, so together they cover
+/// every pixel once
+#define DITHER_FADE                                                     \
+"const float DZY_BAYER[16] = float[16](0.0, 8.0, 2.0, 10.0, 12.0, 4.0, 14.0, 6.0,\n" \
+"    3.0, 11.0, 1.0, 9.0, 15.0, 7.0, 13.0, 5.0);\n"                     \
+"// ordered dither threshold of the pixel, in (0, 1)\n"                 \
+"float ditherThreshold() {\n"                                           \
+"    ivec2 p = ivec2(gl_FragCoord.xy) & 3;\n"                           \
+"    return (DZY_BAYER[p.y * 4 + p.x] + 0.5) / 16.0;\n"                 \
+"}\n"
+
 static const char VERTEX_simple_constant_color[] =
 "#version 300 es\n"
-"uniform mat4 dzyMVPMatrix;\n"
+FRAME_BLOCK
+"invariant gl_Position;\n"
+"uniform mat4 dzyModelMatrix;\n"
 "in vec3 dzyVertexPosition;\n"
 "void main() {\n"
-"    gl_Position = dzyMVPMatrix * vec4(dzyVertexPosition, 1.0);\n"
+"    gl_Position = dzyViewProjMatrix * dzyModelMatrix * vec4(dzyVertexPosition, 1.0);\n"
 "}\n";
 
 static const char FRAGMENT_simple_constant_color[] =
@@ -209,13 +352,6 @@ Program000::Program000() {
     setRequirement(false, false, false, false);
 }
 
-bool Program000::storeLocation() {
-    STORE_CHECK_ATTRIB_LOC("dzyVertexPosition");
-    STORE_CHECK_UNIFORM_LOC("dzyMVPMatrix");
-    STORE_CHECK_UNIFORM_LOC("dzyConstantColor");
-    return true;
-}
-
 bool Program000::uploadData(
     shared_ptr<Camera> camera,
     shared_ptr<Light> light,
@@ -223,19 +359,17 @@ bool Program000::uploadData(
     glm::mat4& world,
     glm::mat4& view,
     glm::mat4& proj) {
-    glm::mat4 mvp = proj * view * world;
-    glUniformMatrix4fv(getLocation("dzyMVPMatrix"), 1, GL_FALSE, glm::value_ptr(mvp));
+    setUniform(SLOT_MODEL_MATRIX, world);
     // TODO: find a way to determine constant color
-    GLint colorLoc = getLocation("dzyConstantColor");
-    glUniform3f(colorLoc, 0.f, 0.f, 0.f);
+    setUniform(SLOT_CONSTANT_COLOR, glm::vec3(0.f, 0.f, 0.f));
     return true;
 }
 
 bool Program000::updateMeshData(shared_ptr<Mesh> mesh, GLuint vbo) {
-    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    GLState::get()->bindBuffer(GL_ARRAY_BUFFER, vbo);
 
     if (mesh->hasVertexPositions()) {
-        GLint posLoc = getLocation("dzyVertexPosition");
+        GLint posLoc = getLocation(SLOT_VERTEX_POSITION);
         glEnableVertexAttribArray(posLoc);
         glVertexAttribPointer(
             posLoc,
@@ -252,12 +386,14 @@ bool Program000::updateMeshData(shared_ptr<Mesh> mesh, GLuint vbo) {
 
 static const char VERTEX_simple_vertex_color[] =
 "#version 300 es\n"
-"uniform mat4 dzyMVPMatrix;\n"
+FRAME_BLOCK
+"invariant gl_Position;\n"
+"uniform mat4 dzyModelMatrix;\n"
 "in vec3 dzyVertexPosition;\n"
 "in vec3 dzyVertexColor;\n"
 "out vec3 vVertexColor;\n"
 "void main() {\n"
-"    gl_Position = dzyMVPMatrix * vec4(dzyVertexPosition, 1.0);\n"
+"    gl_Position = dzyViewProjMatrix * dzyModelMatrix * vec4(dzyVertexPosition, 1.0);\n"
 "    vVertexColor = dzyVertexColor;\n"
 "}\n";
 
@@ -274,13 +410,6 @@ Program010::Program010() {
     setRequirement(true, false, false, false);
 }
 
-bool Program010::storeLocation() {
-    STORE_CHECK_ATTRIB_LOC("dzyVertexPosition");
-    STORE_CHECK_ATTRIB_LOC("dzyVertexColor");
-    STORE_CHECK_UNIFORM_LOC("dzyMVPMatrix");
-    return true;
-}
-
 bool Program010::uploadData(
     shared_ptr<Camera> camera,
     shared_ptr<Light> light,
@@ -288,16 +417,15 @@ bool Program010::uploadData(
     glm::mat4& world,
     glm::mat4& view,
     glm::mat4& proj) {
-    glm::mat4 mvp = proj * view * world;
-    glUniformMatrix4fv(getLocation("dzyMVPMatrix"), 1, GL_FALSE, glm::value_ptr(mvp));
+    setUniform(SLOT_MODEL_MATRIX, world);
     return true;
 }
 
 bool Program010::updateMeshData(shared_ptr<Mesh> mesh, GLuint vbo) {
-    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    GLState::get()->bindBuffer(GL_ARRAY_BUFFER, vbo);
 
     if (mesh->hasVertexPositions()) {
-        GLint posLoc = getLocation("dzyVertexPosition");
+        GLint posLoc = getLocation(SLOT_VERTEX_POSITION);
         glEnableVertexAttribArray(posLoc);
         glVertexAttribPointer(
             posLoc,
@@ -309,7 +437,7 @@ bool Program010::updateMeshData(shared_ptr<Mesh> mesh, GLuint vbo) {
         );
     }
     if (mesh->hasVertexColors()) {
-        GLint colorLoc = getLocation("dzyVertexColor");
+        GLint colorLoc = getLocation(SLOT_VERTEX_COLOR);
         glEnableVertexAttribArray(colorLoc);
         glVertexAttribPointer(
             colorLoc,
@@ -326,38 +454,36 @@ bool Program010::updateMeshData(shared_ptr<Mesh> mesh, GLuint vbo) {
 
 static const char VERTEX_simple_material[] =
 "#version 300 es\n"
-"uniform mat4 dzyMVPMatrix;\n"
+FRAME_BLOCK
+"invariant gl_Position;\n"
+"uniform mat4 dzyModelMatrix;\n"
+"uniform int dzyMaterialIndex;\n"
 "in vec3 dzyVertexPosition;\n"
+"flat out int vMaterialIndex;\n"
 "void main() {\n"
-"    gl_Position = dzyMVPMatrix * vec4(dzyVertexPosition, 1.0);\n"
+"    gl_Position = dzyViewProjMatrix * dzyModelMatrix * vec4(dzyVertexPosition, 1.0);\n"
+"    vMaterialIndex = dzyMaterialIndex;\n"
 "}\n";
 
 static const char FRAGMENT_simple_material[] =
 "#version 300 es\n"
 "precision mediump float;\n"
-"struct Material {\n"
-"    vec3 diffuse;\n"
-"    vec3 ambient;\n"
-"};\n"
-"uniform Material dzyMaterial;\n"
+MATERIAL_BLOCK
+DITHER_FADE
+"uniform float dzyFadeOut;\n"
+"flat in int vMaterialIndex;\n"
 "out vec4 fragColor;\n"
 "void main() {\n"
-"    vec3 color = dzyMaterial.diffuse + dzyMaterial.ambient;\n"
-"    fragColor = vec4(color, 1.0);\n"
+"    if (dzyFadeOut > 0.0 && ditherThreshold() < dzyFadeOut) discard;\n"
+"    DzyMaterial material = dzyMaterials[vMaterialIndex];\n"
+"    vec3 color = material.diffuse.rgb + material.ambient.rgb;\n"
+"    fragColor = vec4(color, material.diffuse.a);\n"
 "}\n";
 
 Program020::Program020() {
     setRequirement(false, false, true, false);
 }
 
-bool Program020::storeLocation() {
-    STORE_CHECK_ATTRIB_LOC("dzyVertexPosition");
-    STORE_CHECK_UNIFORM_LOC("dzyMVPMatrix");
-    STORE_CHECK_UNIFORM_LOC("dzyMaterial.diffuse");
-    STORE_CHECK_UNIFORM_LOC("dzyMaterial.ambient");
-    return true;
-}
-
 bool Program020::uploadData(
     shared_ptr<Camera> camera,
     shared_ptr<Light> light,
@@ -365,20 +491,16 @@ bool Program020::uploadData(
     glm::mat4& world,
     glm::mat4& view,
     glm::mat4& proj) {
-    glm::mat4 mvp = proj * view * world;
-    glUniformMatrix4fv(getLocation("dzyMVPMatrix"), 1, GL_FALSE, glm::value_ptr(mvp));
-    glm::vec3 diffuse = material->getDiffuse();
-    glm::vec3 ambient = material->getAmbient();
-    glUniform3fv(getLocation("dzyMaterial.diffuse"), 1, glm::value_ptr(diffuse));
-    glUniform3fv(getLocation("dzyMaterial.ambient"), 1, glm::value_ptr(ambient));
+    // the material is selected by index, see setMaterialIndex
+    setUniform(SLOT_MODEL_MATRIX, world);
     return true;
 }
 
 bool Program020::updateMeshData(shared_ptr<Mesh> mesh, GLuint vbo) {
-    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    GLState::get()->bindBuffer(GL_ARRAY_BUFFER, vbo);
 
     if (mesh->hasVertexPositions()) {
-        GLint posLoc = getLocation("dzyVertexPosition");
+        GLint posLoc = getLocation(SLOT_VERTEX_POSITION);
         glEnableVertexAttribArray(posLoc);
         glVertexAttribPointer(
             posLoc,
@@ -393,101 +515,168 @@ bool Program020::updateMeshData(shared_ptr<Mesh> mesh, GLuint vbo) {
 }
 
 static const char VERTEX_Blin_Phong_shading[] =
-"#version 300 es\n\
-uniform mat4 dzyMVPMatrix;\n\
-uniform mat4 dzyMVMatrix;\n\
-uniform mat3 dzyNormalMatrix;\n\
-in vec3 dzyVertexPosition;\n\
-in vec3 dzyVertexNormal;\n\
-out vec3 vVertexPositionEyeSpace;\n\
-out vec3 vVertexNormalEyeSpace;\n\
-void main() {\n\
-    gl_Position = dzyMVPMatrix * vec4(dzyVertexPosition, 1.0);\n\
-    vVertexPositionEyeSpace = vec3(dzyMVMatrix * vec4(dzyVertexPosition, 1.0));\n\
-    vVertexNormalEyeSpace = dzyNormalMatrix * dzyVertexNormal;\n\
-}";
+"#version 300 es\n"
+FRAME_BLOCK
+"invariant gl_Position;\n"
+"uniform mat4 dzyModelMatrix;\n"
+"// inverse transpose of the model matrix\n"
+"uniform mat3 dzyNormalMatrix;\n"
+"uniform int dzyMaterialIndex;\n"
+"in vec3 dzyVertexPosition;\n"
+"in vec3 dzyVertexNormal;\n"
+"out vec3 vVertexPositionEyeSpace;\n"
+"out vec3 vVertexNormalEyeSpace;\n"
+"flat out int vMaterialIndex;\n"
+"void main() {\n"
+"    vec4 positionEyeSpace = dzyViewMatrix * dzyModelMatrix * vec4(dzyVertexPosition, 1.0);\n"
+"    gl_Position = dzyProjMatrix * positionEyeSpace;\n"
+"    vVertexPositionEyeSpace = vec3(positionEyeSpace);\n"
+"    vVertexNormalEyeSpace = mat3(dzyViewMatrix) * dzyNormalMatrix * dzyVertexNormal;\n"
+"    vMaterialIndex = dzyMaterialIndex;\n"
+"}\n";
+
+/// Blinn-Phong terms of one light and of one light of the cluster light
+/// texture, see LightClusters, shared by forward and deferred shading,
+/// the shadow casting light is attenuated by its shadow maps, see
+/// ShadowMaps
+///
+///     needs FRAME_BLOCK and MATERIAL_BLOCK, the texel layout must match
+///     LightClusters::build
+#define CLUSTER_LIGHTING                                                \
+"uniform highp sampler2DArrayShadow dzyShadowMap;\n"                    \
+"// lit share of a position in eye space, the cascade is picked by depth\n" \
+"float shadowVisibility(highp vec3 position) {\n"                       \
+"    highp float depth = -position.z;\n"                                \
+"    int cascade = 0;\n"                                                \
+"    while (cascade < dzyShadowLight.z && depth > dzyShadowSplits[cascade])\n" \
+"        cascade++;\n"                                                  \
+"    if (cascade == dzyShadowLight.z) return 1.0;\n"                    \
+"    highp vec4 coord = dzyShadowMatrices[cascade] * vec4(position, 1.0);\n" \
+"    coord.xyz /= coord.w;\n"                                           \
+"    if (any(lessThan(coord.xyz, vec3(0.0))) || any(greaterThan(coord.xyz, vec3(1.0))))\n" \
+"        return 1.0;\n"                                                 \
+"    // compared with linear filtering, 2x2 taps\n"                     \
+"    return texture(dzyShadowMap, vec4(coord.xy, float(cascade), coord.z));\n" \
+"}\n"                                                                   \
+"// eye direction in eye space is constant\n"                           \
+"const vec3 EYE_DIRECTION = vec3(0.0, 0.0, 1.0);\n"                     \
+"// or this ?\n"                                                        \
+"//const vec3 EYE_DIRECTION = vec3(0.0, 0.0, 0.0) - position;\n"        \
+"uniform highp sampler2D dzyClusterLights;\n"                           \
+"void shade(DzyMaterial material, vec3 normal, vec3 color, vec3 ambient,\n" \
+"    vec3 lightDirection, float attenuation, float strength,\n"         \
+"    inout vec3 scattered, inout vec3 reflected) {\n"                   \
+"    vec3 halfVector = normalize(lightDirection + EYE_DIRECTION);\n"    \
+"    float diffuse  = max(dot(normal, lightDirection), 0.0);\n"         \
+"    // Blin-Phong Shading\n"                                           \
+"    float specular = max(dot(normal, halfVector), 0.0);\n"             \
+"    if (diffuse == 0.0)\n"                                             \
+"        specular = 0.0;\n"                                             \
+"    else\n"                                                            \
+"        specular = pow(specular, material.specular.a) * strength;\n"   \
+"    scattered += ambient * material.ambient.rgb * attenuation\n"       \
+"        + color * material.diffuse.rgb * diffuse * attenuation;\n"     \
+"    reflected += color * material.specular.rgb * specular * attenuation;\n" \
+"}\n"                                                                   \
+"void shadeClusterLight(DzyMaterial material, highp vec3 position, vec3 normal,\n" \
+"    int light, inout vec3 scattered, inout vec3 reflected) {\n"        \
+"    highp vec4 origin = texelFetch(dzyClusterLights, ivec2(0, light), 0);\n" \
+"    vec4 color = texelFetch(dzyClusterLights, ivec2(1, light), 0);\n"  \
+"    vec4 direction = texelFetch(dzyClusterLights, ivec2(2, light), 0);\n" \
+"    vec4 a = texelFetch(dzyClusterLights, ivec2(3, light), 0);\n"      \
+"    vec4 ambient = texelFetch(dzyClusterLights, ivec2(4, light), 0);\n" \
+"    vec3 lightDirection;\n"                                            \
+"    float attenuation = 1.0;\n"                                        \
+"    if (color.a == 1.0) {\n"                                           \
+"        // directional\n"                                              \
+"        lightDirection = -direction.xyz;\n"                            \
+"    } else {\n"                                                        \
+"        lightDirection = origin.xyz - position;\n"                     \
+"        float lightDistance = length(lightDirection);\n"               \
+"        lightDirection = lightDirection / lightDistance;\n"            \
+"        attenuation = 1.0 / (a.x + a.y * lightDistance +\n"            \
+"            a.z * lightDistance * lightDistance);\n"                   \
+"        // spot, fades between the outer and the inner cone\n"         \
+"        if (color.a == 2.0)\n"                                         \
+"            attenuation *= clamp((dot(-lightDirection, direction.xyz) - direction.w)\n" \
+"                / max(a.w - direction.w, 1e-4), 0.0, 1.0);\n"          \
+"    }\n"                                                               \
+"    if (light == dzyShadowLight.x) attenuation *= shadowVisibility(position);\n" \
+"    shade(material, normal, color.rgb, ambient.rgb, lightDirection, attenuation,\n" \
+"        ambient.a, scattered, reflected);\n"                           \
+"}\n"
+
+/// lights of a forward shaded pixel, the ones of the per-frame block
+/// and the ones of its cluster
+///
+///     needs FRAME_BLOCK and CLUSTER_LIGHTING
+#define FORWARD_LIGHTING                                                \
+"// light lists of the clusters, see LightClusters\n"                   \
+"uniform highp usampler2D dzyClusterGrid;\n"                            \
+"uniform highp usampler2D dzyClusterIndices;\n"                         \
+"void shadeForward(DzyMaterial material, highp vec3 position, vec3 normal,\n" \
+"    inout vec3 scatteredLight, inout vec3 reflectedLight) {\n"         \
+"    for (int i = 0; i < dzyNumLights.x; i++) {\n"                      \
+"        vec3 lightDirection = dzyLights[i].position.xyz - position;\n" \
+"        float lightDistance = length(lightDirection);\n"               \
+"        // normalize lightDirection\n"                                 \
+"        lightDirection = lightDirection / lightDistance;\n"            \
+"        vec4 a = dzyLights[i].attenuation;\n"                          \
+"        float attenuation = 1.0 / (a.x + a.y * lightDistance +\n"      \
+"            a.z * lightDistance * lightDistance);\n"                   \
+"        if (i == dzyShadowLight.y) attenuation *= shadowVisibility(position);\n" \
+"        shade(material, normal, dzyLights[i].color.rgb,\n"             \
+"            dzyLights[i].ambient.rgb, lightDirection, attenuation, a.w,\n" \
+"            scatteredLight, reflectedLight);\n"                        \
+"    }\n"                                                               \
+"    if (dzyClusterCount.w == 0) return;\n"                             \
+"    // tile from the window position, slice from the log of the depth\n" \
+"    highp float depth = max(-position.z, 1e-4);\n"                     \
+"    ivec3 cell = ivec3(vec3(gl_FragCoord.xy * dzyClusterScale.xy,\n"   \
+"        log(depth) * dzyClusterScale.z + dzyClusterScale.w));\n"       \
+"    cell = clamp(cell, ivec3(0), dzyClusterCount.xyz - 1);\n"          \
+"    highp uvec2 cluster = texelFetch(dzyClusterGrid,\n"                \
+"        ivec2(cell.y * dzyClusterCount.x + cell.x, cell.z), 0).rg;\n"  \
+"    for (highp uint i = 0u; i < cluster.y; i++) {\n"                   \
+"        // LightClusters::INDEX_TEXTURE_WIDTH indices per row\n"       \
+"        highp uint index = cluster.x + i;\n"                           \
+"        int light = int(texelFetch(dzyClusterIndices,\n"               \
+"            ivec2(index % 1024u, index / 1024u), 0).r);\n"             \
+"        shadeClusterLight(material, position, normal, light,\n"        \
+"            scatteredLight, reflectedLight);\n"                        \
+"    }\n"                                                               \
+"}\n"
 
 static const char FRAGMENT_Blin_Phong_shading[] =
-"#version 300 es\n\
-precision mediump float;\n\
-in vec3 vVertexPositionEyeSpace;\n\
-in vec3 vVertexNormalEyeSpace;\n\
-struct Material {\n\
-    vec3 diffuse;\n\
-    vec3 specular;\n\
-    vec3 ambient;\n\
-    vec3 emission;\n\
-    float shininess;\n\
-};\n\
-struct PointLight {\n\
-    vec3 color;\n\
-    vec3 ambient;\n\
-    vec3 position; // in eye space\n\
-    float attenuationConstant;\n\
-    float attenuationLinear;\n\
-    float attenuationQuadratic;\n\
-    float strength;\n\
-};\n\
-uniform Material dzyMaterial;\n\
-uniform PointLight dzyLight;\n\
-// eye direction in eye space is constant\n\
-const vec3 EYE_DIRECTION = vec3(0.0, 0.0, 1.0);\n\
-// or this ?\n\
-//const vec3 EYE_DIRECTION = vec3(0.0, 0.0, 0.0) - vVertexPositionEyeSpace;\n\
-out vec4 fragColor;\n\
-void main() {\n\
-    vec3 lightDirection = dzyLight.position - vVertexPositionEyeSpace;\n\
-    float lightDistance = length(lightDirection);\n\
-    // normalize lightDirection\n\
-    lightDirection = lightDirection / lightDistance;\n\
-    float attenuation = 1.0 / (dzyLight.attenuationConstant +\n\
-        dzyLight.attenuationLinear * lightDistance +\n\
-        dzyLight.attenuationQuadratic * lightDistance * lightDistance);\n\
-    vec3 halfVector = normalize(lightDirection + EYE_DIRECTION);\n\
-    float diffuse  = max(dot(vVertexNormalEyeSpace, lightDirection), 0.0);\n\
-    // Blin-Phong Shading\n\
-    float specular = max(dot(vVertexNormalEyeSpace, halfVector), 0.0);\n\
-    if (diffuse == 0.0)\n\
-        specular = 0.0;\n\
-    else\n\
-        specular = pow(specular, dzyMaterial.shininess) * dzyLight.strength;\n\
-    vec3 scatteredLight = dzyLight.ambient * dzyMaterial.ambient * attenuation\n\
-        + dzyLight.color * dzyMaterial.diffuse * diffuse * attenuation;\n\
-    vec3 reflectedLight = dzyLight.color * dzyMaterial.specular * specular * attenuation;\n\
-    // FIXME: use material diffuse color for the time being\n\
-    vec4 objColor = vec4(dzyMaterial.diffuse, 1.0);\n\
-    vec3 rgb = min(vec3(1.0),\n\
-        dzyMaterial.emission + objColor.rgb * scatteredLight + reflectedLight);\n\
-    fragColor = vec4(rgb, objColor.a);\n\
-}";
+"#version 300 es\n"
+"precision mediump float;\n"
+FRAME_BLOCK
+MATERIAL_BLOCK
+CLUSTER_LIGHTING
+FORWARD_LIGHTING
+DITHER_FADE
+"uniform float dzyFadeOut;\n"
+"in vec3 vVertexPositionEyeSpace;\n"
+"in vec3 vVertexNormalEyeSpace;\n"
+"flat in int vMaterialIndex;\n"
+"out vec4 fragColor;\n"
+"void main() {\n"
+"    if (dzyFadeOut > 0.0 && ditherThreshold() < dzyFadeOut) discard;\n"
+"    DzyMaterial material = dzyMaterials[vMaterialIndex];\n"
+"    vec3 scatteredLight = vec3(0.0);\n"
+"    vec3 reflectedLight = vec3(0.0);\n"
+"    shadeForward(material, vVertexPositionEyeSpace, vVertexNormalEyeSpace,\n"
+"        scatteredLight, reflectedLight);\n"
+"    vec4 objColor = material.diffuse;\n"
+"    vec3 rgb = min(vec3(1.0),\n"
+"        material.emission.rgb + objColor.rgb * scatteredLight + reflectedLight);\n"
+"    fragColor = vec4(rgb, objColor.a);\n"
+"}\n";
 
 Program100::Program100() {
     setRequirement(false, true, true, true);
 }
 
-bool Program100::storeLocation() {
-    STORE_CHECK_ATTRIB_LOC("dzyVertexPosition");
-    STORE_CHECK_ATTRIB_LOC("dzyVertexColor");
-    STORE_CHECK_ATTRIB_LOC("dzyVertexNormal");
-    STORE_CHECK_UNIFORM_LOC("dzyMVPMatrix");
-    STORE_CHECK_UNIFORM_LOC("dzyMVMatrix");
-    STORE_CHECK_UNIFORM_LOC("dzyNormalMatrix");
-    STORE_CHECK_UNIFORM_LOC("dzyMaterial.diffuse");
-    STORE_CHECK_UNIFORM_LOC("dzyMaterial.specular");
-    STORE_CHECK_UNIFORM_LOC("dzyMaterial.ambient");
-    STORE_CHECK_UNIFORM_LOC("dzyMaterial.emission");
-    STORE_CHECK_UNIFORM_LOC("dzyMaterial.shininess");
-    STORE_CHECK_UNIFORM_LOC("dzyLight.color");
-    STORE_CHECK_UNIFORM_LOC("dzyLight.ambient");
-    STORE_CHECK_UNIFORM_LOC("dzyLight.position");
-    STORE_CHECK_UNIFORM_LOC("dzyLight.attenuationConstant");
-    STORE_CHECK_UNIFORM_LOC("dzyLight.attenuationLinear");
-    STORE_CHECK_UNIFORM_LOC("dzyLight.attenuationQuadratic");
-    STORE_CHECK_UNIFORM_LOC("dzyLight.strength");
-
-    return true;
-}
-
 bool Program100::uploadData(
     shared_ptr<Camera> camera,
     shared_ptr<Light> light,
@@ -495,57 +684,19 @@ bool Program100::uploadData(
     glm::mat4& world,
     glm::mat4& view,
     glm::mat4& proj) {
-    glm::mat4 mv = view * world;
-    glUniformMatrix4fv(getLocation("dzyMVMatrix"), 1, GL_FALSE, glm::value_ptr(mv));
-    glm::mat4 mvp = proj * mv;
-    glUniformMatrix4fv(getLocation("dzyMVPMatrix"), 1, GL_FALSE, glm::value_ptr(mvp));
-    glm::mat3 mvInvTransMatrix = glm::mat3(glm::transpose(glm::inverse(mv)));
-    glUniformMatrix3fv(getLocation("dzyNormalMatrix"), 1, GL_FALSE, glm::value_ptr(mvInvTransMatrix));
-
-    if (light) {
-        glUniform3fv(getLocation("dzyLight.color"),
-            1, glm::value_ptr(light->getColorDiffuse()));
-        glUniform3fv(getLocation("dzyLight.ambient"),
-            1, glm::value_ptr(light->getColorAmbient()));
-        glm::vec3 lightPosEyeSpace = glm::vec3(
-            view * light->getTransform() * glm::vec4(light->getPosition(), 1.0f));
-        glUniform3fv(getLocation("dzyLight.position"),
-            1, glm::value_ptr(lightPosEyeSpace));
-        glUniform1f(getLocation("dzyLight.attenuationConstant"),
-            light->getAttenuationConstant());
-        glUniform1f(getLocation("dzyLight.attenuationLinear"),
-            light->getAttenuationLinear());
-        glUniform1f(getLocation("dzyLight.attenuationQuadratic"),
-            light->getAttenuationQuadratic());
-        glUniform1f(getLocation("dzyLight.strength"), 1.0f);
-    }
-
-    if (material) {
-        glm::vec3 diffuse = material->getDiffuse();
-        glm::vec3 specular = material->getSpecular();
-        glm::vec3 ambient = material->getAmbient();
-        glm::vec3 emission = material->getEmission();
-        float shininess = material->getShininess();
-
-        glUniform3fv(getLocation("dzyMaterial.diffuse"),
-            1, glm::value_ptr(diffuse));
-        glUniform3fv(getLocation("dzyMaterial.specular"),
-            1, glm::value_ptr(specular));
-        glUniform3fv(getLocation("dzyMaterial.ambient"),
-            1, glm::value_ptr(ambient));
-        glUniform3fv(getLocation("dzyMaterial.emission"),
-            1, glm::value_ptr(emission));
-        glUniform1f(getLocation("dzyMaterial.shininess"), shininess);
-    }
-
+    // camera and lights are in the per-frame block, the material is
+    // selected by index, see setMaterialIndex
+    setUniform(SLOT_MODEL_MATRIX, world);
+    glm::mat3 worldInvTransMatrix = glm::mat3(glm::transpose(glm::inverse(world)));
+    setUniform(SLOT_NORMAL_MATRIX, worldInvTransMatrix);
     return true;
 }
 
 bool Program100::updateMeshData(shared_ptr<Mesh> mesh, GLuint vbo) {
-    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    GLState::get()->bindBuffer(GL_ARRAY_BUFFER, vbo);
 
     if (mesh->hasVertexPositions()) {
-        GLint posLoc = getLocation("dzyVertexPosition");
+        GLint posLoc = getLocation(SLOT_VERTEX_POSITION);
         glEnableVertexAttribArray(posLoc);
         glVertexAttribPointer(
             posLoc,
@@ -557,8 +708,9 @@ bool Program100::updateMeshData(shared_ptr<Mesh> mesh, GLuint vbo) {
         );
     }
 
-    if (mesh->hasVertexColors()) {
-        GLint colorLoc = getLocation("dzyVertexColor");
+    // Blin-Phong does not shade with vertex colors
+    if (mesh->hasVertexColors() && getLocation(SLOT_VERTEX_COLOR) >= 0) {
+        GLint colorLoc = getLocation(SLOT_VERTEX_COLOR);
         glEnableVertexAttribArray(colorLoc);
         glVertexAttribPointer(
             colorLoc,
@@ -571,7 +723,7 @@ bool Program100::updateMeshData(shared_ptr<Mesh> mesh, GLuint vbo) {
     }
 
     if (mesh->hasVertexNormals()) {
-        GLint normalLoc = getLocation("dzyVertexNormal");
+        GLint normalLoc = getLocation(SLOT_VERTEX_NORMAL);
         glEnableVertexAttribArray(normalLoc);
         glVertexAttribPointer(
             normalLoc,
@@ -586,6 +738,672 @@ bool Program100::updateMeshData(shared_ptr<Mesh> mesh, GLuint vbo) {
     return true;
 }
 
+// per-instance attribute locations must match InstanceAttribLocation
+static const char VERTEX_instanced_simple_material[] =
+"#version 300 es\n"
+FRAME_BLOCK
+"invariant gl_Position;\n"
+"in vec3 dzyVertexPosition;\n"
+"layout(location = 8) in mat4 dzyInstanceWorld;\n"
+"layout(location = 15) in float dzyInstanceMaterial;\n"
+"flat out int vMaterialIndex;\n"
+"void main() {\n"
+"    gl_Position = dzyViewProjMatrix * dzyInstanceWorld * vec4(dzyVertexPosition, 1.0);\n"
+"    vMaterialIndex = int(dzyInstanceMaterial);\n"
+"}\n";
+
+// shading is the same as the non-instanced program
+#define FRAGMENT_instanced_simple_material FRAGMENT_simple_material
+
+bool ProgramInstanced020::uploadData(
+    shared_ptr<Camera> camera,
+    shared_ptr<Light> light,
+    shared_ptr<Material> material,
+    glm::mat4& world,
+    glm::mat4& view,
+    glm::mat4& proj) {
+    // everything comes from uniform blocks and instance attributes
+    return true;
+}
+
+// the view matrix is rigid, so mat3(view) times the world normal
+// matrix equals the normal matrix of the model view matrix
+static const char VERTEX_instanced_Blin_Phong_shading[] =
+"#version 300 es\n"
+FRAME_BLOCK
+"invariant gl_Position;\n"
+"in vec3 dzyVertexPosition;\n"
+"in vec3 dzyVertexNormal;\n"
+"layout(location = 8) in mat4 dzyInstanceWorld;\n"
+"layout(location = 12) in mat3 dzyInstanceNormal;\n"
+"layout(location = 15) in float dzyInstanceMaterial;\n"
+"out vec3 vVertexPositionEyeSpace;\n"
+"out vec3 vVertexNormalEyeSpace;\n"
+"flat out int vMaterialIndex;\n"
+"void main() {\n"
+"    vec4 positionEyeSpace = dzyViewMatrix * dzyInstanceWorld * vec4(dzyVertexPosition, 1.0);\n"
+"    gl_Position = dzyProjMatrix * positionEyeSpace;\n"
+"    vVertexPositionEyeSpace = vec3(positionEyeSpace);\n"
+"    vVertexNormalEyeSpace = mat3(dzyViewMatrix) * dzyInstanceNormal * dzyVertexNormal;\n"
+"    vMaterialIndex = int(dzyInstanceMaterial);\n"
+"}\n";
+
+#define FRAGMENT_instanced_Blin_Phong_shading FRAGMENT_Blin_Phong_shading
+
+bool ProgramInstanced100::uploadData(
+    shared_ptr<Camera> camera,
+    shared_ptr<Light> light,
+    shared_ptr<Material> material,
+    glm::mat4& world,
+    glm::mat4& view,
+    glm::mat4& proj) {
+    // everything comes from uniform blocks and instance attributes
+    return true;
+}
+
+// G-buffer variants transform like the forward programs
+#define VERTEX_gbuffer_Blin_Phong_shading VERTEX_Blin_Phong_shading
+#define VERTEX_gbuffer_instanced_Blin_Phong_shading VERTEX_instanced_Blin_Phong_shading
+
+/// surface attributes for DeferredRenderer, the view depth goes next to
+/// the material index so the lighting passes need no depth texture
+static const char FRAGMENT_gbuffer_Blin_Phong_shading[] =
+"#version 300 es\n"
+"precision mediump float;\n"
+MATERIAL_BLOCK
+DITHER_FADE
+"uniform float dzyFadeOut;\n"
+"in highp vec3 vVertexPositionEyeSpace;\n"
+"in vec3 vVertexNormalEyeSpace;\n"
+"flat in int vMaterialIndex;\n"
+"layout(location = 0) out vec4 gAlbedo;\n"
+"layout(location = 1) out vec4 gNormal;\n"
+"layout(location = 2) out highp uvec2 gMaterial;\n"
+"void main() {\n"
+"    if (dzyFadeOut > 0.0 && ditherThreshold() < dzyFadeOut) discard;\n"
+"    DzyMaterial material = dzyMaterials[vMaterialIndex];\n"
+"    gAlbedo = vec4(material.diffuse.rgb, 1.0);\n"
+"    gNormal = vec4(normalize(vVertexNormalEyeSpace) * 0.5 + 0.5, 0.0);\n"
+"    gMaterial = uvec2(uint(vMaterialIndex), floatBitsToUint(-vVertexPositionEyeSpace.z));\n"
+"}\n";
+
+#define FRAGMENT_gbuffer_instanced_Blin_Phong_shading FRAGMENT_gbuffer_Blin_Phong_shading
+
+/// G-buffer lookup of the pixel being lit, false for the background,
+/// cleared to DeferredRenderer::BACKGROUND_MATERIAL, index 0xFFFFFFFF
+#define GBUFFER_INPUT                                                   \
+"uniform lowp sampler2D dzyGBufferAlbedo;\n"                            \
+"uniform lowp sampler2D dzyGBufferNormal;\n"                            \
+"uniform highp usampler2D dzyGBufferMaterial;\n"                        \
+"bool readGBuffer(out DzyMaterial material, out vec3 albedo,\n"         \
+"    out vec3 normal, out highp vec3 position) {\n"                     \
+"    ivec2 pixel = ivec2(gl_FragCoord.xy);\n"                           \
+"    highp uvec2 m = texelFetch(dzyGBufferMaterial, pixel, 0).rg;\n"    \
+"    if (m.x == 0xFFFFFFFFu) return false;\n"                           \
+"    material = dzyMaterials[int(m.x)];\n"                              \
+"    albedo = texelFetch(dzyGBufferAlbedo, pixel, 0).rgb;\n"            \
+"    normal = normalize(texelFetch(dzyGBufferNormal, pixel, 0).xyz * 2.0 - 1.0);\n" \
+"    // eye position back from the window position and view depth\n"   \
+"    highp float depth = uintBitsToFloat(m.y);\n"                       \
+"    highp vec2 ndc = gl_FragCoord.xy * dzyViewport.zw * 2.0 - 1.0;\n" \
+"    position = vec3((ndc.x + dzyProjMatrix[2][0]) * depth / dzyProjMatrix[0][0],\n" \
+"        (ndc.y + dzyProjMatrix[2][1]) * depth / dzyProjMatrix[1][1], -depth);\n" \
+"    return true;\n"                                                    \
+"}\n"
+
+// light volume, a unit sphere scaled around a center in eye space
+static const char VERTEX_deferred_light_volume[] =
+"#version 300 es\n"
+FRAME_BLOCK
+"uniform vec4 dzyLightVolume;\n"
+"in vec3 dzyVertexPosition;\n"
+"void main() {\n"
+"    vec3 position = dzyLightVolume.xyz + dzyVertexPosition * dzyLightVolume.w;\n"
+"    gl_Position = dzyProjMatrix * vec4(position, 1.0);\n"
+"}\n";
+
+static const char FRAGMENT_deferred_light_volume[] =
+"#version 300 es\n"
+"precision mediump float;\n"
+FRAME_BLOCK
+MATERIAL_BLOCK
+CLUSTER_LIGHTING
+GBUFFER_INPUT
+"uniform int dzyLightIndex;\n"
+"out vec4 fragColor;\n"
+"void main() {\n"
+"    DzyMaterial material;\n"
+"    vec3 albedo, normal;\n"
+"    highp vec3 position;\n"
+"    if (!readGBuffer(material, albedo, normal, position)) discard;\n"
+"    vec3 scatteredLight = vec3(0.0);\n"
+"    vec3 reflectedLight = vec3(0.0);\n"
+"    shadeClusterLight(material, position, normal, dzyLightIndex,\n"
+"        scatteredLight, reflectedLight);\n"
+"    // lights add up in the blend, saturating like the forward min()\n"
+"    fragColor = vec4(albedo * scatteredLight + reflectedLight, 1.0);\n"
+"}\n";
+
+// full screen triangle without vertex attributes
+static const char VERTEX_deferred_light_fullscreen[] =
+"#version 300 es\n"
+"void main() {\n"
+"    vec2 position = vec2(float((gl_VertexID << 1) & 2), float(gl_VertexID & 2));\n"
+"    gl_Position = vec4(position * 2.0 - 1.0, 0.0, 1.0);\n"
+"}\n";
+
+#define FRAGMENT_deferred_light_fullscreen FRAGMENT_deferred_light_volume
+
+#define VERTEX_deferred_emission VERTEX_deferred_light_fullscreen
+
+static const char FRAGMENT_deferred_emission[] =
+"#version 300 es\n"
+"precision mediump float;\n"
+FRAME_BLOCK
+MATERIAL_BLOCK
+GBUFFER_INPUT
+"out vec4 fragColor;\n"
+"void main() {\n"
+"    DzyMaterial material;\n"
+"    vec3 albedo, normal;\n"
+"    highp vec3 position;\n"
+"    if (!readGBuffer(material, albedo, normal, position)) discard;\n"
+"    fragColor = vec4(material.emission.rgb, 1.0);\n"
+"}\n";
+
+ProgramDeferredLight::ProgramDeferredLight() {
+    setRequirement(false, false, false, false);
+}
+
+bool ProgramDeferredLight::uploadData(
+    shared_ptr<Camera> camera,
+    shared_ptr<Light> light,
+    shared_ptr<Material> material,
+    glm::mat4& world,
+    glm::mat4& view,
+    glm::mat4& proj) {
+    // everything comes from uniform blocks, the G-buffer and setLight
+    return true;
+}
+
+/// depth pre-pass, the vertex shader is the one of the program drawn
+/// afterwards, declaring gl_Position invariant, so both write the same
+/// depth, the color mask is off
+static const char FRAGMENT_depth_prepass[] =
+"#version 300 es\n"
+"void main() {\n"
+"}\n";
+
+#define VERTEX_depth_Blin_Phong_shading VERTEX_Blin_Phong_shading
+#define FRAGMENT_depth_Blin_Phong_shading FRAGMENT_depth_prepass
+#define VERTEX_depth_simple_material VERTEX_simple_material
+#define FRAGMENT_depth_simple_material FRAGMENT_depth_prepass
+#define VERTEX_depth_simple_vertex_color VERTEX_simple_vertex_color
+#define FRAGMENT_depth_simple_vertex_color FRAGMENT_depth_prepass
+#define VERTEX_depth_simple_constant_color VERTEX_simple_constant_color
+#define FRAGMENT_depth_simple_constant_color FRAGMENT_depth_prepass
+#define VERTEX_depth_instanced_Blin_Phong_shading VERTEX_instanced_Blin_Phong_shading
+#define FRAGMENT_depth_instanced_Blin_Phong_shading FRAGMENT_depth_prepass
+#define VERTEX_depth_instanced_simple_material VERTEX_instanced_simple_material
+#define FRAGMENT_depth_instanced_simple_material FRAGMENT_depth_prepass
+
+/// impostor atlas cells, see Impostor, the albedo and the normal in the
+/// space of the impostor root with the depth along the view. The view of
+/// the per-frame block is the orthographic one of the cell, model
+/// matrices are relative to the root
+static const char FRAGMENT_impostor_Blin_Phong_shading[] =
+"#version 300 es\n"
+"precision mediump float;\n"
+FRAME_BLOCK
+MATERIAL_BLOCK
+"in vec3 vVertexNormalEyeSpace;\n"
+"flat in int vMaterialIndex;\n"
+"layout(location = 0) out vec4 iAlbedo;\n"
+"layout(location = 1) out vec4 iNormal;\n"
+"void main() {\n"
+"    DzyMaterial material = dzyMaterials[vMaterialIndex];\n"
+"    iAlbedo = vec4(material.diffuse.rgb, 1.0);\n"
+"    // the view is rigid, its transpose takes eye space back\n"
+"    vec3 normal = transpose(mat3(dzyViewMatrix)) * normalize(vVertexNormalEyeSpace);\n"
+"    iNormal = vec4(normal * 0.5 + 0.5, gl_FragCoord.z);\n"
+"}\n";
+
+static const char FRAGMENT_impostor_simple_material[] =
+"#version 300 es\n"
+"precision mediump float;\n"
+FRAME_BLOCK
+MATERIAL_BLOCK
+"flat in int vMaterialIndex;\n"
+"layout(location = 0) out vec4 iAlbedo;\n"
+"layout(location = 1) out vec4 iNormal;\n"
+"void main() {\n"
+"    DzyMaterial material = dzyMaterials[vMaterialIndex];\n"
+"    iAlbedo = vec4(material.diffuse.rgb + material.ambient.rgb, 1.0);\n"
+"    // no normals, facing the view\n"
+"    vec3 normal = transpose(mat3(dzyViewMatrix))[2];\n"
+"    iNormal = vec4(normal * 0.5 + 0.5, gl_FragCoord.z);\n"
+"}\n";
+
+#define VERTEX_impostor_Blin_Phong_shading VERTEX_Blin_Phong_shading
+#define VERTEX_impostor_simple_material VERTEX_simple_material
+
+/// camera facing quad around the bounding sphere of an impostor, each
+/// point of it is projected into the atlas cells of the two views
+/// nearest to the camera the way the cells were drawn, see
+/// Impostor::getView
+static const char VERTEX_impostor[] =
+"#version 300 es\n"
+FRAME_BLOCK
+"// views around, views up, and their inverses\n"
+"uniform vec4 dzyImpostorGrid;\n"
+"layout(location = 8) in vec4 dzyImpostorCenter;\n"
+"layout(location = 9) in mat3 dzyImpostorRotation;\n"
+"layout(location = 12) in vec4 dzyImpostorViews;\n"
+"out vec4 vCells;\n"
+"flat out vec4 vOrigins;\n"
+"out highp vec3 vPositionEyeSpace;\n"
+"flat out vec3 vImpostor;\n"
+"flat out mat3 vNormalMatrix;\n"
+"vec2 cellPosition(float view, vec3 offset, out vec2 origin) {\n"
+"    float column = mod(view, dzyImpostorGrid.x);\n"
+"    float row = floor(view * dzyImpostorGrid.z);\n"
+"    float yaw = column * 6.2831853 * dzyImpostorGrid.z;\n"
+"    float pitch = row * 1.5707963 / max(dzyImpostorGrid.y - 1.0, 1.0);\n"
+"    vec3 direction = vec3(sin(yaw) * cos(pitch), sin(pitch), cos(yaw) * cos(pitch));\n"
+"    vec3 up = vec3(-sin(yaw) * sin(pitch), cos(pitch), -cos(yaw) * sin(pitch));\n"
+"    vec3 right = cross(up, direction);\n"
+"    origin = vec2(column, row);\n"
+"    return vec2(dot(offset, dzyImpostorRotation * right),\n"
+"        dot(offset, dzyImpostorRotation * up)) / dzyImpostorCenter.w * 0.5 + 0.5;\n"
+"}\n"
+"void main() {\n"
+"    // triangle strip\n"
+"    vec2 corner = vec2(float(gl_VertexID & 1), float(gl_VertexID >> 1)) * 2.0 - 1.0;\n"
+"    vec3 right = vec3(dzyViewMatrix[0][0], dzyViewMatrix[1][0], dzyViewMatrix[2][0]);\n"
+"    vec3 up = vec3(dzyViewMatrix[0][1], dzyViewMatrix[1][1], dzyViewMatrix[2][1]);\n"
+"    vec3 offset = (right * corner.x + up * corner.y) * dzyImpostorCenter.w;\n"
+"    vec4 positionEyeSpace = dzyViewMatrix * vec4(dzyImpostorCenter.xyz + offset, 1.0);\n"
+"    gl_Position = dzyProjMatrix * positionEyeSpace;\n"
+"    vPositionEyeSpace = positionEyeSpace.xyz;\n"
+"    vec2 origin0, origin1;\n"
+"    vCells.xy = cellPosition(dzyImpostorViews.x, offset, origin0);\n"
+"    vCells.zw = cellPosition(dzyImpostorViews.y, offset, origin1);\n"
+"    vOrigins = vec4(origin0, origin1);\n"
+"    // weight of the second view, fade, radius\n"
+"    vImpostor = vec3(dzyImpostorViews.zw, dzyImpostorCenter.w);\n"
+"    vNormalMatrix = mat3(dzyViewMatrix) * dzyImpostorRotation;\n"
+"}\n";
+
+/// lit like Blin_Phong_shading with the baked albedo, without specular
+/// or emission, the depth is moved to the baked surface so impostors
+/// intersect the scene like the Geometry they stand for
+static const char FRAGMENT_impostor[] =
+"#version 300 es\n"
+"precision mediump float;\n"
+FRAME_BLOCK
+MATERIAL_BLOCK
+CLUSTER_LIGHTING
+FORWARD_LIGHTING
+DITHER_FADE
+"uniform highp vec4 dzyImpostorGrid;\n"
+"uniform lowp sampler2D dzyImpostorAlbedo;\n"
+"uniform lowp sampler2D dzyImpostorNormal;\n"
+"in vec4 vCells;\n"
+"flat in vec4 vOrigins;\n"
+"in highp vec3 vPositionEyeSpace;\n"
+"flat in vec3 vImpostor;\n"
+"flat in mat3 vNormalMatrix;\n"
+"out vec4 fragColor;\n"
+"void main() {\n"
+"    // the pixels the fading Geometry leaves\n"
+"    if (ditherThreshold() >= vImpostor.y) discard;\n"
+"    // cells are clamped, their border is background\n"
+"    vec2 atlas0 = (vOrigins.xy + clamp(vCells.xy, 0.0, 1.0)) * dzyImpostorGrid.zw;\n"
+"    vec2 atlas1 = (vOrigins.zw + clamp(vCells.zw, 0.0, 1.0)) * dzyImpostorGrid.zw;\n"
+"    vec4 albedo = mix(texture(dzyImpostorAlbedo, atlas0),\n"
+"        texture(dzyImpostorAlbedo, atlas1), vImpostor.x);\n"
+"    if (albedo.a < 0.5) discard;\n"
+"    vec4 normalDepth = mix(texture(dzyImpostorNormal, atlas0),\n"
+"        texture(dzyImpostorNormal, atlas1), vImpostor.x);\n"
+"    vec3 normal = normalize(vNormalMatrix * (normalDepth.xyz * 2.0 - 1.0));\n"
+"    // the depth spans the bounding sphere, the center is at 0.5\n"
+"    highp vec3 position = vPositionEyeSpace;\n"
+"    position.z += (1.0 - 2.0 * normalDepth.w) * vImpostor.z;\n"
+"    highp vec4 clip = dzyProjMatrix * vec4(position, 1.0);\n"
+"    gl_FragDepth = clip.z / clip.w * 0.5 + 0.5;\n"
+"    DzyMaterial material;\n"
+"    material.diffuse = vec4(albedo.rgb, 1.0);\n"
+"    material.specular = vec4(0.0, 0.0, 0.0, 1.0);\n"
+"    material.ambient = vec4(albedo.rgb, 1.0);\n"
+"    material.emission = vec4(0.0);\n"
+"    vec3 scatteredLight = vec3(0.0);\n"
+"    vec3 reflectedLight = vec3(0.0);\n"
+"    shadeForward(material, position, normal, scatteredLight, reflectedLight);\n"
+"    fragColor = vec4(min(vec3(1.0), albedo.rgb * scatteredLight + reflectedLight), 1.0);\n"
+"}\n";
+
+ProgramImpostor::ProgramImpostor() {
+    setRequirement(false, false, false, false);
+}
+
+bool ProgramImpostor::uploadData(
+    shared_ptr<Camera> camera,
+    shared_ptr<Light> light,
+    shared_ptr<Material> material,
+    glm::mat4& world,
+    glm::mat4& view,
+    glm::mat4& proj) {
+    // everything comes from uniform blocks, instance attributes and setGrid
+    return true;
+}
+
+/// instances of a Crowd skinned with the poses of their clip, a row of
+/// dzyCrowdPoses per pose with three texels per bone, the rows of its
+/// skinning matrix, see Crowd::addClip. The two poses around the pose
+/// position are blended, the last one with the first as the clip loops.
+static const char VERTEX_crowd[] =
+"#version 300 es\n"
+FRAME_BLOCK
+"invariant gl_Position;\n"
+"uniform int dzyMaterialIndex;\n"
+"uniform highp sampler2D dzyCrowdPoses;\n"
+"layout(location = 0) in vec3 dzyVertexPosition;\n"
+"layout(location = 1) in vec3 dzyVertexNormal;\n"
+"layout(location = 2) in vec4 dzyVertexBoneWeights;\n"
+"layout(location = 3) in vec4 dzyVertexBones;\n"
+"layout(location = 8) in mat4 dzyInstanceWorld;\n"
+"layout(location = 12) in vec3 dzyInstancePose;\n"
+"out vec3 vVertexPositionEyeSpace;\n"
+"out vec3 vVertexNormalEyeSpace;\n"
+"flat out int vMaterialIndex;\n"
+"highp mat4 boneMatrix(int bone, int pose) {\n"
+"    highp vec4 r0 = texelFetch(dzyCrowdPoses, ivec2(bone * 3, pose), 0);\n"
+"    highp vec4 r1 = texelFetch(dzyCrowdPoses, ivec2(bone * 3 + 1, pose), 0);\n"
+"    highp vec4 r2 = texelFetch(dzyCrowdPoses, ivec2(bone * 3 + 2, pose), 0);\n"
+"    return transpose(mat4(r0, r1, r2, vec4(0.0, 0.0, 0.0, 1.0)));\n"
+"}\n"
+"void main() {\n"
+"    int first = int(dzyInstancePose.x);\n"
+"    int poses = int(dzyInstancePose.y);\n"
+"    int pose = int(dzyInstancePose.z);\n"
+"    float blend = fract(dzyInstancePose.z);\n"
+"    int pose0 = first + pose;\n"
+"    int pose1 = first + (pose + 1) % poses;\n"
+"    highp mat4 skin = mat4(0.0);\n"
+"    for (int i = 0; i < 4; i++) {\n"
+"        float weight = dzyVertexBoneWeights[i];\n"
+"        if (weight == 0.0) continue;\n"
+"        int bone = int(dzyVertexBones[i]);\n"
+"        highp mat4 m0 = boneMatrix(bone, pose0);\n"
+"        skin += weight * (m0 + (boneMatrix(bone, pose1) - m0) * blend);\n"
+"    }\n"
+"    // the weights sum up to 1, or there are none and the vertex stays\n"
+"    if (skin[3][3] == 0.0) skin = mat4(1.0);\n"
+"    highp mat4 world = dzyInstanceWorld * skin;\n"
+"    vec4 positionEyeSpace = dzyViewMatrix * world * vec4(dzyVertexPosition, 1.0);\n"
+"    gl_Position = dzyProjMatrix * positionEyeSpace;\n"
+"    vVertexPositionEyeSpace = vec3(positionEyeSpace);\n"
+"    vVertexNormalEyeSpace = normalize(mat3(dzyViewMatrix) * mat3(world) * dzyVertexNormal);\n"
+"    vMaterialIndex = dzyMaterialIndex;\n"
+"}\n";
+
+// shaded like any Blinn-Phong Geometry, never faded
+#define FRAGMENT_crowd FRAGMENT_Blin_Phong_shading
+
+ProgramCrowd::ProgramCrowd() {
+    setRequirement(false, true, true, true);
+}
+
+bool ProgramCrowd::uploadData(
+    shared_ptr<Camera> camera,
+    shared_ptr<Light> light,
+    shared_ptr<Material> material,
+    glm::mat4& world,
+    glm::mat4& view,
+    glm::mat4& proj) {
+    // everything comes from uniform blocks, attributes and the pose texture
+    return true;
+}
+
+/// one step of a particle, born again when the spawn schedule of its
+/// slot falls into the step: slot i is born at (i + k * particles) / rate
+/// for any whole k, the step time wraps every particles / rate so it
+/// stays exact. A particle born within the step only moves for the part
+/// after its birth.
+static const char VERTEX_particle_update[] =
+"#version 300 es\n"
+"// world matrix of the emitter, planes to bounce off, one per column\n"
+"uniform highp mat4 dzyEmitterWorld;\n"
+"uniform highp mat4 dzyEmitterPlanes;\n"
+"// rate, particles, lifetime, lifetime jitter\n"
+"uniform highp vec4 dzyEmitterSpawn;\n"
+"// initial velocity in emitter space, speed jitter\n"
+"uniform highp vec4 dzyEmitterVelocity;\n"
+"// spawn radius, cosine of the spread, drag\n"
+"uniform highp vec4 dzyEmitterShape;\n"
+"// world acceleration, bounce\n"
+"uniform highp vec4 dzyEmitterForces;\n"
+"// time in the spawn cycle, step, spawn cycle, seed\n"
+"uniform highp vec4 dzyEmitterStep;\n"
+"layout(location = 0) in highp vec3 dzyParticlePosition;\n"
+"layout(location = 1) in highp vec3 dzyParticleVelocity;\n"
+"layout(location = 2) in highp vec2 dzyParticleAge;\n"
+"out highp vec3 dzyOutPosition;\n"
+"out highp vec3 dzyOutVelocity;\n"
+"out highp vec2 dzyOutAge;\n"
+"highp uint hash(highp uint x) {\n"
+"    x ^= x >> 16;\n"
+"    x *= 0x7feb352du;\n"
+"    x ^= x >> 15;\n"
+"    x *= 0x846ca68bu;\n"
+"    x ^= x >> 16;\n"
+"    return x;\n"
+"}\n"
+"highp float random(inout highp uint seed) {\n"
+"    seed = hash(seed);\n"
+"    return float(seed >> 8) * (1.0 / 16777216.0);\n"
+"}\n"
+"highp vec3 randomDirection(inout highp uint seed) {\n"
+"    highp float z = random(seed) * 2.0 - 1.0;\n"
+"    highp float phi = random(seed) * 6.2831853;\n"
+"    highp float r = sqrt(max(1.0 - z * z, 0.0));\n"
+"    return vec3(r * cos(phi), r * sin(phi), z);\n"
+"}\n"
+"void main() {\n"
+"    highp vec3 position = dzyParticlePosition;\n"
+"    highp vec3 velocity = dzyParticleVelocity;\n"
+"    highp vec2 age = dzyParticleAge;\n"
+"    highp float time = dzyEmitterStep.x;\n"
+"    highp float step = dzyEmitterStep.y;\n"
+"    highp float rate = dzyEmitterSpawn.x;\n"
+"    highp float particles = dzyEmitterSpawn.y;\n"
+"    highp float slot = float(gl_VertexID);\n"
+"    highp float k = floor((time * rate - slot) / particles);\n"
+"    highp float birth = (slot + k * particles) / max(rate, 1e-6);\n"
+"    if (rate > 0.0 && birth > time - step) {\n"
+"        // the same slot and cycle always give the same particle\n"
+"        highp uint seed = hash(uint(gl_VertexID) ^\n"
+"            hash(uint(dzyEmitterStep.z + k + 1.0) ^ uint(dzyEmitterStep.w)));\n"
+"        highp vec3 offset = randomDirection(seed) *\n"
+"            pow(random(seed), 1.0 / 3.0) * dzyEmitterShape.x;\n"
+"        // uniform over the cone around the initial velocity\n"
+"        highp float speed = length(dzyEmitterVelocity.xyz);\n"
+"        highp vec3 axis = speed > 0.0 ? dzyEmitterVelocity.xyz / speed : vec3(0.0, 1.0, 0.0);\n"
+"        highp vec3 tangent = normalize(cross(abs(axis.y) < 0.99 ?\n"
+"            vec3(0.0, 1.0, 0.0) : vec3(1.0, 0.0, 0.0), axis));\n"
+"        highp vec3 bitangent = cross(axis, tangent);\n"
+"        highp float cosTheta = mix(1.0, dzyEmitterShape.y, random(seed));\n"
+"        highp float sinTheta = sqrt(max(1.0 - cosTheta * cosTheta, 0.0));\n"
+"        highp float phi = random(seed) * 6.2831853;\n"
+"        highp vec3 direction = (tangent * cos(phi) + bitangent * sin(phi)) * sinTheta\n"
+"            + axis * cosTheta;\n"
+"        speed *= 1.0 + dzyEmitterVelocity.w * (random(seed) * 2.0 - 1.0);\n"
+"        position = (dzyEmitterWorld * vec4(offset, 1.0)).xyz;\n"
+"        velocity = mat3(dzyEmitterWorld) * direction * speed;\n"
+"        age = vec2(0.0, dzyEmitterSpawn.z *\n"
+"            (1.0 + dzyEmitterSpawn.w * (random(seed) * 2.0 - 1.0)));\n"
+"        step = time - birth;\n"
+"    }\n"
+"    if (age.x < age.y) {\n"
+"        velocity += dzyEmitterForces.xyz * step;\n"
+"        velocity *= max(1.0 - dzyEmitterShape.z * step, 0.0);\n"
+"        position += velocity * step;\n"
+"        // unused planes are (0, 0, 0, 1), never crossed\n"
+"        for (int i = 0; i < 4; i++) {\n"
+"            highp vec4 plane = dzyEmitterPlanes[i];\n"
+"            highp float distance = dot(plane.xyz, position) + plane.w;\n"
+"            highp float approach = dot(plane.xyz, velocity);\n"
+"            if (distance < 0.0 && approach < 0.0) {\n"
+"                position -= plane.xyz * distance;\n"
+"                velocity -= (1.0 + dzyEmitterForces.w) * approach * plane.xyz;\n"
+"            }\n"
+"        }\n"
+"        age.x += step;\n"
+"    }\n"
+"    dzyOutPosition = position;\n"
+"    dzyOutVelocity = velocity;\n"
+"    dzyOutAge = age;\n"
+"}\n";
+
+// nothing is rasterized
+static const char FRAGMENT_particle_update[] =
+"#version 300 es\n"
+"precision mediump float;\n"
+"void main() {\n"
+"}\n";
+
+ProgramParticleUpdate::ProgramParticleUpdate() {
+    setRequirement(false, false, false, false);
+}
+
+bool ProgramParticleUpdate::uploadData(
+    shared_ptr<Camera> camera,
+    shared_ptr<Light> light,
+    shared_ptr<Material> material,
+    glm::mat4& world,
+    glm::mat4& view,
+    glm::mat4& proj) {
+    // everything comes from setEmitter and setStep
+    return true;
+}
+
+void ProgramParticleUpdate::prepareLink() {
+    // captured interleaved in the layout of the attributes read
+    static const char* varyings[] = {
+        "dzyOutPosition", "dzyOutVelocity", "dzyOutAge"
+    };
+    glTransformFeedbackVaryings(mProgramId, 3, varyings, GL_INTERLEAVED_ATTRIBS);
+}
+
+/// a quad in view space around each live particle, dead ones collapse
+/// to a point outside the clip volume
+static const char VERTEX_particle[] =
+"#version 300 es\n"
+FRAME_BLOCK
+"uniform vec4 dzyParticleColor;\n"
+"uniform vec4 dzyParticleEndColor;\n"
+"// size at birth and at death\n"
+"uniform vec4 dzyParticleSize;\n"
+"layout(location = 0) in highp vec3 dzyParticlePosition;\n"
+"layout(location = 2) in highp vec2 dzyParticleAge;\n"
+"out vec2 vCorner;\n"
+"out vec4 vColor;\n"
+"void main() {\n"
+"    float life = dzyParticleAge.x / max(dzyParticleAge.y, 1e-6);\n"
+"    if (life >= 1.0) {\n"
+"        gl_Position = vec4(2.0, 2.0, 2.0, 1.0);\n"
+"        vCorner = vec2(0.0);\n"
+"        vColor = vec4(0.0);\n"
+"        return;\n"
+"    }\n"
+"    // triangle strip\n"
+"    vec2 corner = vec2(float(gl_VertexID & 1), float(gl_VertexID >> 1)) * 2.0 - 1.0;\n"
+"    float size = mix(dzyParticleSize.x, dzyParticleSize.y, life);\n"
+"    vec4 positionEyeSpace = dzyViewMatrix * vec4(dzyParticlePosition, 1.0);\n"
+"    positionEyeSpace.xy += corner * size * 0.5;\n"
+"    gl_Position = dzyProjMatrix * positionEyeSpace;\n"
+"    vCorner = corner;\n"
+"    vColor = mix(dzyParticleColor, dzyParticleEndColor, life);\n"
+"}\n";
+
+/// round soft sprites, blended additively so they need no sorting
+static const char FRAGMENT_particle[] =
+"#version 300 es\n"
+"precision mediump float;\n"
+"in vec2 vCorner;\n"
+"in vec4 vColor;\n"
+"out vec4 fragColor;\n"
+"void main() {\n"
+"    float falloff = 1.0 - dot(vCorner, vCorner);\n"
+"    if (falloff <= 0.0) discard;\n"
+"    fragColor = vec4(vColor.rgb, vColor.a * falloff);\n"
+"}\n";
+
+ProgramParticle::ProgramParticle() {
+    setRequirement(false, false, false, false);
+}
+
+bool ProgramParticle::uploadData(
+    shared_ptr<Camera> camera,
+    shared_ptr<Light> light,
+    shared_ptr<Material> material,
+    glm::mat4& world,
+    glm::mat4& view,
+    glm::mat4& proj) {
+    // everything comes from the per-frame block, attributes and setAppearance
+    return true;
+}
+
+static const char VERTEX_depth_only[] =
+"#version 300 es\n"
+"uniform mat4 dzyMVPMatrix;\n"
+"in vec3 dzyVertexPosition;\n"
+"void main() {\n"
+"    gl_Position = dzyMVPMatrix * vec4(dzyVertexPosition, 1.0);\n"
+"}\n";
+
+static const char FRAGMENT_depth_only[] =
+"#version 300 es\n"
+"precision mediump float;\n"
+"out vec4 fragColor;\n"
+"void main() {\n"
+"    fragColor = vec4(1.0);\n"
+"}\n";
+
+ProgramDepthOnly::ProgramDepthOnly() {
+    setRequirement(false, false, false, false);
+}
+
+bool ProgramDepthOnly::uploadData(
+    shared_ptr<Camera> camera,
+    shared_ptr<Light> light,
+    shared_ptr<Material> material,
+    glm::mat4& world,
+    glm::mat4& view,
+    glm::mat4& proj) {
+    glm::mat4 mvp = proj * view * world;
+    setUniform(SLOT_MVP_MATRIX, mvp);
+    return true;
+}
+
+bool ProgramDepthOnly::updateMeshData(shared_ptr<Mesh> mesh, GLuint vbo) {
+    GLState::get()->bindBuffer(GL_ARRAY_BUFFER, vbo);
+
+    if (mesh->hasVertexPositions()) {
+        GLint posLoc = getLocation(SLOT_VERTEX_POSITION);
+        glEnableVertexAttribArray(posLoc);
+        glVertexAttribPointer(
+            posLoc,
+            mesh->getPositionNumComponent(),// size
+            GL_FLOAT,                       // type
+            GL_FALSE,                       // normalized
+            mesh->getPositionBufStride(),   // stride, 0 means tightly packed
+            (void*)mesh->getPositionOffset()// offset
+        );
+    }
+    return true;
+}
+
 /// built-in shaders, mvp & vertex position are mandatory
 ProgramManager::ProgramTable ProgramManager::builtInProgramTable[] = {
 #define PROG_TBL_ENTRY_DEF(NAME) {                  \
@@ -623,39 +1441,110 @@ ProgramManager::ProgramTable ProgramManager::builtInProgramTable[] = {
     PROG_TBL_ENTRY_DEF(simple_vertex_color),
     PROG_TBL_ENTRY_DEF(simple_constant_color),
     PROG_TBL_ENTRY_DEF_END()
+};
+
+/// shaders used by the render itself, not for auto program selection
+ProgramManager::ProgramTable ProgramManager::internalProgramTable[] = {
+    PROG_TBL_ENTRY_DEF(depth_only),
+    PROG_TBL_ENTRY_DEF(instanced_Blin_Phong_shading),
+    PROG_TBL_ENTRY_DEF(instanced_simple_material),
+    PROG_TBL_ENTRY_DEF(gbuffer_Blin_Phong_shading),
+    PROG_TBL_ENTRY_DEF(gbuffer_instanced_Blin_Phong_shading),
+    PROG_TBL_ENTRY_DEF(deferred_emission),
+    PROG_TBL_ENTRY_DEF(deferred_light_fullscreen),
+    PROG_TBL_ENTRY_DEF(deferred_light_volume),
+    PROG_TBL_ENTRY_DEF(depth_Blin_Phong_shading),
+    PROG_TBL_ENTRY_DEF(depth_simple_material),
+    PROG_TBL_ENTRY_DEF(depth_simple_vertex_color),
+    PROG_TBL_ENTRY_DEF(depth_simple_constant_color),
+    PROG_TBL_ENTRY_DEF(depth_instanced_Blin_Phong_shading),
+    PROG_TBL_ENTRY_DEF(depth_instanced_simple_material),
+    PROG_TBL_ENTRY_DEF(impostor_Blin_Phong_shading),
+    PROG_TBL_ENTRY_DEF(impostor_simple_material),
+    PROG_TBL_ENTRY_DEF(impostor),
+    PROG_TBL_ENTRY_DEF(crowd),
+    PROG_TBL_ENTRY_DEF(particle_update),
+    PROG_TBL_ENTRY_DEF(particle),
+    PROG_TBL_ENTRY_DEF_END()
 
 #undef PROG_TBL_ENTRY_DEF
 #undef PROG_TBL_ENTRY_DEF2
 #undef PROG_TBL_ENTRY_DEF_END
 };
 
+shared_ptr<Program> ProgramManager::compileProgram(const ProgramTable& entry) {
+    shared_ptr<Shader> vtxShader(new Shader(Shader::Vertex));
+    if (!vtxShader->compileFromMemory(entry.vertexSrc, entry.vertexLen)) {
+        ALOGE("error compile vertex shader");
+        return nullptr;
+    }
+    shared_ptr<Shader> fragShader(new Shader(Shader::Fragment));
+    if (!fragShader->compileFromMemory(entry.fragmentSrc, entry.fragmentLen)) {
+        ALOGE("error compile fragment shader");
+        return nullptr;
+    }
+    shared_ptr<Program> program(createProgram(entry.technique));
+    if (!program->link(vtxShader, fragShader)) {
+        ALOGE("error link program");
+        return nullptr;
+    }
+
+    return program;
+}
+
 bool ProgramManager::preCompile(shared_ptr<EngineContext> engineContext) {
     for (int i=0; builtInProgramTable[i].technique; i++) {
-        shared_ptr<Shader> vtxShader(new Shader(Shader::Vertex));
-        if (!vtxShader->compileFromMemory(builtInProgramTable[i].vertexSrc, builtInProgramTable[i].vertexLen)) {
-            ALOGE("error compile vertex shader");
-            return false;
-        }
-        shared_ptr<Shader> fragShader(new Shader(Shader::Fragment));
-        if (!fragShader->compileFromMemory(builtInProgramTable[i].fragmentSrc, builtInProgramTable[i].fragmentLen)) {
-            ALOGE("error compile fragment shader");
-            return false;
-        }
-        shared_ptr<Program> program(createProgram(builtInProgramTable[i].technique));
-        if (!program->link(vtxShader, fragShader)) {
-            ALOGE("error link program");
-            return false;
-        }
+        shared_ptr<Program> program(compileProgram(builtInProgramTable[i]));
+        if (!program) return false;
+        mPrograms.push_back(program);
+    }
 
-        program->use();
-        program->storeLocation();
+    for (int i=0; internalProgramTable[i].technique; i++) {
+        shared_ptr<Program> program(compileProgram(internalProgramTable[i]));
+        if (!program) return false;
+        mInternalPrograms[internalProgramTable[i].technique] = program;
+    }
 
-        mPrograms.push_back(program);
+    for (int i=0; builtInProgramTable[i].technique; i++) {
+        shared_ptr<Program> instanced(getInternalProgram(
+            string("instanced_") + builtInProgramTable[i].technique));
+        if (instanced) mInstancedPrograms[mPrograms[i].get()] = instanced;
+
+        static const char* prefixes[NUM_PROGRAM_VARIANTS] = {
+            NULL, "gbuffer_", "depth_", "impostor_"
+        };
+        string technique(builtInProgramTable[i].technique);
+        for (int v=PROGRAM_VARIANT_COLOR+1; v<NUM_PROGRAM_VARIANTS; v++) {
+            shared_ptr<Program> variant(getInternalProgram(prefixes[v] + technique));
+            if (variant) mVariants[v][mPrograms[i].get()] = variant;
+            variant = getInternalProgram(string(prefixes[v]) + "instanced_" + technique);
+            if (variant && instanced) mVariants[v][instanced.get()] = variant;
+        }
     }
 
     return true;
 }
 
+shared_ptr<Program> ProgramManager::getInternalProgram(const string& technique) {
+    auto it = mInternalPrograms.find(technique);
+    if (it == mInternalPrograms.end()) return nullptr;
+    return it->second;
+}
+
+shared_ptr<Program> ProgramManager::getInstancedProgram(shared_ptr<Program> program) {
+    auto it = mInstancedPrograms.find(program.get());
+    if (it == mInstancedPrograms.end()) return nullptr;
+    return it->second;
+}
+
+shared_ptr<Program> ProgramManager::getVariant(shared_ptr<Program> program,
+    ProgramVariant variant) {
+    if (variant == PROGRAM_VARIANT_COLOR) return program;
+    auto it = mVariants[variant].find(program.get());
+    if (it == mVariants[variant].end()) return nullptr;
+    return it->second;
+}
+
 shared_ptr<Program> ProgramManager::getCompatibleProgram(
     shared_ptr<Material> material, bool hasLight, shared_ptr<Mesh> mesh) {
     for (auto it = mPrograms.begin(); it != mPrograms.end(); it++) {
@@ -696,6 +1585,33 @@ shared_ptr<Program> ProgramManager::createProgram(const string& name) {
         return shared_ptr<Program>(new Program010);
     if (name == "simple_constant_color")
         return shared_ptr<Program>(new Program000);
+    if (name == "depth_only")
+        return shared_ptr<Program>(new ProgramDepthOnly);
+    if (name == "instanced_Blin_Phong_shading")
+        return shared_ptr<Program>(new ProgramInstanced100);
+    if (name == "instanced_simple_material")
+        return shared_ptr<Program>(new ProgramInstanced020);
+    if (name == "gbuffer_Blin_Phong_shading")
+        return shared_ptr<Program>(new Program100);
+    if (name == "gbuffer_instanced_Blin_Phong_shading")
+        return shared_ptr<Program>(new ProgramInstanced100);
+    if (name == "deferred_emission" || name == "deferred_light_fullscreen"
+        || name == "deferred_light_volume")
+        return shared_ptr<Program>(new ProgramDeferredLight);
+    if (name == "impostor")
+        return shared_ptr<Program>(new ProgramImpostor);
+    if (name == "crowd")
+        return shared_ptr<Program>(new ProgramCrowd);
+    if (name == "particle_update")
+        return shared_ptr<Program>(new ProgramParticleUpdate);
+    if (name == "particle")
+        return shared_ptr<Program>(new ProgramParticle);
+    // depth and impostor variants upload and bind the same data as their
+    // program
+    if (name.compare(0, 6, "depth_") == 0)
+        return createProgram(name.substr(6));
+    if (name.compare(0, 9, "impostor_") == 0)
+        return createProgram(name.substr(9));
 
     return nullptr;
 }
@@ -10,13 +10,99 @@
 #include "camera.h"
 #include "light.h"
 #include "animation.h"
+#include "bvh.h"
+#include "occlusion_culler.h"
+#include "occlusion_query.h"
+#include "instance_renderer.h"
+#include "render_queue.h"
+#include "gl_state.h"
+#include "frame_uniforms.h"
+#include "material_table.h"
+#include "worker_pool.h"
+#include "light_clusters.h"
+#include "deferred_renderer.h"
+#include "dynamic_resolution.h"
+#include "render_graph.h"
+#include "impostor.h"
+#include "hlod.h"
+#include "crowd.h"
+#include "particle_emitter.h"
+#include "shadow_maps.h"
 #include "render.h"
 
 using namespace std;
 
 namespace dzy {
 
-Render::Render() {
+// Geometry per job of buildDrawList
+static const size_t BUILD_CHUNK_SIZE = 64;
+// weight of the newest frame in the smoothed depth complexity
+static const float DEPTH_COMPLEXITY_SMOOTHING = 0.1f;
+// fraction of the threshold below which the depth pre-pass turns off
+static const float DEPTH_PREPASS_HYSTERESIS = 0.75f;
+// the scene where nothing is drawn
+static const glm::vec4 CLEAR_COLOR(0.6f, 0.7f, 1.0f, 1.0f);
+
+// fraction of the screen covered by the projection of a box, all of it
+// if the box reaches behind the eye
+static float getScreenCoverage(const AABB& box, const glm::mat4& viewProj) {
+    glm::vec3 bmin = box.getMin();
+    glm::vec3 bmax = box.getMax();
+    glm::vec2 lo(1.f);
+    glm::vec2 hi(-1.f);
+    for (int i=0; i<8; i++) {
+        glm::vec4 corner((i & 1) ? bmax.x : bmin.x, (i & 2) ? bmax.y : bmin.y,
+            (i & 4) ? bmax.z : bmin.z, 1.f);
+        glm::vec4 clip = viewProj * corner;
+        if (clip.w <= 0.f) return 1.f;
+        glm::vec2 ndc = glm::vec2(clip) / clip.w;
+        lo = glm::min(lo, ndc);
+        hi = glm::max(hi, ndc);
+    }
+    lo = glm::max(lo, glm::vec2(-1.f));
+    hi = glm::min(hi, glm::vec2(1.f));
+    if (hi.x <= lo.x || hi.y <= lo.y) return 0.f;
+    return (hi.x - lo.x) * (hi.y - lo.y) * 0.25f;
+}
+
+Render::Render()
+    : mFrustumCulling(true)
+    , mCullingActive(false)
+    , mNumCulled(0)
+    , mOcclusionMode(OCCLUSION_NONE)
+    , mOcclusionCuller(new OcclusionCuller)
+    , mOcclusionQueries(new OcclusionQueryManager)
+    , mInstancing(true)
+    , mInstanceRenderer(new InstanceRenderer)
+    , mRenderQueue(new RenderQueue)
+    , mDepthScale(0.f)
+    , mBuildEye(0.f)
+    , mBuildFocal(1.f)
+    , mImpostorRenderer(new ImpostorRenderer)
+    , mFadeOut(0.f)
+    , mCrowdRenderer(new CrowdRenderer)
+    , mParticleRenderer(new ParticleRenderer)
+    , mShadowMaps(new ShadowMaps)
+    , mFrameUniforms(new FrameUniforms)
+    , mMaterialTable(new MaterialTable)
+    , mClusteredLighting(true)
+    , mLightClusters(new LightClusters)
+    , mDeferredShading(false)
+    , mDeferredFrame(false)
+    , mDeferredRenderer(new DeferredRenderer)
+    , mDepthPrepassMode(DEPTH_PREPASS_AUTO)
+    , mDepthPrepassThreshold(2.5f)
+    , mDepthComplexity(0.f)
+    , mDepthPrepassActive(false)
+    , mDepthPrepassFrame(false)
+    , mResolutionScaling(false)
+    , mDynamicResolution(new DynamicResolution)
+    , mRenderGraph(new RenderGraph)
+    , mPipelined(false)
+    , mBuildFrame(NULL)
+    , mAspect(1.f)
+    , mParallelBuild(true)
+    , mWorkers(new WorkerPool) {
     TRACE("");
 }
 
@@ -31,12 +117,13 @@ bool Render::init() {
         return false;
     }
 
-    glCullFace(GL_BACK);
-    glEnable(GL_CULL_FACE);
-    glEnable(GL_DEPTH_TEST);
-    glClearColor(0.6f, 0.7f, 1.0f, 1.0f);
+    GLState* state = GLState::get();
+    state->reset();
+    state->cullFace(GL_BACK);
+    state->enable(GL_CULL_FACE, true);
+    state->enable(GL_DEPTH_TEST, true);
 
-    glViewport(0, 0,
+    state->viewport(0, 0,
         engineContext->getSurfaceWidth(),
         engineContext->getSurfaceHeight());
 
@@ -44,10 +131,35 @@ bool Render::init() {
 }
 
 bool Render::release() {
+    mOcclusionCuller->stop();
+    mWorkers->stop();
+    mOcclusionQueries->release();
+    mInstanceRenderer->release();
+    mImpostorRenderer->release();
+    mCrowdRenderer->release();
+    mParticleRenderer->release();
+    mShadowMaps->release();
+    mFrameUniforms->release();
+    mMaterialTable->release();
+    mLightClusters->release();
+    mDeferredRenderer->release();
+    mDynamicResolution->release();
+    mRenderGraph->release();
+    mLocalFrame.clear();
+    GLState::get()->deleteQueued();
+    GLState::get()->reset();
     return true;
 }
 
 bool Render::drawScene(shared_ptr<Scene> scene) {
+    if (!buildFrame(scene, mLocalFrame)) return false;
+    bool ret = submitFrame(mLocalFrame);
+    mLocalFrame.clear();
+    return ret;
+}
+
+bool Render::buildFrame(shared_ptr<Scene> scene, FrameSnapshot& frame) {
+    MeasureDuration duration;
     shared_ptr<EngineContext> engineContext(getEngineContext());
     if (!engineContext) {
         ALOGE("EngineContext released while rendering a scene");
@@ -66,64 +178,769 @@ bool Render::drawScene(shared_ptr<Scene> scene) {
     if (skeletonRoot) {
         skeletonRoot->setUpdateFlag(NodeObj::F_UPDATE_BONE_TRANSFORM, true);
     }
-    glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
+
+    frame.mScene = scene;
+    frame.mItems.clear();
+    frame.mImpostors.clear();
+    frame.mCrowds.clear();
+    frame.mLights.clear();
+    frame.mOcclusionIndex.reset();
+    for (unsigned int i=0; i<scene->getNumLights(); i++) {
+        shared_ptr<Light> light(scene->getLight(i));
+        if (light) frame.mLights.push_back(shared_ptr<Light>(new Light(*light)));
+    }
+    shared_ptr<Camera> camera(scene->getActiveCamera());
+    frame.mCamera.reset();
+    float surfaceWidth = engineContext->getSurfaceWidth();
+    float surfaceHeight = engineContext->getSurfaceHeight();
+    mAspect = surfaceWidth/surfaceHeight;
+    if (camera) {
+        //override the aspect ratio
+        camera->setAspect(mAspect);
+        frame.mCamera.reset(new Camera(*camera));
+        mView = camera->getViewMatrix();
+        mDepthScale = 1.f / camera->getFarPlane();
+        mBuildViewProj = camera->getProjMatrix() * mView;
+        mBuildEye = glm::vec3(glm::inverse(mView)[3]);
+        mBuildFocal = camera->getProjMatrix()[1][1];
+        // before the scene graph walk, Geometry::draw asks it
+        if (scene->getHLOD()) scene->getHLOD()->select(mBuildEye);
+    }
+    if ((mClusteredLighting || mDeferredShading) && frame.mCamera) {
+        mLightClusters->build(frame.mCamera, frame.mLights,
+            surfaceWidth, surfaceHeight, frame.mLightGrid);
+    } else {
+        frame.mLightGrid.clear();
+    }
+
+    cullScene(scene);
+    mBuildFrame = &frame;
+    mFadeOut = 0.f;
+    mFadeStack.clear();
     rootNode->draw(*this, scene, timeStamp);
+    mBuildFrame = NULL;
+    buildDrawList(frame);
+    // the casters of the shadow maps come from the walk and the draw list
+    mShadowMaps->build(frame);
+    // instances are culled and posed here, skinned on the GPU
+    Crowd::VisibleFunc isInView = [this] (const AABB& box) { return isVisible(box); };
+    for (unsigned int i=0; i<scene->getNumCrowds() && frame.mCamera; i++) {
+        frame.mCrowds.push_back(FrameSnapshot::CrowdItem());
+        FrameSnapshot::CrowdItem& item = frame.mCrowds.back();
+        item.mCrowd = scene->getCrowd(i);
+        item.mCrowd->buildInstances(timeStamp, isInView, item);
+        if (!item.mNumInstances) frame.mCrowds.pop_back();
+    }
+    updateDepthPrepass(frame);
+    if (mCullingActive && getActiveOcclusionMode() == OCCLUSION_HARDWARE) {
+        frame.mOcclusionIndex = mCullingIndex;
+        frame.mViewProj = mViewProj;
+        frame.mEye = mEye;
+    }
+    mCullingActive = false;
+    mCullingIndex.reset();
+    frame.mBuildTime = duration.getMicroSeconds();
+    return true;
+}
+
+void Render::recordDraw(shared_ptr<Geometry> geometry, bool boundsChanged, bool skinned) {
+    if (!mBuildFrame) {
+        ALOGE("Geometry drawn outside of Render::buildFrame");
+        return;
+    }
+    Candidate candidate;
+    candidate.mGeometry = geometry;
+    // world transforms and mesh bounds are computed lazily, along the
+    // parent chain and for shared meshes, the workers only read them
+    candidate.mWorld = geometry->getWorldTransform().toMat4();
+    geometry->getMesh()->getBoundingBox();
+    candidate.mBoundsChanged = boundsChanged;
+    candidate.mSkinned = skinned;
+    candidate.mFadeOut = mFadeOut;
+    mCandidates.push_back(candidate);
+    // casters are kept even out of view, they shadow what is not
+    if (mShadowMaps->isEnabled())
+        mShadowMaps->recordCaster(geometry, candidate.mWorld, boundsChanged, skinned);
+}
+
+void Render::recordEmitter(shared_ptr<ParticleEmitter> emitter, double timeStamp) {
+    if (!mBuildFrame) {
+        ALOGE("ParticleEmitter drawn outside of Render::buildFrame");
+        return;
+    }
+    mBuildFrame->mEmitters.push_back(FrameSnapshot::EmitterItem());
+    FrameSnapshot::EmitterItem& item = mBuildFrame->mEmitters.back();
+    emitter->buildItem(timeStamp, item);
+    const AABB& bounds = emitter->getBounds();
+    if (bounds.isValid()) item.mVisible = isVisible(bounds.transform(item.mWorld));
+}
+
+void Render::buildDrawList(FrameSnapshot& frame) {
+    size_t numCandidates = mCandidates.size();
+    int numJobs = (numCandidates + BUILD_CHUNK_SIZE - 1) / BUILD_CHUNK_SIZE;
+    if ((int)mFragments.size() < numJobs) mFragments.resize(numJobs);
+
+    WorkerPool::Job job = [&] (int j) {
+        size_t begin = j * BUILD_CHUNK_SIZE;
+        buildFragment(begin, min(begin + BUILD_CHUNK_SIZE, numCandidates), mFragments[j]);
+    };
+    // hardware occlusion queries schedule re-tests while testing
+    bool queries = mCullingActive && getActiveOcclusionMode() == OCCLUSION_HARDWARE;
+    if (mParallelBuild && !queries) {
+        mWorkers->run(numJobs, job);
+    } else {
+        for (int j=0; j<numJobs; j++) job(j);
+    }
+
+    // scene graph order is kept, the GL thread sorts the list anyway
+    size_t numItems = 0;
+    frame.mDepthComplexity = 0.f;
+    for (int j=0; j<numJobs; j++) {
+        numItems += mFragments[j].mItems.size();
+        frame.mDepthComplexity += mFragments[j].mCoverage;
+    }
+    frame.mItems.reserve(numItems);
+    for (int j=0; j<numJobs; j++) {
+        Fragment& fragment = mFragments[j];
+        for (size_t i=0; i<fragment.mItems.size(); i++) {
+            frame.mItems.push_back(FrameSnapshot::DrawItem());
+            std::swap(frame.mItems.back(), fragment.mItems[i]);
+        }
+        fragment.mItems.clear();
+        mNumCulled += fragment.mNumCulled;
+    }
+    mCandidates.clear();
+}
+
+void Render::updateDepthPrepass(FrameSnapshot& frame) {
+    if (!frame.mCamera) {
+        frame.mDepthPrepass = false;
+        return;
+    }
+    mDepthComplexity += (frame.mDepthComplexity - mDepthComplexity) * DEPTH_COMPLEXITY_SMOOTHING;
+    switch (mDepthPrepassMode) {
+        case DEPTH_PREPASS_OFF: mDepthPrepassActive = false; break;
+        case DEPTH_PREPASS_ON: mDepthPrepassActive = true; break;
+        case DEPTH_PREPASS_AUTO:
+            if (mDepthComplexity > mDepthPrepassThreshold)
+                mDepthPrepassActive = true;
+            else if (mDepthComplexity < mDepthPrepassThreshold * DEPTH_PREPASS_HYSTERESIS)
+                mDepthPrepassActive = false;
+            break;
+    }
+    frame.mDepthPrepass = mDepthPrepassActive;
+}
+
+void Render::buildFragment(size_t begin, size_t end, Fragment& fragment) {
+    fragment.mNumCulled = 0;
+    fragment.mCoverage = 0.f;
+    for (size_t c=begin; c<end; c++) {
+        const Candidate& candidate = mCandidates[c];
+        shared_ptr<Geometry> geometry(candidate.mGeometry);
+        if (!isVisible(geometry, candidate.mBoundsChanged)) {
+            fragment.mNumCulled++;
+            continue;
+        }
+
+        fragment.mItems.push_back(FrameSnapshot::DrawItem());
+        FrameSnapshot::DrawItem& item = fragment.mItems.back();
+        item.mGeometry = geometry;
+        item.mMaterial = geometry->getMaterial();
+        item.mWorld = candidate.mWorld;
+        item.mNormal = glm::transpose(glm::inverse(glm::mat3(candidate.mWorld)));
+        item.mFadeOut = candidate.mFadeOut;
+
+        // cameras may be shared, only the copy gets the aspect ratio
+        shared_ptr<Camera> camera(geometry->getCamera());
+        if (camera) {
+            item.mCamera.reset(new Camera(*camera));
+            item.mCamera->setAspect(mAspect);
+        }
+        shared_ptr<Light> light(geometry->getLight());
+        if (light) item.mLight.reset(new Light(*light));
+
+        int proxy = geometry->getProxy();
+        shared_ptr<Mesh> mesh(geometry->getMesh());
+        AABB box = (mCullingIndex && proxy != BVH::NULL_PROXY) ?
+            mCullingIndex->getBounds(proxy) :
+            mesh->getBoundingBox().transform(candidate.mWorld);
+        item.mDepth = -(mView * glm::vec4(box.getCenter(), 1.f)).z * mDepthScale;
+        // blended and overlay Geometry add nothing a pre-pass could save
+        if (!item.mCamera && !(item.mMaterial && item.mMaterial->isTransparent()))
+            fragment.mCoverage += getScreenCoverage(box, mBuildViewProj);
+
+        if (candidate.mSkinned) {
+            // the Mesh is skinned again for the next frame while this one
+            // is submitted
+            const char* vertices = (const char*)mesh->getVertexBuf();
+            item.mVertices.assign(vertices, vertices + mesh->getVertexBufSize());
+        }
+    }
+}
+
+bool Render::submitFrame(FrameSnapshot& frame) {
+    MeasureDuration duration;
+    shared_ptr<EngineContext> engineContext(getEngineContext());
+    if (!engineContext) {
+        ALOGE("EngineContext released while rendering a scene");
+        return false;
+    }
+    if (!frame.mScene) return false;
+    // GL objects of Geometry dropped on the game thread
+    GLState::get()->deleteQueued();
+
+    mSurfaceSize = glm::ivec2(engineContext->getSurfaceWidth(), engineContext->getSurfaceHeight());
+    glm::ivec2 targetSize(mSurfaceSize);
+    mSceneSize = mSurfaceSize;
+    if (mResolutionScaling) {
+        mDynamicResolution->beginTiming();
+        targetSize = mDynamicResolution->getTargetSize(mSurfaceSize.x, mSurfaceSize.y);
+        mSceneSize = mDynamicResolution->getSceneSize(mSurfaceSize.x, mSurfaceSize.y);
+    }
+
+    mSceneLights = frame.mLights;
+    mFrameUniforms->invalidate();
+    mMaterialTable->setScene(frame.mScene);
+    // impostors first seen in this frame, their cells are drawn before
+    // the frame so they can stand in right away
+    mImpostorRenderer->bake(frame, *mMaterialTable, *mFrameUniforms);
+    // one step of every emitter, its particles are drawn with the scene
+    mParticleRenderer->simulate(frame);
+    bool clustered = frame.mLightGrid.isValid() && mLightClusters->upload(frame.mLightGrid);
+    if (!clustered) frame.mLightGrid.clear();
+    // lights of a deferred frame come from the grid
+    mDeferredFrame = mDeferredShading && clustered && mDeferredRenderer->prepare();
+    if (!buildRenderGraph(frame, targetSize)) {
+        ALOGW("render targets not available, frame drawn to the window");
+        mDeferredFrame = false;
+        mSceneSize = mSurfaceSize;
+        if (!buildRenderGraph(frame, targetSize)) {
+            if (mResolutionScaling) mDynamicResolution->endTiming();
+            return false;
+        }
+    }
+    mFrameUniforms->setViewport(mSceneSize.x, mSceneSize.y);
+    if (clustered) {
+        // clusters are tiles of the surface, whatever the pixels they span
+        glm::vec4 scale(frame.mLightGrid.mScale);
+        scale.x *= (float)mSurfaceSize.x / mSceneSize.x;
+        scale.y *= (float)mSurfaceSize.y / mSceneSize.y;
+        mFrameUniforms->setLightGrid(scale, frame.mLightGrid.mCount);
+    }
+    if (frame.mCamera) updateFrameUniforms(frame, frame.mCamera, nullptr);
+
+    bool hasLight = !frame.mLights.empty();
+    for (size_t i=0; i<frame.mItems.size(); i++) {
+        const FrameSnapshot::DrawItem& item = frame.mItems[i];
+        if (!item.mGeometry->prepareBufferObject(item.mVertices)) continue;
+        // drawn together with Geometry sharing the Mesh at the end of the scene
+        if (queueInstance(hasLight, frame, i)) continue;
+        // drawn in sorted order once the whole frame is queued
+        queueDraw(hasLight, frame, i);
+    }
+    // the buffer objects of the casters are up to date, the frame
+    // uniforms are the camera ones again once the maps are drawn
+    mShadowMaps->draw(frame, *mMaterialTable, *mFrameUniforms);
+    if (frame.mCamera) updateFrameUniforms(frame, frame.mCamera, nullptr);
+    submitQueue(frame);
+    mDeferredFrame = false;
+    mDepthPrepassFrame = false;
+
+    if (mResolutionScaling) mDynamicResolution->endTiming();
+    GLState::get()->endFrame();
     eglSwapBuffers(engineContext->getEGLDisplay(), engineContext->getEGLSurface());
+    if (mResolutionScaling) mDynamicResolution->update(duration.getMicroSeconds());
 
     return true;
 }
 
-bool Render::drawNode(shared_ptr<Scene> scene, shared_ptr<Node> node) {
-    return true;
+void Render::setPipelined(bool pipelined) {
+    if (pipelined && mOcclusionMode == OCCLUSION_HARDWARE)
+        ALOGW("frames are pipelined, software occlusion culling replaces the hardware queries");
+    mPipelined = pipelined;
+    if (getActiveOcclusionMode() != OCCLUSION_SOFTWARE) mOcclusionCuller->stop();
 }
 
-bool Render::drawGeometry(shared_ptr<Scene> scene, shared_ptr<Geometry> geometry) {
-    if (!geometry || !scene) {
-        ALOGE("Invalid argument");
-        return false;
+Render::OcclusionMode Render::getActiveOcclusionMode() const {
+    if (mOcclusionMode == OCCLUSION_HARDWARE && mPipelined) return OCCLUSION_SOFTWARE;
+    return mOcclusionMode;
+}
+
+void Render::cullScene(shared_ptr<Scene> scene) {
+    mCullingActive = false;
+    mNumCulled = 0;
+    shared_ptr<BVH> bvh(scene->getSpatialIndex());
+    if (!mFrustumCulling || !bvh) return;
+
+    shared_ptr<Camera> camera(scene->getActiveCamera());
+    if (!camera) return;
+    glm::mat4 view = camera->getViewMatrix();
+    glm::mat4 viewProj = camera->getProjMatrix() * view;
+    mFrustum.setMatrix(viewProj);
+    mViewProj = viewProj;
+    mEye = glm::vec3(glm::inverse(view)[3]);
+
+    bvh->optimize();
+    vector<int> proxies;
+    bvh->queryFrustum(mFrustum, proxies);
+    mVisibility.assign(bvh->getCapacity(), 0);
+    for (size_t i=0; i<proxies.size(); i++) {
+        mVisibility[proxies[i]] = 1;
     }
+    mCullingIndex = bvh;
+    mCullingActive = true;
 
-    shared_ptr<Node> rootNode(scene->getRootNode());
-    assert(rootNode);
-    glm::mat4 world = geometry->getWorldTransform().toMat4();
-    glm::mat4 view = glm::mat4(1.0f);
-    glm::mat4 proj = glm::mat4(1.0f);
+    OcclusionMode mode = getActiveOcclusionMode();
+    if (mode == OCCLUSION_SOFTWARE) {
+        mOcclusionCuller->start();
+        mOcclusionCuller->beginFrame(viewProj);
+        submitOcclusion(bvh, proxies, viewProj);
+    } else if (mode == OCCLUSION_HARDWARE) {
+        mOcclusionQueries->beginFrame();
+    }
+}
 
-    shared_ptr<Material> material(geometry->getMaterial());
-    shared_ptr<Program> currentProgram(
-        geometry->getProgram(material, scene->getNumLights() > 0, geometry->getMesh()));
+void Render::submitOcclusion(shared_ptr<BVH> bvh,
+    const vector<int>& proxies, const glm::mat4& viewProj) {
+    vector<OcclusionCuller::Occluder> occluders;
+    vector<OcclusionCuller::Occludee> occludees;
+    for (size_t i=0; i<proxies.size(); i++) {
+        shared_ptr<Geometry> geometry(bvh->getGeometry(proxies[i]));
+        // same rules as isVisible, these are never culled
+        if (!geometry || geometry->getCamera() || geometry->getMesh()->hasBones())
+            continue;
+        if (geometry->isOccluder()) {
+            OcclusionCuller::Occluder occluder;
+            occluder.mMesh = geometry->getOccluderMesh();
+            occluder.mWorld = geometry->getWorldTransform().toMat4();
+            occluders.push_back(occluder);
+        } else {
+            // the fat box keeps the result valid while the Geometry
+            // moves a little in the next frame
+            OcclusionCuller::Occludee occludee;
+            occludee.mProxy = proxies[i];
+            occludee.mBox = bvh->getFatBounds(proxies[i]);
+            occludees.push_back(occludee);
+        }
+    }
+    mOcclusionCuller->submit(viewProj, occluders, occludees);
+}
+
+void Render::setOcclusionMode(OcclusionMode mode) {
+    mOcclusionMode = mode;
+    if (getActiveOcclusionMode() != OCCLUSION_SOFTWARE) mOcclusionCuller->stop();
+}
+
+float Render::getOcclusionRate() const {
+    switch (getActiveOcclusionMode()) {
+        case OCCLUSION_SOFTWARE: return mOcclusionCuller->getOcclusionRate();
+        case OCCLUSION_HARDWARE: return mOcclusionQueries->getOcclusionRate();
+        default: return 0.f;
+    }
+}
+
+bool Render::isVisible(shared_ptr<Geometry> geometry, bool boundsChanged) {
+    if (!mCullingActive) return true;
+    // rendered with its own camera, not the frustum we culled against
+    if (geometry->getCamera()) return true;
+    // bind pose bounds are not conservative for skinned meshes, those
+    // with SkinBounds were culled by their pose before skinning
+    if (geometry->getMesh()->hasBones()) return true;
+
+    bool visible;
+    int proxy = geometry->getProxy();
+    if (boundsChanged || proxy == BVH::NULL_PROXY || proxy >= (int)mVisibility.size())
+        visible = mFrustum.intersects(geometry->getWorldBoundingBox());
+    else
+        visible = mVisibility[proxy] != 0;
+    if (visible && proxy != BVH::NULL_PROXY && mCullingIndex) {
+        OcclusionMode mode = getActiveOcclusionMode();
+        if (mode == OCCLUSION_SOFTWARE)
+            visible = !mOcclusionCuller->isOccluded(proxy, mCullingIndex->getBounds(proxy));
+        else if (mode == OCCLUSION_HARDWARE)
+            visible = mOcclusionQueries->isVisible(proxy, geometry.get());
+    }
+    return visible;
+}
+
+bool Render::isVisible(const AABB& box) {
+    if (!mCullingActive || mFrustum.intersects(box)) return true;
+    mNumCulled++;
+    return false;
+}
+
+bool Render::queueInstance(bool hasLight, const FrameSnapshot& frame, size_t index) {
+    const FrameSnapshot::DrawItem& item = frame.mItems[index];
+    if (!mInstancing || !item.mGeometry->isAutoProgram()) return false;
+    // instances are drawn in no particular order
+    if (item.mMaterial && item.mMaterial->isTransparent()) return false;
+    // per Geometry camera and light can not be shared by an instance group
+    if (item.mCamera || item.mLight) return false;
+    if (item.mGeometry->getMesh()->hasBones()) return false;
+    // the fade is a uniform
+    if (item.mFadeOut > 0.f) return false;
+    return mInstanceRenderer->add(hasLight, frame, index);
+}
+
+void Render::drawInstances(const FrameSnapshot& frame, ProgramVariant variant) {
+    // the block may hold the camera or light of an overriding Geometry
+    if (frame.mCamera) updateFrameUniforms(frame, frame.mCamera, nullptr);
+    mInstanceRenderer->draw(frame, frame.mCamera,
+        frame.mLights.empty() ? nullptr : frame.mLights[0], variant,
+        variant == PROGRAM_VARIANT_COLOR && mDepthPrepassFrame);
+    // impostors stand for opaque scene Geometry, shaded forward
+    if (variant == PROGRAM_VARIANT_COLOR && frame.mCamera)
+        mImpostorRenderer->draw(frame);
+    // so are crowds
+    if (variant == PROGRAM_VARIANT_COLOR && frame.mCamera)
+        mCrowdRenderer->draw(frame, *mMaterialTable);
+}
+
+void Render::queueDraw(bool hasLight, const FrameSnapshot& frame, size_t index) {
+    const FrameSnapshot::DrawItem& item = frame.mItems[index];
+    shared_ptr<Mesh> mesh(item.mGeometry->getMesh());
+    shared_ptr<Program> program(item.mGeometry->getProgram(item.mMaterial, hasLight, mesh));
+    bool transparent = item.mMaterial && item.mMaterial->isTransparent();
+    RenderQueue::Pass pass = item.mCamera ?
+        RenderQueue::PASS_OVERLAY : RenderQueue::PASS_SCENE;
+    // a Geometry with its own light is shaded forward by that light
+    if (mDeferredFrame && pass == RenderQueue::PASS_SCENE && !transparent && !item.mLight
+        && ProgramManager::get()->getVariant(program, PROGRAM_VARIANT_GBUFFER))
+        pass = RenderQueue::PASS_GBUFFER;
+
+    uint64_t key = RenderQueue::makeKey(pass, transparent,
+        mRenderQueue->getProgramId(program.get()),
+        mRenderQueue->getMaterialId(item.mMaterial.get()),
+        mRenderQueue->getMeshId(mesh.get()),
+        item.mDepth);
+    mRenderQueue->push(key, index);
+}
+
+bool Render::buildRenderGraph(const FrameSnapshot& frame, const glm::ivec2& targetSize) {
+    RenderGraph& graph = *mRenderGraph;
+    graph.reset();
+    mDepthPrepassFrame = frame.mDepthPrepass && !mDeferredFrame;
+    RenderGraph::Resource window = graph.importWindow(mSurfaceSize.x, mSurfaceSize.y);
+    // the scene gets targets of its own when lit deferred or scaled up
+    bool offscreen = mDeferredFrame || mSceneSize != mSurfaceSize;
+    RenderGraph::Resource color = window;
+    RenderGraph::Resource depth = window;
+    if (offscreen) {
+        color = graph.createTexture("scene color",
+            RenderGraph::TextureDesc(targetSize.x, targetSize.y, GL_RGBA8));
+        depth = graph.createTexture("scene depth",
+            RenderGraph::TextureDesc(targetSize.x, targetSize.y, GL_DEPTH24_STENCIL8));
+    }
+    // the first pass drawing the scene clears it, the later ones load it
+    auto attachScene = [&] (int pass, RenderGraph::LoadAction colorLoad,
+        RenderGraph::LoadAction depthLoad) {
+        graph.setColor(pass, 0, color, colorLoad);
+        graph.setClearColor(pass, 0, CLEAR_COLOR);
+        graph.setDepth(pass, depth, depthLoad);
+        graph.setViewport(pass, mSceneSize.x, mSceneSize.y);
+    };
+
+    int pass;
+    if (mDepthPrepassFrame) {
+        pass = graph.addPass("depth prepass", [this, &frame] {
+            drawDepthPrepass(frame);
+        });
+        attachScene(pass, RenderGraph::LOAD_ACTION_CLEAR, RenderGraph::LOAD_ACTION_CLEAR);
+    }
+
+    if (mDeferredFrame) {
+        static const char* names[DeferredRenderer::NUM_TARGETS] = {
+            "gbuffer albedo", "gbuffer normal", "gbuffer material"
+        };
+        RenderGraph::Resource gbuffer[DeferredRenderer::NUM_TARGETS];
+        for (int i=0; i<DeferredRenderer::NUM_TARGETS; i++) {
+            gbuffer[i] = graph.createTexture(names[i], RenderGraph::TextureDesc(
+                targetSize.x, targetSize.y, DeferredRenderer::TARGET_FORMATS[i], true));
+        }
+        pass = graph.addPass("gbuffer", [this, &frame] {
+            drawQueue(frame, RenderQueue::PASS_GBUFFER);
+        });
+        // albedo and normal of the background are never read, its material
+        // is the background entry
+        graph.setColor(pass, DeferredRenderer::TARGET_ALBEDO,
+            gbuffer[DeferredRenderer::TARGET_ALBEDO], RenderGraph::LOAD_ACTION_DONT_CARE);
+        graph.setColor(pass, DeferredRenderer::TARGET_NORMAL,
+            gbuffer[DeferredRenderer::TARGET_NORMAL], RenderGraph::LOAD_ACTION_DONT_CARE);
+        graph.setColor(pass, DeferredRenderer::TARGET_MATERIAL,
+            gbuffer[DeferredRenderer::TARGET_MATERIAL], RenderGraph::LOAD_ACTION_CLEAR);
+        graph.setClearColor(pass, DeferredRenderer::TARGET_MATERIAL,
+            DeferredRenderer::BACKGROUND_MATERIAL);
+        graph.setDepth(pass, depth, RenderGraph::LOAD_ACTION_CLEAR);
+        graph.setViewport(pass, mSceneSize.x, mSceneSize.y);
+
+        pass = graph.addPass("deferred lighting", [this, &frame, gbuffer] {
+            GLuint targets[DeferredRenderer::NUM_TARGETS];
+            for (int i=0; i<DeferredRenderer::NUM_TARGETS; i++)
+                targets[i] = mRenderGraph->getName(gbuffer[i]);
+            if (frame.mCamera) updateFrameUniforms(frame, frame.mCamera, nullptr);
+            mDeferredRenderer->applyLights(frame.mLightGrid, mFrameUniforms->getProjMatrix(), targets);
+        });
+        for (int i=0; i<DeferredRenderer::NUM_TARGETS; i++) graph.read(pass, gbuffer[i]);
+        // background is the clear color, surfaces are overwritten by emission
+        attachScene(pass, RenderGraph::LOAD_ACTION_CLEAR, RenderGraph::LOAD_ACTION_LOAD);
+    }
+
+    // everything forward, over the lit G-buffer in deferred frames
+    pass = graph.addPass("scene", [this, &frame] {
+        drawQueue(frame, RenderQueue::PASS_SCENE);
+        // blended over everything, the block may hold the camera or
+        // light of an overriding Geometry
+        if (frame.mCamera) {
+            updateFrameUniforms(frame, frame.mCamera, nullptr);
+            mParticleRenderer->draw(frame);
+        }
+        // queries test against the depth of the scene
+        if (frame.mOcclusionIndex)
+            mOcclusionQueries->issueQueries(frame.mOcclusionIndex, frame.mViewProj, frame.mEye);
+    });
+    RenderGraph::LoadAction sceneLoad = mDeferredFrame || mDepthPrepassFrame ?
+        RenderGraph::LOAD_ACTION_LOAD : RenderGraph::LOAD_ACTION_CLEAR;
+    attachScene(pass, sceneLoad, sceneLoad);
+
+    if (offscreen) {
+        pass = graph.addPass("resolve", [this, color] {
+            if (!mRenderGraph->bindReadFramebuffer(color)) return;
+            glBlitFramebuffer(0, 0, mSceneSize.x, mSceneSize.y,
+                0, 0, mSurfaceSize.x, mSurfaceSize.y, GL_COLOR_BUFFER_BIT,
+                mSceneSize == mSurfaceSize ? GL_NEAREST : GL_LINEAR);
+            GLState::get()->countCall();
+        });
+        graph.read(pass, color);
+        // the blit covers the whole window
+        graph.setColor(pass, 0, window, RenderGraph::LOAD_ACTION_DONT_CARE);
+    }
+
+    // Geometry with their own camera, at native resolution
+    pass = graph.addPass("overlay", [this, &frame, offscreen] {
+        if (offscreen) {
+            mFrameUniforms->setViewport(mSurfaceSize.x, mSurfaceSize.y);
+            if (frame.mLightGrid.isValid())
+                mFrameUniforms->setLightGrid(frame.mLightGrid.mScale, frame.mLightGrid.mCount);
+        }
+        drawQueue(frame, RenderQueue::PASS_OVERLAY);
+    });
+    graph.setColor(pass, 0, window);
+    // against a depth buffer of their own when the scene was offscreen,
+    // the depth of the window is discarded after them
+    graph.setDepth(pass, window,
+        offscreen ? RenderGraph::LOAD_ACTION_CLEAR : RenderGraph::LOAD_ACTION_LOAD);
+    return graph.compile();
+}
+
+void Render::submitQueue(const FrameSnapshot& frame) {
+    // groups too small to instance are sorted with everything else
+    vector<size_t> singles;
+    mInstanceRenderer->prepare(frame, *mMaterialTable, singles);
+    bool hasLight = !frame.mLights.empty();
+    for (size_t i=0; i<singles.size(); i++) {
+        queueDraw(hasLight, frame, singles[i]);
+    }
+
+    mRenderQueue->sort();
+    if (!mRenderGraph->execute()) ALOGE("render passes skipped, see the log above");
+    // groups of skipped passes must not outlive the frame
+    mInstanceRenderer->clear();
+    mRenderQueue->clear();
+}
+
+void Render::drawQueue(const FrameSnapshot& frame, RenderQueue::Pass pass) {
+    bool hasLight = !frame.mLights.empty();
+    ProgramVariant variant = pass == RenderQueue::PASS_GBUFFER ?
+        PROGRAM_VARIANT_GBUFFER : PROGRAM_VARIANT_COLOR;
+    // instance groups are opaque scene Geometry, they go before anything
+    // blended
+    bool instancesDrawn = pass == RenderQueue::PASS_OVERLAY;
+    // sorted by pass first
+    for (size_t i=0; i<mRenderQueue->size(); i++) {
+        uint64_t key = mRenderQueue->getKey(i);
+        RenderQueue::Pass itemPass = RenderQueue::getPass(key);
+        if (itemPass < pass) continue;
+        if (itemPass > pass) break;
+        if (!instancesDrawn && RenderQueue::isTransparent(key)) {
+            drawInstances(frame, variant);
+            instancesDrawn = true;
+        }
+
+        const FrameSnapshot::DrawItem& item = frame.mItems[mRenderQueue->getItem(i)];
+        if (drawItem(frame, item, variant))
+            // program attached to Geometry node only when drawItem returns true
+            drawMesh(item.mGeometry->getMesh(), item.mGeometry->getVertexArray(
+                getItemProgram(item, hasLight, variant)));
+    }
+    // code drawing without a vao must not change the last one bound
+    GLState::get()->bindVertexArray(0);
+    if (!instancesDrawn) drawInstances(frame, variant);
+}
+
+void Render::drawDepthPrepass(const FrameSnapshot& frame) {
+    bool hasLight = !frame.mLights.empty();
+    // the queue is sorted front to back inside each state already
+    for (size_t i=0; i<mRenderQueue->size(); i++) {
+        uint64_t key = mRenderQueue->getKey(i);
+        if (RenderQueue::getPass(key) != RenderQueue::PASS_SCENE
+            || RenderQueue::isTransparent(key)) continue;
+        const FrameSnapshot::DrawItem& item = frame.mItems[mRenderQueue->getItem(i)];
+        // fading Geometry do not cover their pixels
+        if (item.mFadeOut > 0.f) continue;
+        shared_ptr<Program> program(getItemProgram(item, hasLight, PROGRAM_VARIANT_DEPTH));
+        if (!program) continue;
+        if (drawItem(frame, item, PROGRAM_VARIANT_DEPTH))
+            drawMesh(item.mGeometry->getMesh(), item.mGeometry->getVertexArray(program));
+    }
+    GLState::get()->bindVertexArray(0);
+    drawInstances(frame, PROGRAM_VARIANT_DEPTH);
+}
+
+shared_ptr<Program> Render::getItemProgram(const FrameSnapshot::DrawItem& item,
+    bool hasLight, ProgramVariant variant) {
+    shared_ptr<Program> program(
+        item.mGeometry->getProgram(item.mMaterial, hasLight, item.mGeometry->getMesh()));
+    return ProgramManager::get()->getVariant(program, variant);
+}
+
+bool Render::drawNode(shared_ptr<Node> node) {
+    shared_ptr<Impostor> impostor(node->getImpostor());
+    if (!impostor) return true;
+    float fadeOut = mFadeOut;
+    if (mBuildFrame && mBuildFrame->mCamera)
+        fadeOut = max(fadeOut, selectImpostor(node, impostor));
+    if (fadeOut >= 1.f) return false;
+    mFadeStack.push_back(mFadeOut);
+    mFadeOut = fadeOut;
+    return true;
+}
+
+void Render::finishNode(shared_ptr<Node> node) {
+    if (!node->getImpostor() || mFadeStack.empty()) return;
+    mFadeOut = mFadeStack.back();
+    mFadeStack.pop_back();
+}
+
+float Render::selectImpostor(shared_ptr<Node> node, shared_ptr<Impostor> impostor) {
+    if (impostor->getState() == Impostor::STATE_NONE) queueImpostorBake(node, impostor);
+    // the subtree is drawn until the atlas is
+    if (!impostor->isBaked()) return 0.f;
+
+    // impostors take uniform scale only, the largest axis is used
+    glm::mat4 world = node->getWorldTransform().toMat4();
+    glm::mat3 rotation(world);
+    float scale = max(glm::length(rotation[0]),
+        max(glm::length(rotation[1]), glm::length(rotation[2])));
+    if (scale <= 0.f) return 0.f;
+    glm::vec3 center(world * glm::vec4(impostor->getCenter(), 1.f));
+    float radius = impostor->getRadius() * scale;
+    glm::vec3 toEye = mBuildEye - center;
+    float distance = glm::length(toEye);
+    if (distance <= radius) return 0.f;
+    float fadeOut = impostor->getFadeOut(radius * mBuildFocal / distance);
+    if (fadeOut <= 0.f) return 0.f;
+
+    if (mFrustumCulling && !Frustum(mBuildViewProj).intersects(Sphere(center, radius)))
+        return fadeOut;
+    FrameSnapshot::ImpostorItem item;
+    item.mImpostor = impostor;
+    item.mCenter = glm::vec4(center, radius);
+    item.mRotation = rotation / scale;
+    item.mViews = glm::vec4(Impostor::selectViews(
+        glm::transpose(item.mRotation) * toEye / distance), fadeOut);
+    mBuildFrame->mImpostors.push_back(item);
+    return fadeOut;
+}
+
+void Render::queueImpostorBake(shared_ptr<Node> node, shared_ptr<Impostor> impostor) {
+    FrameSnapshot::ImpostorBake bake;
+    bake.mImpostor = impostor;
+    glm::mat4 toRoot = glm::inverse(node->getWorldTransform().toMat4());
+    AABB bounds;
+    node->depthFirstTraversal([&] (shared_ptr<NodeObj> obj) {
+        shared_ptr<Geometry> geometry(dynamic_pointer_cast<Geometry>(obj));
+        // batched Geometry are drawn by their batch, elsewhere
+        if (!geometry || geometry->isBatched() || geometry->getCamera()
+            || geometry->getMesh()->hasBones()) return;
+        FrameSnapshot::DrawItem item;
+        item.mGeometry = geometry;
+        item.mMaterial = geometry->getMaterial();
+        item.mWorld = toRoot * geometry->getWorldTransform().toMat4();
+        item.mNormal = glm::transpose(glm::inverse(glm::mat3(item.mWorld)));
+        bounds.expand(geometry->getMesh()->getBoundingBox().transform(item.mWorld));
+        bake.mItems.push_back(item);
+    });
+    // an empty subtree fails to bake, and is not walked again
+    if (!impostor->queueBake()) return;
+    bake.mCenter = bounds.isValid() ? bounds.getCenter() : glm::vec3(0.f);
+    bake.mRadius = bounds.isValid() ? glm::length(bounds.getExtent()) : 0.f;
+    impostor->setBounds(bake.mCenter, bake.mRadius);
+    mBuildFrame->mImpostorBakes.push_back(bake);
+}
+
+bool Render::drawItem(const FrameSnapshot& frame, const FrameSnapshot::DrawItem& item,
+    ProgramVariant variant) {
+    shared_ptr<Geometry> geometry(item.mGeometry);
+    shared_ptr<Material> material(item.mMaterial);
+    shared_ptr<Program> currentProgram(getItemProgram(item, !frame.mLights.empty(), variant));
     if (!currentProgram) {
         ALOGE("No built-in program generated for material: %s, mesh: %s",
             material ? material->getName().c_str() : "NULL", geometry->getMesh()->getName().c_str());
         return false;
     }
-    currentProgram->use();
+    // sorted by program and transparency, most draws apply the same state
+    PipelineState::Desc desc;
+    desc.mProgram = currentProgram->getId();
+    bool transparent = material && material->isTransparent();
+    if (transparent) {
+        desc.mBlend = true;
+        desc.mDepthWrite = false;
+    }
+    if (variant == PROGRAM_VARIANT_DEPTH) {
+        desc.mColorWrite = false;
+    } else if (variant == PROGRAM_VARIANT_COLOR && mDepthPrepassFrame && !transparent
+        && !item.mCamera && item.mFadeOut <= 0.f
+        && getItemProgram(item, !frame.mLights.empty(), PROGRAM_VARIANT_DEPTH)) {
+        // depth is final already, only the visible surface passes
+        desc.mDepthFunc = GL_LEQUAL;
+        desc.mDepthWrite = false;
+    }
+    GLState::get()->apply(*GLState::get()->getPipelineState(desc));
 
-    shared_ptr<Camera> camera(geometry->getCamera());
-    if (!camera)
-        camera = scene->getActiveCamera();
+    shared_ptr<Camera> camera(item.mCamera ? item.mCamera : frame.mCamera);
     if (!camera) {
         ALOGE("No camera available in scene");
         return false;
     }
-    //override the aspect ratio
-    float surfaceWidth = getEngineContext()->getSurfaceWidth();
-    float surfaceHeight = getEngineContext()->getSurfaceHeight();
-    camera->setAspect(surfaceWidth/surfaceHeight);
 
-    view = camera->getViewMatrix();
-    proj = camera->getProjMatrix();
+    // a no-op unless the camera or lights differ from the last draw
+    shared_ptr<Light> light(item.mLight);
+    if (!updateFrameUniforms(frame, camera, light)) return false;
 
-    shared_ptr<Light> light(geometry->getLight());
-    if (!light) light = scene->getLight(0);
-    currentProgram->uploadData(camera, light, material, world, view, proj);
+    if (!light && !frame.mLights.empty()) light = frame.mLights[0];
+    glm::mat4 world = item.mWorld;
+    currentProgram->uploadData(camera, light, material, world,
+        mFrameUniforms->getViewMatrix(), mFrameUniforms->getProjMatrix());
+    currentProgram->setMaterialIndex(mMaterialTable->getIndex(material));
+    currentProgram->setFadeOut(item.mFadeOut);
     return true;
 }
 
-void Render::drawMesh(shared_ptr<Scene> scene, shared_ptr<Mesh> mesh,
-    shared_ptr<Program> program, GLuint vbo, GLuint ibo) {
+bool Render::updateFrameUniforms(const FrameSnapshot& frame,
+    shared_ptr<Camera> camera, shared_ptr<Light> light) {
+    if (light)
+        return mFrameUniforms->update(camera, vector<shared_ptr<Light> >(1, light));
+    // all scene lights are in the clusters
+    if (frame.mLightGrid.isValid())
+        return mFrameUniforms->update(camera, vector<shared_ptr<Light> >(), true);
+    return mFrameUniforms->update(camera, mSceneLights);
+}
+
+void Render::drawMesh(shared_ptr<Mesh> mesh, shared_ptr<Program> program,
+    GLuint vbo, GLuint ibo) {
     program->updateMeshData(mesh, vbo);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
+    GLState::get()->bindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
+    GLState::get()->countCall();
     // support only GL_UNSIGNED_INT right now
     glDrawElements(GL_TRIANGLES,            // mode
         mesh->getNumIndices(),              // indices count
@@ -131,6 +948,14 @@ void Render::drawMesh(shared_ptr<Scene> scene, shared_ptr<Mesh> mesh,
         (void *)0);                         // offset
 }
 
+void Render::drawMesh(shared_ptr<Mesh> mesh, GLuint vao) {
+    if (!vao) return;
+    GLState::get()->bindVertexArray(vao);
+    GLState::get()->countCall();
+    // support only GL_UNSIGNED_INT right now
+    glDrawElements(GL_TRIANGLES, mesh->getNumIndices(), GL_UNSIGNED_INT, (void*)0);
+}
+
 shared_ptr<EngineContext> Render::getEngineContext() {
     return mEngineContext.lock();
 }
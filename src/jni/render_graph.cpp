@@ -0,0 +1,556 @@
+#include <algorithm>
+#include "log.h"
+#include "gl_state.h"
+#include "render_graph.h"
+
+using namespace std;
+
+namespace dzy {
+
+// slot of the depth attachment in Pass::mLoad and Pass::mStore
+static const int DEPTH_SLOT = RenderGraph::MAX_COLOR_ATTACHMENTS;
+
+static bool isStencilFormat(GLenum format) {
+    return format == GL_DEPTH24_STENCIL8 || format == GL_DEPTH32F_STENCIL8;
+}
+
+static bool isIntegerFormat(GLenum format) {
+    switch (format) {
+    case GL_R8UI: case GL_R16UI: case GL_R32UI:
+    case GL_RG8UI: case GL_RG16UI: case GL_RG32UI:
+    case GL_RGBA8UI: case GL_RGB10_A2UI: case GL_RGBA16UI: case GL_RGBA32UI:
+    case GL_R8I: case GL_R16I: case GL_R32I:
+    case GL_RG8I: case GL_RG16I: case GL_RG32I:
+    case GL_RGBA8I: case GL_RGBA16I: case GL_RGBA32I:
+        return true;
+    default:
+        return false;
+    }
+}
+
+RenderGraph::RenderGraph()
+    : mNextId(0)
+    , mFrame(0)
+    , mCompiled(false)
+    , mNumPasses(0)
+    , mNumCulled(0)
+    , mNumInvalidated(0)
+    , mNumCleared(0) {
+}
+
+RenderGraph::~RenderGraph() {
+    TRACE("");
+}
+
+void RenderGraph::release() {
+    GLState* state = GLState::get();
+    for (auto it = mFramebuffers.begin(); it != mFramebuffers.end(); ++it) {
+        state->deleteFramebuffer(it->second);
+    }
+    mFramebuffers.clear();
+    for (size_t i=0; i<mPhysicals.size(); i++) {
+        if (mPhysicals[i].mDesc.mSampled)
+            state->deleteTexture(mPhysicals[i].mName);
+        else
+            glDeleteRenderbuffers(1, &mPhysicals[i].mName);
+    }
+    mPhysicals.clear();
+    mResources.clear();
+    mPasses.clear();
+    mCompiled = false;
+}
+
+void RenderGraph::reset() {
+    mFrame++;
+    collect();
+    mResources.clear();
+    mPasses.clear();
+    mCompiled = false;
+}
+
+RenderGraph::Resource RenderGraph::createTexture(const char* name, const TextureDesc& desc) {
+    ResourceNode node;
+    node.mName = name;
+    node.mDesc = desc;
+    node.mWindow = false;
+    node.mPhysical = -1;
+    node.mFirstPass = -1;
+    node.mLastPass = -1;
+    mResources.push_back(node);
+    return mResources.size() - 1;
+}
+
+RenderGraph::Resource RenderGraph::importWindow(int width, int height) {
+    Resource window = createTexture("window", TextureDesc(width, height, GL_RGBA8));
+    mResources[window].mWindow = true;
+    return window;
+}
+
+int RenderGraph::addPass(const char* name, Execute execute) {
+    Pass pass;
+    pass.mName = name;
+    pass.mExecute = execute;
+    for (int i=0; i<MAX_COLOR_ATTACHMENTS; i++) {
+        pass.mColors[i] = NULL_RESOURCE;
+        pass.mClearColor[i] = glm::vec4(0.f);
+        pass.mClearColorUint[i] = glm::uvec4(0);
+    }
+    pass.mDepth = NULL_RESOURCE;
+    for (int i=0; i<=DEPTH_SLOT; i++) {
+        pass.mLoad[i] = LOAD_ACTION_LOAD;
+        pass.mStore[i] = STORE_ACTION_AUTO;
+        pass.mKeep[i] = false;
+    }
+    pass.mViewport = glm::ivec2(0);
+    pass.mCulled = false;
+    mPasses.push_back(pass);
+    return mPasses.size() - 1;
+}
+
+bool RenderGraph::isValid(Resource resource) const {
+    return resource >= 0 && resource < (int)mResources.size();
+}
+
+void RenderGraph::setColor(int pass, int index, Resource target, LoadAction load,
+    StoreAction store) {
+    if (pass < 0 || pass >= (int)mPasses.size() || index < 0 || index >= MAX_COLOR_ATTACHMENTS
+        || !isValid(target)) {
+        ALOGE("invalid color attachment %d of pass %d", index, pass);
+        return;
+    }
+    if (mResources[target].mWindow && index != 0) {
+        ALOGE("the window is only attached at color 0, pass %s", mPasses[pass].mName.c_str());
+        return;
+    }
+    mPasses[pass].mColors[index] = target;
+    mPasses[pass].mLoad[index] = load;
+    mPasses[pass].mStore[index] = store;
+}
+
+void RenderGraph::setDepth(int pass, Resource target, LoadAction load, StoreAction store) {
+    if (pass < 0 || pass >= (int)mPasses.size() || !isValid(target)) {
+        ALOGE("invalid depth attachment of pass %d", pass);
+        return;
+    }
+    mPasses[pass].mDepth = target;
+    mPasses[pass].mLoad[DEPTH_SLOT] = load;
+    mPasses[pass].mStore[DEPTH_SLOT] = store;
+}
+
+void RenderGraph::setClearColor(int pass, int index, const glm::vec4& color) {
+    if (pass < 0 || pass >= (int)mPasses.size() || index < 0 || index >= MAX_COLOR_ATTACHMENTS)
+        return;
+    mPasses[pass].mClearColor[index] = color;
+}
+
+void RenderGraph::setClearColor(int pass, int index, const glm::uvec4& color) {
+    if (pass < 0 || pass >= (int)mPasses.size() || index < 0 || index >= MAX_COLOR_ATTACHMENTS)
+        return;
+    mPasses[pass].mClearColorUint[index] = color;
+}
+
+void RenderGraph::read(int pass, Resource resource) {
+    if (pass < 0 || pass >= (int)mPasses.size() || !isValid(resource)) {
+        ALOGE("invalid read of pass %d", pass);
+        return;
+    }
+    mPasses[pass].mReads.push_back(resource);
+}
+
+void RenderGraph::setViewport(int pass, int width, int height) {
+    if (pass < 0 || pass >= (int)mPasses.size()) return;
+    mPasses[pass].mViewport = glm::ivec2(width, height);
+}
+
+void RenderGraph::getAttachments(const Pass& pass, vector<Resource>& resources,
+    vector<int>& slots, vector<GLenum>& points) const {
+    for (int i=0; i<MAX_COLOR_ATTACHMENTS; i++) {
+        if (pass.mColors[i] == NULL_RESOURCE) continue;
+        resources.push_back(pass.mColors[i]);
+        slots.push_back(i);
+        points.push_back(mResources[pass.mColors[i]].mWindow ? GL_COLOR : GL_COLOR_ATTACHMENT0 + i);
+    }
+    if (pass.mDepth == NULL_RESOURCE) return;
+    if (mResources[pass.mDepth].mWindow) {
+        // whatever the EGL config has, invalidating what is not there is
+        // harmless
+        resources.push_back(pass.mDepth);
+        slots.push_back(DEPTH_SLOT);
+        points.push_back(GL_DEPTH);
+        resources.push_back(pass.mDepth);
+        slots.push_back(DEPTH_SLOT);
+        points.push_back(GL_STENCIL);
+        return;
+    }
+    bool stencil = isStencilFormat(mResources[pass.mDepth].mDesc.mFormat);
+    resources.push_back(pass.mDepth);
+    slots.push_back(DEPTH_SLOT);
+    points.push_back(stencil ? GL_DEPTH_STENCIL_ATTACHMENT : GL_DEPTH_ATTACHMENT);
+}
+
+void RenderGraph::cull() {
+    // a resource is live while a later pass that runs needs its contents,
+    // the depth of the window is tracked apart from its color, after all
+    // resources
+    vector<char> live(mResources.size() + 1, 0);
+    int windowDepth = mResources.size();
+    vector<Resource> attachments;
+    vector<int> slots;
+    vector<GLenum> points;
+    mNumCulled = 0;
+    for (int p=(int)mPasses.size()-1; p>=0; p--) {
+        Pass& pass = mPasses[p];
+        attachments.clear();
+        slots.clear();
+        points.clear();
+        getAttachments(pass, attachments, slots, points);
+        bool needed = false;
+        for (size_t i=0; i<attachments.size(); i++) {
+            const ResourceNode& node = mResources[attachments[i]];
+            if (node.mWindow && slots[i] != DEPTH_SLOT) needed = true;
+            int key = node.mWindow && slots[i] == DEPTH_SLOT ? windowDepth : attachments[i];
+            pass.mKeep[slots[i]] = live[key] || (node.mWindow && slots[i] != DEPTH_SLOT);
+            if (live[key]) needed = true;
+        }
+        pass.mCulled = !needed;
+        if (!needed) {
+            DEBUG(Log::F_GLES, "render pass %s culled", pass.mName.c_str());
+            mNumCulled++;
+            continue;
+        }
+        // a pass that clears or overwrites an attachment does not need
+        // what earlier passes left there
+        for (size_t i=0; i<attachments.size(); i++) {
+            const ResourceNode& node = mResources[attachments[i]];
+            int key = node.mWindow && slots[i] == DEPTH_SLOT ? windowDepth : attachments[i];
+            live[key] = pass.mLoad[slots[i]] == LOAD_ACTION_LOAD;
+        }
+        for (size_t i=0; i<pass.mReads.size(); i++) live[pass.mReads[i]] = 1;
+    }
+}
+
+int RenderGraph::acquire(const TextureDesc& desc) {
+    for (size_t i=0; i<mPhysicals.size(); i++) {
+        Physical& physical = mPhysicals[i];
+        if (physical.mInUse || !(physical.mDesc == desc)) continue;
+        physical.mInUse = true;
+        physical.mLastFrame = mFrame;
+        return i;
+    }
+
+    Physical physical;
+    physical.mDesc = desc;
+    physical.mName = 0;
+    physical.mId = mNextId++;
+    physical.mLastFrame = mFrame;
+    physical.mInUse = true;
+    if (desc.mSampled) {
+        glGenTextures(1, &physical.mName);
+        if (!physical.mName) {
+            ALOGE("glGenTextures error");
+            return -1;
+        }
+        // read with texelFetch only
+        GLState::get()->bindTexture(0, GL_TEXTURE_2D, physical.mName);
+        glTexStorage2D(GL_TEXTURE_2D, 1, desc.mFormat, desc.mWidth, desc.mHeight);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    } else {
+        glGenRenderbuffers(1, &physical.mName);
+        if (!physical.mName) {
+            ALOGE("glGenRenderbuffers error");
+            return -1;
+        }
+        glBindRenderbuffer(GL_RENDERBUFFER, physical.mName);
+        glRenderbufferStorage(GL_RENDERBUFFER, desc.mFormat, desc.mWidth, desc.mHeight);
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    }
+    DEBUG(Log::F_GLES, "render target %dx%d format 0x%x created",
+        desc.mWidth, desc.mHeight, desc.mFormat);
+    mPhysicals.push_back(physical);
+    return mPhysicals.size() - 1;
+}
+
+bool RenderGraph::allocate() {
+    for (size_t r=0; r<mResources.size(); r++) {
+        mResources[r].mPhysical = -1;
+        mResources[r].mFirstPass = -1;
+        mResources[r].mLastPass = -1;
+    }
+    vector<Resource> used;
+    vector<int> slots;
+    vector<GLenum> points;
+    vector<vector<Resource> > passResources(mPasses.size());
+    for (size_t p=0; p<mPasses.size(); p++) {
+        if (mPasses[p].mCulled) continue;
+        used.clear();
+        slots.clear();
+        points.clear();
+        getAttachments(mPasses[p], used, slots, points);
+        used.insert(used.end(), mPasses[p].mReads.begin(), mPasses[p].mReads.end());
+        for (size_t i=0; i<used.size(); i++) {
+            ResourceNode& node = mResources[used[i]];
+            if (node.mFirstPass < 0) node.mFirstPass = p;
+            node.mLastPass = p;
+        }
+        passResources[p] = used;
+    }
+
+    // in pass order, a GL object freed by the last pass of one resource
+    // is taken by a resource starting in a later pass
+    for (size_t p=0; p<mPasses.size(); p++) {
+        const vector<Resource>& resources = passResources[p];
+        for (size_t i=0; i<resources.size(); i++) {
+            ResourceNode& node = mResources[resources[i]];
+            if (node.mWindow || node.mPhysical >= 0) continue;
+            node.mPhysical = acquire(node.mDesc);
+            if (node.mPhysical < 0) return false;
+        }
+        for (size_t i=0; i<resources.size(); i++) {
+            ResourceNode& node = mResources[resources[i]];
+            if (!node.mWindow && node.mLastPass == (int)p) mPhysicals[node.mPhysical].mInUse = false;
+        }
+    }
+    return true;
+}
+
+void RenderGraph::collect() {
+    GLState* state = GLState::get();
+    for (size_t i=0; i<mPhysicals.size(); ) {
+        Physical& physical = mPhysicals[i];
+        physical.mInUse = false;
+        if (mFrame - physical.mLastFrame <= PHYSICAL_LIFETIME) {
+            i++;
+            continue;
+        }
+        for (auto it = mFramebuffers.begin(); it != mFramebuffers.end(); ) {
+            if (find(it->first.begin(), it->first.end(), physical.mId) == it->first.end()) {
+                ++it;
+                continue;
+            }
+            state->deleteFramebuffer(it->second);
+            it = mFramebuffers.erase(it);
+        }
+        if (physical.mDesc.mSampled)
+            state->deleteTexture(physical.mName);
+        else
+            glDeleteRenderbuffers(1, &physical.mName);
+        mPhysicals.erase(mPhysicals.begin() + i);
+    }
+}
+
+bool RenderGraph::compile() {
+    cull();
+    mCompiled = allocate();
+    return mCompiled;
+}
+
+GLuint RenderGraph::getName(Resource resource) const {
+    if (!isValid(resource)) return 0;
+    const ResourceNode& node = mResources[resource];
+    if (node.mWindow || node.mPhysical < 0) return 0;
+    return mPhysicals[node.mPhysical].mName;
+}
+
+GLuint RenderGraph::getFramebuffer(const Pass& pass, GLenum target) {
+    FramebufferKey key;
+    for (int i=0; i<MAX_COLOR_ATTACHMENTS; i++) {
+        Resource color = pass.mColors[i];
+        key.push_back(color == NULL_RESOURCE ? -1 : mPhysicals[mResources[color].mPhysical].mId);
+    }
+    key.push_back(pass.mDepth == NULL_RESOURCE ? -1 :
+        mPhysicals[mResources[pass.mDepth].mPhysical].mId);
+    auto it = mFramebuffers.find(key);
+    if (it != mFramebuffers.end()) return it->second;
+
+    GLuint framebuffer = createFramebuffer(pass, target);
+    if (framebuffer) mFramebuffers[key] = framebuffer;
+    return framebuffer;
+}
+
+GLuint RenderGraph::createFramebuffer(const Pass& pass, GLenum target) {
+    GLuint framebuffer = 0;
+    glGenFramebuffers(1, &framebuffer);
+    if (!framebuffer) {
+        ALOGE("glGenFramebuffers error");
+        return 0;
+    }
+    GLState* state = GLState::get();
+    state->bindFramebuffer(target, framebuffer);
+    vector<Resource> attachments;
+    vector<int> slots;
+    vector<GLenum> points;
+    getAttachments(pass, attachments, slots, points);
+    for (size_t i=0; i<attachments.size(); i++) {
+        const Physical& physical = mPhysicals[mResources[attachments[i]].mPhysical];
+        if (physical.mDesc.mSampled)
+            glFramebufferTexture2D(target, points[i], GL_TEXTURE_2D, physical.mName, 0);
+        else
+            glFramebufferRenderbuffer(target, points[i], GL_RENDERBUFFER, physical.mName);
+    }
+    // a read framebuffer has a single color attachment, which the
+    // default draw buffer selects already
+    if (target != GL_READ_FRAMEBUFFER) {
+        GLenum drawBuffers[MAX_COLOR_ATTACHMENTS];
+        for (int i=0; i<MAX_COLOR_ATTACHMENTS; i++) {
+            drawBuffers[i] = pass.mColors[i] == NULL_RESOURCE ? GL_NONE : GL_COLOR_ATTACHMENT0 + i;
+        }
+        glDrawBuffers(MAX_COLOR_ATTACHMENTS, drawBuffers);
+    }
+    GLenum status = glCheckFramebufferStatus(target);
+    if (status != GL_FRAMEBUFFER_COMPLETE) {
+        ALOGE("framebuffer of pass %s incomplete: 0x%x", pass.mName.c_str(), status);
+        state->deleteFramebuffer(framebuffer);
+        return 0;
+    }
+    return framebuffer;
+}
+
+RenderGraph::LoadAction RenderGraph::getLoadAction(const Pass& pass, int index, int slot,
+    Resource resource) const {
+    const ResourceNode& node = mResources[resource];
+    // nothing to load before the first pass
+    if (pass.mLoad[slot] == LOAD_ACTION_LOAD && !node.mWindow && node.mFirstPass == index)
+        return LOAD_ACTION_DONT_CARE;
+    return pass.mLoad[slot];
+}
+
+RenderGraph::StoreAction RenderGraph::getStoreAction(const Pass& pass, int slot) const {
+    if (pass.mStore[slot] != STORE_ACTION_AUTO) return pass.mStore[slot];
+    return pass.mKeep[slot] ? STORE_ACTION_STORE : STORE_ACTION_DISCARD;
+}
+
+void RenderGraph::clear(const Pass& pass, int slot, Resource resource) {
+    GLState* state = GLState::get();
+    // clears are masked like draws
+    const ResourceNode& node = mResources[resource];
+    if (slot == DEPTH_SLOT) {
+        state->depthMask(true);
+        if (node.mWindow || isStencilFormat(node.mDesc.mFormat)) {
+            glClearBufferfi(GL_DEPTH_STENCIL, 0, 1.f, 0);
+        } else {
+            static const GLfloat depth = 1.f;
+            glClearBufferfv(GL_DEPTH, 0, &depth);
+        }
+    } else {
+        state->colorMask(true);
+        if (isIntegerFormat(node.mDesc.mFormat)) {
+            const glm::uvec4& color = pass.mClearColorUint[slot];
+            GLuint value[4] = { color.x, color.y, color.z, color.w };
+            glClearBufferuiv(GL_COLOR, slot, value);
+        } else {
+            const glm::vec4& color = pass.mClearColor[slot];
+            GLfloat value[4] = { color.x, color.y, color.z, color.w };
+            glClearBufferfv(GL_COLOR, slot, value);
+        }
+    }
+    state->countCall();
+    mNumCleared++;
+}
+
+void RenderGraph::load(const Pass& pass, int index) {
+    vector<Resource> attachments;
+    vector<int> slots;
+    vector<GLenum> points;
+    getAttachments(pass, attachments, slots, points);
+    GLenum dead[MAX_COLOR_ATTACHMENTS + 2];
+    int numDead = 0;
+    for (size_t i=0; i<attachments.size(); i++) {
+        LoadAction action = getLoadAction(pass, index, slots[i], attachments[i]);
+        if (action == LOAD_ACTION_DONT_CARE) dead[numDead++] = points[i];
+    }
+    if (numDead) {
+        glInvalidateFramebuffer(GL_DRAW_FRAMEBUFFER, numDead, dead);
+        GLState::get()->countCall();
+        mNumInvalidated += numDead;
+    }
+    for (size_t i=0; i<attachments.size(); i++) {
+        // the window depth shows up as depth and as stencil
+        if (i > 0 && slots[i] == slots[i - 1]) continue;
+        if (getLoadAction(pass, index, slots[i], attachments[i]) == LOAD_ACTION_CLEAR)
+            clear(pass, slots[i], attachments[i]);
+    }
+}
+
+void RenderGraph::store(const Pass& pass) {
+    vector<Resource> attachments;
+    vector<int> slots;
+    vector<GLenum> points;
+    getAttachments(pass, attachments, slots, points);
+    GLenum dead[MAX_COLOR_ATTACHMENTS + 2];
+    int numDead = 0;
+    for (size_t i=0; i<attachments.size(); i++) {
+        StoreAction action = getStoreAction(pass, slots[i]);
+        if (action == STORE_ACTION_DISCARD) dead[numDead++] = points[i];
+    }
+    if (!numDead) return;
+    glInvalidateFramebuffer(GL_DRAW_FRAMEBUFFER, numDead, dead);
+    GLState::get()->countCall();
+    mNumInvalidated += numDead;
+}
+
+bool RenderGraph::execute() {
+    mNumPasses = 0;
+    mNumInvalidated = 0;
+    mNumCleared = 0;
+    if (!mCompiled) {
+        ALOGE("render graph executed without compiling");
+        return false;
+    }
+
+    GLState* state = GLState::get();
+    bool complete = true;
+    for (size_t p=0; p<mPasses.size(); p++) {
+        Pass& pass = mPasses[p];
+        if (pass.mCulled) continue;
+
+        Resource target = pass.mColors[0] != NULL_RESOURCE ? pass.mColors[0] : pass.mDepth;
+        for (int i=1; target == NULL_RESOURCE && i<MAX_COLOR_ATTACHMENTS; i++)
+            target = pass.mColors[i];
+        GLuint framebuffer = 0;
+        if (target != NULL_RESOURCE) {
+            if (!mResources[target].mWindow) framebuffer = getFramebuffer(pass, GL_FRAMEBUFFER);
+            if (!mResources[target].mWindow && !framebuffer) {
+                complete = false;
+                continue;
+            }
+            state->bindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+            load(pass, p);
+            glm::ivec2 viewport(pass.mViewport);
+            if (viewport.x <= 0 || viewport.y <= 0)
+                viewport = glm::ivec2(mResources[target].mDesc.mWidth, mResources[target].mDesc.mHeight);
+            state->viewport(0, 0, viewport.x, viewport.y);
+        }
+
+        pass.mExecute();
+        mNumPasses++;
+
+        if (target != NULL_RESOURCE) {
+            // the pass may have bound another framebuffer to read from
+            state->bindFramebuffer(GL_DRAW_FRAMEBUFFER, framebuffer);
+            store(pass);
+        }
+    }
+    state->bindFramebuffer(GL_FRAMEBUFFER, 0);
+    return complete;
+}
+
+bool RenderGraph::bindReadFramebuffer(Resource color) {
+    if (!isValid(color)) return false;
+    if (mResources[color].mWindow) {
+        GLState::get()->bindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+        return true;
+    }
+    if (mResources[color].mPhysical < 0) return false;
+    Pass pass;
+    pass.mName = mResources[color].mName;
+    for (int i=0; i<MAX_COLOR_ATTACHMENTS; i++) pass.mColors[i] = NULL_RESOURCE;
+    pass.mColors[0] = color;
+    pass.mDepth = NULL_RESOURCE;
+    GLuint framebuffer = getFramebuffer(pass, GL_READ_FRAMEBUFFER);
+    if (!framebuffer) return false;
+    GLState::get()->bindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+    return true;
+}
+
+} // namespace dzy
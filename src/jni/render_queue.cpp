@@ -0,0 +1,94 @@
+#include "log.h"
+#include "scene_graph.h"
+#include "render_queue.h"
+
+using namespace std;
+
+namespace dzy {
+
+static const uint64_t DEPTH_MAX = (1 << 24) - 1;
+
+uint64_t RenderQueue::makeKey(Pass pass, bool transparent,
+    unsigned int program, unsigned int material, unsigned int mesh, float depth) {
+    if (depth < 0.f) depth = 0.f;
+    if (depth > 1.f) depth = 1.f;
+    uint64_t d = (uint64_t)(depth * DEPTH_MAX);
+    // a material change is one integer uniform, a mesh change binds
+    // another vertex array
+    uint64_t state = ((uint64_t)(program & 0x3FF) << 24)
+        | ((uint64_t)(mesh & 0xFFF) << 12)
+        | (uint64_t)(material & 0xFFF);
+
+    uint64_t key = ((uint64_t)pass << 62);
+    if (transparent) {
+        // farthest first
+        key |= (uint64_t)1 << 61;
+        key |= (DEPTH_MAX - d) << 37;
+        key |= state << 3;
+    } else {
+        key |= state << 27;
+        key |= d << 3;
+    }
+    return key;
+}
+
+RenderQueue::RenderQueue() {
+}
+
+void RenderQueue::clear() {
+    mSorted.clear();
+}
+
+void RenderQueue::push(uint64_t key, uint32_t item) {
+    SortItem sortItem = { key, item };
+    mSorted.push_back(sortItem);
+}
+
+void RenderQueue::sort() {
+    size_t n = mSorted.size();
+    if (n < 2) return;
+
+    // one histogram per byte in a single sweep
+    uint32_t counts[8][256] = {{0}};
+    for (size_t i=0; i<n; i++) {
+        uint64_t key = mSorted[i].mKey;
+        for (int b=0; b<8; b++)
+            counts[b][(key >> (b * 8)) & 0xFF]++;
+    }
+
+    mScratch.resize(n);
+    SortItem* src = &mSorted[0];
+    SortItem* dst = &mScratch[0];
+    for (int b=0; b<8; b++) {
+        uint32_t* count = counts[b];
+        // every key has the same byte, the pass would not move anything
+        if (count[(src[0].mKey >> (b * 8)) & 0xFF] == n) continue;
+
+        uint32_t offset = 0;
+        for (int i=0; i<256; i++) {
+            uint32_t c = count[i];
+            count[i] = offset;
+            offset += c;
+        }
+        for (size_t i=0; i<n; i++) {
+            dst[count[(src[i].mKey >> (b * 8)) & 0xFF]++] = src[i];
+        }
+        swap(src, dst);
+    }
+    if (src != &mSorted[0]) mSorted.swap(mScratch);
+}
+
+unsigned int RenderQueue::getId(IdMap& ids, const void* object, int bits) {
+    auto it = ids.find(object);
+    if (it != ids.end()) return it->second;
+    if (ids.size() >= (1u << bits)) {
+        // ids only group items, start over rather than alias forever
+        DEBUG(Log::F_GENERIC, "render queue id space of %d bits exhausted", bits);
+        ids.clear();
+    }
+    unsigned int id = ids.size();
+    ids[object] = id;
+    return id;
+}
+
+} // namespace dzy
@@ -0,0 +1,153 @@
+#include <EGL/egl.h>
+#include "log.h"
+#include "engine_context.h"
+#include "render.h"
+#include "impostor.h"
+#include "render_thread.h"
+
+using namespace std;
+
+namespace dzy {
+
+RenderThread::RenderThread()
+    : mRunning(false)
+    , mContextReady(false)
+    , mFrameCount(0)
+    , mNumFrames(0)
+    , mWaitTime(0)
+    , mSubmitTime(0) {
+}
+
+RenderThread::~RenderThread() {
+    TRACE("");
+    stop();
+}
+
+bool RenderThread::start(shared_ptr<EngineContext> engineContext) {
+    if (mRunning) return true;
+    if (eglMakeCurrent(engineContext->getEGLDisplay(),
+        EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT) == EGL_FALSE) {
+        ALOGE("Unable to release egl context for the render thread");
+        return false;
+    }
+
+    mEngineContext = engineContext;
+    mFree.clear();
+    mQueued.clear();
+    for (int i=0; i<NUM_SNAPSHOTS; i++) {
+        mFree.push_back(&mSnapshots[i]);
+    }
+    mFrameCount = 0;
+    mNumFrames = 0;
+    mContextReady = false;
+    mRunning = true;
+    mThread = thread(&RenderThread::renderLoop, this);
+
+    // the first frame must not be built before the context moved over
+    unique_lock<mutex> lock(mMutex);
+    mCondition.wait(lock, [this] { return mContextReady || !mRunning; });
+    if (mContextReady) return true;
+
+    lock.unlock();
+    if (mThread.joinable()) mThread.join();
+    eglMakeCurrent(engineContext->getEGLDisplay(), engineContext->getEGLSurface(),
+        engineContext->getEGLSurface(), engineContext->getEGLContext());
+    return false;
+}
+
+void RenderThread::stop() {
+    {
+        lock_guard<mutex> lock(mMutex);
+        if (!mRunning) return;
+        mRunning = false;
+    }
+    mCondition.notify_all();
+    if (mThread.joinable()) mThread.join();
+
+    shared_ptr<EngineContext> engineContext(mEngineContext.lock());
+    if (engineContext && eglMakeCurrent(engineContext->getEGLDisplay(),
+        engineContext->getEGLSurface(), engineContext->getEGLSurface(),
+        engineContext->getEGLContext()) == EGL_FALSE) {
+        ALOGE("Unable to take the egl context back from the render thread");
+    }
+    for (int i=0; i<NUM_SNAPSHOTS; i++) {
+        // impostors queued by frames never drawn are queued again
+        vector<FrameSnapshot::ImpostorBake>& bakes = mSnapshots[i].mImpostorBakes;
+        for (size_t j=0; j<bakes.size(); j++) bakes[j].mImpostor->cancelBake();
+        mSnapshots[i].clear();
+    }
+    mFree.clear();
+    mQueued.clear();
+    DEBUG(Log::F_GLES, "render thread stopped after %d frames", mNumFrames);
+}
+
+FrameSnapshot* RenderThread::acquire() {
+    MeasureDuration duration;
+    unique_lock<mutex> lock(mMutex);
+    if (!mRunning) return nullptr;
+    mCondition.wait(lock, [this] { return !mFree.empty(); });
+    FrameSnapshot* frame = mFree.front();
+    mFree.pop_front();
+    lock.unlock();
+
+    // references held by the frame drawn last from this snapshot are
+    // dropped here, Geometry destructors touch the spatial index and
+    // that belongs to the game thread
+    frame->clear();
+    frame->mFrame = mFrameCount++;
+    mWaitTime = duration.getMicroSeconds();
+    return frame;
+}
+
+void RenderThread::publish(FrameSnapshot* frame) {
+    if (!frame) return;
+    {
+        lock_guard<mutex> lock(mMutex);
+        mQueued.push_back(frame);
+    }
+    mCondition.notify_all();
+}
+
+void RenderThread::renderLoop() {
+    shared_ptr<EngineContext> engineContext(mEngineContext.lock());
+    bool ready = engineContext && eglMakeCurrent(engineContext->getEGLDisplay(),
+        engineContext->getEGLSurface(), engineContext->getEGLSurface(),
+        engineContext->getEGLContext()) == EGL_TRUE;
+    shared_ptr<Render> render;
+    if (ready) render = engineContext->getDefaultRender();
+
+    unique_lock<mutex> lock(mMutex);
+    if (!ready || !render) {
+        ALOGE("Unable to make egl context current on the render thread");
+        mRunning = false;
+        mCondition.notify_all();
+        return;
+    }
+    mContextReady = true;
+    mCondition.notify_all();
+
+    while (true) {
+        mCondition.wait(lock, [this] { return !mRunning || !mQueued.empty(); });
+        // frames published before stop are still drawn
+        if (mQueued.empty()) break;
+        FrameSnapshot* frame = mQueued.front();
+        lock.unlock();
+
+        MeasureDuration duration;
+        render->submitFrame(*frame);
+        long long submitTime = duration.getMicroSeconds();
+
+        lock.lock();
+        mQueued.pop_front();
+        mFree.push_back(frame);
+        mSubmitTime = submitTime;
+        mNumFrames++;
+        mCondition.notify_all();
+    }
+    lock.unlock();
+
+    eglMakeCurrent(engineContext->getEGLDisplay(),
+        EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+}
+
+} // namespace dzy
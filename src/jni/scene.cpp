@@ -17,6 +17,7 @@
 #include "material.h"
 #include "camera.h"
 #include "animation.h"
+#include "bvh.h"
 #include "scene.h"
 
 using namespace std;
@@ -24,8 +25,9 @@ using namespace std;
 namespace dzy {
 
 Scene::Scene()
-    : mRootNode(new Node("dzyroot"))
-    , mActiveCamera(-1) {
+    : mActiveCamera(-1)
+    , mRootNode(new Node("dzyroot"))
+    , mSpatialIndex(new BVH) {
 }
 
 Scene::~Scene() {
@@ -62,12 +64,33 @@ shared_ptr<Light> Scene::getLight(int idx) {
     return nullptr;
 }
 
+shared_ptr<Material> Scene::getMaterial(int idx) {
+    if (idx >= 0 && idx < mMaterials.size())
+        return mMaterials[idx];
+    return nullptr;
+}
+
 std::shared_ptr<Animation> Scene::getAnimation(int idx) {
     if (idx >= 0 && idx < mAnimations.size())
         return mAnimations[idx];
     return nullptr;
 }
 
+void Scene::addCrowd(shared_ptr<Crowd> crowd) {
+    if (!crowd || find(mCrowds.begin(), mCrowds.end(), crowd) != mCrowds.end()) return;
+    mCrowds.push_back(crowd);
+}
+
+void Scene::removeCrowd(shared_ptr<Crowd> crowd) {
+    mCrowds.erase(remove(mCrowds.begin(), mCrowds.end(), crowd), mCrowds.end());
+}
+
+shared_ptr<Crowd> Scene::getCrowd(int idx) {
+    if (idx >= 0 && idx < mCrowds.size())
+        return mCrowds[idx];
+    return nullptr;
+}
+
 bool Scene::atLeastOneMeshHasVertexPosition() {
     for (size_t i=0; i<getNumMeshes(); i++) {
         if (mMeshes[i]->hasVertexPositions()) return true;
@@ -89,6 +112,18 @@ bool Scene::atLeastOneMeshHasNormal() {
     return false;
 }
 
+void Scene::buildSpatialIndex() {
+    MeasureDuration duration;
+    shared_ptr<BVH> bvh(mSpatialIndex);
+    mRootNode->depthFirstTraversal([&] (shared_ptr<NodeObj> nodeObj) {
+        shared_ptr<Geometry> geometry = dynamic_pointer_cast<Geometry>(nodeObj);
+        if (geometry) geometry->updateSpatialIndex(bvh);
+    });
+    bvh->rebuild();
+    DUMP(Log::F_MODEL, "spatial index: %d proxies, height %d, %lld us",
+        bvh->getNumProxies(), bvh->getHeight(), duration.getMicroSeconds());
+}
+
 shared_ptr<Scene> Scene::loadColladaFromFile(const string &file) {
     ifstream ifs(file.c_str(), ifstream::binary);
     if (!ifs) {
@@ -206,6 +241,7 @@ std::shared_ptr<Scene> Scene::loadColladaFromMemory(
 
     AIAdapter::buildSceneGraph(s, scene->mRootNode);
     AIAdapter::postProcess(s);
+    s->buildSpatialIndex();
 
     long long cvtTime = cvtDuration.getMicroSeconds();
 
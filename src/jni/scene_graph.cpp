@@ -4,6 +4,7 @@
 #include <queue>
 #include <stack>
 #define GLM_FORCE_RADIANS
+#include <EGL/egl.h>
 #include <glm/gtc/matrix_transform.hpp>
 #include "log.h"
 #include "program.h"
@@ -12,6 +13,10 @@
 #include "mesh.h"
 #include "material.h"
 #include "animation.h"
+#include "bvh.h"
+#include "gl_state.h"
+#include "hlod.h"
+#include "skin_bounds.h"
 #include "scene_graph.h"
 
 using namespace std;
@@ -405,10 +410,13 @@ void Node::update(double timeStamp) {
 
 void Node::draw(Render &render, shared_ptr<Scene> scene, double timeStamp) {
     NodeObj::updateAnimation(timeStamp);
-    render.drawNode(scene, dynamic_pointer_cast<Node>(shared_from_this()));
+    shared_ptr<Node> node(dynamic_pointer_cast<Node>(shared_from_this()));
+    // an impostor stands for the whole subtree
+    if (!render.drawNode(node)) return;
     std::for_each(mChildren.begin(), mChildren.end(), [&] (shared_ptr<NodeObj> c) {
         c->draw(render, scene, timeStamp);
     });
+    render.finishNode(node);
 }
 
 void Node::dumpHierarchy(Log::Flag f) {
@@ -452,34 +460,171 @@ Geometry::Geometry(shared_ptr<Mesh> mesh)
 Geometry::Geometry(const string& name, shared_ptr<Mesh> mesh)
     : NodeObj(name)
     , mMesh(mesh)
-    , mBOUpdated(false) {
-    glGenBuffers(1, &mVertexBO);
-    glGenBuffers(1, &mIndexBO);
+    , mVertexBO(0)
+    , mIndexBO(0)
+    , mBOUpdated(false)
+    , mVertexBOSize(0)
+    , mIndexBOSize(0)
+    , mProxy(BVH::NULL_PROXY)
+    , mBoundsDirty(true)
+    , mOccluder(false)
+    , mIsBatch(false)
+    , mHLODCluster(-1)
+    , mIsHLODProxy(false) {
 }
 
 Geometry::~Geometry() {
     TRACE(getName().c_str());
+    // the last reference may be dropped on the game thread while the
+    // render thread owns the context, which deletes them with its next
+    // frame then
+    GLState* state = GLState::get();
+    if (eglGetCurrentContext() != EGL_NO_CONTEXT) {
+        releaseVertexArrays();
+        if (mVertexBO) state->deleteBuffer(mVertexBO);
+        if (mIndexBO) state->deleteBuffer(mIndexBO);
+    } else {
+        for (auto it = mVertexArrays.begin(); it != mVertexArrays.end(); it++)
+            state->queueDeleteVertexArray(it->second);
+        state->queueDeleteBuffer(mVertexBO);
+        state->queueDeleteBuffer(mIndexBO);
+    }
+    shared_ptr<BVH> bvh(mSpatialIndex.lock());
+    if (bvh && mProxy != BVH::NULL_PROXY)
+        bvh->remove(mProxy);
+}
+
+AABB Geometry::getWorldBoundingBox() {
+    if (!mMesh) return AABB();
+    // the bind pose may be far from the animated ones
+    if (mSkinBounds && mMesh->hasBones())
+        return mSkinBounds->getBounds().transform(getWorldTransform().toMat4());
+    return mMesh->getBoundingBox().transform(getWorldTransform().toMat4());
+}
+
+void Geometry::setSkinBounds(shared_ptr<SkinBounds> bounds) {
+    mSkinBounds = bounds;
+    mBoundsDirty = true;
 }
 
-bool Geometry::updateBufferObject() {
+bool Geometry::updateSpatialIndex(shared_ptr<BVH> bvh) {
+    // batches are culled by their own bounds, the merged Geometry
+    // stay in the index for picking
+    if (!bvh || mIsBatch) return false;
+
+    shared_ptr<BVH> current(mSpatialIndex.lock());
+    if (current != bvh) {
+        // moved to another scene
+        if (current && mProxy != BVH::NULL_PROXY)
+            current->remove(mProxy);
+        mProxy = BVH::NULL_PROXY;
+    }
+
+    if (mProxy == BVH::NULL_PROXY) {
+        mProxy = bvh->insert(getWorldBoundingBox(),
+            dynamic_pointer_cast<Geometry>(shared_from_this()));
+        mSpatialIndex = bvh;
+        mBoundsDirty = false;
+        return true;
+    }
+
+    if (!mBoundsDirty) return false;
+    mBoundsDirty = false;
+    bvh->update(mProxy, getWorldBoundingBox());
+    return true;
+}
+
+void Geometry::setUpdateFlag(UpdateFlag f, bool recursive) {
+    NodeObj::setUpdateFlag(f, recursive);
+    if (f & F_UPDATE_WORLD_TRANSFORM)
+        mBoundsDirty = true;
+}
+
+bool Geometry::prepareBufferObject(const vector<char>& vertices) {
+    if (!vertices.empty()) {
+        if (vertices.size() != mMesh->getVertexBufSize()) {
+            ALOGE("%s: skinned vertices do not match the mesh", getName().c_str());
+            return false;
+        }
+        mBOUpdated = updateBufferObject(&vertices[0]);
+    } else if (!mBOUpdated) {
+        mBOUpdated = updateBufferObject(mMesh ? mMesh->getVertexBuf() : NULL);
+    }
+    return mBOUpdated;
+}
+
+bool Geometry::updateBufferObject(const void* vertices) {
     if (!mMesh) {
         ALOGE("One Geometry must attach one Mesh");
         return false;
     }
 
-    // Load vertex and index data into buffer object
-    glBindBuffer(GL_ARRAY_BUFFER, mVertexBO);
-    glBufferData(GL_ARRAY_BUFFER, mMesh->getVertexBufSize(),
-        mMesh->getVertexBuf(), GL_STATIC_DRAW);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mIndexBO);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, mMesh->getIndexBufSize(),
-        mMesh->getIndexBuf(), GL_STATIC_DRAW);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    // created here on the thread owning the context, a Geometry may be
+    // created on the game thread while the render thread owns it
+    if (!mVertexBO) glGenBuffers(1, &mVertexBO);
+    if (!mIndexBO) glGenBuffers(1, &mIndexBO);
+    if (!mVertexBO || !mIndexBO) {
+        ALOGE("glGenBuffers error");
+        return false;
+    }
+
+    // Load vertex and index data into buffer object, reuse the storage
+    // when the size is unchanged so cached vertex arrays stay valid
+    size_t vertexSize = mMesh->getVertexBufSize();
+    size_t indexSize = mMesh->getIndexBufSize();
+    if (vertexSize != mVertexBOSize || indexSize != mIndexBOSize)
+        releaseVertexArrays();
+
+    GLState::get()->bindBuffer(GL_ARRAY_BUFFER, mVertexBO);
+    if (vertexSize == mVertexBOSize) {
+        glBufferSubData(GL_ARRAY_BUFFER, 0, vertexSize, vertices);
+    } else {
+        glBufferData(GL_ARRAY_BUFFER, vertexSize, vertices, GL_STATIC_DRAW);
+        mVertexBOSize = vertexSize;
+    }
+    GLState::get()->bindBuffer(GL_ELEMENT_ARRAY_BUFFER, mIndexBO);
+    if (indexSize == mIndexBOSize) {
+        glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 0, indexSize, mMesh->getIndexBuf());
+    } else {
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexSize, mMesh->getIndexBuf(), GL_STATIC_DRAW);
+        mIndexBOSize = indexSize;
+    }
+    GLState::get()->bindBuffer(GL_ARRAY_BUFFER, 0);
+    GLState::get()->bindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 
     return true;
 }
 
+GLuint Geometry::getVertexArray(shared_ptr<Program> program) {
+    // no buffer objects before prepareBufferObject
+    if (!program || !mVertexBO) return 0;
+    auto it = mVertexArrays.find(program->getId());
+    if (it != mVertexArrays.end()) return it->second;
+
+    GLuint vao = 0;
+    glGenVertexArrays(1, &vao);
+    if (!vao) {
+        ALOGE("glGenVertexArrays error");
+        return 0;
+    }
+    // attribute pointers and the index buffer are recorded in the vao
+    GLState::get()->bindVertexArray(vao);
+    program->updateMeshData(mMesh, mVertexBO);
+    GLState::get()->bindBuffer(GL_ELEMENT_ARRAY_BUFFER, mIndexBO);
+    GLState::get()->bindVertexArray(0);
+    GLState::get()->bindBuffer(GL_ARRAY_BUFFER, 0);
+
+    mVertexArrays[program->getId()] = vao;
+    return vao;
+}
+
+void Geometry::releaseVertexArrays() {
+    for (auto it = mVertexArrays.begin(); it != mVertexArrays.end(); it++) {
+        GLState::get()->deleteVertexArray(it->second);
+    }
+    mVertexArrays.clear();
+}
+
 void Geometry::update(double timeStamp) {
     // find the skeleton root
 /* from assimp doc:
@@ -497,23 +642,41 @@ c2) If the node is marked as not necessary, skip it and do not iterate over its
 void Geometry::draw(Render &render, shared_ptr<Scene> scene, double timeStamp) {
     NodeObj::updateAnimation(timeStamp);
 
+    bool boundsChanged = updateSpatialIndex(scene->getSpatialIndex());
+    if (isBatched()) return;
+    // replaced by a proxy, or a proxy not selected
+    shared_ptr<HLOD> hlod(scene->getHLOD());
+    if (hlod && isInHLOD() && !hlod->isDrawn(mHLODCluster, mIsHLODProxy)) return;
+
     shared_ptr<Node> rootNode(scene->getRootNode());
     assert(rootNode);
+    vector<int> bones;
     vector<Transform> boneTransforms;
-    // do vertex skinning
-    bool cpuBoneTransform = false;
+    // pose the bones, bone nodes are shared and updated lazily, so this
+    // stays in the scene graph walk
     for (int i=0; i<mMesh->getNumBones(); i++) {
         shared_ptr<Bone> bone(mMesh->getBone(i));
         shared_ptr<NodeObj> boneNode(rootNode->getChild(bone->getName()));
         if (boneNode) {
-            Transform nodeTransform = boneNode->getBoneTransform(timeStamp);
-            boneTransforms.push_back(nodeTransform);
-            bone->transform(mMesh, nodeTransform);
-            cpuBoneTransform = true;
+            bones.push_back(i);
+            boneTransforms.push_back(boneNode->getBoneTransform(timeStamp));
         } else {
             ALOGW("%-10s bone has no node in scene graph", bone->getName().c_str());
         }
     }
+    // skinned Geometry are culled by the bounds of their pose here, so
+    // off screen ones are not skinned, without bounds they never are
+    if (mSkinBounds && !bones.empty() && bones.size() == (size_t)mMesh->getNumBones() &&
+        !getCamera()) {
+        AABB bounds = mSkinBounds->getPoseBounds(bones, boneTransforms);
+        if (!render.isVisible(bounds.transform(getWorldTransform().toMat4()))) return;
+    }
+    // do vertex skinning
+    bool cpuBoneTransform = false;
+    for (size_t i=0; i<bones.size(); i++) {
+        mMesh->getBone(bones[i])->transform(mMesh, boneTransforms[i]);
+        cpuBoneTransform = true;
+    }
 
 #if 0
     int boneTransformSize = boneTransforms.size();
@@ -522,14 +685,10 @@ void Geometry::draw(Render &render, shared_ptr<Scene> scene, double timeStamp) {
     }
 #endif
 
-    if (!mBOUpdated || cpuBoneTransform) {
-        updateBufferObject();
-        mBOUpdated = true;
-    }
-
-    if (render.drawGeometry(scene, dynamic_pointer_cast<Geometry>(shared_from_this())))
-        // program attached to Geometry node only when drawGeometry returns true
-        render.drawMesh(scene, mMesh, getProgram(), mVertexBO, mIndexBO);
+    // culled and recorded in parallel once the walk is done, buffer
+    // objects are uploaded when the frame is submitted
+    render.recordDraw(dynamic_pointer_cast<Geometry>(shared_from_this()),
+        boundsChanged, cpuBoneTransform);
 }
 
 std::shared_ptr<Mesh> Geometry::getMesh() {
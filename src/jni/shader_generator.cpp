@@ -58,12 +58,12 @@ shared_ptr<Program> ShaderGenerator::generateProgram(
     shared_ptr<Material> material, shared_ptr<Mesh> mesh) {
     Info info;
     if (mesh->hasVertexPositions()) {
-        info.mVertexAttribs.push_back(ShaderVariable("vec3", "dzyVertexPosition"));
-        info.mVertexUniforms.push_back(ShaderVariable("mat4", "dzyMVPMatrix"));
+        info.mVertexAttribs.push_back(ShaderVariable("vec3", getShaderSlotName(SLOT_VERTEX_POSITION)));
+        info.mVertexUniforms.push_back(ShaderVariable("mat4", getShaderSlotName(SLOT_MVP_MATRIX)));
         if (mesh->hasVertexNormals()) {
-            info.mVertexAttribs.push_back(ShaderVariable("vec3", "dzyVertexNormal"));
-            info.mVertexUniforms.push_back(ShaderVariable("mat4", "dzyMVMatrix"));
-            info.mVertexUniforms.push_back(ShaderVariable("mat3", "dzyNormalMatrix"));
+            info.mVertexAttribs.push_back(ShaderVariable("vec3", getShaderSlotName(SLOT_VERTEX_NORMAL)));
+            info.mVertexUniforms.push_back(ShaderVariable("mat4", getShaderSlotName(SLOT_MV_MATRIX)));
+            info.mVertexUniforms.push_back(ShaderVariable("mat3", getShaderSlotName(SLOT_NORMAL_MATRIX)));
             info.mVaryings.push_back(ShaderVariable("vec3", "vVertexPositionEyeSpace"));
             info.mVaryings.push_back(ShaderVariable("vec3", "vVertexNormalEyeSpace"));
             info.mHasNormal = true;
@@ -116,9 +116,6 @@ shared_ptr<Program> ShaderGenerator::generateProgram(
         return nullptr;
     }
 
-    program->use();
-    program->storeLocation();
-
     return program;
 }
 
@@ -0,0 +1,546 @@
+#include <math.h>
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
+#include <glm/gtc/matrix_transform.hpp>
+#include "log.h"
+#include "scene_graph.h"
+#include "mesh.h"
+#include "material.h"
+#include "camera.h"
+#include "light.h"
+#include "program.h"
+#include "gl_state.h"
+#include "material_table.h"
+#include "shadow_maps.h"
+
+using namespace std;
+
+namespace dzy {
+
+// weight of the logarithmic split over the linear one
+static const float SPLIT_LAMBDA = 0.75f;
+// a cascade covers its slice with this margin, the slice center may move
+// by the margin minus one before the cascade follows
+static const float CASCADE_MARGIN = 1.25f;
+// widest spot cone a map covers, wider is too coarse to be worth it
+static const float MAX_SPOT_ANGLE = 170.f * (float)M_PI / 180.f;
+// depth bias of the casters, in slope and in depth units
+static const float OFFSET_FACTOR = 2.f;
+static const float OFFSET_UNITS = 4.f;
+
+// clip space to map coordinates and depth
+static const glm::mat4 CLIP_TO_MAP(
+    0.5f, 0.f, 0.f, 0.f,
+    0.f, 0.5f, 0.f, 0.f,
+    0.f, 0.f, 0.5f, 0.f,
+    0.5f, 0.5f, 0.5f, 1.f);
+
+static glm::vec3 getUp(const glm::vec3& direction) {
+    return fabsf(direction.y) > 0.99f ? glm::vec3(1.f, 0.f, 0.f) : glm::vec3(0.f, 1.f, 0.f);
+}
+
+ShadowMaps::ShadowMaps()
+    : mEnabled(false)
+    , mResolution(1024)
+    , mNumCascades(3)
+    , mDistance(50.f)
+    , mMaxInterval(4)
+    , mInvalidated(true)
+    , mStaticHash(0)
+    , mStaticMoved(false)
+    , mLastStaticHash(0)
+    , mLightType(Light::LIGHT_SOURCE_UNDEFINED)
+    , mLightPosition(0.f)
+    , mLightDirection(0.f)
+    , mLightCone(0.f)
+    , mBuiltResolution(0)
+    , mBuiltCascades(0)
+    , mBuiltDistance(0.f)
+    , mFrame(0)
+    , mCacheLost(true)
+    , mMaps(0)
+    , mCaches(0)
+    , mSize(0)
+    , mLayers(0)
+    , mNumBakes(0)
+    , mNumUpdates(0) {
+    mFramebuffers[0] = mFramebuffers[1] = 0;
+}
+
+ShadowMaps::~ShadowMaps() {
+    TRACE("");
+}
+
+void ShadowMaps::setResolution(int size) {
+    mResolution = min(max(size, 64), 4096);
+}
+
+void ShadowMaps::setNumCascades(int cascades) {
+    mNumCascades = min(max(cascades, 1), (int)MAX_CASCADES);
+}
+
+void ShadowMaps::setDistance(float distance) {
+    mDistance = max(distance, 0.1f);
+}
+
+void ShadowMaps::setMaxInterval(int frames) {
+    mMaxInterval = max(frames, 1);
+}
+
+bool ShadowMaps::isStaticCaster(shared_ptr<Geometry> geometry) {
+    shared_ptr<Mesh> mesh(geometry->getMesh());
+    if (!mesh || mesh->hasBones()) return false;
+    // drawn with its own camera, an overlay casts no shadow
+    if (geometry->getCamera()) return false;
+    shared_ptr<NodeObj> nodeObj(geometry);
+    while (nodeObj) {
+        if (nodeObj->getAnimation()) return false;
+        nodeObj = nodeObj->getParent();
+    }
+    return true;
+}
+
+void ShadowMaps::recordCaster(shared_ptr<Geometry> geometry, const glm::mat4& world,
+    bool moved, bool skinned) {
+    Caster caster;
+    caster.mGeometry = geometry;
+    caster.mWorld = world;
+    caster.mBounds = geometry->getMesh()->getBoundingBox().transform(world);
+    caster.mSkinned = skinned;
+    caster.mItem = -1;
+    caster.mCaster = -1;
+    if (!isStaticCaster(geometry)) {
+        // an overlay casts no shadow
+        if (geometry->getCamera()) return;
+        shared_ptr<Material> material(geometry->getMaterial());
+        if (material && material->isTransparent()) return;
+        mDynamic.push_back(caster);
+        return;
+    }
+    mStatic.push_back(caster);
+    // the walk visits the scene graph in the same order every frame
+    mStaticHash = mStaticHash * 31 + hash<Geometry*>()(geometry.get());
+    // moved by code, not by an animation
+    if (moved) mStaticMoved = true;
+}
+
+void ShadowMaps::build(FrameSnapshot& frame) {
+    frame.mShadows.clear();
+    frame.mShadowLight = -1;
+    int index = -1;
+    for (size_t i=0; i<frame.mLights.size() && index < 0; i++) {
+        Light& light = *frame.mLights[i];
+        if (light.getType() == Light::LIGHT_SOURCE_DIRECTIONAL ||
+            (light.getType() == Light::LIGHT_SOURCE_SPOT &&
+             light.getAngleOuterCone() * 0.5f < (float)M_PI * 0.5f))
+            index = i;
+    }
+    frame.mShadowCasters.clear();
+    if (!mEnabled || !frame.mCamera || index < 0) {
+        mStatic.clear();
+        mDynamic.clear();
+        mStaticHash = 0;
+        mStaticMoved = false;
+        mLightType = Light::LIGHT_SOURCE_UNDEFINED;
+        return;
+    }
+
+    Light& light = *frame.mLights[index];
+    int type = light.getType();
+    glm::vec3 position(light.getTransform() * glm::vec4(light.getPosition(), 1.f));
+    glm::vec3 direction(glm::mat3(light.getTransform()) * light.getDirection());
+    if (glm::dot(direction, direction) <= 0.f) direction = glm::vec3(0.f, 0.f, -1.f);
+    direction = glm::normalize(direction);
+    // assimp cone angles are full angles
+    float cone = light.getAngleOuterCone() * 0.5f;
+
+    // anything the caches were drawn from changed, draw all of them again
+    bool lightChanged = type != mLightType
+        || glm::length(direction - mLightDirection) > 1e-4f
+        || (type == Light::LIGHT_SOURCE_SPOT &&
+            (glm::length(position - mLightPosition) > 1e-4f || fabsf(cone - mLightCone) > 1e-4f));
+    bool settingsChanged = mResolution != mBuiltResolution
+        || mNumCascades != mBuiltCascades || mDistance != mBuiltDistance;
+    bool cacheLost = mCacheLost.exchange(false);
+    bool bake = lightChanged || settingsChanged || cacheLost || mInvalidated
+        || mStaticMoved || mStaticHash != mLastStaticHash;
+    mLightType = type;
+    mLightPosition = position;
+    mLightDirection = direction;
+    mLightCone = cone;
+    mBuiltResolution = mResolution;
+    mBuiltCascades = mNumCascades;
+    mBuiltDistance = mDistance;
+    mInvalidated = false;
+    mStaticMoved = false;
+    mLastStaticHash = mStaticHash;
+    mStaticHash = 0;
+    mFrame++;
+
+    // dynamic casters in view are drawn from the frame items, the others
+    // get items of their own once a map needs them, see pickCasters
+    if (!mDynamic.empty()) {
+        unordered_map<const Geometry*, int> items;
+        for (size_t i=0; i<frame.mItems.size(); i++)
+            items[frame.mItems[i].mGeometry.get()] = i;
+        for (size_t i=0; i<mDynamic.size(); i++) {
+            auto it = items.find(mDynamic[i].mGeometry.get());
+            if (it != items.end()) mDynamic[i].mItem = it->second;
+        }
+    }
+
+    glm::vec4 splits(0.f);
+    if (type == Light::LIGHT_SOURCE_DIRECTIONAL) {
+        Camera& camera = *frame.mCamera;
+        float near = camera.getNearPlane();
+        float far = min(camera.getFarPlane(), mDistance);
+        if (far <= near || near <= 0.f) {
+            mStatic.clear();
+            mDynamic.clear();
+            return;
+        }
+        glm::mat4 proj = camera.getProjMatrix();
+        glm::mat4 toWorld = glm::inverse(camera.getViewMatrix());
+        glm::mat4 lightView = glm::lookAt(glm::vec3(0.f), direction, getUp(direction));
+        bool perspective = proj[2][3] != 0.f;
+
+        frame.mShadows.resize(mNumCascades);
+        float sliceNear = near;
+        for (int c=0; c<mNumCascades; c++) {
+            float s = (float)(c + 1) / mNumCascades;
+            float sliceFar = near + (far - near) * s;
+            sliceFar += (near * powf(far / near, s) - sliceFar) * SPLIT_LAMBDA;
+            splits[c] = sliceFar;
+
+            // bounding sphere of the slice, its size does not change with
+            // the view direction so the texels keep their size
+            glm::vec3 corners[8];
+            glm::vec3 center(0.f);
+            for (int i=0; i<8; i++) {
+                float x = (i & 1) ? 1.f : -1.f;
+                float y = (i & 2) ? 1.f : -1.f;
+                float d = (i & 4) ? sliceFar : sliceNear;
+                if (perspective) {
+                    x = (x + proj[2][0]) * d / proj[0][0];
+                    y = (y + proj[2][1]) * d / proj[1][1];
+                } else {
+                    x = (x - proj[3][0]) / proj[0][0];
+                    y = (y - proj[3][1]) / proj[1][1];
+                }
+                corners[i] = glm::vec3(x, y, -d);
+                center += corners[i] * 0.125f;
+            }
+            float radius = 0.f;
+            for (int i=0; i<8; i++) radius = max(radius, glm::length(corners[i] - center));
+            center = glm::vec3(toWorld * glm::vec4(center, 1.f));
+
+            Cascade& cascade = mCascades[c];
+            FrameSnapshot::ShadowItem& item = frame.mShadows[c];
+            item.mBake = placeCascade(cascade, lightView, center, radius, bake);
+            // near cascades every frame, far ones less often and out of step
+            int interval = min(1 << c, mMaxInterval);
+            item.mUpdate = item.mBake || (mFrame + c) % interval == 0;
+            item.mView = cascade.mView;
+            item.mProj = cascade.mProj;
+            pickCasters(cascade, frame, item);
+            sliceNear = sliceFar;
+        }
+    } else {
+        Cascade& cascade = mCascades[0];
+        if (bake || !cascade.mValid) placeSpot(cascade, position, direction, cone);
+        frame.mShadows.resize(1);
+        FrameSnapshot::ShadowItem& item = frame.mShadows[0];
+        item.mBake = bake;
+        item.mUpdate = true;
+        item.mView = cascade.mView;
+        item.mProj = cascade.mProj;
+        pickCasters(cascade, frame, item);
+        // the cone limits the map, not the view depth
+        splits.x = 1e30f;
+    }
+
+    frame.mShadowLight = index;
+    frame.mShadowSize = mResolution;
+    frame.mShadowSplits = splits;
+    mStatic.clear();
+    mDynamic.clear();
+}
+
+bool ShadowMaps::placeCascade(Cascade& cascade, const glm::mat4& lightView,
+    const glm::vec3& center, float radius, bool bake) {
+    glm::vec3 lightCenter(lightView * glm::vec4(center, 1.f));
+    float extent = radius * CASCADE_MARGIN;
+    bool place = bake || !cascade.mValid
+        || fabsf(extent - cascade.mExtent) > extent * 0.01f
+        || glm::length(lightCenter - cascade.mCenter) > extent - radius;
+    if (!place) return false;
+
+    // whole texel steps, the texels of the static casters do not swim
+    float texel = 2.f * extent / mResolution;
+    cascade.mCenter = glm::vec3(floorf(lightCenter.x / texel) * texel,
+        floorf(lightCenter.y / texel) * texel, lightCenter.z);
+    cascade.mExtent = extent;
+    cascade.mView = lightView;
+
+    // the light looks down -z, casters toward it between the slice and
+    // the light are kept, a margin leaves room for dynamic ones
+    float zmin = lightCenter.z - extent;
+    float zmax = lightCenter.z + extent;
+    AABB rect(glm::vec3(cascade.mCenter.x - extent, cascade.mCenter.y - extent, zmin),
+        glm::vec3(cascade.mCenter.x + extent, cascade.mCenter.y + extent, 1e30f));
+    for (size_t i=0; i<mStatic.size(); i++) {
+        AABB box = mStatic[i].mBounds.transform(lightView);
+        if (box.intersects(rect)) zmax = max(zmax, box.getMax().z);
+    }
+    zmax += extent;
+    cascade.mProj = glm::ortho(cascade.mCenter.x - extent, cascade.mCenter.x + extent,
+        cascade.mCenter.y - extent, cascade.mCenter.y + extent, -zmax, -zmin);
+    cascade.mValid = true;
+    return true;
+}
+
+void ShadowMaps::placeSpot(Cascade& cascade, const glm::vec3& position,
+    const glm::vec3& direction, float cone) {
+    // a texel of margin around the cone
+    float angle = min(2.f * cone * (1.f + 2.f / mResolution), MAX_SPOT_ANGLE);
+    float far = mDistance;
+    float near = max(far / 1000.f, 0.05f);
+    cascade.mView = glm::lookAt(position, position + direction, getUp(direction));
+    cascade.mProj = glm::perspective(angle, 1.f, near, far);
+    cascade.mCenter = position;
+    cascade.mExtent = far;
+    cascade.mValid = true;
+}
+
+void ShadowMaps::pickCasters(const Cascade& cascade, FrameSnapshot& frame,
+    FrameSnapshot::ShadowItem& item) {
+    Frustum frustum(cascade.mProj * cascade.mView);
+    if (item.mBake) {
+        for (size_t i=0; i<mStatic.size(); i++) {
+            const Caster& caster = mStatic[i];
+            shared_ptr<Material> material(caster.mGeometry->getMaterial());
+            if (material && material->isTransparent()) continue;
+            if (!frustum.intersects(caster.mBounds)) continue;
+            item.mStatic.push_back(FrameSnapshot::DrawItem());
+            FrameSnapshot::DrawItem& draw = item.mStatic.back();
+            draw.mGeometry = caster.mGeometry;
+            draw.mMaterial = material;
+            draw.mWorld = caster.mWorld;
+            draw.mNormal = glm::transpose(glm::inverse(glm::mat3(caster.mWorld)));
+        }
+    }
+    if (!item.mUpdate) return;
+    // the casters of the light frustum, a moving one just out of view
+    // still shadows what is in it
+    for (size_t i=0; i<mDynamic.size(); i++) {
+        Caster& caster = mDynamic[i];
+        if (!frustum.intersects(caster.mBounds)) continue;
+        if (caster.mItem >= 0) {
+            item.mDynamic.push_back(caster.mItem);
+            continue;
+        }
+        if (caster.mCaster < 0) {
+            caster.mCaster = frame.mShadowCasters.size();
+            frame.mShadowCasters.push_back(FrameSnapshot::DrawItem());
+            FrameSnapshot::DrawItem& draw = frame.mShadowCasters.back();
+            draw.mGeometry = caster.mGeometry;
+            draw.mMaterial = caster.mGeometry->getMaterial();
+            draw.mWorld = caster.mWorld;
+            draw.mNormal = glm::transpose(glm::inverse(glm::mat3(caster.mWorld)));
+            if (caster.mSkinned) {
+                // the Mesh is skinned again for the next frame meanwhile
+                shared_ptr<Mesh> mesh(caster.mGeometry->getMesh());
+                const char* vertices = (const char*)mesh->getVertexBuf();
+                draw.mVertices.assign(vertices, vertices + mesh->getVertexBufSize());
+            }
+        }
+        item.mCasters.push_back(caster.mCaster);
+    }
+}
+
+void ShadowMaps::release() {
+    GLState* state = GLState::get();
+    if (mMaps) state->deleteTexture(mMaps);
+    if (mCaches) state->deleteTexture(mCaches);
+    for (int i=0; i<2; i++)
+        if (mFramebuffers[i]) state->deleteFramebuffer(mFramebuffers[i]);
+    mMaps = mCaches = 0;
+    mFramebuffers[0] = mFramebuffers[1] = 0;
+    mSize = mLayers = 0;
+    // drawn again on a new context
+    mCacheLost = true;
+}
+
+bool ShadowMaps::prepareMaps(int size, int layers, bool& created) {
+    created = false;
+    if (mMaps && size == mSize && layers == mLayers) return true;
+    GLState* state = GLState::get();
+    if (mMaps) state->deleteTexture(mMaps);
+    if (mCaches) state->deleteTexture(mCaches);
+    mMaps = mCaches = 0;
+    mSize = mLayers = 0;
+    // whatever was cached is gone, the next frame built draws it again
+    mCacheLost = true;
+    created = true;
+
+    GLuint textures[2] = { 0, 0 };
+    glGenTextures(2, textures);
+    if (!textures[0] || !textures[1]) {
+        ALOGE("glGenTextures error");
+        return false;
+    }
+    for (int i=0; i<2; i++) {
+        state->bindTexture(0, GL_TEXTURE_2D_ARRAY, textures[i]);
+        glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1, GL_DEPTH_COMPONENT24, size, size, layers);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    }
+    // the maps are compared and filtered, the caches only copied
+    mMaps = textures[0];
+    state->bindTexture(0, GL_TEXTURE_2D_ARRAY, mMaps);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+    mCaches = textures[1];
+    state->bindTexture(0, GL_TEXTURE_2D_ARRAY, mCaches);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    if (!mFramebuffers[0]) glGenFramebuffers(2, mFramebuffers);
+    if (!mFramebuffers[0] || !mFramebuffers[1]) {
+        ALOGE("glGenFramebuffers error");
+        return false;
+    }
+    // depth only, the cache one is read from, the map one drawn to
+    GLuint textureOf[2] = { mCaches, mMaps };
+    static const GLenum none = GL_NONE;
+    for (int i=0; i<2; i++) {
+        state->bindFramebuffer(GL_FRAMEBUFFER, mFramebuffers[i]);
+        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, textureOf[i], 0, 0);
+        glDrawBuffers(1, &none);
+        glReadBuffer(GL_NONE);
+        GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+        if (status != GL_FRAMEBUFFER_COMPLETE) {
+            ALOGE("shadow map framebuffer incomplete: 0x%x", status);
+            return false;
+        }
+    }
+    mSize = size;
+    mLayers = layers;
+    DEBUG(Log::F_GLES, "shadow maps %dx%d, %d cascades", size, size, layers);
+    return true;
+}
+
+void ShadowMaps::drawItem(const FrameSnapshot::DrawItem& item, bool hasLight,
+    MaterialTable& materials, glm::mat4& view, glm::mat4& proj) {
+    GLState* state = GLState::get();
+    shared_ptr<Mesh> mesh(item.mGeometry->getMesh());
+    shared_ptr<Program> program(ProgramManager::get()->getVariant(
+        item.mGeometry->getProgram(item.mMaterial, hasLight, mesh), PROGRAM_VARIANT_DEPTH));
+    if (!program) return;
+    PipelineState::Desc desc;
+    desc.mProgram = program->getId();
+    desc.mColorWrite = false;
+    state->apply(*state->getPipelineState(desc));
+    glm::mat4 world = item.mWorld;
+    program->uploadData(nullptr, nullptr, item.mMaterial, world, view, proj);
+    program->setMaterialIndex(materials.getIndex(item.mMaterial));
+    GLuint vao = item.mGeometry->getVertexArray(program);
+    if (!vao) return;
+    state->bindVertexArray(vao);
+    glDrawElements(GL_TRIANGLES, mesh->getNumIndices(), GL_UNSIGNED_INT, (void*)0);
+    state->countCall();
+}
+
+void ShadowMaps::draw(const FrameSnapshot& frame, MaterialTable& materials,
+    FrameUniforms& uniforms) {
+    mNumBakes = 0;
+    mNumUpdates = 0;
+    int layers = frame.mShadows.size();
+    bool created = false;
+    if (frame.mShadowLight < 0 || !layers) {
+        uniforms.setShadows(NULL, -1, NULL, glm::vec4(0.f), 0);
+        return;
+    }
+    if (!prepareMaps(frame.mShadowSize, layers, created)) {
+        uniforms.setShadows(NULL, -1, NULL, glm::vec4(0.f), 0);
+        return;
+    }
+    // new maps hold nothing yet, wait for a frame drawing all caches
+    for (int c=0; c<layers && created; c++) {
+        if (!frame.mShadows[c].mBake) {
+            uniforms.setShadows(NULL, -1, NULL, glm::vec4(0.f), 0);
+            return;
+        }
+    }
+
+    // the frame items are up to date, the casters out of view are not
+    vector<bool> ready(frame.mShadowCasters.size());
+    for (size_t i=0; i<frame.mShadowCasters.size(); i++) {
+        const FrameSnapshot::DrawItem& item = frame.mShadowCasters[i];
+        ready[i] = item.mGeometry->prepareBufferObject(item.mVertices);
+    }
+
+    GLState* state = GLState::get();
+    // not sampled while drawn to
+    state->bindTexture(TEXTURE_UNIT_SHADOW_MAP, GL_TEXTURE_2D_ARRAY, 0);
+    state->enable(GL_POLYGON_OFFSET_FILL, true);
+    glPolygonOffset(OFFSET_FACTOR, OFFSET_UNITS);
+    state->viewport(0, 0, mSize, mSize);
+    static const GLfloat farDepth = 1.f;
+    bool hasLight = !frame.mLights.empty();
+    for (int c=0; c<layers; c++) {
+        const FrameSnapshot::ShadowItem& shadow = frame.mShadows[c];
+        if (!shadow.mUpdate) continue;
+        glm::mat4 view = shadow.mView;
+        glm::mat4 proj = shadow.mProj;
+        if (!uniforms.update(view, proj)) break;
+
+        if (shadow.mBake) {
+            state->bindFramebuffer(GL_FRAMEBUFFER, mFramebuffers[0]);
+            glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, mCaches, 0, c);
+            // depth writes must be on for the clear
+            state->apply(*state->getPipelineState(PipelineState::Desc()));
+            glClearBufferfv(GL_DEPTH, 0, &farDepth);
+            state->countCall();
+            for (size_t i=0; i<shadow.mStatic.size(); i++) {
+                const FrameSnapshot::DrawItem& item = shadow.mStatic[i];
+                if (!item.mGeometry->prepareBufferObject(item.mVertices)) continue;
+                drawItem(item, hasLight, materials, view, proj);
+            }
+            mNumBakes++;
+        }
+
+        // the cached static casters, then the dynamic ones over them
+        state->bindFramebuffer(GL_READ_FRAMEBUFFER, mFramebuffers[0]);
+        glFramebufferTextureLayer(GL_READ_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, mCaches, 0, c);
+        state->bindFramebuffer(GL_DRAW_FRAMEBUFFER, mFramebuffers[1]);
+        glFramebufferTextureLayer(GL_DRAW_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, mMaps, 0, c);
+        glBlitFramebuffer(0, 0, mSize, mSize, 0, 0, mSize, mSize,
+            GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+        state->countCall();
+        for (size_t i=0; i<shadow.mDynamic.size(); i++)
+            drawItem(frame.mItems[shadow.mDynamic[i]], hasLight, materials, view, proj);
+        for (size_t i=0; i<shadow.mCasters.size(); i++) {
+            int caster = shadow.mCasters[i];
+            if (ready[caster])
+                drawItem(frame.mShadowCasters[caster], hasLight, materials, view, proj);
+        }
+        mMatrices[c] = CLIP_TO_MAP * proj * view;
+        mNumUpdates++;
+    }
+    state->bindVertexArray(0);
+    state->enable(GL_POLYGON_OFFSET_FILL, false);
+    state->bindFramebuffer(GL_FRAMEBUFFER, 0);
+    state->bindTexture(TEXTURE_UNIT_SHADOW_MAP, GL_TEXTURE_2D_ARRAY, mMaps);
+
+    int index = frame.mShadowLight;
+    uniforms.setShadows(frame.mLights[index].get(), index, mMatrices, frame.mShadowSplits, layers);
+    if (mNumBakes) {
+        DEBUG(Log::F_GLES, "shadow caches drawn: %d, maps updated: %d", mNumBakes, mNumUpdates);
+    }
+}
+
+} // namespace dzy
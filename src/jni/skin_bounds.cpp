@@ -0,0 +1,171 @@
+#include <map>
+#include <algorithm>
+#include "log.h"
+#include "scene.h"
+#include "scene_graph.h"
+#include "mesh.h"
+#include "animation.h"
+#include "skin_bounds.h"
+
+using namespace std;
+
+namespace dzy {
+
+typedef map<string, shared_ptr<NodeAnim> > NodeAnimMap;
+
+// computed like NodeObj::doUpdateBoneTransform
+static Transform getClipTransform(shared_ptr<NodeObj> node,
+    const NodeAnimMap& nodeAnims, double time) {
+    vector<shared_ptr<NodeObj> > path;
+    while (node && node->getName() != "dzyroot") {
+        path.push_back(node);
+        node = node->getParent();
+    }
+
+    Transform transform;
+    for (int i=path.size()-1; i>=0; i--) {
+        auto it = nodeAnims.find(path[i]->getName());
+        Transform local = it == nodeAnims.end() ? path[i]->getLocalTransform() :
+            Transform(it->second->getTranslation(time),
+                it->second->getRotation(time), it->second->getScale(time));
+        if (i != (int)path.size()-1) local.combine(transform);
+        transform = local;
+    }
+    return transform;
+}
+
+SkinBounds::SkinBounds(shared_ptr<Mesh> mesh)
+    : mMesh(mesh) {
+    unsigned int numVertices = mesh->getNumVertices();
+    vector<char> weighted(numVertices, 0);
+    const float* pos = (const float*)mesh->getOriginalPositionBuf();
+    mJoints.resize(mesh->getNumBones());
+    for (unsigned int b=0; b<mesh->getNumBones(); b++) {
+        shared_ptr<Bone> bone(mesh->getBone(b));
+        for (size_t i=0; i<bone->mWeights.size(); i++) {
+            const VertexWeight& vw = bone->mWeights[i];
+            if (vw.mWeight <= 0.f || vw.mVertexIndex >= numVertices) continue;
+            const float* p = pos + vw.mVertexIndex * 3;
+            mJoints[b].expand(glm::vec3(p[0], p[1], p[2]));
+            weighted[vw.mVertexIndex] = 1;
+        }
+    }
+    for (unsigned int v=0; v<numVertices; v++) {
+        if (!weighted[v]) mUnweighted.expand(glm::vec3(pos[v*3], pos[v*3+1], pos[v*3+2]));
+    }
+    mBounds = mesh->getBoundingBox();
+}
+
+SkinBounds::~SkinBounds() {
+    TRACE("");
+}
+
+AABB SkinBounds::getPoseBounds(const vector<int>& bones,
+    const vector<Transform>& nodeTransforms) const {
+    shared_ptr<Mesh> mesh(mMesh.lock());
+    AABB bounds(mUnweighted);
+    if (!mesh) return bounds;
+    for (size_t i=0; i<bones.size(); i++) {
+        const AABB& joint = mJoints[bones[i]];
+        if (!joint.isValid()) continue;
+        // the same transform Bone::transform skins the vertices with
+        Transform finalTransform(mesh->getBone(bones[i])->mTransform);
+        finalTransform.combine(nodeTransforms[i]);
+        bounds.expand(joint.transform(finalTransform.toMat4()));
+    }
+    return bounds;
+}
+
+bool SkinBounds::addClip(shared_ptr<Animation> animation,
+    shared_ptr<Node> root, int numSamples) {
+    shared_ptr<Mesh> mesh(mMesh.lock());
+    if (!mesh || !animation || !root) return false;
+
+    vector<int> bones;
+    vector<shared_ptr<NodeObj> > nodes;
+    for (unsigned int b=0; b<mesh->getNumBones(); b++) {
+        shared_ptr<NodeObj> node(root->getChild(mesh->getBone(b)->getName()));
+        if (!node) continue;
+        bones.push_back(b);
+        nodes.push_back(node);
+    }
+    if (bones.empty()) return false;
+
+    numSamples = max(numSamples, 1);
+    double duration = animation->getDuration();
+    Clip clip;
+    clip.mAnimation = animation;
+    AABB previous;
+    float margin = 0.f;
+    vector<Transform> nodeTransforms;
+    for (int s=0; s<=numSamples; s++) {
+        getClipPose(animation, nodes, duration * s / numSamples, nodeTransforms);
+        AABB pose = getPoseBounds(bones, nodeTransforms);
+        // the pose moves at most this much between two samples
+        if (previous.isValid() && pose.isValid()) {
+            glm::vec3 delta = glm::max(glm::abs(pose.getMin() - previous.getMin()),
+                glm::abs(pose.getMax() - previous.getMax()));
+            margin = max(margin, max(delta.x, max(delta.y, delta.z)));
+        }
+        clip.mBounds.expand(pose);
+        previous = pose;
+    }
+    clip.mBounds.inflate(margin);
+    mClips.push_back(clip);
+    mBounds.expand(clip.mBounds);
+
+    DUMP(Log::F_ANIMATION, "%-10s clip %-10s bounds (%f, %f, %f) - (%f, %f, %f)",
+        mesh->getName().c_str(), animation->getName().c_str(),
+        clip.mBounds.getMin().x, clip.mBounds.getMin().y, clip.mBounds.getMin().z,
+        clip.mBounds.getMax().x, clip.mBounds.getMax().y, clip.mBounds.getMax().z);
+    return true;
+}
+
+void SkinBounds::getClipPose(shared_ptr<Animation> animation,
+    const vector<shared_ptr<NodeObj> >& nodes, double time,
+    vector<Transform>& nodeTransforms) {
+    NodeAnimMap nodeAnims;
+    for (unsigned int i=0; i<animation->getNumNodeAnims(); i++) {
+        shared_ptr<NodeAnim> nodeAnim(animation->getNodeAnim(i));
+        nodeAnims[nodeAnim->getName()] = nodeAnim;
+    }
+    nodeTransforms.resize(nodes.size());
+    for (size_t i=0; i<nodes.size(); i++)
+        nodeTransforms[i] = getClipTransform(nodes[i], nodeAnims, time);
+}
+
+int SkinBounds::attach(shared_ptr<Scene> scene, int numSamples) {
+    shared_ptr<Node> root(scene ? scene->getRootNode() : nullptr);
+    if (!root) {
+        ALOGE("Invalid scene to attach skin bounds to");
+        return 0;
+    }
+
+    MeasureDuration duration;
+    // Geometry sharing a Mesh share its bounds
+    map<Mesh*, shared_ptr<SkinBounds> > meshBounds;
+    int numGeometry = 0;
+    root->depthFirstTraversal([&] (shared_ptr<NodeObj> nodeObj) {
+        shared_ptr<Geometry> geometry = dynamic_pointer_cast<Geometry>(nodeObj);
+        if (!geometry) return;
+        shared_ptr<Mesh> mesh(geometry->getMesh());
+        if (!mesh || !mesh->hasBones()) return;
+        if (mesh->getPositionNumComponent() != 3 ||
+            mesh->getPositionBufStride() != 3 * sizeof(float)) return;
+
+        shared_ptr<SkinBounds>& bounds = meshBounds[mesh.get()];
+        if (!bounds) {
+            bounds.reset(new SkinBounds(mesh));
+            for (unsigned int i=0; i<scene->getNumAnimations(); i++)
+                bounds->addClip(scene->getAnimation(i), root, numSamples);
+        }
+        geometry->setSkinBounds(bounds);
+        numGeometry++;
+    });
+
+    DUMP(Log::F_ANIMATION, "skin bounds: %d Geometry, %d Mesh, %lld us",
+        numGeometry, (int)meshBounds.size(), duration.getMicroSeconds());
+    return numGeometry;
+}
+
+} // namespace dzy
@@ -0,0 +1,246 @@
+#include <string.h>
+#include <map>
+#include <sstream>
+#include <algorithm>
+#include "log.h"
+#include "scene.h"
+#include "scene_graph.h"
+#include "mesh.h"
+#include "material.h"
+#include "animation.h"
+#include "static_batcher.h"
+
+using namespace std;
+
+namespace dzy {
+
+StaticBatcher::StaticBatcher(unsigned int maxVertices)
+    : mMaxVertices(maxVertices)
+    , mNumMerged(0) {
+}
+
+bool StaticBatcher::isStatic(shared_ptr<Geometry> geometry, shared_ptr<Node> root) {
+    shared_ptr<Mesh> mesh(geometry->getMesh());
+    if (!mesh || mesh->hasBones() || !mesh->hasFaces()) return false;
+    if (mesh->getPositionNumComponent() != 3 ||
+        mesh->getPositionBufStride() != 3 * sizeof(float)) return false;
+    if (mesh->hasVertexNormals() &&
+        mesh->getNormalBufStride() != 3 * sizeof(float)) return false;
+    if (mesh->hasVertexTangentsAndBitangents() &&
+        (mesh->getTangentBufStride() != 3 * sizeof(float) ||
+         mesh->getBitangentBufStride() != 3 * sizeof(float))) return false;
+    if (geometry->isBatch() || geometry->isBatched()) return false;
+    if (geometry->isInHLOD()) return false;
+    // drawn with its own camera, light or program, keep it separate
+    if (geometry->getCamera() || geometry->getLight() || !geometry->isAutoProgram())
+        return false;
+
+    shared_ptr<NodeObj> nodeObj(geometry);
+    while (nodeObj && nodeObj != root) {
+        if (nodeObj->getAnimation()) return false;
+        nodeObj = nodeObj->getParent();
+    }
+    // not attached under the root of this scene
+    return nodeObj == root;
+}
+
+string StaticBatcher::getFormatSignature(shared_ptr<Mesh> mesh) {
+    // float only components, other formats never share a batch
+    ostringstream os;
+    os << "n" << (mesh->hasVertexNormals() ? mesh->getNormalBufStride() : 0);
+    os << "t" << (mesh->hasVertexTangentsAndBitangents() ? mesh->getTangentBufStride() : 0);
+    os << "b" << (mesh->hasVertexTangentsAndBitangents() ? mesh->getBitangentBufStride() : 0);
+    for (unsigned int i=0; i<mesh->getNumColorChannels(); i++)
+        os << "c" << mesh->getColorNumComponent(i) << ":" << mesh->getColorBufStride(i);
+    for (unsigned int i=0; i<mesh->getNumTextureCoordChannels(); i++)
+        os << "u" << mesh->getTextureCoordNumComponent(i) << ":" << mesh->getTextureCoordBufStride(i);
+    return os.str();
+}
+
+int StaticBatcher::batch(shared_ptr<Scene> scene) {
+    mNumMerged = 0;
+    shared_ptr<Node> root(scene ? scene->getRootNode() : nullptr);
+    if (!root) {
+        ALOGE("Invalid scene to batch");
+        return 0;
+    }
+
+    MeasureDuration duration;
+    // group by material and vertex format, material pointer identity
+    // is enough since Geometry share the scene materials
+    typedef pair<Material*, string> GroupKey;
+    map<GroupKey, GeometryList> groups;
+    root->depthFirstTraversal([&] (shared_ptr<NodeObj> nodeObj) {
+        shared_ptr<Geometry> geometry = dynamic_pointer_cast<Geometry>(nodeObj);
+        if (!geometry || !isStatic(geometry, root)) return;
+        GroupKey key(geometry->getMaterial().get(), getFormatSignature(geometry->getMesh()));
+        groups[key].push_back(geometry);
+    });
+
+    glm::mat4 rootInverse = glm::inverse(root->getWorldTransform().toMat4());
+    vector<shared_ptr<Geometry> > batches;
+    for (auto it = groups.begin(); it != groups.end(); it++) {
+        GeometryList& group = it->second;
+        if (group.size() < 2) continue;
+
+        // sort along the longest axis so each batch stays compact
+        AABB groupBox;
+        for (size_t i=0; i<group.size(); i++)
+            groupBox.expand(group[i]->getWorldBoundingBox().getCenter());
+        glm::vec3 extent = groupBox.getExtent();
+        int axis = 0;
+        if (extent.y > extent[axis]) axis = 1;
+        if (extent.z > extent[axis]) axis = 2;
+        vector<pair<float, shared_ptr<Geometry> > > sorted;
+        for (size_t i=0; i<group.size(); i++)
+            sorted.push_back(make_pair(group[i]->getWorldBoundingBox().getCenter()[axis], group[i]));
+        sort(sorted.begin(), sorted.end(),
+            [] (const pair<float, shared_ptr<Geometry> >& a,
+                const pair<float, shared_ptr<Geometry> >& b) {
+                return a.first < b.first;
+            });
+
+        GeometryList chunk;
+        unsigned int numVertices = 0;
+        for (size_t i=0; i<=sorted.size(); i++) {
+            bool flush = i == sorted.size() || (!chunk.empty() &&
+                numVertices + sorted[i].second->getMesh()->getNumVertices() > mMaxVertices);
+            if (flush && chunk.size() > 1) {
+                ostringstream name;
+                name << "batch-" << (it->first.first ? it->first.first->getName() : "default")
+                    << "-" << batches.size();
+                batches.push_back(merge(chunk, rootInverse, name.str()));
+                mNumMerged += chunk.size();
+            }
+            if (flush) {
+                chunk.clear();
+                numVertices = 0;
+            }
+            if (i < sorted.size()) {
+                chunk.push_back(sorted[i].second);
+                numVertices += sorted[i].second->getMesh()->getNumVertices();
+            }
+        }
+    }
+
+    for (size_t i=0; i<batches.size(); i++) {
+        root->attachChild(batches[i]);
+        batches[i]->setUpdateFlag(NodeObj::F_UPDATE_WORLD_TRANSFORM, false);
+    }
+
+    DUMP(Log::F_MODEL, "static batching: %d Geometry merged into %d batches, %lld us",
+        mNumMerged, (int)batches.size(), duration.getMicroSeconds());
+    return batches.size();
+}
+
+shared_ptr<Geometry> StaticBatcher::merge(const GeometryList& group,
+    const glm::mat4& rootInverse, const string& name) {
+    shared_ptr<Mesh> first(group[0]->getMesh());
+    unsigned int totalVertices = 0;
+    unsigned int totalFaces = 0;
+    for (size_t i=0; i<group.size(); i++) {
+        totalVertices += group[i]->getMesh()->getNumVertices();
+        totalFaces += group[i]->getMesh()->getNumFaces();
+    }
+
+    bool hasNormal = first->hasVertexNormals();
+    bool hasTangent = first->hasVertexTangentsAndBitangents();
+    unsigned int numColorChannels = first->getNumColorChannels();
+    unsigned int numTexChannels = first->getNumTextureCoordChannels();
+
+    vector<float> positions(totalVertices * 3);
+    vector<float> normals(hasNormal ? totalVertices * 3 : 0);
+    vector<float> tangents(hasTangent ? totalVertices * 3 : 0);
+    vector<float> bitangents(hasTangent ? totalVertices * 3 : 0);
+    vector<vector<unsigned char> > colors(numColorChannels);
+    for (unsigned int c=0; c<numColorChannels; c++)
+        colors[c].resize(first->getColorBufStride(c) * totalVertices);
+    vector<vector<unsigned char> > texCoords(numTexChannels);
+    for (unsigned int c=0; c<numTexChannels; c++)
+        texCoords[c].resize(first->getTextureCoordBufStride(c) * totalVertices);
+    vector<unsigned int> indices;
+    indices.reserve(totalFaces * 3);
+
+    unsigned int base = 0;
+    for (size_t g=0; g<group.size(); g++) {
+        shared_ptr<Mesh> mesh(group[g]->getMesh());
+        glm::mat4 transform = rootInverse * group[g]->getWorldTransform().toMat4();
+        glm::mat3 linear = glm::mat3(transform);
+        glm::mat3 normalMatrix = glm::transpose(glm::inverse(linear));
+        unsigned int n = mesh->getNumVertices();
+
+        const float* pos = (const float*)mesh->getOriginalPositionBuf();
+        for (unsigned int v=0; v<n; v++) {
+            glm::vec3 p(transform * glm::vec4(pos[v*3], pos[v*3+1], pos[v*3+2], 1.f));
+            positions[(base+v)*3]   = p.x;
+            positions[(base+v)*3+1] = p.y;
+            positions[(base+v)*3+2] = p.z;
+        }
+        if (hasNormal) {
+            const float* src = (const float*)mesh->getOriginalNormalBuf();
+            for (unsigned int v=0; v<n; v++) {
+                glm::vec3 d = glm::normalize(normalMatrix * glm::vec3(src[v*3], src[v*3+1], src[v*3+2]));
+                normals[(base+v)*3]   = d.x;
+                normals[(base+v)*3+1] = d.y;
+                normals[(base+v)*3+2] = d.z;
+            }
+        }
+        if (hasTangent) {
+            const float* t = (const float*)mesh->getTangentBuf();
+            const float* b = (const float*)mesh->getBitangentBuf();
+            for (unsigned int v=0; v<n; v++) {
+                glm::vec3 dt = glm::normalize(linear * glm::vec3(t[v*3], t[v*3+1], t[v*3+2]));
+                glm::vec3 db = glm::normalize(linear * glm::vec3(b[v*3], b[v*3+1], b[v*3+2]));
+                tangents[(base+v)*3]     = dt.x;
+                tangents[(base+v)*3+1]   = dt.y;
+                tangents[(base+v)*3+2]   = dt.z;
+                bitangents[(base+v)*3]   = db.x;
+                bitangents[(base+v)*3+1] = db.y;
+                bitangents[(base+v)*3+2] = db.z;
+            }
+        }
+        for (unsigned int c=0; c<numColorChannels; c++) {
+            unsigned int stride = mesh->getColorBufStride(c);
+            memcpy(&colors[c][base * stride], mesh->getColorBuf(c), stride * n);
+        }
+        for (unsigned int c=0; c<numTexChannels; c++) {
+            unsigned int stride = mesh->getTextureCoordBufStride(c);
+            memcpy(&texCoords[c][base * stride], mesh->getTextureCoordBuf(c), stride * n);
+        }
+
+        const unsigned int* src = (const unsigned int*)mesh->getIndexBuf();
+        for (unsigned int i=0; i<mesh->getNumIndices(); i++) {
+            indices.push_back(src[i] + base);
+        }
+        base += n;
+    }
+
+    shared_ptr<Mesh> mesh(new Mesh(Mesh::PRIMITIVE_TYPE_TRIANGLE, totalVertices, name));
+    mesh->reserveDataStorage(positions.size() * sizeof(float) * (hasNormal ? 2 : 1)
+        + (hasTangent ? tangents.size() * sizeof(float) * 2 : 0));
+    mesh->appendVertexPositions(&positions[0], 3, sizeof(float));
+    if (hasNormal)
+        mesh->appendVertexNormals(&normals[0], 3, sizeof(float));
+    if (hasTangent) {
+        mesh->appendVertexTangents(&tangents[0], 3, sizeof(float));
+        mesh->appendVertexBitangents(&bitangents[0], 3, sizeof(float));
+    }
+    for (unsigned int c=0; c<numColorChannels; c++)
+        mesh->appendVertexColors(&colors[c][0], first->getColorNumComponent(c),
+            first->getColorBufStride(c) / first->getColorNumComponent(c), c);
+    for (unsigned int c=0; c<numTexChannels; c++)
+        mesh->appendVertexTextureCoords(&texCoords[c][0], first->getTextureCoordNumComponent(c),
+            first->getTextureCoordBufStride(c) / first->getTextureCoordNumComponent(c), c);
+    mesh->buildIndexBuffer(&indices[0], totalFaces);
+    mesh->mMaterialIndex = first->mMaterialIndex;
+
+    shared_ptr<Geometry> batch(new Geometry(name, mesh));
+    batch->mIsBatch = true;
+    batch->setMaterial(group[0]->getMaterial());
+    for (size_t g=0; g<group.size(); g++) {
+        group[g]->mBatch = batch;
+    }
+    return batch;
+}
+
+} // namespace dzy
@@ -0,0 +1,95 @@
+#include "log.h"
+#include "worker_pool.h"
+
+using namespace std;
+
+namespace dzy {
+
+WorkerPool::WorkerPool(int numThreads)
+    : mNumThreads(numThreads)
+    , mRunning(false)
+    , mJob(NULL)
+    , mNumJobs(0)
+    , mNextJob(0)
+    , mNumDone(0) {
+    if (mNumThreads <= 0) {
+        // hardware_concurrency may not know, 0 means no worker then
+        int cores = thread::hardware_concurrency();
+        mNumThreads = cores > 1 ? cores - 1 : 0;
+    }
+    if (mNumThreads > MAX_THREADS) mNumThreads = MAX_THREADS;
+}
+
+WorkerPool::~WorkerPool() {
+    TRACE("");
+    stop();
+}
+
+void WorkerPool::start() {
+    if (mRunning) return;
+    mRunning = true;
+    for (int i=0; i<mNumThreads; i++) {
+        mWorkers.push_back(thread(&WorkerPool::workerLoop, this));
+    }
+    DEBUG(Log::F_GLES, "worker pool: %d threads", mNumThreads);
+}
+
+void WorkerPool::stop() {
+    {
+        lock_guard<mutex> lock(mMutex);
+        if (!mRunning) return;
+        mRunning = false;
+    }
+    mCondition.notify_all();
+    for (size_t i=0; i<mWorkers.size(); i++) {
+        if (mWorkers[i].joinable()) mWorkers[i].join();
+    }
+    mWorkers.clear();
+}
+
+void WorkerPool::run(int numJobs, const Job& job) {
+    if (numJobs <= 0) return;
+    if (numJobs == 1 || mNumThreads == 0) {
+        for (int i=0; i<numJobs; i++) job(i);
+        return;
+    }
+    start();
+
+    unique_lock<mutex> lock(mMutex);
+    mJob = &job;
+    mNumJobs = numJobs;
+    mNextJob = 0;
+    mNumDone = 0;
+    mCondition.notify_all();
+    while (mNextJob < mNumJobs) {
+        int i = mNextJob++;
+        lock.unlock();
+        job(i);
+        lock.lock();
+        mNumDone++;
+    }
+    // workers may still be busy with the last jobs
+    mDoneCondition.wait(lock, [this] { return mNumDone == mNumJobs; });
+    mJob = NULL;
+}
+
+void WorkerPool::workerLoop() {
+    unique_lock<mutex> lock(mMutex);
+    while (true) {
+        mCondition.wait(lock, [this] {
+            return !mRunning || (mJob && mNextJob < mNumJobs);
+        });
+        if (!mRunning) break;
+        while (mJob && mNextJob < mNumJobs) {
+            int i = mNextJob++;
+            // run does not return before this job is counted as done
+            const Job* job = mJob;
+            lock.unlock();
+            (*job)(i);
+            lock.lock();
+            if (++mNumDone == mNumJobs) mDoneCondition.notify_all();
+        }
+    }
+}
+
+} // namespace dzy